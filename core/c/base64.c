@@ -54,7 +54,16 @@
 * project, please see <http://www.apache.org/>.
 */
 
+#include <stdbool.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MPW_BASE64_X86 1
+#include <immintrin.h>
+#endif
+
 #include "base64.h"
+#include "mpw-metrics.h"
 
 /* aaaack but it's fast and const should make it shared text page. */
 static const uint8_t b64ToBits[256] =
@@ -78,18 +87,221 @@ static const uint8_t b64ToBits[256] =
                 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
         };
 
+static const char basis_64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Vectorized codecs, after Wojciech Muła's SSE and AVX2 base64 algorithms:
+ * http://0x80.pl/articles/index.html#base64-algorithm-new
+ * They handle whole blocks of valid input and leave the remainder to the byte-at-a-time code. */
+
+#if MPW_BASE64_X86
+
+/** Decode 16 b64 chars into 12 plain bytes.
+ * @return false if the chars are not all valid b64 chars, nothing is written then. */
+__attribute__((target( "ssse3" )))
+static inline bool mpw_base64_decode_ssse3_block(uint8_t *plainBuf, const __m128i b64) {
+
+    // Validate the chars: maskLUT[lower nibble] has a bit set for each upper nibble that makes a valid char.
+    const __m128i shiftLUT = _mm_setr_epi8( 0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 );
+    const __m128i maskLUT = _mm_setr_epi8(
+            (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+            (char)0xf8, (char)0xf8, (char)0xf0, 0x54, 0x50, 0x50, 0x50, 0x54 );
+    const __m128i bitposLUT = _mm_setr_epi8( 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0 );
+    __m128i higherNibble = _mm_and_si128( _mm_srli_epi32( b64, 4 ), _mm_set1_epi8( 0x0f ) );
+    __m128i lowerNibble = _mm_and_si128( b64, _mm_set1_epi8( 0x0f ) );
+    __m128i invalid = _mm_cmpeq_epi8( _mm_and_si128(
+            _mm_shuffle_epi8( maskLUT, lowerNibble ), _mm_shuffle_epi8( bitposLUT, higherNibble ) ), _mm_setzero_si128() );
+    if (_mm_movemask_epi8( invalid ))
+        return false;
+
+    // Translate the chars into their 6-bit values: the offset depends on the upper nibble, except for '/'.
+    __m128i slash = _mm_cmpeq_epi8( b64, _mm_set1_epi8( '/' ) );
+    __m128i shift = _mm_or_si128( _mm_and_si128( slash, _mm_set1_epi8( 16 ) ),
+            _mm_andnot_si128( slash, _mm_shuffle_epi8( shiftLUT, higherNibble ) ) );
+    __m128i values = _mm_add_epi8( b64, shift );
+
+    // Pack each four 6-bit values into three bytes.
+    __m128i merged = _mm_madd_epi16( _mm_maddubs_epi16( values, _mm_set1_epi32( 0x01400140 ) ), _mm_set1_epi32( 0x00011000 ) );
+    __m128i plain = _mm_shuffle_epi8( merged, _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ) );
+    _mm_storel_epi64( (__m128i *)plainBuf, plain );
+    uint32_t tail = (uint32_t)_mm_cvtsi128_si32( _mm_srli_si128( plain, 8 ) );
+    memcpy( plainBuf + 8, &tail, sizeof( tail ) );
+
+    return true;
+}
+
+/** @return The amount of b64 chars decoded, a multiple of 16. */
+__attribute__((target( "ssse3" )))
+static size_t mpw_base64_decode_ssse3(uint8_t *plainBuf, const uint8_t *b64Text, const size_t b64Size) {
+
+    size_t b64Cursor = 0;
+    for (; b64Cursor + 16 <= b64Size; b64Cursor += 16, plainBuf += 12)
+        if (!mpw_base64_decode_ssse3_block( plainBuf, _mm_loadu_si128( (const __m128i *)(b64Text + b64Cursor) ) ))
+            break;
+
+    return b64Cursor;
+}
+
+/** @return The amount of b64 chars decoded, a multiple of 16. */
+__attribute__((target( "avx2" )))
+static size_t mpw_base64_decode_avx2(uint8_t *plainBuf, const uint8_t *b64Text, const size_t b64Size) {
+
+    const __m256i shiftLUT = _mm256_setr_epi8(
+            0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 );
+    const __m256i maskLUT = _mm256_setr_epi8(
+            (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+            (char)0xf8, (char)0xf8, (char)0xf0, 0x54, 0x50, 0x50, 0x50, 0x54,
+            (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+            (char)0xf8, (char)0xf8, (char)0xf0, 0x54, 0x50, 0x50, 0x50, 0x54 );
+    const __m256i bitposLUT = _mm256_setr_epi8(
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0,
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0 );
+    const __m256i packShuffle = _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 );
+
+    size_t b64Cursor = 0;
+    for (; b64Cursor + 32 <= b64Size; b64Cursor += 32, plainBuf += 24) {
+        __m256i b64 = _mm256_loadu_si256( (const __m256i *)(b64Text + b64Cursor) );
+        __m256i higherNibble = _mm256_and_si256( _mm256_srli_epi32( b64, 4 ), _mm256_set1_epi8( 0x0f ) );
+        __m256i lowerNibble = _mm256_and_si256( b64, _mm256_set1_epi8( 0x0f ) );
+        __m256i invalid = _mm256_cmpeq_epi8( _mm256_and_si256(
+                _mm256_shuffle_epi8( maskLUT, lowerNibble ), _mm256_shuffle_epi8( bitposLUT, higherNibble ) ),
+                _mm256_setzero_si256() );
+        if (_mm256_movemask_epi8( invalid ))
+            break;
+
+        __m256i shift = _mm256_blendv_epi8( _mm256_shuffle_epi8( shiftLUT, higherNibble ), _mm256_set1_epi8( 16 ),
+                _mm256_cmpeq_epi8( b64, _mm256_set1_epi8( '/' ) ) );
+        __m256i values = _mm256_add_epi8( b64, shift );
+        __m256i merged = _mm256_madd_epi16( _mm256_maddubs_epi16( values, _mm256_set1_epi32( 0x01400140 ) ),
+                _mm256_set1_epi32( 0x00011000 ) );
+
+        // Each lane packs into its low 12 bytes, then the lanes are joined into 24 consecutive bytes.
+        __m256i plain = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( merged, packShuffle ),
+                _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 7, 7 ) );
+        _mm_storeu_si128( (__m128i *)plainBuf, _mm256_castsi256_si128( plain ) );
+        _mm_storel_epi64( (__m128i *)(plainBuf + 16), _mm256_extracti128_si256( plain, 1 ) );
+    }
+
+    // Clear the upper lanes so the legacy SSE code that handles the remainder doesn't stall on them.
+    _mm256_zeroupper();
+    return b64Cursor + mpw_base64_decode_ssse3( plainBuf, b64Text + b64Cursor, b64Size - b64Cursor );
+}
+
+/** Encode the first 12 bytes of the block into 16 b64 chars. */
+__attribute__((target( "ssse3" )))
+static inline __m128i mpw_base64_encode_ssse3_block(__m128i plain) {
+
+    // Spread each three bytes over four 32-bit words' bytes, then split them into 6-bit values.
+    plain = _mm_shuffle_epi8( plain, _mm_set_epi8( 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1 ) );
+    __m128i values = _mm_or_si128(
+            _mm_mulhi_epu16( _mm_and_si128( plain, _mm_set1_epi32( 0x0fc0fc00 ) ), _mm_set1_epi32( 0x04000040 ) ),
+            _mm_mullo_epi16( _mm_and_si128( plain, _mm_set1_epi32( 0x003f03f0 ) ), _mm_set1_epi32( 0x01000010 ) ) );
+
+    // Translate the 6-bit values into chars by adding the offset of the range each value is in.
+    const __m128i shiftLUT = _mm_setr_epi8( 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 );
+    __m128i range = _mm_subs_epu8( values, _mm_set1_epi8( 51 ) );
+    range = _mm_or_si128( range, _mm_and_si128( _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), values ), _mm_set1_epi8( 13 ) ) );
+
+    return _mm_add_epi8( values, _mm_shuffle_epi8( shiftLUT, range ) );
+}
+
+/** @return The amount of plain bytes encoded, a multiple of 12. */
+__attribute__((target( "ssse3" )))
+static size_t mpw_base64_encode_ssse3(char *b64Text, const uint8_t *plainBuf, const size_t plainSize) {
+
+    // Each block reads 16 bytes to encode 12 of them.
+    size_t plainCursor = 0;
+    for (; plainCursor + 16 <= plainSize; plainCursor += 12, b64Text += 16)
+        _mm_storeu_si128( (__m128i *)b64Text,
+                mpw_base64_encode_ssse3_block( _mm_loadu_si128( (const __m128i *)(plainBuf + plainCursor) ) ) );
+
+    return plainCursor;
+}
+
+/** @return The amount of plain bytes encoded, a multiple of 12. */
+__attribute__((target( "avx2" )))
+static size_t mpw_base64_encode_avx2(char *b64Text, const uint8_t *plainBuf, const size_t plainSize) {
+
+    const __m256i spread = _mm256_set_epi8(
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1 );
+    const __m256i shiftLUT = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 );
+
+    // Each block reads 28 bytes, 12 in each lane, to encode 24 of them.
+    size_t plainCursor = 0;
+    for (; plainCursor + 28 <= plainSize; plainCursor += 24, b64Text += 32) {
+        __m256i plain = _mm256_inserti128_si256( _mm256_castsi128_si256(
+                _mm_loadu_si128( (const __m128i *)(plainBuf + plainCursor) ) ),
+                _mm_loadu_si128( (const __m128i *)(plainBuf + plainCursor + 12) ), 1 );
+        plain = _mm256_shuffle_epi8( plain, spread );
+        __m256i values = _mm256_or_si256(
+                _mm256_mulhi_epu16( _mm256_and_si256( plain, _mm256_set1_epi32( 0x0fc0fc00 ) ), _mm256_set1_epi32( 0x04000040 ) ),
+                _mm256_mullo_epi16( _mm256_and_si256( plain, _mm256_set1_epi32( 0x003f03f0 ) ), _mm256_set1_epi32( 0x01000010 ) ) );
+
+        __m256i range = _mm256_subs_epu8( values, _mm256_set1_epi8( 51 ) );
+        range = _mm256_or_si256( range, _mm256_and_si256(
+                _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), values ), _mm256_set1_epi8( 13 ) ) );
+        _mm256_storeu_si256( (__m256i *)b64Text, _mm256_add_epi8( values, _mm256_shuffle_epi8( shiftLUT, range ) ) );
+    }
+
+    _mm256_zeroupper();
+    return plainCursor + mpw_base64_encode_ssse3( b64Text, plainBuf + plainCursor, plainSize - plainCursor );
+}
+
+#endif
+
+static size_t mpw_base64_decode_simd(uint8_t *plainBuf, const uint8_t *b64Text, const size_t b64Size) {
+
+#if MPW_BASE64_X86
+    if (__builtin_cpu_supports( "avx2" ))
+        return mpw_base64_decode_avx2( plainBuf, b64Text, b64Size );
+    if (__builtin_cpu_supports( "ssse3" ))
+        return mpw_base64_decode_ssse3( plainBuf, b64Text, b64Size );
+#endif
+
+    return 0;
+}
+
+static size_t mpw_base64_encode_simd(char *b64Text, const uint8_t *plainBuf, const size_t plainSize) {
+
+#if MPW_BASE64_X86
+    if (__builtin_cpu_supports( "avx2" ))
+        return mpw_base64_encode_avx2( b64Text, plainBuf, plainSize );
+    if (__builtin_cpu_supports( "ssse3" ))
+        return mpw_base64_encode_ssse3( b64Text, plainBuf, plainSize );
+#endif
+
+    return 0;
+}
+
 size_t mpw_base64_decode_max(const char *b64Text) {
 
     register const uint8_t *b64Cursor = (uint8_t *)b64Text;
     while (b64ToBits[*(b64Cursor++)] <= 63);
-    int b64Size = (int)(b64Cursor - (uint8_t *)b64Text) - 1;
+    size_t b64Size = (size_t)(b64Cursor - (uint8_t *)b64Text) - 1;
 
-    // Every 4 b64 chars yield 3 plain bytes => len = 3 * ceil(b64Size / 4)
-    return (size_t)(3 /*bytes*/ * ((b64Size + 4 /*chars*/ - 1) / 4 /*chars*/));
+    // Every 4 b64 chars yield 3 plain bytes, a trailing 2 or 3 chars yield 1 or 2 more.
+    return 3 /*bytes*/ * (b64Size / 4 /*chars*/) + (b64Size % 4 > 1? b64Size % 4 - 1: 0);
 }
 
 int mpw_base64_decode(uint8_t *plainBuf, const char *b64Text) {
 
+    mpw_metric_scope( MPMetricBase64Decode );
+
+    // Decode whole blocks of valid chars with the vector codec, the rest one quad at a time.
+    size_t b64Decoded = mpw_base64_decode_simd( plainBuf, (const uint8_t *)b64Text, strlen( b64Text ) );
+    uint8_t *plainStart = plainBuf;
+    plainBuf += b64Decoded / 4 * 3;
+    b64Text += b64Decoded;
+
     register const uint8_t *b64Cursor = (uint8_t *)b64Text;
     while (b64ToBits[*(b64Cursor++)] <= 63);
     int b64Remaining = (int)(b64Cursor - (uint8_t *)b64Text) - 1;
@@ -112,23 +324,23 @@ int mpw_base64_decode(uint8_t *plainBuf, const char *b64Text) {
     if (b64Remaining > 3)
         *(plainCursor++) = (uint8_t)(b64ToBits[b64Cursor[2]] << 6 | b64ToBits[b64Cursor[3]]);
 
-    return (int)(plainCursor - plainBuf);
+    return (int)(plainCursor - plainStart);
 }
 
-static const char basis_64[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
 size_t mpw_base64_encode_max(size_t plainSize) {
 
     // Every 3 plain bytes yield 4 b64 chars => len = 4 * ceil(plainSize / 3)
-    return 4 /*chars*/ * (plainSize + 3 /*bytes*/ - 1) / 3 /*bytes*/;
+    return 4 /*chars*/ * ((plainSize + 3 /*bytes*/ - 1) / 3 /*bytes*/);
 }
 
 int mpw_base64_encode(char *b64Text, const uint8_t *plainBuf, size_t plainSize) {
 
-    size_t plainCursor = 0;
-    char *b64Cursor = b64Text;
-    for (; plainCursor < plainSize - 2; plainCursor += 3) {
+    mpw_metric_scope( MPMetricBase64Encode );
+
+    // Encode whole blocks with the vector codec, the rest one triplet at a time.
+    size_t plainCursor = mpw_base64_encode_simd( b64Text, plainBuf, plainSize );
+    char *b64Cursor = b64Text + plainCursor / 3 * 4;
+    for (; plainCursor + 2 < plainSize; plainCursor += 3) {
         *b64Cursor++ = basis_64[((plainBuf[plainCursor] >> 2)) & 0x3F];
         *b64Cursor++ = basis_64[((plainBuf[plainCursor] & 0x3) << 4) |
                                 ((plainBuf[plainCursor + 1] & 0xF0) >> 4)];
@@ -58,7 +58,7 @@
 #include <stdint.h>
 
 /**
- * @return The amount of bytes needed to decode the given b64Text.
+ * @return The exact amount of bytes that decoding the given b64Text yields.
  */
 size_t mpw_base64_decode_max(const char *b64Text);
 /** Decodes a base-64 encoded string into a plain byte buffer.
@@ -16,14 +16,27 @@
 // LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
 //==============================================================================
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "mpw-algorithm.h"
 #include "mpw-algorithm_v0.c"
 #include "mpw-algorithm_v1.c"
 #include "mpw-algorithm_v2.c"
 #include "mpw-algorithm_v3.c"
 
+/** The least amount of sites worth spreading over another thread in mpw_siteResults_derive. */
+#define MP_deriveBatchSites 256
+
 MPMasterKey mpw_masterKey(const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion) {
 
+    return mpw_masterKey_control( fullName, masterPassword, algorithmVersion, NULL );
+}
+
+MPMasterKey mpw_masterKey_control(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control) {
+
     if (fullName && !strlen( fullName ))
         fullName = NULL;
     if (masterPassword && !strlen( masterPassword ))
@@ -37,13 +50,13 @@ MPMasterKey mpw_masterKey(const char *fullName, const char *masterPassword, cons
 
     switch (algorithmVersion) {
         case MPAlgorithmVersion0:
-            return mpw_masterKey_v0( fullName, masterPassword );
+            return mpw_masterKey_v0( fullName, masterPassword, control );
         case MPAlgorithmVersion1:
-            return mpw_masterKey_v1( fullName, masterPassword );
+            return mpw_masterKey_v1( fullName, masterPassword, control );
         case MPAlgorithmVersion2:
-            return mpw_masterKey_v2( fullName, masterPassword );
+            return mpw_masterKey_v2( fullName, masterPassword, control );
         case MPAlgorithmVersion3:
-            return mpw_masterKey_v3( fullName, masterPassword );
+            return mpw_masterKey_v3( fullName, masterPassword, control );
         default:
             err( "Unsupported version: %d\n", algorithmVersion );
             return NULL;
@@ -82,22 +95,67 @@ MPSiteKey mpw_siteKey(
     }
 }
 
-const char *mpw_siteResult(
-        MPMasterKey masterKey, const char *siteName, const MPCounterValue siteCounter,
-        const MPKeyPurpose keyPurpose, const char *keyContext,
-        const MPResultType resultType, const char *resultParam,
-        const MPAlgorithmVersion algorithmVersion) {
+/** @return A new buffer with the salt that the site key of the given algorithm version is the HMAC of. */
+static const uint8_t *mpw_siteSalt(
+        const char *siteName, const MPCounterValue siteCounter, const MPKeyPurpose keyPurpose, const char *keyContext,
+        const MPAlgorithmVersion algorithmVersion, size_t *siteSaltSize) {
 
-    if (siteName && !strlen( siteName ))
-        siteName = NULL;
-    if (keyContext && !strlen( keyContext ))
-        keyContext = NULL;
-    if (resultParam && !strlen( resultParam ))
-        resultParam = NULL;
+    switch (algorithmVersion) {
+        case MPAlgorithmVersion0:
+            return mpw_siteSalt_v0( siteName, siteCounter, keyPurpose, keyContext, siteSaltSize );
+        case MPAlgorithmVersion1:
+            return mpw_siteSalt_v1( siteName, siteCounter, keyPurpose, keyContext, siteSaltSize );
+        case MPAlgorithmVersion2:
+            return mpw_siteSalt_v2( siteName, siteCounter, keyPurpose, keyContext, siteSaltSize );
+        case MPAlgorithmVersion3:
+            return mpw_siteSalt_v3( siteName, siteCounter, keyPurpose, keyContext, siteSaltSize );
+        default:
+            err( "Unsupported version: %d\n", algorithmVersion );
+            return NULL;
+    }
+}
 
-    MPSiteKey siteKey = mpw_siteKey( masterKey, siteName, siteCounter, keyPurpose, keyContext, algorithmVersion );
-    if (!siteKey)
-        return NULL;
+bool mpw_siteKeys_batch(
+        MPMasterKey masterKey, const MPSiteKeyParams siteParams[], const size_t count, uint8_t siteKeys[][MPSiteKeySize]) {
+
+    trc( "-- mpw_siteKeys_batch (count: %zu)\n", count );
+    if (!masterKey || !siteParams || !siteKeys)
+        return false;
+    if (!count)
+        return true;
+
+    const uint8_t **siteSalts = calloc( count, sizeof( *siteSalts ) );
+    size_t *siteSaltSizes = calloc( count, sizeof( *siteSaltSizes ) );
+    bool success = siteSalts && siteSaltSizes;
+    for (size_t s = 0; success && s < count; ++s) {
+        const MPSiteKeyParams *params = &siteParams[s];
+        const char *siteName = params->siteName && strlen( params->siteName )? params->siteName: NULL;
+        const char *keyContext = params->keyContext && strlen( params->keyContext )? params->keyContext: NULL;
+        if (!siteName) {
+            success = false;
+            break;
+        }
+
+        siteSalts[s] = mpw_siteSalt( siteName, params->siteCounter, params->keyPurpose, keyContext, params->algorithmVersion,
+                &siteSaltSizes[s] );
+        success = siteSalts[s] != NULL;
+    }
+
+    // All site keys are an HMAC of a site salt with the same master key.
+    if (success && !(success = mpw_hash_hmac_sha256_batch( siteKeys, masterKey, MPMasterKeySize, NULL, 0, siteSalts, siteSaltSizes, count )))
+        err( "Could not derive site keys: %s\n", strerror( errno ) );
+
+    for (size_t s = 0; siteSalts && siteSaltSizes && s < count; ++s)
+        mpw_free( &siteSalts[s], siteSaltSizes[s] );
+    mpw_free( &siteSalts, count * sizeof( *siteSalts ) );
+    mpw_free( &siteSaltSizes, count * sizeof( *siteSaltSizes ) );
+
+    return success;
+}
+
+const char *mpw_siteResult_forKey(
+        MPMasterKey masterKey, MPSiteKey siteKey, const MPResultType resultType, const char *resultParam,
+        const MPAlgorithmVersion algorithmVersion) {
 
     trc( "-- mpw_siteResult (algorithm: %u)\n", algorithmVersion );
     trc( "resultType: %d (%s)\n", resultType, mpw_nameForType( resultType ) );
@@ -156,6 +214,212 @@ const char *mpw_siteResult(
     return sitePassword;
 }
 
+const char *mpw_siteResult(
+        MPMasterKey masterKey, const char *siteName, const MPCounterValue siteCounter,
+        const MPKeyPurpose keyPurpose, const char *keyContext,
+        const MPResultType resultType, const char *resultParam,
+        const MPAlgorithmVersion algorithmVersion) {
+
+    if (siteName && !strlen( siteName ))
+        siteName = NULL;
+    if (keyContext && !strlen( keyContext ))
+        keyContext = NULL;
+    if (resultParam && !strlen( resultParam ))
+        resultParam = NULL;
+
+    MPSiteKey siteKey = mpw_siteKey( masterKey, siteName, siteCounter, keyPurpose, keyContext, algorithmVersion );
+    if (!siteKey)
+        return NULL;
+
+    const char *sitePassword = mpw_siteResult_forKey( masterKey, siteKey, resultType, resultParam, algorithmVersion );
+    mpw_free( &siteKey, MPSiteKeySize );
+
+    return sitePassword;
+}
+
+bool mpw_siteResults_counterRange(
+        MPMasterKey masterKey, const char *siteName, const MPCounterValue firstCounter, const MPCounterValue lastCounter,
+        const MPKeyPurpose keyPurpose, const char *keyContext,
+        const MPResultType resultType, const char *resultParam,
+        const MPAlgorithmVersion algorithmVersion, const char *results[]) {
+
+    if (siteName && !strlen( siteName ))
+        siteName = NULL;
+    if (keyContext && !strlen( keyContext ))
+        keyContext = NULL;
+    if (resultParam && !strlen( resultParam ))
+        resultParam = NULL;
+
+    trc( "-- mpw_siteResults_counterRange (algorithm: %u)\n", algorithmVersion );
+    trc( "siteName: %s\n", siteName );
+    trc( "siteCounter: %u - %u\n", firstCounter, lastCounter );
+    if (!masterKey || !siteName || !results || firstCounter == MPCounterValueTOTP || lastCounter < firstCounter)
+        return false;
+
+    // Every version's site salt ends in the counter and the key context, the prefix before them is the same for all counters.
+    size_t siteSaltSize = 0, count = (size_t)(lastCounter - firstCounter) + 1;
+    const uint8_t *siteSalt = mpw_siteSalt( siteName, firstCounter, keyPurpose, keyContext, algorithmVersion, &siteSaltSize );
+    if (!siteSalt)
+        return false;
+    size_t suffixSize = sizeof( uint32_t ) + (keyContext? sizeof( uint32_t ) + strlen( keyContext ): 0);
+    size_t prefixSize = siteSaltSize - suffixSize;
+
+    uint8_t *suffixes = calloc( count, suffixSize );
+    const uint8_t **messages = calloc( count, sizeof( *messages ) );
+    size_t *messageSizes = calloc( count, sizeof( *messageSizes ) );
+    uint8_t (*siteKeys)[MPSiteKeySize] = calloc( count, sizeof( *siteKeys ) );
+    bool success = suffixes && messages && messageSizes && siteKeys;
+    for (size_t c = 0; success && c < count; ++c) {
+        messages[c] = suffixes + c * suffixSize;
+        messageSizes[c] = suffixSize;
+        memcpy( suffixes + c * suffixSize, siteSalt + prefixSize, suffixSize );
+        mpw_uint32( (uint32_t)(firstCounter + c), suffixes + c * suffixSize );
+    }
+
+    // The site keys are the HMACs of the shared prefix followed by each counter's suffix.
+    if (success && !(success = mpw_hash_hmac_sha256_batch(
+            siteKeys, masterKey, MPMasterKeySize, siteSalt, prefixSize, messages, messageSizes, count )))
+        err( "Could not derive site keys: %s\n", strerror( errno ) );
+
+    for (size_t c = 0; success && c < count; ++c)
+        if (!(results[c] = mpw_siteResult_forKey( masterKey, siteKeys[c], resultType, resultParam, algorithmVersion ))) {
+            while (c)
+                mpw_free_string( &results[--c] );
+            success = false;
+        }
+
+    mpw_free( &siteSalt, siteSaltSize );
+    mpw_free( &suffixes, count * suffixSize );
+    mpw_free( &messages, count * sizeof( *messages ) );
+    mpw_free( &messageSizes, count * sizeof( *messageSizes ) );
+    mpw_free( &siteKeys, count * sizeof( *siteKeys ) );
+
+    return success;
+}
+
+size_t mpw_siteResult_decryptSize(const char *resultParam) {
+
+    return resultParam? mpw_base64_decode_max( resultParam ) + 1: 0;
+}
+
+const char *mpw_siteResult_decrypt(
+        MPMasterKey masterKey, const char *resultParam, char *resultBuf, const size_t resultBufSize,
+        const MPAlgorithmVersion algorithmVersion) {
+
+    trc( "-- mpw_siteResult_decrypt (algorithm: %u)\n", algorithmVersion );
+    if (!masterKey || !resultParam || !strlen( resultParam ))
+        return NULL;
+
+    switch (algorithmVersion) {
+        case MPAlgorithmVersion0:
+            return mpw_sitePasswordFromCryptBuf_v0( masterKey, resultParam, resultBuf, resultBufSize );
+        case MPAlgorithmVersion1:
+            return mpw_sitePasswordFromCryptBuf_v1( masterKey, resultParam, resultBuf, resultBufSize );
+        case MPAlgorithmVersion2:
+            return mpw_sitePasswordFromCryptBuf_v2( masterKey, resultParam, resultBuf, resultBufSize );
+        case MPAlgorithmVersion3:
+            return mpw_sitePasswordFromCryptBuf_v3( masterKey, resultParam, resultBuf, resultBufSize );
+        default:
+            err( "Unsupported version: %d\n", algorithmVersion );
+            return NULL;
+    }
+}
+
+size_t mpw_siteResults_deriveSize(const uint16_t keySize) {
+
+    if (keySize < 128 || keySize > 512 || keySize % 8 != 0)
+        return 0;
+
+    return mpw_base64_encode_max( keySize / 8 ) + 1;
+}
+
+/** A slice of the sites of mpw_siteResults_derive, derived by one thread. */
+typedef struct {
+    MPMasterKey masterKey;
+    const MPSiteKeyParams *siteParams;
+    size_t count;
+    size_t keyBytes;
+    char *results;
+    size_t rowSize;
+    bool success;
+    int error;
+    pthread_t thread;
+} MPDeriveBatch;
+
+static void *mpw_siteResults_deriveBatch(void *context) {
+
+    MPDeriveBatch *batch = context;
+    uint8_t (*siteKeys)[MPSiteKeySize] = calloc( batch->count, sizeof( *siteKeys ) );
+    uint8_t *resultKeys = calloc( batch->count, batch->keyBytes );
+
+    // The tokens of MPResultTypeDeriveKey are the same in all algorithm versions: a blake2b subkey of the site key.
+    batch->success = siteKeys && resultKeys &&
+                     mpw_siteKeys_batch( batch->masterKey, batch->siteParams, batch->count, siteKeys ) &&
+                     mpw_kdf_blake2b_batch( resultKeys, batch->keyBytes, (const uint8_t *)siteKeys, MPSiteKeySize, batch->count,
+                             NULL, 0, 0, NULL );
+    for (size_t s = 0; batch->success && s < batch->count; ++s)
+        batch->success = mpw_base64_encode( batch->results + s * batch->rowSize,
+                resultKeys + s * batch->keyBytes, batch->keyBytes ) >= 0;
+    if (!batch->success)
+        batch->error = errno;
+
+    mpw_free( &siteKeys, batch->count * sizeof( *siteKeys ) );
+    mpw_free( &resultKeys, batch->count * batch->keyBytes );
+
+    return NULL;
+}
+
+bool mpw_siteResults_derive(
+        MPMasterKey masterKey, const MPSiteKeyParams siteParams[], const size_t count, const uint16_t keySize,
+        char *results) {
+
+    trc( "-- mpw_siteResults_derive (count: %zu, keySize: %u)\n", count, keySize );
+    size_t rowSize = mpw_siteResults_deriveSize( keySize );
+    if (!rowSize) {
+        err( "Not a valid key size (should be 128 - 512): %u\n", keySize );
+        return false;
+    }
+    if (!masterKey || !siteParams || !results)
+        return false;
+    if (!count)
+        return true;
+
+    // Spread large batches over the host's cores, the calling thread derives the last slice.
+    long cores = sysconf( _SC_NPROCESSORS_ONLN );
+    size_t batchesCount = (count + MP_deriveBatchSites - 1) / MP_deriveBatchSites;
+    if (batchesCount > (size_t)(cores > 1? cores: 1))
+        batchesCount = (size_t)(cores > 1? cores: 1);
+
+    MPDeriveBatch batches[batchesCount];
+    bool threaded[batchesCount];
+    for (size_t b = 0, first = 0; b < batchesCount; ++b) {
+        size_t last = count * (b + 1) / batchesCount;
+        batches[b] = (MPDeriveBatch){
+                .masterKey = masterKey, .siteParams = siteParams + first, .count = last - first, .keyBytes = keySize / 8,
+                .results = results + first * rowSize, .rowSize = rowSize,
+        };
+        first = last;
+
+        threaded[b] = b + 1 < batchesCount &&
+                      pthread_create( &batches[b].thread, NULL, mpw_siteResults_deriveBatch, &batches[b] ) == 0;
+        if (!threaded[b])
+            mpw_siteResults_deriveBatch( &batches[b] );
+    }
+
+    bool success = true;
+    for (size_t b = 0; b < batchesCount; ++b) {
+        if (threaded[b])
+            pthread_join( batches[b].thread, NULL );
+        if (!batches[b].success && success) {
+            err( "Could not derive result keys: %s\n", strerror( batches[b].error ) );
+            errno = batches[b].error;
+            success = false;
+        }
+    }
+
+    return success;
+}
+
 const char *mpw_siteState(
         MPMasterKey masterKey, const char *siteName, const MPCounterValue siteCounter,
         const MPKeyPurpose keyPurpose, const char *keyContext,
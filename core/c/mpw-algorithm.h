@@ -42,12 +42,60 @@ typedef mpw_enum( unsigned int, MPAlgorithmVersion ) {
 MPMasterKey mpw_masterKey(
         const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion);
 
+/** Derive the master key like mpw_masterKey, under the control of the caller.
+ * The derivation can be cancelled or held to a deadline, and reports its progress as it goes.
+ * @param control NULL to derive like mpw_masterKey.
+ * @return A new MPMasterKeySize-byte allocated buffer, or NULL if an error occurred or the derivation was abandoned,
+ *         errno is ECANCELED or ETIMEDOUT then. */
+MPMasterKey mpw_masterKey_control(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control);
+
+/** A source of master keys with the signature of mpw_masterKey, eg. one that derives them ahead of time.
+ * @return A new MPMasterKeySize-byte allocated buffer or NULL if an error occurred. */
+typedef MPMasterKey (*MPMasterKeyProvider)(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion);
+
 /** Derive the site key for a user's site from the given master key and site parameters.
  * @return A new MPSiteKeySize-byte allocated buffer or NULL if an error occurred. */
 MPSiteKey mpw_siteKey(
         MPMasterKey masterKey, const char *siteName, const MPCounterValue siteCounter,
         const MPKeyPurpose keyPurpose, const char *keyContext, const MPAlgorithmVersion algorithmVersion);
 
+/** Write the salt that the site key of the given algorithm version is the HMAC of, see mpw_siteKey, without allocating.
+ * @param siteName The site name's siteNameSize bytes, they needn't be NUL-terminated.
+ * @param keyContext The key context's keyContextSize bytes, or NULL for no key context.
+ * @param siteSalt A buffer of siteSaltSize bytes, or NULL to only learn the size of the salt.
+ * @return The size of the salt, it is written into siteSalt only if it fits.  0 if the site name is empty or the
+ *         key purpose is unknown. */
+size_t mpw_siteSalt_v0_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize);
+size_t mpw_siteSalt_v1_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize);
+size_t mpw_siteSalt_v2_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize);
+size_t mpw_siteSalt_v3_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize);
+
+/** The parameters that identify a site key, see mpw_siteKey. */
+typedef struct {
+    const char *siteName;
+    MPCounterValue siteCounter;
+    MPKeyPurpose keyPurpose;
+    const char *keyContext;
+    MPAlgorithmVersion algorithmVersion;
+} MPSiteKeyParams;
+
+/** Derive the site keys for many of a user's sites at once, sharing the work for the master key between them.
+ * @param siteKeys The site key for siteParams[s] is written into siteKeys[s].
+ * @return false if an error occurred, in which case the contents of siteKeys is undefined. */
+bool mpw_siteKeys_batch(
+        MPMasterKey masterKey, const MPSiteKeyParams siteParams[], const size_t count, uint8_t siteKeys[][MPSiteKeySize]);
+
 /** Generate a site result token from the given parameters.
  * @param resultParam A parameter for the resultType.  For stateful result types, the output of mpw_siteState.
  * @return A newly allocated string or NULL if an error occurred. */
@@ -57,6 +105,51 @@ const char *mpw_siteResult(
         const MPResultType resultType, const char *resultParam,
         const MPAlgorithmVersion algorithmVersion);
 
+/** Generate a site result token from a site key, as mpw_siteResult would for the site key's parameters.
+ * @param siteKey A site key from mpw_siteKey or mpw_siteKeys_batch.
+ * @return A newly allocated string or NULL if an error occurred. */
+const char *mpw_siteResult_forKey(
+        MPMasterKey masterKey, MPSiteKey siteKey, const MPResultType resultType, const char *resultParam,
+        const MPAlgorithmVersion algorithmVersion);
+
+/** Generate the site result tokens of a range of counters of a site at once, as mpw_siteResult would for each counter.
+ * The part of the site salt before the counter is hashed once for all counters.
+ * @param firstCounter The first counter of the range, it cannot be MPCounterValueTOTP.
+ * @param results An array of lastCounter - firstCounter + 1 strings, results[c] receives a newly allocated string
+ *                with the token for counter firstCounter + c.
+ * @return false if an error occurred, in which case no strings were allocated. */
+bool mpw_siteResults_counterRange(
+        MPMasterKey masterKey, const char *siteName, const MPCounterValue firstCounter, const MPCounterValue lastCounter,
+        const MPKeyPurpose keyPurpose, const char *keyContext,
+        const MPResultType resultType, const char *resultParam,
+        const MPAlgorithmVersion algorithmVersion, const char *results[]);
+
+/** @return The size of the buffer that mpw_siteResult_decrypt needs for the result of the given state. */
+size_t mpw_siteResult_decryptSize(const char *resultParam);
+
+/** Decrypt a stateful site token into a buffer of the caller, without allocating.
+ * Unlike mpw_siteResult, the site key is not needed to decrypt a state, so no site parameters are required.
+ * @param resultParam The output of mpw_siteState.
+ * @param resultBuf A buffer of at least mpw_siteResult_decryptSize( resultParam ) bytes.
+ * @return resultBuf, holding the NUL-terminated result, or NULL if an error occurred. */
+const char *mpw_siteResult_decrypt(
+        MPMasterKey masterKey, const char *resultParam, char *resultBuf, const size_t resultBufSize,
+        const MPAlgorithmVersion algorithmVersion);
+
+/** @return The size of each row of the table that mpw_siteResults_derive writes keySize-bit keys into,
+ *          or 0 if keySize is not a valid MPResultTypeDeriveKey size. */
+size_t mpw_siteResults_deriveSize(const uint16_t keySize);
+
+/** Generate the MPResultTypeDeriveKey site tokens of many sites at once, into a table of the caller.
+ * The site keys are derived in batches and large batches are spread over the host's cores.
+ * @param keySize The size of the keys to derive in bits, as the resultParam of MPResultTypeDeriveKey.
+ * @param results A table of count rows of mpw_siteResults_deriveSize( keySize ) bytes.
+ *                The NUL-terminated token for siteParams[s] is written into the row at results + s * rowSize.
+ * @return false if an error occurred, in which case the contents of results is undefined. */
+bool mpw_siteResults_derive(
+        MPMasterKey masterKey, const MPSiteKeyParams siteParams[], const size_t count, const uint16_t keySize,
+        char *results);
+
 /** Encrypt a stateful site token for persistence.
  * @param resultParam A parameter for the resultType.  For stateful result types, the desired mpw_siteResult.
  * @return A newly allocated string or NULL if an error occurred. */
@@ -49,7 +49,7 @@ static const char mpw_characterFromClass_v0(char characterClass, uint16_t classI
 
 // Algorithm version overrides.
 static MPMasterKey mpw_masterKey_v0(
-        const char *fullName, const char *masterPassword) {
+        const char *fullName, const char *masterPassword, const MPKDFControl *control) {
 
     const char *keyScope = mpw_scopeForPurpose( MPKeyPurposeAuthentication );
     trc( "keyScope: %s\n", keyScope );
@@ -70,10 +70,14 @@ static MPMasterKey mpw_masterKey_v0(
 
     // Calculate the master key.
     trc( "masterKey: scrypt( masterPassword, masterKeySalt, N=%lu, r=%u, p=%u )\n", MP_N, MP_r, MP_p );
-    MPMasterKey masterKey = mpw_kdf_scrypt( MPMasterKeySize, masterPassword, masterKeySalt, masterKeySaltSize, MP_N, MP_r, MP_p );
+    MPMasterKey masterKey = mpw_kdf_scrypt_control( MPMasterKeySize, masterPassword, masterKeySalt, masterKeySaltSize, MP_N, MP_r, MP_p,
+            control );
     mpw_free( &masterKeySalt, masterKeySaltSize );
     if (!masterKey) {
-        err( "Could not derive master key: %s\n", strerror( errno ) );
+        if (errno == ECANCELED || errno == ETIMEDOUT)
+            dbg( "Abandoned master key derivation: %s\n", strerror( errno ) );
+        else
+            err( "Could not derive master key: %s\n", strerror( errno ) );
         return NULL;
     }
     trc( "  => masterKey.id: %s\n", mpw_id_buf( masterKey, MPMasterKeySize ) );
@@ -81,36 +85,84 @@ static MPMasterKey mpw_masterKey_v0(
     return masterKey;
 }
 
-static MPSiteKey mpw_siteKey_v0(
-        MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
-        MPKeyPurpose keyPurpose, const char *keyContext) {
+/** Lay out a site salt: the key scope, the site name's length and bytes, the counter and the key context's length and bytes.
+ * @return The size of the salt, it is written into siteSalt if it fits in siteSaltSize bytes. */
+static size_t mpw_siteSalt_layout(
+        const char *keyScope, const uint32_t siteNameLength, const char *siteName, const size_t siteNameSize,
+        const uint32_t siteCounter, const uint32_t keyContextLength, const char *keyContext, const size_t keyContextSize,
+        uint8_t *siteSalt, const size_t siteSaltSize) {
+
+    const size_t keyScopeSize = strlen( keyScope );
+    const size_t saltSize = keyScopeSize + 4 + siteNameSize + 4 + (keyContext? 4 + keyContextSize: 0);
+    if (!siteSalt || saltSize > siteSaltSize)
+        return saltSize;
+
+    uint8_t *salt = siteSalt;
+    memcpy( salt, keyScope, keyScopeSize );
+    mpw_uint32( siteNameLength, salt += keyScopeSize );
+    memcpy( salt += 4, siteName, siteNameSize );
+    mpw_uint32( siteCounter, salt += siteNameSize );
+    if (keyContext) {
+        mpw_uint32( keyContextLength, salt += 4 );
+        memcpy( salt + 4, keyContext, keyContextSize );
+    }
+
+    return saltSize;
+}
+
+size_t mpw_siteSalt_v0_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize) {
 
     const char *keyScope = mpw_scopeForPurpose( keyPurpose );
-    trc( "keyScope: %s\n", keyScope );
+    if (!keyScope || !siteName || !siteNameSize)
+        return 0;
+    if (!keyContextSize)
+        keyContext = NULL;
 
     // OTP counter value.
     if (siteCounter == MPCounterValueTOTP)
         siteCounter = ((uint32_t)time( NULL ) / MP_otp_window) * MP_otp_window;
 
+    // V0 counts the lengths of the site name and key context in characters.
+    return mpw_siteSalt_layout( keyScope,
+            (uint32_t)mpw_utf8_strnlen( siteName, siteNameSize ), siteName, siteNameSize, siteCounter,
+            keyContext? (uint32_t)mpw_utf8_strnlen( keyContext, keyContextSize ): 0, keyContext, keyContextSize,
+            siteSalt, siteSaltSize );
+}
+
+static const uint8_t *mpw_siteSalt_v0(
+        const char *siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, const char *keyContext,
+        size_t *siteSaltSize) {
+
+    trc( "keyScope: %s\n", mpw_scopeForPurpose( keyPurpose ) );
+
     // Calculate the site seed.
     trc( "siteSalt: keyScope=%s | #siteName=%s | siteName=%s | siteCounter=%s | #keyContext=%s | keyContext=%s\n",
-            keyScope, mpw_hex_l( (uint32_t)mpw_utf8_strlen( siteName ) ), siteName, mpw_hex_l( siteCounter ),
-            keyContext? mpw_hex_l( (uint32_t)mpw_utf8_strlen( keyContext ) ): NULL, keyContext );
-    size_t siteSaltSize = 0;
-    uint8_t *siteSalt = NULL;
-    mpw_push_string( &siteSalt, &siteSaltSize, keyScope );
-    mpw_push_int( &siteSalt, &siteSaltSize, (uint32_t)mpw_utf8_strlen( siteName ) );
-    mpw_push_string( &siteSalt, &siteSaltSize, siteName );
-    mpw_push_int( &siteSalt, &siteSaltSize, siteCounter );
-    if (keyContext) {
-        mpw_push_int( &siteSalt, &siteSaltSize, (uint32_t)mpw_utf8_strlen( keyContext ) );
-        mpw_push_string( &siteSalt, &siteSaltSize, keyContext );
-    }
-    if (!siteSalt) {
+            mpw_scopeForPurpose( keyPurpose ), mpw_hex_l( (uint32_t)mpw_utf8_strlen( siteName ) ), siteName,
+            mpw_hex_l( siteCounter ), keyContext? mpw_hex_l( (uint32_t)mpw_utf8_strlen( keyContext ) ): NULL, keyContext );
+    const size_t siteNameSize = strlen( siteName ), keyContextSize = keyContext? strlen( keyContext ): 0;
+    *siteSaltSize = mpw_siteSalt_v0_buf( siteName, siteNameSize, siteCounter, keyPurpose, keyContext, keyContextSize, NULL, 0 );
+    uint8_t *siteSalt = *siteSaltSize? malloc( *siteSaltSize ): NULL;
+    if (!siteSalt || mpw_siteSalt_v0_buf( siteName, siteNameSize, siteCounter, keyPurpose, keyContext, keyContextSize,
+            siteSalt, *siteSaltSize ) != *siteSaltSize) {
         err( "Could not allocate site salt: %s\n", strerror( errno ) );
+        mpw_free( &siteSalt, *siteSaltSize );
         return NULL;
     }
-    trc( "  => siteSalt.id: %s\n", mpw_id_buf( siteSalt, siteSaltSize ) );
+    trc( "  => siteSalt.id: %s\n", mpw_id_buf( siteSalt, *siteSaltSize ) );
+
+    return siteSalt;
+}
+
+static MPSiteKey mpw_siteKey_v0(
+        MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
+        MPKeyPurpose keyPurpose, const char *keyContext) {
+
+    size_t siteSaltSize = 0;
+    const uint8_t *siteSalt = mpw_siteSalt_v0( siteName, siteCounter, keyPurpose, keyContext, &siteSaltSize );
+    if (!siteSalt)
+        return NULL;
 
     trc( "siteKey: hmac-sha256( masterKey.id=%s, siteSalt )\n",
             mpw_id_buf( masterKey, MPMasterKeySize ) );
@@ -155,32 +207,53 @@ static const char *mpw_sitePasswordFromTemplate_v0(
     return sitePassword;
 }
 
-static const char *mpw_sitePasswordFromCrypt_v0(
-        MPMasterKey masterKey, MPSiteKey __unused siteKey, MPResultType __unused resultType, const char *cipherText) {
+static const char *mpw_sitePasswordFromCryptBuf_v0(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize) {
 
     if (!cipherText) {
         err( "Missing encrypted state.\n" );
         return NULL;
     }
+    if (!plainText || plainTextSize < mpw_base64_decode_max( cipherText ) + 1) {
+        err( "Insufficient room for decrypted state.\n" );
+        errno = ERANGE;
+        return NULL;
+    }
 
-    // Base64-decode
-    uint8_t *cipherBuf = calloc( 1, mpw_base64_decode_max( cipherText ) );
-    size_t bufSize = (size_t)mpw_base64_decode( cipherBuf, cipherText );
-    if ((int)bufSize < 0) {
+    // Base64-decode into the result buffer.
+    int bufSize = mpw_base64_decode( (uint8_t *)plainText, cipherText );
+    if (bufSize < 0) {
         err( "Base64 decoding error." );
-        mpw_free( &cipherBuf, mpw_base64_decode_max( cipherText ) );
         return NULL;
     }
-    trc( "b64 decoded: %zu bytes = %s\n", bufSize, mpw_hex( cipherBuf, bufSize ) );
+    trc( "b64 decoded: %d bytes = %s\n", bufSize, mpw_hex( plainText, (size_t)bufSize ) );
 
-    // Decrypt
-    const uint8_t *plainBytes = mpw_aes_decrypt( masterKey, MPMasterKeySize, cipherBuf, bufSize );
-    mpw_free( &cipherBuf, bufSize );
-    const char *plainText = strndup( (char *)plainBytes, bufSize );
-    mpw_free( &plainBytes, bufSize );
-    if (!plainText)
+    // Decrypt in place.
+    if (!mpw_aes_decrypt_inplace( masterKey, MPMasterKeySize, (uint8_t *)plainText, (size_t)bufSize )) {
         err( "AES decryption error: %s\n", strerror( errno ) );
-    trc( "decrypted -> plainText: %s = %s\n", plainText, mpw_hex( plainText, sizeof( plainText ) ) );
+        bzero( plainText, (size_t)bufSize );
+        return NULL;
+    }
+    plainText[bufSize] = '\0';
+    trc( "decrypted -> plainText: %s = %s\n", plainText, mpw_hex( plainText, (size_t)bufSize ) );
+
+    return plainText;
+}
+
+static const char *mpw_sitePasswordFromCrypt_v0(
+        MPMasterKey masterKey, MPSiteKey __unused siteKey, MPResultType __unused resultType, const char *cipherText) {
+
+    if (!cipherText) {
+        err( "Missing encrypted state.\n" );
+        return NULL;
+    }
+
+    size_t plainTextSize = mpw_base64_decode_max( cipherText ) + 1;
+    char *plainText = malloc( plainTextSize );
+    if (!mpw_sitePasswordFromCryptBuf_v0( masterKey, cipherText, plainText, plainTextSize )) {
+        mpw_free( &plainText, plainTextSize );
+        return NULL;
+    }
 
     return plainText;
 }
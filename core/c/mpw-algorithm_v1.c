@@ -27,12 +27,17 @@
 
 // Inherited functions.
 MPMasterKey mpw_masterKey_v0(
-        const char *fullName, const char *masterPassword);
+        const char *fullName, const char *masterPassword, const MPKDFControl *control);
+const uint8_t *mpw_siteSalt_v0(
+        const char *siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, const char *keyContext,
+        size_t *siteSaltSize);
 MPSiteKey mpw_siteKey_v0(
         MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
         MPKeyPurpose keyPurpose, const char *keyContext);
 const char *mpw_sitePasswordFromCrypt_v0(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *cipherText);
+const char *mpw_sitePasswordFromCryptBuf_v0(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize);
 const char *mpw_sitePasswordFromDerive_v0(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam);
 const char *mpw_siteState_v0(
@@ -40,9 +45,23 @@ const char *mpw_siteState_v0(
 
 // Algorithm version overrides.
 static MPMasterKey mpw_masterKey_v1(
-        const char *fullName, const char *masterPassword) {
+        const char *fullName, const char *masterPassword, const MPKDFControl *control) {
 
-    return mpw_masterKey_v0( fullName, masterPassword );
+    return mpw_masterKey_v0( fullName, masterPassword, control );
+}
+
+static const uint8_t *mpw_siteSalt_v1(
+        const char *siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, const char *keyContext,
+        size_t *siteSaltSize) {
+
+    return mpw_siteSalt_v0( siteName, siteCounter, keyPurpose, keyContext, siteSaltSize );
+}
+
+size_t mpw_siteSalt_v1_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize) {
+
+    return mpw_siteSalt_v0_buf( siteName, siteNameSize, siteCounter, keyPurpose, keyContext, keyContextSize, siteSalt, siteSaltSize );
 }
 
 static MPSiteKey mpw_siteKey_v1(
@@ -85,6 +104,12 @@ static const char *mpw_sitePasswordFromCrypt_v1(
     return mpw_sitePasswordFromCrypt_v0( masterKey, siteKey, resultType, cipherText );
 }
 
+static const char *mpw_sitePasswordFromCryptBuf_v1(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize) {
+
+    return mpw_sitePasswordFromCryptBuf_v0( masterKey, cipherText, plainText, plainTextSize );
+}
+
 static const char *mpw_sitePasswordFromDerive_v1(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam) {
 
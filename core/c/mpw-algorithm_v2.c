@@ -29,11 +29,13 @@
 
 // Inherited functions.
 MPMasterKey mpw_masterKey_v1(
-        const char *fullName, const char *masterPassword);
+        const char *fullName, const char *masterPassword, const MPKDFControl *control);
 const char *mpw_sitePasswordFromTemplate_v1(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam);
 const char *mpw_sitePasswordFromCrypt_v1(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *cipherText);
+const char *mpw_sitePasswordFromCryptBuf_v1(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize);
 const char *mpw_sitePasswordFromDerive_v1(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam);
 const char *mpw_siteState_v1(
@@ -41,41 +43,64 @@ const char *mpw_siteState_v1(
 
 // Algorithm version overrides.
 static MPMasterKey mpw_masterKey_v2(
-        const char *fullName, const char *masterPassword) {
+        const char *fullName, const char *masterPassword, const MPKDFControl *control) {
 
-    return mpw_masterKey_v1( fullName, masterPassword );
+    return mpw_masterKey_v1( fullName, masterPassword, control );
 }
 
-static MPSiteKey mpw_siteKey_v2(
-        MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
-        MPKeyPurpose keyPurpose, const char *keyContext) {
+size_t mpw_siteSalt_v2_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize) {
 
     const char *keyScope = mpw_scopeForPurpose( keyPurpose );
-    trc( "keyScope: %s\n", keyScope );
+    if (!keyScope || !siteName || !siteNameSize)
+        return 0;
+    if (!keyContextSize)
+        keyContext = NULL;
 
     // OTP counter value.
     if (siteCounter == MPCounterValueTOTP)
         siteCounter = ((uint32_t)time( NULL ) / MP_otp_window) * MP_otp_window;
 
+    // V2 counts the lengths of the site name and key context in bytes.
+    return mpw_siteSalt_layout( keyScope,
+            (uint32_t)siteNameSize, siteName, siteNameSize, siteCounter,
+            (uint32_t)keyContextSize, keyContext, keyContextSize,
+            siteSalt, siteSaltSize );
+}
+
+static const uint8_t *mpw_siteSalt_v2(
+        const char *siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, const char *keyContext,
+        size_t *siteSaltSize) {
+
+    trc( "keyScope: %s\n", mpw_scopeForPurpose( keyPurpose ) );
+
     // Calculate the site seed.
     trc( "siteSalt: keyScope=%s | #siteName=%s | siteName=%s | siteCounter=%s | #keyContext=%s | keyContext=%s\n",
-            keyScope, mpw_hex_l( (uint32_t)strlen( siteName ) ), siteName, mpw_hex_l( siteCounter ),
+            mpw_scopeForPurpose( keyPurpose ), mpw_hex_l( (uint32_t)strlen( siteName ) ), siteName, mpw_hex_l( siteCounter ),
             keyContext? mpw_hex_l( (uint32_t)strlen( keyContext ) ): NULL, keyContext );
-    size_t siteSaltSize = 0;
-    uint8_t *siteSalt = NULL;
-    mpw_push_string( &siteSalt, &siteSaltSize, keyScope );
-    mpw_push_int( &siteSalt, &siteSaltSize, (uint32_t)strlen( siteName ) );
-    mpw_push_string( &siteSalt, &siteSaltSize, siteName );
-    mpw_push_int( &siteSalt, &siteSaltSize, siteCounter );
-    if (keyContext) {
-        mpw_push_int( &siteSalt, &siteSaltSize, (uint32_t)strlen( keyContext ) );
-        mpw_push_string( &siteSalt, &siteSaltSize, keyContext );
-    }
-    if (!siteSalt) {
+    const size_t siteNameSize = strlen( siteName ), keyContextSize = keyContext? strlen( keyContext ): 0;
+    *siteSaltSize = mpw_siteSalt_v2_buf( siteName, siteNameSize, siteCounter, keyPurpose, keyContext, keyContextSize, NULL, 0 );
+    uint8_t *siteSalt = *siteSaltSize? malloc( *siteSaltSize ): NULL;
+    if (!siteSalt || mpw_siteSalt_v2_buf( siteName, siteNameSize, siteCounter, keyPurpose, keyContext, keyContextSize,
+            siteSalt, *siteSaltSize ) != *siteSaltSize) {
         err( "Could not allocate site salt: %s\n", strerror( errno ) );
+        mpw_free( &siteSalt, *siteSaltSize );
         return NULL;
     }
-    trc( "  => siteSalt.id: %s\n", mpw_id_buf( siteSalt, siteSaltSize ) );
+    trc( "  => siteSalt.id: %s\n", mpw_id_buf( siteSalt, *siteSaltSize ) );
+
+    return siteSalt;
+}
+
+static MPSiteKey mpw_siteKey_v2(
+        MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
+        MPKeyPurpose keyPurpose, const char *keyContext) {
+
+    size_t siteSaltSize = 0;
+    const uint8_t *siteSalt = mpw_siteSalt_v2( siteName, siteCounter, keyPurpose, keyContext, &siteSaltSize );
+    if (!siteSalt)
+        return NULL;
 
     trc( "siteKey: hmac-sha256( masterKey.id=%s, siteSalt )\n",
             mpw_id_buf( masterKey, MPMasterKeySize ) );
@@ -102,6 +127,12 @@ static const char *mpw_sitePasswordFromCrypt_v2(
     return mpw_sitePasswordFromCrypt_v1( masterKey, siteKey, resultType, cipherText );
 }
 
+static const char *mpw_sitePasswordFromCryptBuf_v2(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize) {
+
+    return mpw_sitePasswordFromCryptBuf_v1( masterKey, cipherText, plainText, plainTextSize );
+}
+
 static const char *mpw_sitePasswordFromDerive_v2(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam) {
 
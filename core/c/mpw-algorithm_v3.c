@@ -27,6 +27,9 @@
 #define MP_otp_window       5 * 60 /* s */
 
 // Inherited functions.
+const uint8_t *mpw_siteSalt_v2(
+        const char *siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, const char *keyContext,
+        size_t *siteSaltSize);
 MPSiteKey mpw_siteKey_v2(
         MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
         MPKeyPurpose keyPurpose, const char *keyContext);
@@ -34,6 +37,8 @@ const char *mpw_sitePasswordFromTemplate_v2(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam);
 const char *mpw_sitePasswordFromCrypt_v2(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *cipherText);
+const char *mpw_sitePasswordFromCryptBuf_v2(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize);
 const char *mpw_sitePasswordFromDerive_v2(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam);
 const char *mpw_siteState_v2(
@@ -41,7 +46,7 @@ const char *mpw_siteState_v2(
 
 // Algorithm version overrides.
 static MPMasterKey mpw_masterKey_v3(
-        const char *fullName, const char *masterPassword) {
+        const char *fullName, const char *masterPassword, const MPKDFControl *control) {
 
     const char *keyScope = mpw_scopeForPurpose( MPKeyPurposeAuthentication );
     trc( "keyScope: %s\n", keyScope );
@@ -62,10 +67,14 @@ static MPMasterKey mpw_masterKey_v3(
 
     // Calculate the master key.
     trc( "masterKey: scrypt( masterPassword, masterKeySalt, N=%lu, r=%u, p=%u )\n", MP_N, MP_r, MP_p );
-    MPMasterKey masterKey = mpw_kdf_scrypt( MPMasterKeySize, masterPassword, masterKeySalt, masterKeySaltSize, MP_N, MP_r, MP_p );
+    MPMasterKey masterKey = mpw_kdf_scrypt_control( MPMasterKeySize, masterPassword, masterKeySalt, masterKeySaltSize, MP_N, MP_r, MP_p,
+            control );
     mpw_free( &masterKeySalt, masterKeySaltSize );
     if (!masterKey) {
-        err( "Could not derive master key: %s\n", strerror( errno ) );
+        if (errno == ECANCELED || errno == ETIMEDOUT)
+            dbg( "Abandoned master key derivation: %s\n", strerror( errno ) );
+        else
+            err( "Could not derive master key: %s\n", strerror( errno ) );
         return NULL;
     }
     trc( "  => masterKey.id: %s\n", mpw_id_buf( masterKey, MPMasterKeySize ) );
@@ -73,6 +82,20 @@ static MPMasterKey mpw_masterKey_v3(
     return masterKey;
 }
 
+static const uint8_t *mpw_siteSalt_v3(
+        const char *siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, const char *keyContext,
+        size_t *siteSaltSize) {
+
+    return mpw_siteSalt_v2( siteName, siteCounter, keyPurpose, keyContext, siteSaltSize );
+}
+
+size_t mpw_siteSalt_v3_buf(
+        const char *siteName, const size_t siteNameSize, MPCounterValue siteCounter, const MPKeyPurpose keyPurpose,
+        const char *keyContext, const size_t keyContextSize, uint8_t *siteSalt, const size_t siteSaltSize) {
+
+    return mpw_siteSalt_v2_buf( siteName, siteNameSize, siteCounter, keyPurpose, keyContext, keyContextSize, siteSalt, siteSaltSize );
+}
+
 static MPSiteKey mpw_siteKey_v3(
         MPMasterKey masterKey, const char *siteName, MPCounterValue siteCounter,
         MPKeyPurpose keyPurpose, const char *keyContext) {
@@ -92,6 +115,12 @@ static const char *mpw_sitePasswordFromCrypt_v3(
     return mpw_sitePasswordFromCrypt_v2( masterKey, siteKey, resultType, cipherText );
 }
 
+static const char *mpw_sitePasswordFromCryptBuf_v3(
+        MPMasterKey masterKey, const char *cipherText, char *plainText, const size_t plainTextSize) {
+
+    return mpw_sitePasswordFromCryptBuf_v2( masterKey, cipherText, plainText, plainTextSize );
+}
+
 static const char *mpw_sitePasswordFromDerive_v3(
         MPMasterKey masterKey, MPSiteKey siteKey, MPResultType resultType, const char *resultParam) {
 
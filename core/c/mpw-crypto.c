@@ -0,0 +1,766 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <string.h>
+#include <errno.h>
+
+#if MPW_CPERCIVA
+#include <scrypt/crypto_scrypt.h>
+#include <scrypt/sha256.h>
+#endif
+#if MPW_SODIUM
+#include "sodium.h"
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MPW_CRYPTO_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "mpw-util.h"
+
+#include "mpw-crypto.h"
+
+//// Backend: built-in, using the host's SHA and AES instructions.
+
+#if MPW_CRYPTO_X86
+
+static const uint32_t mpw_sha256_iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+static const uint32_t mpw_sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+typedef struct {
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t blockSize;
+    uint64_t length;
+} MPSHA256;
+
+/** Rearrange the state from ABCD EFGH into the ABEF CDGH the SHA instructions operate on. */
+__attribute__((target( "sha,sse4.1,ssse3" )))
+static inline void mpw_sha256_shani_load(const uint32_t state[8], __m128i *abef, __m128i *cdgh) {
+
+    __m128i cdab = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)&state[0] ), 0xB1 );
+    __m128i efgh = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)&state[4] ), 0x1B );
+    *abef = _mm_alignr_epi8( cdab, efgh, 8 );
+    *cdgh = _mm_blend_epi16( efgh, cdab, 0xF0 );
+}
+
+/** Rearrange the state back into ABCD EFGH. */
+__attribute__((target( "sha,sse4.1,ssse3" )))
+static inline void mpw_sha256_shani_store(uint32_t state[8], const __m128i abef, const __m128i cdgh) {
+
+    __m128i feba = _mm_shuffle_epi32( abef, 0x1B );
+    __m128i dchg = _mm_shuffle_epi32( cdgh, 0xB1 );
+    _mm_storeu_si128( (__m128i *)&state[0], _mm_blend_epi16( feba, dchg, 0xF0 ) );
+    _mm_storeu_si128( (__m128i *)&state[4], _mm_alignr_epi8( dchg, feba, 8 ) );
+}
+
+/** Compress a 64-byte block into each of the lanes' states, interleaving the lanes' rounds. */
+__attribute__((target( "sha,sse4.1,ssse3" ), always_inline))
+static inline void mpw_sha256_shani_rounds(__m128i abef[], __m128i cdgh[], const uint8_t *const blocks[], const size_t lanes) {
+
+    const __m128i byteswap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+    __m128i abefSaved[lanes], cdghSaved[lanes], w[lanes][4];
+    for (size_t l = 0; l < lanes; ++l) {
+        abefSaved[l] = abef[l];
+        cdghSaved[l] = cdgh[l];
+    }
+
+    for (size_t r = 0; r < 16; ++r) {
+        __m128i k = _mm_loadu_si128( (const __m128i *)&mpw_sha256_k[r * 4] );
+        for (size_t l = 0; l < lanes; ++l) {
+            // Message schedule: the words for rounds r*4 to r*4+3.
+            if (r < 4)
+                w[l][r] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(blocks[l] + r * 16) ), byteswap );
+            else
+                w[l][r % 4] = _mm_sha256msg2_epu32( _mm_add_epi32(
+                        _mm_sha256msg1_epu32( w[l][r % 4], w[l][(r + 1) % 4] ),
+                        _mm_alignr_epi8( w[l][(r + 3) % 4], w[l][(r + 2) % 4], 4 ) ), w[l][(r + 3) % 4] );
+
+            __m128i wk = _mm_add_epi32( w[l][r % 4], k );
+            cdgh[l] = _mm_sha256rnds2_epu32( cdgh[l], abef[l], wk );
+            abef[l] = _mm_sha256rnds2_epu32( abef[l], cdgh[l], _mm_shuffle_epi32( wk, 0x0E ) );
+        }
+    }
+
+    for (size_t l = 0; l < lanes; ++l) {
+        abef[l] = _mm_add_epi32( abef[l], abefSaved[l] );
+        cdgh[l] = _mm_add_epi32( cdgh[l], cdghSaved[l] );
+    }
+}
+
+/** Compress the 64-byte blocks into the SHA-256 state. */
+__attribute__((target( "sha,sse4.1,ssse3" )))
+static void mpw_sha256_blocks(uint32_t state[8], const uint8_t *blocks, size_t blocksCount) {
+
+    __m128i abef, cdgh;
+    mpw_sha256_shani_load( state, &abef, &cdgh );
+    for (; blocksCount; --blocksCount, blocks += 64)
+        mpw_sha256_shani_rounds( &abef, &cdgh, (const uint8_t *const[]){ blocks }, 1 );
+    mpw_sha256_shani_store( state, abef, cdgh );
+}
+
+static void mpw_sha256_init(MPSHA256 *sha256) {
+
+    *sha256 = (MPSHA256){ .blockSize = 0 };
+    memcpy( sha256->state, mpw_sha256_iv, sizeof( sha256->state ) );
+}
+
+static void mpw_sha256_update(MPSHA256 *sha256, const uint8_t *buf, size_t bufSize) {
+
+    sha256->length += bufSize;
+
+    // Complete a partial block.
+    if (sha256->blockSize) {
+        size_t fill = min( bufSize, sizeof( sha256->block ) - sha256->blockSize );
+        memcpy( sha256->block + sha256->blockSize, buf, fill );
+        sha256->blockSize += fill;
+        buf += fill;
+        bufSize -= fill;
+        if (sha256->blockSize < sizeof( sha256->block ))
+            return;
+
+        mpw_sha256_blocks( sha256->state, sha256->block, 1 );
+        sha256->blockSize = 0;
+    }
+
+    // Compress whole blocks straight from the buffer, keep the remainder.
+    mpw_sha256_blocks( sha256->state, buf, bufSize / 64 );
+    sha256->blockSize = bufSize % 64;
+    memcpy( sha256->block, buf + bufSize - sha256->blockSize, sha256->blockSize );
+}
+
+static void mpw_sha256_final(MPSHA256 *sha256, uint8_t digest[MPCryptoSHA256Size]) {
+
+    uint8_t length[8];
+    mpw_uint64( sha256->length * 8, length );
+
+    // Pad with a one bit and zeros up to the length's position in the block, then append the length.
+    static const uint8_t padding[64] = { 0x80 };
+    mpw_sha256_update( sha256, padding, 1 + (119 - sha256->blockSize % 64) % 64 );
+    mpw_sha256_update( sha256, length, sizeof( length ) );
+
+    for (size_t s = 0; s < 8; ++s)
+        mpw_uint32( sha256->state[s], &digest[s * 4] );
+    bzero( sha256, sizeof( *sha256 ) );
+}
+
+static bool mpw_crypto_x86_sha256(uint8_t digest[MPCryptoSHA256Size], const uint8_t *buf, const size_t bufSize) {
+
+    MPSHA256 sha256;
+    mpw_sha256_init( &sha256 );
+    mpw_sha256_update( &sha256, buf, bufSize );
+    mpw_sha256_final( &sha256, digest );
+
+    return true;
+}
+
+static bool mpw_crypto_x86_hmac_sha256(uint8_t mac[MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+        const uint8_t *message, const size_t messageSize) {
+
+    // Keys longer than a block are hashed, shorter keys are padded with zeros.
+    uint8_t pad[64] = { 0 };
+    if (keySize > sizeof( pad ))
+        mpw_crypto_x86_sha256( pad, key, keySize );
+    else
+        memcpy( pad, key, keySize );
+
+    MPSHA256 inner, outer;
+    for (size_t p = 0; p < sizeof( pad ); ++p)
+        pad[p] ^= 0x36;
+    mpw_sha256_init( &inner );
+    mpw_sha256_update( &inner, pad, sizeof( pad ) );
+    for (size_t p = 0; p < sizeof( pad ); ++p)
+        pad[p] ^= 0x36 ^ 0x5c;
+    mpw_sha256_init( &outer );
+    mpw_sha256_update( &outer, pad, sizeof( pad ) );
+    bzero( pad, sizeof( pad ) );
+
+    uint8_t innerDigest[MPCryptoSHA256Size];
+    mpw_sha256_update( &inner, message, messageSize );
+    mpw_sha256_final( &inner, innerDigest );
+    mpw_sha256_update( &outer, innerDigest, sizeof( innerDigest ) );
+    mpw_sha256_final( &outer, mac );
+    bzero( innerDigest, sizeof( innerDigest ) );
+
+    return true;
+}
+
+/** Compress a 64-byte block into the state of each lane whose bit is set in active, the other lanes' states are left alone. */
+typedef void (*MPSHA256Lanes)(uint32_t states[][8], const uint8_t *const blocks[], const unsigned int active);
+#define MPSHA256LanesMax 8
+
+/** The blocks of a message that follows prefixSize bytes already hashed, its tail padded with the total length. */
+typedef struct {
+    const uint8_t *buf;
+    size_t bufBlocks;
+    size_t blocksCount;
+    uint8_t tail[128];
+} MPSHA256Blocks;
+
+static void mpw_sha256_pad(MPSHA256Blocks *blocks, const uint8_t *buf, const size_t bufSize, const size_t prefixSize) {
+
+    size_t tailSize = bufSize % 64, paddedSize = tailSize + 1 + 8 <= 64? 64: 128;
+    blocks->buf = buf;
+    blocks->bufBlocks = bufSize / 64;
+    blocks->blocksCount = blocks->bufBlocks + paddedSize / 64;
+
+    bzero( blocks->tail, sizeof( blocks->tail ) );
+    memcpy( blocks->tail, buf + bufSize - tailSize, tailSize );
+    blocks->tail[tailSize] = 0x80;
+    mpw_uint64( (uint64_t)(prefixSize + bufSize) * 8, &blocks->tail[paddedSize - 8] );
+}
+
+static const uint8_t *mpw_sha256_block(const MPSHA256Blocks *blocks, const size_t block) {
+
+    return block < blocks->bufBlocks? blocks->buf + block * 64: blocks->tail + (block - blocks->bufBlocks) * 64;
+}
+
+/** Hash each lane's blocks until the longest runs out, masking out the lanes that ran out before it. */
+static void mpw_sha256_lanes_hash(MPSHA256Lanes compress, uint32_t states[][8],
+        const MPSHA256Blocks blocks[], const size_t lanes) {
+
+    size_t blocksCount = 0;
+    for (size_t l = 0; l < lanes; ++l)
+        blocksCount = max( blocksCount, blocks[l].blocksCount );
+
+    const uint8_t *block[MPSHA256LanesMax];
+    for (size_t b = 0; b < blocksCount; ++b) {
+        unsigned int active = 0;
+        for (size_t l = 0; l < MPSHA256LanesMax; ++l)
+            if (l < lanes && b < blocks[l].blocksCount) {
+                block[l] = mpw_sha256_block( &blocks[l], b );
+                active |= 1U << l;
+            }
+            else
+                block[l] = blocks[0].tail;
+        compress( states, block, active );
+    }
+}
+
+static void mpw_sha256_lanes_digest(const uint32_t state[8], uint8_t digest[MPCryptoSHA256Size]) {
+
+    for (size_t s = 0; s < 8; ++s)
+        mpw_uint32( state[s], &digest[s * 4] );
+}
+
+/** Compress one 64-byte block into the state of the first lane. */
+static void mpw_sha256_lanes_one(MPSHA256Lanes compress, uint32_t states[][8], const uint8_t *block) {
+
+    compress( states, (const uint8_t *const[MPSHA256LanesMax]){ block, block, block, block, block, block, block, block }, 1U );
+}
+
+/** HMAC-SHA-256 for many messages with one key and prefix: the key's inner and outer blocks and the prefix's whole blocks
+ * are compressed only once, and the messages are hashed side by side, lanes at a time.
+ * @return false if the buffers for the rest of the prefix could not be allocated. */
+static bool mpw_sha256_lanes_hmac(MPSHA256Lanes compress, const size_t lanes,
+        uint8_t macs[][MPCryptoSHA256Size], const uint8_t *key, const size_t keySize, const uint8_t *prefix, const size_t prefixSize,
+        const uint8_t *const messages[], const size_t messageSizes[], const size_t count) {
+
+    // The rest of the prefix is hashed along with each message, from a buffer of each lane.
+    size_t prefixTail = prefixSize % 64, joinedSize = 0;
+    uint8_t *joined = NULL;
+    if (prefixTail) {
+        for (size_t m = 0; m < count; ++m)
+            joinedSize = max( joinedSize, prefixTail + messageSizes[m] );
+        if (!(joined = malloc( lanes * joinedSize )))
+            return false;
+        for (size_t l = 0; l < lanes; ++l)
+            memcpy( joined + l * joinedSize, prefix + prefixSize - prefixTail, prefixTail );
+    }
+
+    uint32_t states[MPSHA256LanesMax][8] = { { 0 } };
+    MPSHA256Blocks blocks[MPSHA256LanesMax];
+    uint8_t innerDigests[MPSHA256LanesMax][MPCryptoSHA256Size];
+
+    // Keys longer than a block are hashed, shorter keys are padded with zeros.
+    uint8_t pad[64] = { 0 };
+    if (keySize > sizeof( pad )) {
+        memcpy( states[0], mpw_sha256_iv, sizeof( states[0] ) );
+        mpw_sha256_pad( &blocks[0], key, keySize, 0 );
+        mpw_sha256_lanes_hash( compress, states, blocks, 1 );
+        mpw_sha256_lanes_digest( states[0], pad );
+    }
+    else
+        memcpy( pad, key, keySize );
+
+    // The states after the key's inner block and the prefix's whole blocks, and after the key's outer block.
+    uint32_t inner[8], outer[8];
+    for (size_t p = 0; p < sizeof( pad ); ++p)
+        pad[p] ^= 0x36;
+    memcpy( states[0], mpw_sha256_iv, sizeof( states[0] ) );
+    mpw_sha256_lanes_one( compress, states, pad );
+    for (size_t b = 0; b < prefixSize / 64; ++b)
+        mpw_sha256_lanes_one( compress, states, prefix + b * 64 );
+    memcpy( inner, states[0], sizeof( inner ) );
+    for (size_t p = 0; p < sizeof( pad ); ++p)
+        pad[p] ^= 0x36 ^ 0x5c;
+    memcpy( states[0], mpw_sha256_iv, sizeof( states[0] ) );
+    mpw_sha256_lanes_one( compress, states, pad );
+    memcpy( outer, states[0], sizeof( outer ) );
+
+    for (size_t first = 0; first < count; first += lanes) {
+        size_t group = min( lanes, count - first );
+
+        // inner = H( key ^ ipad || prefix || message )
+        for (size_t l = 0; l < group; ++l) {
+            memcpy( states[l], inner, sizeof( states[l] ) );
+            if (joined) {
+                memcpy( joined + l * joinedSize + prefixTail, messages[first + l], messageSizes[first + l] );
+                mpw_sha256_pad( &blocks[l], joined + l * joinedSize, prefixTail + messageSizes[first + l],
+                        sizeof( pad ) + prefixSize - prefixTail );
+            }
+            else
+                mpw_sha256_pad( &blocks[l], messages[first + l], messageSizes[first + l], sizeof( pad ) + prefixSize );
+        }
+        mpw_sha256_lanes_hash( compress, states, blocks, group );
+
+        // mac = H( key ^ opad || inner )
+        for (size_t l = 0; l < group; ++l) {
+            mpw_sha256_lanes_digest( states[l], innerDigests[l] );
+            memcpy( states[l], outer, sizeof( states[l] ) );
+            mpw_sha256_pad( &blocks[l], innerDigests[l], sizeof( innerDigests[l] ), sizeof( pad ) );
+        }
+        mpw_sha256_lanes_hash( compress, states, blocks, group );
+
+        for (size_t l = 0; l < group; ++l)
+            mpw_sha256_lanes_digest( states[l], macs[first + l] );
+    }
+
+    bzero( pad, sizeof( pad ) );
+    bzero( inner, sizeof( inner ) );
+    bzero( outer, sizeof( outer ) );
+    bzero( states, sizeof( states ) );
+    bzero( innerDigests, sizeof( innerDigests ) );
+    bzero( blocks, sizeof( blocks ) );
+    mpw_free( &joined, lanes * joinedSize );
+
+    return true;
+}
+
+/** Two lanes on the SHA instructions: their rounds are interleaved to fill the instructions' latency. */
+__attribute__((target( "sha,sse4.1,ssse3" )))
+static void mpw_sha256_lanes_shani(uint32_t states[][8], const uint8_t *const blocks[], const unsigned int active) {
+
+    __m128i abef[2], cdgh[2];
+    for (size_t l = 0; l < 2; ++l)
+        mpw_sha256_shani_load( states[l], &abef[l], &cdgh[l] );
+    mpw_sha256_shani_rounds( abef, cdgh, blocks, 2 );
+    for (size_t l = 0; l < 2; ++l)
+        if (active & (1U << l))
+            mpw_sha256_shani_store( states[l], abef[l], cdgh[l] );
+}
+
+#define mpw_sha256_avx2_ror(x, n) _mm256_or_si256( _mm256_srli_epi32( x, n ), _mm256_slli_epi32( x, 32 - (n) ) )
+
+/** Eight lanes on AVX2, one lane in each 32-bit element. */
+__attribute__((target( "avx2" )))
+static void mpw_sha256_lanes_avx2(uint32_t states[][8], const uint8_t *const blocks[], const unsigned int active) {
+
+    const __m256i laneOffsets = _mm256_setr_epi32( 0, 8, 16, 24, 32, 40, 48, 56 );
+    __m256i v[8], saved[8], w[16];
+    for (size_t s = 0; s < 8; ++s)
+        saved[s] = v[s] = _mm256_i32gather_epi32( (const int *)&states[0][s], laneOffsets, 4 );
+    for (size_t i = 0; i < 16; ++i) {
+        uint32_t words[8];
+        for (size_t l = 0; l < 8; ++l) {
+            memcpy( &words[l], blocks[l] + i * 4, sizeof( words[l] ) );
+            words[l] = __builtin_bswap32( words[l] );
+        }
+        w[i] = _mm256_loadu_si256( (const __m256i *)words );
+    }
+
+    for (size_t r = 0; r < 64; ++r) {
+        if (r >= 16) {
+            __m256i w1 = w[(r + 1) % 16], w14 = w[(r + 14) % 16];
+            __m256i s0 = _mm256_xor_si256( _mm256_xor_si256(
+                    mpw_sha256_avx2_ror( w1, 7 ), mpw_sha256_avx2_ror( w1, 18 ) ), _mm256_srli_epi32( w1, 3 ) );
+            __m256i s1 = _mm256_xor_si256( _mm256_xor_si256(
+                    mpw_sha256_avx2_ror( w14, 17 ), mpw_sha256_avx2_ror( w14, 19 ) ), _mm256_srli_epi32( w14, 10 ) );
+            w[r % 16] = _mm256_add_epi32( _mm256_add_epi32( w[r % 16], s0 ), _mm256_add_epi32( w[(r + 9) % 16], s1 ) );
+        }
+
+        __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+        __m256i S1 = _mm256_xor_si256( _mm256_xor_si256(
+                mpw_sha256_avx2_ror( e, 6 ), mpw_sha256_avx2_ror( e, 11 ) ), mpw_sha256_avx2_ror( e, 25 ) );
+        __m256i ch = _mm256_xor_si256( _mm256_and_si256( e, f ), _mm256_andnot_si256( e, g ) );
+        __m256i t1 = _mm256_add_epi32( _mm256_add_epi32( h, S1 ), _mm256_add_epi32(
+                _mm256_add_epi32( ch, _mm256_set1_epi32( (int)mpw_sha256_k[r] ) ), w[r % 16] ) );
+        __m256i S0 = _mm256_xor_si256( _mm256_xor_si256(
+                mpw_sha256_avx2_ror( a, 2 ), mpw_sha256_avx2_ror( a, 13 ) ), mpw_sha256_avx2_ror( a, 22 ) );
+        __m256i maj = _mm256_or_si256( _mm256_and_si256( a, b ), _mm256_and_si256( c, _mm256_or_si256( a, b ) ) );
+
+        v[7] = g;
+        v[6] = f;
+        v[5] = e;
+        v[4] = _mm256_add_epi32( d, t1 );
+        v[3] = c;
+        v[2] = b;
+        v[1] = a;
+        v[0] = _mm256_add_epi32( t1, _mm256_add_epi32( S0, maj ) );
+    }
+
+    for (size_t s = 0; s < 8; ++s) {
+        uint32_t words[8];
+        _mm256_storeu_si256( (__m256i *)words, _mm256_add_epi32( v[s], saved[s] ) );
+        for (size_t l = 0; l < 8; ++l)
+            if (active & (1U << l))
+                states[l][s] = words[l];
+    }
+}
+
+static MPSHA256Lanes mpw_sha256_lanes;
+static size_t mpw_sha256_lanesCount;
+
+static bool mpw_crypto_x86_hmac_sha256_batch(uint8_t macs[][MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+        const uint8_t *prefix, const size_t prefixSize, const uint8_t *const messages[], const size_t messageSizes[], const size_t count) {
+
+    return mpw_sha256_lanes_hmac( mpw_sha256_lanes, mpw_sha256_lanesCount, macs, key, keySize, prefix, prefixSize,
+            messages, messageSizes, count );
+}
+
+__attribute__((target( "aes,sse2" )))
+static inline __m128i mpw_aes128_expand(__m128i roundKey, __m128i assist) {
+
+    roundKey = _mm_xor_si128( roundKey, _mm_slli_si128( roundKey, 4 ) );
+    roundKey = _mm_xor_si128( roundKey, _mm_slli_si128( roundKey, 4 ) );
+    roundKey = _mm_xor_si128( roundKey, _mm_slli_si128( roundKey, 4 ) );
+    return _mm_xor_si128( roundKey, _mm_shuffle_epi32( assist, 0xFF ) );
+}
+
+#define mpw_aes128_expand_round(roundKeys, round, rcon) \
+        roundKeys[round] = mpw_aes128_expand( roundKeys[round - 1], _mm_aeskeygenassist_si128( roundKeys[round - 1], rcon ) )
+
+__attribute__((target( "aes,sse2" )))
+static bool mpw_crypto_x86_aes128_ctr(uint8_t *out, const uint8_t *in, const size_t bufSize,
+        const uint8_t key[MPCryptoAESKeySize], const uint8_t nonce[MPCryptoAESBlockSize]) {
+
+    __m128i roundKeys[11];
+    roundKeys[0] = _mm_loadu_si128( (const __m128i *)key );
+    mpw_aes128_expand_round( roundKeys, 1, 0x01 );
+    mpw_aes128_expand_round( roundKeys, 2, 0x02 );
+    mpw_aes128_expand_round( roundKeys, 3, 0x04 );
+    mpw_aes128_expand_round( roundKeys, 4, 0x08 );
+    mpw_aes128_expand_round( roundKeys, 5, 0x10 );
+    mpw_aes128_expand_round( roundKeys, 6, 0x20 );
+    mpw_aes128_expand_round( roundKeys, 7, 0x40 );
+    mpw_aes128_expand_round( roundKeys, 8, 0x80 );
+    mpw_aes128_expand_round( roundKeys, 9, 0x1B );
+    mpw_aes128_expand_round( roundKeys, 10, 0x36 );
+
+    uint8_t counter[MPCryptoAESBlockSize], stream[MPCryptoAESBlockSize];
+    memcpy( counter, nonce, sizeof( counter ) );
+    for (size_t offset = 0; offset < bufSize; offset += MPCryptoAESBlockSize) {
+        __m128i block = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)counter ), roundKeys[0] );
+        for (size_t round = 1; round < 10; ++round)
+            block = _mm_aesenc_si128( block, roundKeys[round] );
+        block = _mm_aesenclast_si128( block, roundKeys[10] );
+
+        if (bufSize - offset >= MPCryptoAESBlockSize)
+            _mm_storeu_si128( (__m128i *)(out + offset),
+                    _mm_xor_si128( block, _mm_loadu_si128( (const __m128i *)(in + offset) ) ) );
+        else {
+            _mm_storeu_si128( (__m128i *)stream, block );
+            for (size_t b = 0; offset + b < bufSize; ++b)
+                out[offset + b] = in[offset + b] ^ stream[b];
+        }
+
+        for (size_t c = sizeof( counter ); c-- && !++counter[c];);
+    }
+
+    bzero( roundKeys, sizeof( roundKeys ) );
+    bzero( stream, sizeof( stream ) );
+    return true;
+}
+
+static bool mpw_crypto_x86_init(void);
+static MPCryptoBackend mpw_crypto_x86 = {
+        .name = "simd",
+        .init = mpw_crypto_x86_init,
+};
+
+static bool mpw_crypto_x86_init(void) {
+
+    unsigned int eax, ebx, ecx, edx;
+    bool ssse3 = false, sse41 = false, aes = false, sha = false, avx2 = false, ymm = false;
+    if (__get_cpuid( 1, &eax, &ebx, &ecx, &edx )) {
+        ssse3 = ecx & bit_SSSE3;
+        sse41 = ecx & bit_SSE4_1;
+        aes = ecx & bit_AES;
+        if (ecx & bit_OSXSAVE) {
+            // The OS must save the YMM registers for AVX to be usable.
+            unsigned int xcr0, xcr0High;
+            __asm__( "xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0) );
+            ymm = (xcr0 & 0x6) == 0x6;
+        }
+    }
+    if (__get_cpuid_max( 0, NULL ) >= 7) {
+        __cpuid_count( 7, 0, eax, ebx, ecx, edx );
+        sha = ebx & (1 << 29);
+        avx2 = ebx & bit_AVX2;
+    }
+    trc( "simd: ssse3=%d, sse4.1=%d, aes=%d, sha=%d, avx2=%d\n", ssse3, sse41, aes, sha, avx2 && ymm );
+
+    sha = sha && ssse3 && sse41;
+    avx2 = avx2 && ymm;
+    mpw_crypto_x86.sha256 = sha? mpw_crypto_x86_sha256: NULL;
+    mpw_crypto_x86.hmac_sha256 = sha? mpw_crypto_x86_hmac_sha256: NULL;
+    mpw_sha256_lanes = sha? mpw_sha256_lanes_shani: avx2? mpw_sha256_lanes_avx2: NULL;
+    mpw_sha256_lanesCount = sha? 2: avx2? 8: 0;
+    mpw_crypto_x86.hmac_sha256_batch = mpw_sha256_lanes? mpw_crypto_x86_hmac_sha256_batch: NULL;
+    mpw_crypto_x86.aes128_ctr = aes? mpw_crypto_x86_aes128_ctr: NULL;
+
+    return sha || avx2 || aes;
+}
+
+#endif
+
+//// Backend: Colin Percival's scrypt library.
+
+#if MPW_CPERCIVA
+
+static bool mpw_crypto_cperciva_init(void) {
+
+    return true;
+}
+
+static bool mpw_crypto_cperciva_scrypt(uint8_t *key, const size_t keySize, const uint8_t *secret, const size_t secretSize,
+        const uint8_t *salt, const size_t saltSize, const uint64_t N, const uint32_t r, const uint32_t p) {
+
+    return crypto_scrypt( secret, secretSize, salt, saltSize, N, r, p, key, keySize ) == 0;
+}
+
+static bool mpw_crypto_cperciva_sha256(uint8_t digest[MPCryptoSHA256Size], const uint8_t *buf, const size_t bufSize) {
+
+    SHA256_Buf( buf, bufSize, digest );
+    return true;
+}
+
+static bool mpw_crypto_cperciva_hmac_sha256(uint8_t mac[MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+        const uint8_t *message, const size_t messageSize) {
+
+    HMAC_SHA256_Buf( key, keySize, message, messageSize, mac );
+    return true;
+}
+
+static MPCryptoBackend mpw_crypto_cperciva = {
+        .name = "cperciva",
+        .init = mpw_crypto_cperciva_init,
+        .scrypt = mpw_crypto_cperciva_scrypt,
+        .sha256 = mpw_crypto_cperciva_sha256,
+        .hmac_sha256 = mpw_crypto_cperciva_hmac_sha256,
+};
+
+#endif
+
+//// Backend: libsodium.
+
+#if MPW_SODIUM
+
+static bool mpw_crypto_sodium_init(void) {
+
+    // Also lets libsodium pick the fastest implementations for this host's CPU.
+    return sodium_init() >= 0;
+}
+
+static bool mpw_crypto_sodium_scrypt(uint8_t *key, const size_t keySize, const uint8_t *secret, const size_t secretSize,
+        const uint8_t *salt, const size_t saltSize, const uint64_t N, const uint32_t r, const uint32_t p) {
+
+    return crypto_pwhash_scryptsalsa208sha256_ll( secret, secretSize, salt, saltSize, N, r, p, key, keySize ) == 0;
+}
+
+static bool mpw_crypto_sodium_blake2b(uint8_t *subkey, const size_t subkeySize, const uint8_t *key, const size_t keySize,
+        const uint8_t *context, const size_t contextSize,
+        const uint8_t salt[MPCryptoBlake2bSaltSize], const uint8_t personal[MPCryptoBlake2bPersonalSize]) {
+
+    // The context is the hashed message, it can be of any size; the subkey is the hash.
+    if (keySize < crypto_generichash_blake2b_KEYBYTES_MIN || keySize > crypto_generichash_blake2b_KEYBYTES_MAX ||
+        subkeySize < crypto_generichash_blake2b_BYTES_MIN || subkeySize > crypto_generichash_blake2b_BYTES_MAX) {
+        errno = EINVAL;
+        return false;
+    }
+
+    return crypto_generichash_blake2b_salt_personal( subkey, subkeySize, context, contextSize, key, keySize, salt, personal ) == 0;
+}
+
+static bool mpw_crypto_sodium_sha256(uint8_t digest[MPCryptoSHA256Size], const uint8_t *buf, const size_t bufSize) {
+
+    return crypto_hash_sha256( digest, buf, bufSize ) == 0;
+}
+
+static bool mpw_crypto_sodium_hmac_sha256(uint8_t mac[MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+        const uint8_t *message, const size_t messageSize) {
+
+    crypto_auth_hmacsha256_state state;
+    return crypto_auth_hmacsha256_init( &state, key, keySize ) == 0 &&
+           crypto_auth_hmacsha256_update( &state, message, messageSize ) == 0 &&
+           crypto_auth_hmacsha256_final( &state, mac ) == 0;
+}
+
+static bool mpw_crypto_sodium_hmac_sha256_batch(uint8_t macs[][MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+        const uint8_t *prefix, const size_t prefixSize, const uint8_t *const messages[], const size_t messageSizes[], const size_t count) {
+
+    // The key and prefix are absorbed once, each message continues from a copy of that state.
+    crypto_auth_hmacsha256_state keyed, state;
+    bool success = crypto_auth_hmacsha256_init( &keyed, key, keySize ) == 0 &&
+                   (!prefixSize || crypto_auth_hmacsha256_update( &keyed, prefix, prefixSize ) == 0);
+    for (size_t m = 0; success && m < count; ++m) {
+        state = keyed;
+        success = crypto_auth_hmacsha256_update( &state, messages[m], messageSizes[m] ) == 0 &&
+                  crypto_auth_hmacsha256_final( &state, macs[m] ) == 0;
+    }
+    bzero( &keyed, sizeof( keyed ) );
+    bzero( &state, sizeof( state ) );
+
+    return success;
+}
+
+static bool mpw_crypto_sodium_aes128_ctr(uint8_t *out, const uint8_t *in, const size_t bufSize,
+        const uint8_t key[MPCryptoAESKeySize], const uint8_t nonce[MPCryptoAESBlockSize]) {
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+    return crypto_stream_aes128ctr_xor( out, in, bufSize, nonce, key ) == 0;
+#pragma clang diagnostic pop
+#pragma GCC diagnostic pop
+}
+
+static MPCryptoBackend mpw_crypto_sodium = {
+        .name = "sodium",
+        .init = mpw_crypto_sodium_init,
+        .scrypt = mpw_crypto_sodium_scrypt,
+        .blake2b = mpw_crypto_sodium_blake2b,
+        .sha256 = mpw_crypto_sodium_sha256,
+        .hmac_sha256 = mpw_crypto_sodium_hmac_sha256,
+        .hmac_sha256_batch = mpw_crypto_sodium_hmac_sha256_batch,
+        .aes128_ctr = mpw_crypto_sodium_aes128_ctr,
+};
+
+#endif
+
+#if !MPW_CPERCIVA && !MPW_SODIUM
+#error No crypto support.
+#endif
+
+//// Selection.
+
+static const MPCryptoBackend *const mpw_crypto_backends_[] = {
+#if MPW_CRYPTO_X86
+        &mpw_crypto_x86,
+#endif
+#if MPW_CPERCIVA
+        &mpw_crypto_cperciva,
+#endif
+#if MPW_SODIUM
+        &mpw_crypto_sodium,
+#endif
+        NULL
+};
+
+/** The selected backend, resolved with the functions of the others. */
+static MPCryptoBackend mpw_crypto_selected;
+/** 0: no backend selected, 1: selecting a backend, 2: backend selected. */
+static int mpw_crypto_selection;
+
+const MPCryptoBackend *const *mpw_crypto_backends(void) {
+
+    return mpw_crypto_backends_;
+}
+
+static bool mpw_crypto_resolve(MPCryptoBackend *resolved, const char *name) {
+
+    const MPCryptoBackend *const *backend = mpw_crypto_backends_;
+    for (; *backend; ++backend)
+        if (!name || strcmp( (*backend)->name, name ) == 0) {
+            if ((*backend)->init())
+                break;
+            if (name) {
+                dbg( "Crypto backend %s cannot be used on this host.\n", name );
+                return false;
+            }
+        }
+    if (!*backend) {
+        if (name)
+            dbg( "Unknown crypto backend: %s\n", name );
+        return false;
+    }
+
+    // Perform the functions the backend doesn't implement with the next backend that does.
+    *resolved = **backend;
+    for (const MPCryptoBackend *const *fallback = mpw_crypto_backends_; *fallback; ++fallback) {
+        if (*fallback == *backend || !(*fallback)->init())
+            continue;
+
+        resolved->scrypt = resolved->scrypt?: (*fallback)->scrypt;
+        resolved->blake2b = resolved->blake2b?: (*fallback)->blake2b;
+        resolved->sha256 = resolved->sha256?: (*fallback)->sha256;
+        resolved->hmac_sha256 = resolved->hmac_sha256?: (*fallback)->hmac_sha256;
+        resolved->hmac_sha256_batch = resolved->hmac_sha256_batch?: (*fallback)->hmac_sha256_batch;
+        resolved->aes128_ctr = resolved->aes128_ctr?: (*fallback)->aes128_ctr;
+    }
+
+    return true;
+}
+
+static bool mpw_crypto_setup(const char *name, const bool lazily) {
+
+    // Take our turn at selecting a backend, unless one was already selected for a lazy setup.
+    int selection;
+    do {
+        selection = __atomic_load_n( &mpw_crypto_selection, __ATOMIC_ACQUIRE );
+        if (lazily && selection == 2)
+            return true;
+    } while (selection == 1 ||
+             !__atomic_compare_exchange_n( &mpw_crypto_selection, &selection, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ));
+
+    MPCryptoBackend resolved;
+    bool success = mpw_crypto_resolve( &resolved, name );
+    if (success) {
+        mpw_crypto_selected = resolved;
+        dbg( "Crypto backend: %s\n", mpw_crypto_selected.name );
+    }
+    __atomic_store_n( &mpw_crypto_selection, success? 2: selection, __ATOMIC_RELEASE );
+
+    return success;
+}
+
+bool mpw_crypto_select(const char *name) {
+
+    return mpw_crypto_setup( name, false );
+}
+
+const MPCryptoBackend *mpw_crypto(void) {
+
+    if (__atomic_load_n( &mpw_crypto_selection, __ATOMIC_ACQUIRE ) != 2)
+        mpw_crypto_setup( NULL, true );
+
+    return &mpw_crypto_selected;
+}
@@ -0,0 +1,75 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#ifndef _MPW_CRYPTO_H
+#define _MPW_CRYPTO_H
+
+#include "mpw-types.h"
+
+//// Crypto backends.
+
+#define MPCryptoSHA256Size 32 /* bytes */
+#define MPCryptoAESKeySize 16 /* bytes */ // Size of an AES-128 key
+#define MPCryptoAESBlockSize 16 /* bytes */
+#define MPCryptoBlake2bSaltSize 16 /* bytes */
+#define MPCryptoBlake2bPersonalSize 16 /* bytes */
+
+/** An implementation of the cryptographic primitives used by the algorithm.
+ * Functions a backend doesn't implement are NULL; they are performed by the next backend that does. */
+typedef struct MPCryptoBackend {
+    /** The backend's name, see mpw_crypto_select. */
+    const char *name;
+    /** Prepare the backend for use on this host.
+     * @return false if the backend cannot be used on this host. */
+    bool (*init)(void);
+
+    /** Derive keySize bytes of key from the secret and salt using scrypt. */
+    bool (*scrypt)(uint8_t *key, const size_t keySize, const uint8_t *secret, const size_t secretSize,
+            const uint8_t *salt, const size_t saltSize, const uint64_t N, const uint32_t r, const uint32_t p);
+    /** Derive subkeySize bytes of subkey from the key and context using keyed blake2b. */
+    bool (*blake2b)(uint8_t *subkey, const size_t subkeySize, const uint8_t *key, const size_t keySize,
+            const uint8_t *context, const size_t contextSize,
+            const uint8_t salt[MPCryptoBlake2bSaltSize], const uint8_t personal[MPCryptoBlake2bPersonalSize]);
+    /** Hash the buffer using SHA-256. */
+    bool (*sha256)(uint8_t digest[MPCryptoSHA256Size], const uint8_t *buf, const size_t bufSize);
+    /** Calculate the MAC of the message with the key using HMAC-SHA-256. */
+    bool (*hmac_sha256)(uint8_t mac[MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+            const uint8_t *message, const size_t messageSize);
+    /** Calculate the MACs of count messages that follow the same prefix with the same key using HMAC-SHA-256,
+     * macs[m] for prefix || messages[m].  The prefix may be empty. */
+    bool (*hmac_sha256_batch)(uint8_t macs[][MPCryptoSHA256Size], const uint8_t *key, const size_t keySize,
+            const uint8_t *prefix, const size_t prefixSize,
+            const uint8_t *const messages[], const size_t messageSizes[], const size_t count);
+    /** XOR the buffer with the AES-128-CTR key stream for the key, starting at the big-endian counter block nonce. */
+    bool (*aes128_ctr)(uint8_t *out, const uint8_t *in, const size_t bufSize,
+            const uint8_t key[MPCryptoAESKeySize], const uint8_t nonce[MPCryptoAESBlockSize]);
+} MPCryptoBackend;
+
+/** @return The backends built into this library, most preferred first, terminated by NULL.
+ *          Not all of them may be usable on this host. */
+const MPCryptoBackend *const *mpw_crypto_backends(void);
+/** Select the backend that performs the cryptographic functions.
+ * Select the backend before the first cryptographic operation, it is not safe to change backends while they're in use.
+ * @param name The name of a backend, or NULL to select the most preferred backend usable on this host.
+ * @return false if no such backend exists or it cannot be used on this host, in which case the selection is unchanged. */
+bool mpw_crypto_select(const char *name);
+/** @return The selected backend, with its missing functions performed by the next backend that implements them.
+ *          The most preferred usable backend is selected if none was yet. */
+const MPCryptoBackend *mpw_crypto(void);
+
+#endif // _MPW_CRYPTO_H
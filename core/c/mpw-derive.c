@@ -0,0 +1,590 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#if __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "mpw-util.h"
+#include "mpw-crypto.h"
+
+#include "mpw-derive.h"
+
+/** A derivation in flight and the calls that wait for it. */
+typedef struct MPDeriveFlight {
+    /** The HMAC of the full name under the master password, identifies the key without holding on to the password. */
+    uint8_t id[MPCryptoSHA256Size];
+    MPAlgorithmVersion algorithm;
+    MPDerivePriority priority;
+
+    /** The calls that still need the flight: the one that derives the key and those that wait for it. */
+    size_t callers;
+    /** Set while one of the calls derives the key, it is queued otherwise. */
+    bool departed;
+    bool landed;
+    MPMasterKey masterKey;
+    /** The errno of the derivation if it landed without a key. */
+    int error;
+
+    struct MPDeriveFlight *next;
+    /** The flight after this one in its priority's queue. */
+    struct MPDeriveFlight *queued;
+} MPDeriveFlight;
+
+/** How often a waiting call checks whether it was cancelled, in nanoseconds. */
+#define MP_derive_cancelPoll 10000000
+
+static pthread_mutex_t mpw_derive_lock = PTHREAD_MUTEX_INITIALIZER;
+static MPDeriveFlight *mpw_derive_flights;
+
+/** Signalled when a derivation may be able to take its turn, or a flight landed or returned to its queue. */
+static pthread_cond_t mpw_derive_turn = PTHREAD_COND_INITIALIZER;
+static MPDeriveFlight *mpw_derive_queues[MPDerivePriorityLast + 1];
+static size_t mpw_derive_running, mpw_derive_concurrency;
+
+/** @return The amount of derivations that fit in the memory and on the processors, at least 1. */
+static size_t mpw_derive_fit(size_t memory) {
+
+    if (!memory) {
+        long pages = sysconf( _SC_PHYS_PAGES ), pageSize = sysconf( _SC_PAGESIZE );
+        memory = pages > 0 && pageSize > 0? (size_t)pages / 4 * (size_t)pageSize: MPDeriveMemory;
+    }
+    long processors = sysconf( _SC_NPROCESSORS_ONLN );
+
+    return max( (size_t)1, min( memory / MPDeriveMemory, processors > 0? (size_t)processors: (size_t)1 ) );
+}
+
+/** Add the flight to the back of its priority's queue.  Call with mpw_derive_lock held. */
+static void mpw_derive_enqueue(MPDeriveFlight *flight) {
+
+    MPDeriveFlight **last = &mpw_derive_queues[flight->priority];
+    while (*last)
+        last = &(*last)->queued;
+    *last = flight;
+    flight->queued = NULL;
+}
+
+/** Take the flight out of its priority's queue.  Call with mpw_derive_lock held. */
+static void mpw_derive_dequeue(MPDeriveFlight *flight) {
+
+    for (MPDeriveFlight **queued = &mpw_derive_queues[flight->priority]; *queued; queued = &(*queued)->queued)
+        if (*queued == flight) {
+            *queued = flight->queued;
+            break;
+        }
+    flight->queued = NULL;
+}
+
+/** @return true if the flight is first in line and a derivation may start.  Call with mpw_derive_lock held. */
+static bool mpw_derive_turn_of(const MPDeriveFlight *flight) {
+
+    if (!mpw_derive_concurrency)
+        mpw_derive_concurrency = mpw_derive_fit( 0 );
+    if (mpw_derive_running >= mpw_derive_concurrency)
+        return false;
+
+    for (MPDerivePriority priority = MPDerivePriorityFirst; priority <= MPDerivePriorityLast; ++priority)
+        if (mpw_derive_queues[priority])
+            return mpw_derive_queues[priority] == flight;
+
+    return false;
+}
+
+/** Take the flight out of the flights that calls can join.  Call with mpw_derive_lock held. */
+static void mpw_derive_unlist(MPDeriveFlight *flight) {
+
+    for (MPDeriveFlight **listed = &mpw_derive_flights; *listed; listed = &(*listed)->next)
+        if (*listed == flight) {
+            *listed = flight->next;
+            break;
+        }
+}
+
+/** Leave a flight, the last caller to leave frees it, or drops it if it hasn't landed.  Call with mpw_derive_lock held. */
+static void mpw_derive_leave(MPDeriveFlight *flight) {
+
+    if (--flight->callers)
+        return;
+
+    if (!flight->landed) {
+        mpw_derive_dequeue( flight );
+        mpw_derive_unlist( flight );
+    }
+    mpw_free( &flight->masterKey, MPMasterKeySize );
+    mpw_free( &flight, sizeof( *flight ) );
+}
+
+/** @return false, with errno set, if the control abandons the call: it was cancelled or ran past its deadline. */
+static bool mpw_derive_proceed(const MPKDFControl *control) {
+
+    if (control && control->cancelled && __atomic_load_n( control->cancelled, __ATOMIC_RELAXED )) {
+        errno = ECANCELED;
+        return false;
+    }
+    if (control && control->deadline && mpw_now() >= control->deadline) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+
+    return true;
+}
+
+/** Wait for the scheduler to change, no longer than the call's control lets it proceed.  Call with mpw_derive_lock held. */
+static void mpw_derive_wait(const MPKDFControl *control) {
+
+    uint64_t wait = control && control->cancelled? MP_derive_cancelPoll: 0;
+    if (control && control->deadline) {
+        uint64_t now = mpw_now();
+        if (now >= control->deadline)
+            return;
+        wait = wait? min( wait, control->deadline - now ): control->deadline - now;
+    }
+    if (!wait) {
+        pthread_cond_wait( &mpw_derive_turn, &mpw_derive_lock );
+        return;
+    }
+
+    // The condition waits on the real-time clock, the deadline is on the monotonic clock.
+    struct timespec until;
+    clock_gettime( CLOCK_REALTIME, &until );
+    uint64_t nsec = (uint64_t)until.tv_nsec + wait;
+    until.tv_sec += (time_t)(nsec / 1000000000ULL);
+    until.tv_nsec = (long)(nsec % 1000000000ULL);
+    pthread_cond_timedwait( &mpw_derive_turn, &mpw_derive_lock, &until );
+}
+
+MPMasterKey mpw_derive_masterKey(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPDerivePriority priority, const MPKDFControl *control) {
+
+    if (!fullName || !masterPassword || !strlen( masterPassword ) || priority > MPDerivePriorityLast)
+        return mpw_masterKey_control( fullName, masterPassword, algorithmVersion, control );
+
+    uint8_t id[MPCryptoSHA256Size];
+    const uint8_t *mac = mpw_hash_hmac_sha256( (const uint8_t *)masterPassword, strlen( masterPassword ),
+            (const uint8_t *)fullName, strlen( fullName ) );
+    if (!mac)
+        return mpw_masterKey_control( fullName, masterPassword, algorithmVersion, control );
+    memcpy( id, mac, sizeof( id ) );
+    mpw_free( &mac, MPCryptoSHA256Size );
+
+    // Join the flight that derives this key, or queue a new one.
+    pthread_mutex_lock( &mpw_derive_lock );
+    MPDeriveFlight *flight = mpw_derive_flights;
+    while (flight && (flight->algorithm != algorithmVersion || memcmp( flight->id, id, sizeof( id ) ) != 0))
+        flight = flight->next;
+    if (flight) {
+        if (!flight->departed && priority < flight->priority) {
+            mpw_derive_dequeue( flight );
+            flight->priority = priority;
+            mpw_derive_enqueue( flight );
+            pthread_cond_broadcast( &mpw_derive_turn );
+        }
+    }
+    else {
+        if (!(flight = calloc( 1, sizeof( *flight ) ))) {
+            pthread_mutex_unlock( &mpw_derive_lock );
+            bzero( id, sizeof( id ) );
+            return mpw_masterKey_control( fullName, masterPassword, algorithmVersion, control );
+        }
+        memcpy( flight->id, id, sizeof( id ) );
+        flight->algorithm = algorithmVersion;
+        flight->priority = priority;
+        flight->next = mpw_derive_flights;
+        mpw_derive_flights = flight;
+        mpw_derive_enqueue( flight );
+    }
+    ++flight->callers;
+    bzero( id, sizeof( id ) );
+
+    // Wait for the flight to land, or derive the key when it's the flight's turn, for the calls that wait on it as well.
+    // A call that is abandoned by its control leaves the flight without affecting the others.
+    MPMasterKey masterKey = NULL;
+    for (int error = 0; !flight->landed;) {
+        if (!mpw_derive_proceed( control )) {
+            error = errno;
+            mpw_derive_leave( flight );
+            pthread_mutex_unlock( &mpw_derive_lock );
+            errno = error;
+            return NULL;
+        }
+        if (flight->departed || !mpw_derive_turn_of( flight )) {
+            mpw_derive_wait( control );
+            continue;
+        }
+
+        mpw_derive_dequeue( flight );
+        flight->departed = true;
+        ++mpw_derive_running;
+        // The next in line may fit as well.
+        pthread_cond_broadcast( &mpw_derive_turn );
+        pthread_mutex_unlock( &mpw_derive_lock );
+
+        masterKey = mpw_masterKey_control( fullName, masterPassword, algorithmVersion, control );
+        error = masterKey? 0: errno;
+
+        pthread_mutex_lock( &mpw_derive_lock );
+        --mpw_derive_running;
+        flight->departed = false;
+        pthread_cond_broadcast( &mpw_derive_turn );
+        if (!masterKey && (error == ECANCELED || error == ETIMEDOUT) && flight->callers > 1) {
+            // Abandoned by this call's control: hand the flight back, first in line, for another caller to derive.
+            flight->queued = mpw_derive_queues[flight->priority];
+            mpw_derive_queues[flight->priority] = flight;
+            mpw_derive_leave( flight );
+            pthread_mutex_unlock( &mpw_derive_lock );
+            errno = error;
+            return NULL;
+        }
+
+        mpw_derive_unlist( flight );
+        if (masterKey && flight->callers > 1 && (flight->masterKey = malloc( MPMasterKeySize )))
+            memcpy( (uint8_t *)flight->masterKey, masterKey, MPMasterKeySize );
+        flight->error = error;
+        flight->landed = true;
+        mpw_derive_leave( flight );
+        pthread_mutex_unlock( &mpw_derive_lock );
+        if (!masterKey && error)
+            errno = error;
+        return masterKey;
+    }
+
+    // Another call derived the key.
+    if (flight->masterKey && (masterKey = malloc( MPMasterKeySize )))
+        memcpy( (uint8_t *)masterKey, flight->masterKey, MPMasterKeySize );
+    int error = flight->error;
+    mpw_derive_leave( flight );
+    pthread_mutex_unlock( &mpw_derive_lock );
+    if (!masterKey && error)
+        errno = error;
+
+    return masterKey;
+}
+
+/** An asynchronous derivation, from the pool's queue until its callback is called. */
+typedef struct MPDeriveJob {
+    const char *fullName, *masterPassword;
+    MPAlgorithmVersion algorithm;
+    const MPKDFControl *control;
+    MPMasterKeyCallback callback;
+    void *context;
+    /** The queue to complete into, or NULL to call back on the pool. */
+    MPDeriveQueue *queue;
+    MPMasterKey masterKey;
+
+    struct MPDeriveJob *next;
+} MPDeriveJob;
+
+struct MPDeriveQueue {
+    pthread_mutex_t lock;
+    /** The descriptors that are read and written to signal completions, the same eventfd where there is one. */
+    int readFD, writeFD;
+    MPDeriveJob *completed, **completedLast;
+    /** The derivations that will complete into the queue. */
+    size_t pending;
+    /** Set once the queue is being freed, it waits for its running derivations to complete. */
+    bool freed;
+    pthread_cond_t drained;
+};
+
+static pthread_mutex_t mpw_derive_poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mpw_derive_work = PTHREAD_COND_INITIALIZER;
+static MPDeriveJob *mpw_derive_jobs, **mpw_derive_jobsLast = &mpw_derive_jobs;
+static size_t mpw_derive_workers, mpw_derive_idle;
+
+static void mpw_derive_job_free(MPDeriveJob **job) {
+
+    mpw_free_strings( &(*job)->fullName, &(*job)->masterPassword, NULL );
+    mpw_free( &(*job)->masterKey, MPMasterKeySize );
+    mpw_free( job, sizeof( **job ) );
+}
+
+static void mpw_derive_queue_close(MPDeriveQueue **queue) {
+
+    if ((*queue)->writeFD != (*queue)->readFD)
+        close( (*queue)->writeFD );
+    close( (*queue)->readFD );
+    pthread_cond_destroy( &(*queue)->drained );
+    pthread_mutex_destroy( &(*queue)->lock );
+    mpw_free( queue, sizeof( **queue ) );
+}
+
+/** Hand the derived job to its queue and signal the queue's descriptor. */
+static void mpw_derive_queue_complete(MPDeriveJob *job) {
+
+    MPDeriveQueue *queue = job->queue;
+    pthread_mutex_lock( &queue->lock );
+    --queue->pending;
+    if (queue->freed) {
+        pthread_cond_signal( &queue->drained );
+        pthread_mutex_unlock( &queue->lock );
+        mpw_derive_job_free( &job );
+        return;
+    }
+
+    *queue->completedLast = job;
+    queue->completedLast = &job->next;
+#if __linux__
+    if (eventfd_write( queue->writeFD, 1 ) != 0)
+#else
+    if (write( queue->writeFD, "", 1 ) < 0 && errno != EAGAIN)
+#endif
+        wrn( "Couldn't signal derivation completion: %s\n", strerror( errno ) );
+    pthread_mutex_unlock( &queue->lock );
+}
+
+static void *mpw_derive_worker(void __unused *unused) {
+
+    pthread_mutex_lock( &mpw_derive_poolLock );
+    for (MPDeriveJob *job;;) {
+        while (!(job = mpw_derive_jobs)) {
+            ++mpw_derive_idle;
+            pthread_cond_wait( &mpw_derive_work, &mpw_derive_poolLock );
+            --mpw_derive_idle;
+        }
+        if (!(mpw_derive_jobs = job->next))
+            mpw_derive_jobsLast = &mpw_derive_jobs;
+        job->next = NULL;
+        pthread_mutex_unlock( &mpw_derive_poolLock );
+
+        job->masterKey = mpw_derive_masterKey( job->fullName, job->masterPassword, job->algorithm,
+                MPDerivePriorityInteractive, job->control );
+        mpw_free_strings( &job->fullName, &job->masterPassword, NULL );
+        if (job->queue)
+            mpw_derive_queue_complete( job );
+        else {
+            job->callback( job->masterKey, job->context );
+            job->masterKey = NULL;
+            mpw_derive_job_free( &job );
+        }
+
+        pthread_mutex_lock( &mpw_derive_poolLock );
+    }
+
+    return NULL;
+}
+
+/** Queue a job for the pool, growing the pool to the derivations' concurrency limit if no worker is idle. */
+static bool mpw_derive_submit(
+        MPDeriveQueue *queue, const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control, MPMasterKeyCallback callback, void *context) {
+
+    if (!fullName || !masterPassword || !callback)
+        return false;
+
+    MPDeriveJob *job = calloc( 1, sizeof( *job ) );
+    if (!job)
+        return false;
+    *job = (MPDeriveJob){
+            .fullName = strdup( fullName ), .masterPassword = strdup( masterPassword ), .algorithm = algorithmVersion,
+            .control = control, .callback = callback, .context = context, .queue = queue,
+    };
+    if (!job->fullName || !job->masterPassword) {
+        mpw_derive_job_free( &job );
+        return false;
+    }
+
+    size_t concurrency = mpw_derive_load().concurrency;
+    pthread_mutex_lock( &mpw_derive_poolLock );
+    if (!mpw_derive_idle && mpw_derive_workers < concurrency) {
+        pthread_t worker;
+        pthread_attr_t attributes;
+        pthread_attr_init( &attributes );
+        pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+        if (pthread_create( &worker, &attributes, mpw_derive_worker, NULL ) == 0)
+            ++mpw_derive_workers;
+        pthread_attr_destroy( &attributes );
+    }
+    if (!mpw_derive_workers) {
+        pthread_mutex_unlock( &mpw_derive_poolLock );
+        mpw_derive_job_free( &job );
+        return false;
+    }
+    if (queue) {
+        pthread_mutex_lock( &queue->lock );
+        ++queue->pending;
+        pthread_mutex_unlock( &queue->lock );
+    }
+    *mpw_derive_jobsLast = job;
+    mpw_derive_jobsLast = &job->next;
+    pthread_cond_signal( &mpw_derive_work );
+    pthread_mutex_unlock( &mpw_derive_poolLock );
+
+    return true;
+}
+
+bool mpw_masterKey_async(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control, MPMasterKeyCallback callback, void *context) {
+
+    return mpw_derive_submit( NULL, fullName, masterPassword, algorithmVersion, control, callback, context );
+}
+
+MPDeriveQueue *mpw_derive_queue_new(void) {
+
+    MPDeriveQueue *queue = calloc( 1, sizeof( *queue ) );
+    if (!queue)
+        return NULL;
+
+#if __linux__
+    queue->readFD = queue->writeFD = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if (queue->readFD < 0) {
+#else
+    int fds[2];
+    if (pipe( fds ) == 0) {
+        queue->readFD = fds[0];
+        queue->writeFD = fds[1];
+        for (int f = 0; f < 2; ++f) {
+            fcntl( fds[f], F_SETFL, fcntl( fds[f], F_GETFL ) | O_NONBLOCK );
+            fcntl( fds[f], F_SETFD, FD_CLOEXEC );
+        }
+    }
+    else {
+#endif
+        err( "Couldn't create derivation queue descriptor: %s\n", strerror( errno ) );
+        mpw_free( &queue, sizeof( *queue ) );
+        return NULL;
+    }
+    pthread_mutex_init( &queue->lock, NULL );
+    pthread_cond_init( &queue->drained, NULL );
+    queue->completedLast = &queue->completed;
+
+    return queue;
+}
+
+int mpw_derive_queue_fd(const MPDeriveQueue *queue) {
+
+    return queue? queue->readFD: ERR;
+}
+
+bool mpw_masterKey_queued(
+        MPDeriveQueue *queue, const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control, MPMasterKeyCallback callback, void *context) {
+
+    return queue && mpw_derive_submit( queue, fullName, masterPassword, algorithmVersion, control, callback, context );
+}
+
+size_t mpw_derive_queue_run(MPDeriveQueue *queue) {
+
+    if (!queue)
+        return 0;
+
+    pthread_mutex_lock( &queue->lock );
+#if __linux__
+    eventfd_t signals;
+    eventfd_read( queue->readFD, &signals );
+#else
+    char signals[64];
+    while (read( queue->readFD, signals, sizeof( signals ) ) > 0);
+#endif
+    MPDeriveJob *completed = queue->completed;
+    queue->completed = NULL;
+    queue->completedLast = &queue->completed;
+    pthread_mutex_unlock( &queue->lock );
+
+    size_t count = 0;
+    for (MPDeriveJob *job; (job = completed); ++count) {
+        completed = job->next;
+        job->callback( job->masterKey, job->context );
+        job->masterKey = NULL;
+        mpw_derive_job_free( &job );
+    }
+
+    return count;
+}
+
+bool mpw_derive_queue_free(MPDeriveQueue **queue) {
+
+    if (!queue || !*queue)
+        return false;
+
+    // Drop the derivations that haven't started, and wait for those that run to stop using their control.
+    MPDeriveJob *dropped = NULL;
+    pthread_mutex_lock( &mpw_derive_poolLock );
+    pthread_mutex_lock( &(*queue)->lock );
+    for (MPDeriveJob **job = &mpw_derive_jobs; *job;)
+        if ((*job)->queue == *queue) {
+            MPDeriveJob *drop = *job;
+            *job = drop->next;
+            drop->next = dropped;
+            dropped = drop;
+            --(*queue)->pending;
+        }
+        else
+            job = &(*job)->next;
+    for (mpw_derive_jobsLast = &mpw_derive_jobs; *mpw_derive_jobsLast;)
+        mpw_derive_jobsLast = &(*mpw_derive_jobsLast)->next;
+    pthread_mutex_unlock( &mpw_derive_poolLock );
+
+    MPDeriveJob *completed = (*queue)->completed;
+    (*queue)->completed = NULL;
+    (*queue)->completedLast = &(*queue)->completed;
+    (*queue)->freed = true;
+    while ((*queue)->pending)
+        pthread_cond_wait( &(*queue)->drained, &(*queue)->lock );
+    pthread_mutex_unlock( &(*queue)->lock );
+
+    for (MPDeriveJob *job; (job = completed);) {
+        completed = job->next;
+        mpw_derive_job_free( &job );
+    }
+    for (MPDeriveJob *job; (job = dropped);) {
+        dropped = job->next;
+        mpw_derive_job_free( &job );
+    }
+    mpw_derive_queue_close( queue );
+
+    return true;
+}
+
+size_t mpw_derive_limit(const size_t memory) {
+
+    size_t concurrency = mpw_derive_fit( memory );
+
+    pthread_mutex_lock( &mpw_derive_lock );
+    mpw_derive_concurrency = concurrency;
+    pthread_cond_broadcast( &mpw_derive_turn );
+    pthread_mutex_unlock( &mpw_derive_lock );
+
+    return concurrency;
+}
+
+MPDeriveLoad mpw_derive_load(void) {
+
+    MPDeriveLoad load = { .concurrency = 0 };
+
+    pthread_mutex_lock( &mpw_derive_lock );
+    if (!mpw_derive_concurrency)
+        mpw_derive_concurrency = mpw_derive_fit( 0 );
+    load.concurrency = mpw_derive_concurrency;
+    load.running = mpw_derive_running;
+    for (MPDerivePriority priority = MPDerivePriorityFirst; priority <= MPDerivePriorityLast; ++priority)
+        for (MPDeriveFlight *queued = mpw_derive_queues[priority]; queued; queued = queued->queued)
+            ++load.queued[priority];
+    for (MPDeriveFlight *flight = mpw_derive_flights; flight; flight = flight->next)
+        load.joined += flight->callers - 1;
+    pthread_mutex_unlock( &mpw_derive_lock );
+
+    return load;
+}
@@ -0,0 +1,107 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#ifndef _MPW_DERIVE_H
+#define _MPW_DERIVE_H
+
+#include "mpw-algorithm.h"
+
+//// Master key derivation for concurrent callers.
+
+/** The memory one master key derivation takes: scrypt's 128 * r * N bytes. */
+#define MPDeriveMemory (128 * 8 * 32768LU)
+
+typedef mpw_enum( unsigned int, MPDerivePriority ) {
+    /** A user waits for the key: derived before any queued bulk work. */
+            MPDerivePriorityInteractive,
+    /** Background work: derived when no interactive derivations are queued. */
+            MPDerivePriorityBulk,
+
+    MPDerivePriorityFirst = MPDerivePriorityInteractive,
+    MPDerivePriorityLast = MPDerivePriorityBulk,
+};
+
+typedef struct {
+    /** The amount of derivations that may run at once. */
+    size_t concurrency;
+    /** The amount of derivations running now. */
+    size_t running;
+    /** The amount of derivations waiting for their turn, by priority. */
+    size_t queued[MPDerivePriorityLast + 1];
+    /** The amount of calls that joined a derivation of another call rather than derive the key again. */
+    size_t joined;
+} MPDeriveLoad;
+
+/** Derive the master key like mpw_masterKey_control, sharing the work with the concurrent calls that derive the same key.
+ * A call for the full name, master password and algorithm version of a derivation in flight waits for its result
+ * instead of deriving the key again.  Each call receives its own copy of the key.
+ * Derivations wait for their turn while the concurrency limit is reached, the first in line of the highest priority
+ * is next.  Joining a queued derivation with a higher priority moves it up to that priority.
+ * The derivation runs under the control of the call that takes its turn.  A call abandoned by its own control, while it
+ * waits or derives, leaves without affecting the others: a derivation it abandons goes back to the front of its queue
+ * for one of the calls that still wait for it.
+ * @param control NULL to derive without control.
+ * @return A new MPMasterKeySize-byte allocated buffer or NULL if the key couldn't be derived,
+ *         errno is ECANCELED or ETIMEDOUT if the call was abandoned. */
+MPMasterKey mpw_derive_masterKey(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPDerivePriority priority, const MPKDFControl *control);
+
+/** Receives the master key of an asynchronous derivation, or NULL if the key couldn't be derived.
+ * The callback owns the key, free it with mpw_free. */
+typedef void (*MPMasterKeyCallback)(MPMasterKey masterKey, void *context);
+
+/** Derive the master key on a background thread of the derivations' pool, as an interactive derivation.
+ * The callback is called on the pool's thread once the key is derived.
+ * @param control NULL to derive without control, see mpw_derive_masterKey.  It must stay valid until the callback is
+ *        called, its progress is reported on the pool's thread.
+ * @return false if the derivation couldn't be started, the callback won't be called then. */
+bool mpw_masterKey_async(
+        const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control, MPMasterKeyCallback callback, void *context);
+
+/** Derivations that completed on the pool, waiting for their callbacks to be called on the thread that runs the queue. */
+typedef struct MPDeriveQueue MPDeriveQueue;
+/** @return A new completion queue or NULL if its descriptor couldn't be created. */
+MPDeriveQueue *mpw_derive_queue_new(void);
+/** @return A descriptor that is readable while derivations have completed into the queue, to poll from an event loop.
+ * It is owned by the queue: only poll it, don't read or close it. */
+int mpw_derive_queue_fd(const MPDeriveQueue *queue);
+/** Derive the master key like mpw_masterKey_async, but complete it into the queue rather than calling back on the pool.
+ * The control must stay valid until the callback is called or the queue is freed.
+ * @return false if the derivation couldn't be started, the callback won't be called then. */
+bool mpw_masterKey_queued(
+        MPDeriveQueue *queue, const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion,
+        const MPKDFControl *control, MPMasterKeyCallback callback, void *context);
+/** Call the callbacks of the derivations that completed into the queue, on this thread.
+ * @return The amount of callbacks called. */
+size_t mpw_derive_queue_run(MPDeriveQueue *queue);
+/** Free the queue and the keys that completed into it without calling their callbacks, then set the reference to NULL.
+ * Pending derivations that haven't started are dropped, the free waits for those that run to complete: their controls
+ * aren't used once it returns.  Cancel them through their controls first to free the queue without that wait. */
+bool mpw_derive_queue_free(MPDeriveQueue **queue);
+
+/** Limit the derivations that run at once to those that fit in the given memory, and to the online processors.
+ * Derivations that run already aren't affected.
+ * @param memory The bytes that derivations may use at once, 0 to use at most a quarter of the physical memory.
+ * @return The amount of derivations that may run at once, at least 1. */
+size_t mpw_derive_limit(const size_t memory);
+/** @return A consistent copy of the derivations' current load. */
+MPDeriveLoad mpw_derive_load(void);
+
+#endif // _MPW_DERIVE_H
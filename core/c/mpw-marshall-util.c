@@ -97,12 +97,12 @@ bool mpw_get_json_boolean(
 }
 
 bool mpw_update_masterKey(MPMasterKey *masterKey, MPAlgorithmVersion *masterKeyAlgorithm, MPAlgorithmVersion targetKeyAlgorithm,
-        const char *fullName, const char *masterPassword) {
+        const char *fullName, const char *masterPassword, MPMasterKeyProvider masterKeyProvider) {
 
     if (*masterKeyAlgorithm != targetKeyAlgorithm) {
         mpw_free( masterKey, MPMasterKeySize );
         *masterKeyAlgorithm = targetKeyAlgorithm;
-        *masterKey = mpw_masterKey( fullName, masterPassword, *masterKeyAlgorithm );
+        *masterKey = (masterKeyProvider?: mpw_masterKey)( fullName, masterPassword, *masterKeyAlgorithm );
         if (!*masterKey) {
             err( "Couldn't derive master key for user %s, algorithm %d.\n", fullName, *masterKeyAlgorithm );
             return false;
@@ -61,9 +61,10 @@ bool mpw_get_json_boolean(
 /// mpw.
 
 /** Calculate a master key if the target master key algorithm is different from the given master key algorithm.
+  * @param masterKeyProvider Obtains the master key, or NULL to derive it with mpw_masterKey.
   * @return false if an error occurred during the derivation of the master key. */
 bool mpw_update_masterKey(
         MPMasterKey *masterKey, MPAlgorithmVersion *masterKeyAlgorithm, MPAlgorithmVersion targetKeyAlgorithm,
-        const char *fullName, const char *masterPassword);
+        const char *fullName, const char *masterPassword, MPMasterKeyProvider masterKeyProvider);
 
 #endif // _MPW_MARSHALL_UTIL_H
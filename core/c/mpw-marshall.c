@@ -20,10 +20,36 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "mpw-marshall.h"
 #include "mpw-util.h"
 #include "mpw-marshall-util.h"
+#include "mpw-metrics.h"
+
+/** The size of the first chunk of a user's arena, it holds the strings of a few hundred sites. */
+#define MP_marshall_arenaCapacity 16 * 1024
+
+/** @return A copy of the string that is freed with the user, or NULL if string is NULL or an allocation failed. */
+static const char *mpw_marshall_strdup(
+        MPMarshalledUser *user, const char *string) {
+
+    if (!string)
+        return NULL;
+
+    return user->arena? mpw_arena_strdup( user->arena, string ): strdup( string );
+}
+
+/** Free a string of the user's data.  Strings from the user's arena are wiped with the arena, others are freed now. */
+static bool mpw_marshall_free_string(
+        MPMarshalledUser *user, const char **string) {
+
+    if (!mpw_arena_owns( user->arena, *string ))
+        return mpw_free_string( string );
+
+    *string = NULL;
+    return true;
+}
 
 MPMarshalledUser *mpw_marshall_user(
         const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion) {
@@ -33,8 +59,7 @@ MPMarshalledUser *mpw_marshall_user(
         return NULL;
 
     *user = (MPMarshalledUser){
-            .fullName = strdup( fullName ),
-            .masterPassword = strdup( masterPassword ),
+            .arena = mpw_arena_new( MP_marshall_arenaCapacity ),
             .algorithm = algorithmVersion,
             .redacted = true,
 
@@ -45,6 +70,14 @@ MPMarshalledUser *mpw_marshall_user(
             .sites_count = 0,
             .sites = NULL,
     };
+    if (!user->arena)
+        wrn( "Could not create arena for user, its strings will be allocated one by one: %s\n", strerror( errno ) );
+    if (!(user->fullName = mpw_marshall_strdup( user, fullName )) ||
+        !(user->masterPassword = mpw_marshall_strdup( user, masterPassword ))) {
+        mpw_marshal_free( &user );
+        return NULL;
+    }
+
     return user;
 };
 
@@ -54,10 +87,12 @@ MPMarshalledSite *mpw_marshall_site(
 
     if (!siteName || !mpw_realloc( &user->sites, NULL, sizeof( MPMarshalledSite ) * ++user->sites_count ))
         return NULL;
+    mpw_marshall_columns_free( &user->columns );
+    mpw_marshall_search_free( &user->search );
 
     MPMarshalledSite *site = &user->sites[user->sites_count - 1];
     *site = (MPMarshalledSite){
-            .name = strdup( siteName ),
+            .name = mpw_marshall_strdup( user, siteName ),
             .content = NULL,
             .type = resultType,
             .counter = siteCounter,
@@ -93,6 +128,487 @@ MPMarshalledQuestion *mpw_marshal_question(
     return question;
 }
 
+bool mpw_site_render(
+        MPMasterKey masterKey, const MPMarshalledSite *site, MPRenderedSite *out) {
+
+    if (!out)
+        return false;
+    *out = (MPRenderedSite){ .password = NULL };
+    if (!masterKey || !site || !site->name || !strlen( site->name ))
+        return false;
+
+    // The password, the login name and an answer for each question.
+    size_t count = 2 + site->questions_count;
+    MPSiteKeyParams *siteParams = calloc( count, sizeof( *siteParams ) );
+    MPResultType *resultTypes = calloc( count, sizeof( *resultTypes ) );
+    const char **resultParams = calloc( count, sizeof( *resultParams ) );
+    const char **results = calloc( count, sizeof( *results ) );
+    uint8_t (*siteKeys)[MPSiteKeySize] = calloc( count, sizeof( *siteKeys ) );
+    bool success = siteParams && resultTypes && resultParams && results && siteKeys;
+    if (success) {
+        siteParams[0] = (MPSiteKeyParams){
+                .siteName = site->name, .siteCounter = site->counter, .keyPurpose = MPKeyPurposeAuthentication,
+                .algorithmVersion = site->algorithm,
+        };
+        resultTypes[0] = site->type;
+        resultParams[0] = site->content;
+        siteParams[1] = (MPSiteKeyParams){
+                .siteName = site->name, .siteCounter = MPCounterValueInitial, .keyPurpose = MPKeyPurposeIdentification,
+                .algorithmVersion = site->algorithm,
+        };
+        resultTypes[1] = site->loginType;
+        resultParams[1] = site->loginContent;
+        for (size_t q = 0; q < site->questions_count; ++q) {
+            siteParams[2 + q] = (MPSiteKeyParams){
+                    .siteName = site->name, .siteCounter = MPCounterValueInitial, .keyPurpose = MPKeyPurposeRecovery,
+                    .keyContext = site->questions[q].keyword, .algorithmVersion = site->algorithm,
+            };
+            resultTypes[2 + q] = site->questions[q].type;
+            resultParams[2 + q] = site->questions[q].content;
+        }
+        success = mpw_siteKeys_batch( masterKey, siteParams, count, siteKeys );
+    }
+
+    // Generate the results and pack them into one buffer, after the answers array.
+    size_t bufferSize = site->questions_count * sizeof( *out->answers );
+    for (size_t r = 0; success && r < count; ++r) {
+        const char *resultParam = resultParams[r] && strlen( resultParams[r] )? resultParams[r]: NULL;
+        if ((results[r] = mpw_siteResult_forKey( masterKey, siteKeys[r], resultTypes[r], resultParam, site->algorithm )))
+            bufferSize += strlen( results[r] ) + 1;
+    }
+    uint8_t *buffer = success? malloc( bufferSize?: 1 ): NULL;
+    if ((success = buffer != NULL)) {
+        const char **answers = (const char **)buffer, *rendered[count];
+        char *cursor = (char *)(buffer + site->questions_count * sizeof( *out->answers ));
+        for (size_t r = 0; r < count; ++r) {
+            rendered[r] = NULL;
+            if (results[r]) {
+                rendered[r] = strcpy( cursor, results[r] );
+                cursor += strlen( results[r] ) + 1;
+            }
+            if (r >= 2)
+                answers[r - 2] = rendered[r];
+        }
+        *out = (MPRenderedSite){
+                .password = rendered[0], .login = rendered[1],
+                .answers_count = site->questions_count, .answers = site->questions_count? answers: NULL,
+                .buffer = buffer, .bufferSize = bufferSize,
+        };
+    }
+
+    for (size_t r = 0; results && r < count; ++r)
+        mpw_free_string( &results[r] );
+    mpw_free( &siteParams, count * sizeof( *siteParams ) );
+    mpw_free( &resultTypes, count * sizeof( *resultTypes ) );
+    mpw_free( &resultParams, count * sizeof( *resultParams ) );
+    mpw_free( &results, count * sizeof( *results ) );
+    mpw_free( &siteKeys, count * sizeof( *siteKeys ) );
+
+    return success;
+}
+
+void mpw_site_render_free(
+        MPRenderedSite *rendered) {
+
+    if (!rendered)
+        return;
+
+    mpw_free( &rendered->buffer, rendered->bufferSize );
+    *rendered = (MPRenderedSite){ .password = NULL };
+}
+
+/** @return The 32-bit FNV-1a hash of a string. */
+static uint32_t mpw_marshall_columns_hash(
+        const char *string) {
+
+    uint32_t hash = 2166136261U;
+    for (const unsigned char *c = (const unsigned char *)string; *c; ++c)
+        hash = (hash ^ *c) * 16777619U;
+
+    return hash;
+}
+
+MPMarshalledColumns *mpw_marshall_columns_new(
+        const MPMarshalledUser *user) {
+
+    if (!user)
+        return NULL;
+
+    // The view, its columns and the names share one buffer, the columns ordered by alignment.
+    const size_t count = user->sites_count;
+    size_t namesSize = 0;
+    for (size_t s = 0; s < count; ++s)
+        namesSize += strlen( user->sites[s].name?: "" ) + 1;
+    if (namesSize > UINT32_MAX)
+        return NULL;
+
+    const size_t headerSize = (sizeof( MPMarshalledColumns ) + sizeof( time_t ) - 1) / sizeof( time_t ) * sizeof( time_t );
+    size_t bufferSize = headerSize + count * (sizeof( time_t ) + sizeof( uint64_t ) + 2 * sizeof( uint32_t ) +
+                                              sizeof( MPResultType ) + sizeof( MPCounterValue ) +
+                                              sizeof( MPAlgorithmVersion ) + sizeof( unsigned int )) + namesSize;
+    uint8_t *buffer = malloc( bufferSize );
+    if (!buffer)
+        return NULL;
+
+    MPMarshalledColumns *columns = (MPMarshalledColumns *)buffer;
+    uint8_t *column = buffer + headerSize;
+    *columns = (MPMarshalledColumns){ .count = count, .bufferSize = bufferSize };
+    columns->lastUsed = (time_t *)column, column += count * sizeof( *columns->lastUsed );
+    columns->namePrefixes = (uint64_t *)column, column += count * sizeof( *columns->namePrefixes );
+    columns->nameHashes = (uint32_t *)column, column += count * sizeof( *columns->nameHashes );
+    columns->nameOffsets = (uint32_t *)column, column += count * sizeof( *columns->nameOffsets );
+    columns->types = (MPResultType *)column, column += count * sizeof( *columns->types );
+    columns->counters = (MPCounterValue *)column, column += count * sizeof( *columns->counters );
+    columns->algorithms = (MPAlgorithmVersion *)column, column += count * sizeof( *columns->algorithms );
+    columns->uses = (unsigned int *)column, column += count * sizeof( *columns->uses );
+    char *names = (char *)column;
+    columns->names = names;
+
+    size_t nameOffset = 0;
+    for (size_t s = 0; s < count; ++s) {
+        const MPMarshalledSite *site = &user->sites[s];
+        const char *name = site->name?: "";
+        const size_t nameSize = strlen( name ) + 1;
+        memcpy( names + nameOffset, name, nameSize );
+
+        columns->namePrefixes[s] = 0;
+        memcpy( &columns->namePrefixes[s], name, min( nameSize - 1, sizeof( *columns->namePrefixes ) ) );
+        columns->nameHashes[s] = mpw_marshall_columns_hash( name );
+        columns->nameOffsets[s] = (uint32_t)nameOffset;
+        columns->types[s] = site->type;
+        columns->counters[s] = site->counter;
+        columns->algorithms[s] = site->algorithm;
+        columns->uses[s] = site->uses;
+        columns->lastUsed[s] = site->lastUsed;
+        nameOffset += nameSize;
+    }
+
+    return columns;
+}
+
+const MPMarshalledColumns *mpw_marshall_columns(
+        MPMarshalledUser *user) {
+
+    if (!user)
+        return NULL;
+    if (!user->columns)
+        user->columns = mpw_marshall_columns_new( user );
+
+    return user->columns;
+}
+
+bool mpw_marshall_columns_find(
+        const MPMarshalledColumns *columns, const char *siteName, size_t *site) {
+
+    if (!columns || !siteName)
+        return false;
+
+    const uint32_t nameHash = mpw_marshall_columns_hash( siteName );
+    for (size_t s = 0; s < columns->count; ++s)
+        if (columns->nameHashes[s] == nameHash && strcmp( columns->names + columns->nameOffsets[s], siteName ) == 0) {
+            if (site)
+                *site = s;
+            return true;
+        }
+
+    return false;
+}
+
+size_t mpw_marshall_columns_prefix(
+        const MPMarshalledColumns *columns, const char *prefix, size_t *sites) {
+
+    if (!columns || !prefix)
+        return 0;
+
+    // The first bytes of the prefix are compared with the namePrefixes column, the rest with the names.
+    const size_t prefixSize = strlen( prefix ), wordSize = min( prefixSize, sizeof( uint64_t ) );
+    uint64_t prefixWord = 0, prefixMask = 0;
+    memcpy( &prefixWord, prefix, wordSize );
+    memset( &prefixMask, 0xFF, wordSize );
+
+    size_t matches = 0;
+    for (size_t s = 0; s < columns->count; ++s)
+        if ((columns->namePrefixes[s] & prefixMask) == prefixWord && (prefixSize <= wordSize ||
+            strncmp( columns->names + columns->nameOffsets[s] + wordSize, prefix + wordSize, prefixSize - wordSize ) == 0)) {
+            if (sites)
+                sites[matches] = s;
+            ++matches;
+        }
+
+    return matches;
+}
+
+bool mpw_marshall_columns_recent(
+        const MPMarshalledColumns *columns, size_t *sites) {
+
+    if (!columns || !sites)
+        return false;
+
+    // A stable LSD radix sort of the lastUsed column, descending: ties keep their order.
+    const size_t count = columns->count;
+    uint64_t *keys = malloc( 2 * count * sizeof( *keys ) ), *keysBuf = keys + count;
+    size_t *sitesBuf = malloc( count * sizeof( *sitesBuf ) ), *sorted = sites;
+    if (!keys || !sitesBuf) {
+        free( keys );
+        free( sitesBuf );
+        return !count;
+    }
+
+    for (size_t s = 0; s < count; ++s) {
+        keys[s] = ~((uint64_t)(int64_t)columns->lastUsed[s] ^ ((uint64_t)1 << 63));
+        sorted[s] = s;
+    }
+    for (unsigned int shift = 0; count && shift < 64; shift += 8) {
+        size_t offsets[256] = { 0 };
+        for (size_t s = 0; s < count; ++s)
+            ++offsets[(keys[s] >> shift) & 0xFF];
+
+        // Bytes that all keys share don't reorder anything.
+        if (offsets[(keys[0] >> shift) & 0xFF] == count)
+            continue;
+
+        for (size_t b = 0, offset = 0; b < 256; ++b) {
+            size_t bucket = offsets[b];
+            offsets[b] = offset;
+            offset += bucket;
+        }
+        for (size_t s = 0; s < count; ++s) {
+            size_t to = offsets[(keys[s] >> shift) & 0xFF]++;
+            keysBuf[to] = keys[s];
+            sitesBuf[to] = sorted[s];
+        }
+
+        uint64_t *swapKeys = keys;
+        keys = keysBuf, keysBuf = swapKeys;
+        size_t *swapSites = sorted;
+        sorted = sitesBuf, sitesBuf = swapSites;
+    }
+    if (sorted != sites) {
+        memcpy( sites, sorted, count * sizeof( *sites ) );
+        sitesBuf = sorted;
+    }
+    free( keys < keysBuf? keys: keysBuf );
+    free( sitesBuf );
+
+    return true;
+}
+
+bool mpw_marshall_columns_free(
+        MPMarshalledColumns **columns) {
+
+    if (!columns || !*columns)
+        return false;
+
+    return mpw_free( columns, (*columns)->bufferSize );
+}
+
+/** Append the trigrams of a string to a table of (trigram << 32 | site) pairs.
+ * @return false if the table could not grow. */
+static bool mpw_marshall_search_push(
+        uint64_t **pairs, size_t *pairsCount, size_t *pairsSize, const char *string, const uint32_t site) {
+
+    if (!string || !*string)
+        return true;
+
+    // Two NULs before the string and one after it pad its trigrams, NUL doesn't occur in strings.
+    const size_t stringSize = strlen( string ), pushCount = stringSize + 1;
+    if ((*pairsCount + pushCount) * sizeof( **pairs ) > *pairsSize &&
+        !mpw_realloc( pairs, pairsSize, max( *pairsSize, (pushCount + 1024) * sizeof( **pairs ) ) ))
+        return false;
+
+    uint32_t trigram = 0;
+    for (size_t c = 0; c <= stringSize; ++c) {
+        // Only ASCII letters are folded, the bytes of other characters are taken as they are.
+        const uint8_t byte = (uint8_t)string[c];
+        trigram = ((trigram << 8) | (byte >= 'A' && byte <= 'Z'? byte | 0x20: byte)) & 0xFFFFFF;
+        (*pairs)[(*pairsCount)++] = (uint64_t)trigram << 32 | site;
+    }
+
+    return true;
+}
+
+/** Sort the pairs from the given one on and drop the duplicates, the pairs of a site or of a query are few.
+ * @return The new amount of pairs. */
+static size_t mpw_marshall_search_distinct(
+        uint64_t *pairs, const size_t from, const size_t pairsCount) {
+
+    for (size_t p = from + 1; p < pairsCount; ++p) {
+        const uint64_t pair = pairs[p];
+        size_t to = p;
+        for (; to > from && pairs[to - 1] > pair; --to)
+            pairs[to] = pairs[to - 1];
+        pairs[to] = pair;
+    }
+
+    size_t distinctCount = min( from + 1, pairsCount );
+    for (size_t p = from + 1; p < pairsCount; ++p)
+        if (pairs[p] != pairs[distinctCount - 1])
+            pairs[distinctCount++] = pairs[p];
+
+    return distinctCount;
+}
+
+MPMarshalledSearch *mpw_marshall_search_new(
+        const MPMarshalledUser *user) {
+
+    if (!user || user->sites_count > UINT32_MAX)
+        return NULL;
+
+    // Gather the distinct trigrams of each site, in the order of the sites.
+    const size_t count = user->sites_count;
+    uint64_t *pairs = NULL;
+    size_t pairsCount = 0, pairsSize = 0;
+    uint32_t *siteTrigrams = malloc( (count?: 1) * sizeof( *siteTrigrams ) );
+    bool success = siteTrigrams != NULL;
+    for (size_t s = 0; success && s < count; ++s) {
+        const size_t from = pairsCount;
+        success = mpw_marshall_search_push( &pairs, &pairsCount, &pairsSize, user->sites[s].name, (uint32_t)s ) &&
+                  mpw_marshall_search_push( &pairs, &pairsCount, &pairsSize, user->sites[s].url, (uint32_t)s );
+        pairsCount = mpw_marshall_search_distinct( pairs, from, pairsCount );
+        siteTrigrams[s] = (uint32_t)(pairsCount - from);
+    }
+
+    // A stable LSD radix sort of the pairs by their 24-bit trigram keeps the sites of each trigram ascending.
+    uint64_t *pairsBuf = success? malloc( (pairsCount?: 1) * sizeof( *pairsBuf ) ): NULL;
+    if (!pairsBuf || pairsCount > UINT32_MAX) {
+        free( siteTrigrams );
+        free( pairs );
+        free( pairsBuf );
+        return NULL;
+    }
+    for (unsigned int shift = 32; shift < 56; shift += 8) {
+        size_t offsets[256] = { 0 };
+        for (size_t p = 0; p < pairsCount; ++p)
+            ++offsets[(pairs[p] >> shift) & 0xFF];
+        for (size_t b = 0, offset = 0; b < 256; ++b) {
+            size_t bucket = offsets[b];
+            offsets[b] = offset;
+            offset += bucket;
+        }
+        for (size_t p = 0; p < pairsCount; ++p)
+            pairsBuf[offsets[(pairs[p] >> shift) & 0xFF]++] = pairs[p];
+
+        uint64_t *swapPairs = pairs;
+        pairs = pairsBuf, pairsBuf = swapPairs;
+    }
+    free( pairsBuf );
+    size_t trigramsCount = 0;
+    for (size_t p = 0; p < pairsCount; ++p)
+        trigramsCount += !p || (pairs[p] >> 32) != (pairs[p - 1] >> 32);
+
+    // The index and its tables share one buffer.
+    const size_t bufferSize = sizeof( MPMarshalledSearch ) +
+                              (count + 2 * trigramsCount + 1 + pairsCount) * sizeof( uint32_t );
+    uint8_t *buffer = malloc( bufferSize );
+    if (!buffer) {
+        free( siteTrigrams );
+        free( pairs );
+        return NULL;
+    }
+
+    MPMarshalledSearch *search = (MPMarshalledSearch *)buffer;
+    uint32_t *table = (uint32_t *)(buffer + sizeof( MPMarshalledSearch ));
+    *search = (MPMarshalledSearch){ .count = count, .trigramsCount = trigramsCount, .bufferSize = bufferSize };
+    search->siteTrigrams = table, table += count;
+    search->trigrams = table, table += trigramsCount;
+    search->postingOffsets = table, table += trigramsCount + 1;
+    search->postings = table;
+
+    memcpy( search->siteTrigrams, siteTrigrams, count * sizeof( *siteTrigrams ) );
+    for (size_t p = 0, t = 0; p < pairsCount; ++p) {
+        const uint32_t trigram = (uint32_t)(pairs[p] >> 32);
+        if (!p || trigram != search->trigrams[t - 1]) {
+            search->trigrams[t] = trigram;
+            search->postingOffsets[t++] = (uint32_t)p;
+        }
+        search->postings[p] = (uint32_t)pairs[p];
+    }
+    search->postingOffsets[trigramsCount] = (uint32_t)pairsCount;
+    free( siteTrigrams );
+    free( pairs );
+
+    return search;
+}
+
+const MPMarshalledSearch *mpw_marshall_search(
+        MPMarshalledUser *user) {
+
+    if (!user)
+        return NULL;
+    if (!user->search)
+        user->search = mpw_marshall_search_new( user );
+
+    return user->search;
+}
+
+size_t mpw_marshall_search_query(
+        const MPMarshalledSearch *search, const char *query, MPMarshalledMatch *matches, const size_t matchesCount) {
+
+    if (!search || !query || !matches || !matchesCount)
+        return 0;
+
+    uint64_t *queryTrigrams = NULL;
+    size_t queryTrigramsCount = 0, queryTrigramsSize = 0;
+    if (!mpw_marshall_search_push( &queryTrigrams, &queryTrigramsCount, &queryTrigramsSize, query, 0 )) {
+        free( queryTrigrams );
+        return 0;
+    }
+    // Queries are site names, counting up to 255 of their trigrams keeps the counts of the sites in a byte.
+    queryTrigramsCount = min( mpw_marshall_search_distinct( queryTrigrams, 0, queryTrigramsCount ), (size_t)UINT8_MAX );
+
+    // Count the trigrams each site shares with the query by walking the postings of the query's trigrams.
+    uint8_t *shared = calloc( search->count?: 1, sizeof( *shared ) );
+    if (!shared) {
+        free( queryTrigrams );
+        return 0;
+    }
+    for (size_t q = 0; q < queryTrigramsCount; ++q) {
+        const uint32_t trigram = (uint32_t)(queryTrigrams[q] >> 32);
+        size_t low = 0, high = search->trigramsCount;
+        while (low < high) {
+            size_t t = low + (high - low) / 2;
+            if (search->trigrams[t] < trigram)
+                low = t + 1;
+            else
+                high = t;
+        }
+        if (low == search->trigramsCount || search->trigrams[low] != trigram)
+            continue;
+
+        for (uint32_t p = search->postingOffsets[low]; p < search->postingOffsets[low + 1]; ++p)
+            ++shared[search->postings[p]];
+    }
+    free( queryTrigrams );
+
+    // Keep the best matches, in order: a site only displaces those it resembles the query more than.
+    size_t matched = 0;
+    for (size_t s = 0; s < search->count; ++s) {
+        if (!shared[s])
+            continue;
+
+        const float score = 2.0f * shared[s] / (float)(queryTrigramsCount + search->siteTrigrams[s]);
+        if (matched == matchesCount && score <= matches[matched - 1].score)
+            continue;
+
+        size_t to = matched < matchesCount? matched++: matched - 1;
+        for (; to > 0 && matches[to - 1].score < score; --to)
+            matches[to] = matches[to - 1];
+        matches[to] = (MPMarshalledMatch){ .site = s, .score = score };
+    }
+    free( shared );
+
+    return matched;
+}
+
+bool mpw_marshall_search_free(
+        MPMarshalledSearch **search) {
+
+    if (!search || !*search)
+        return false;
+
+    return mpw_free( search, (*search)->bufferSize );
+}
+
 bool mpw_marshal_info_free(
         MPMarshallInfo **info) {
 
@@ -106,6 +622,22 @@ bool mpw_marshal_info_free(
     return success;
 }
 
+bool mpw_marshal_string(
+        MPMarshalledUser *user, const char **string, const char *value) {
+
+    if (!user || !string)
+        return false;
+
+    // A string from the arena can't be released on its own, it is wiped in place.
+    if (mpw_arena_owns( user->arena, *string ))
+        bzero( (void *)*string, strlen( *string ) );
+    else
+        mpw_free_string( string );
+
+    *string = mpw_marshall_strdup( user, value );
+    return !value || *string;
+}
+
 bool mpw_marshal_free(
         MPMarshalledUser **user) {
 
@@ -113,27 +645,39 @@ bool mpw_marshal_free(
         return true;
 
     bool success = true;
-    success &= mpw_free_strings( &(*user)->fullName, &(*user)->masterPassword, NULL );
+    success &= mpw_marshall_free_string( *user, &(*user)->fullName );
+    success &= mpw_marshall_free_string( *user, &(*user)->masterPassword );
 
+    // Strings from the arena aren't touched one by one, those set otherwise are freed individually.
     for (size_t s = 0; s < (*user)->sites_count; ++s) {
         MPMarshalledSite *site = &(*user)->sites[s];
-        success &= mpw_free_strings( &site->name, &site->content, &site->loginContent, &site->url, NULL );
+        success &= mpw_marshall_free_string( *user, &site->name );
+        success &= mpw_marshall_free_string( *user, &site->content );
+        success &= mpw_marshall_free_string( *user, &site->loginContent );
+        success &= mpw_marshall_free_string( *user, &site->url );
 
         for (size_t q = 0; q < site->questions_count; ++q) {
             MPMarshalledQuestion *question = &site->questions[q];
-            success &= mpw_free_strings( &question->keyword, &question->content, NULL );
+            success &= mpw_marshall_free_string( *user, &question->keyword );
+            success &= mpw_marshall_free_string( *user, &question->content );
         }
         success &= mpw_free( &site->questions, sizeof( MPMarshalledQuestion ) * site->questions_count );
     }
 
     success &= mpw_free( &(*user)->sites, sizeof( MPMarshalledSite ) * (*user)->sites_count );
+    if ((*user)->columns)
+        success &= mpw_marshall_columns_free( &(*user)->columns );
+    if ((*user)->search)
+        success &= mpw_marshall_search_free( &(*user)->search );
+    if ((*user)->arena)
+        success &= mpw_arena_free( &(*user)->arena );
     success &= mpw_free( user, sizeof( MPMarshalledUser ) );
 
     return success;
 }
 
 static bool mpw_marshall_write_flat(
-        char **out, const MPMarshalledUser *user, MPMarshallError *error) {
+        char **out, const MPMarshalledUser *user, MPMasterKeyProvider masterKeyProvider, MPMarshallError *error) {
 
     *error = (MPMarshallError){ MPMarshallErrorInternal, "Unexpected internal error." };
     if (!user->fullName || !strlen( user->fullName )) {
@@ -146,7 +690,7 @@ static bool mpw_marshall_write_flat(
     }
     MPMasterKey masterKey = NULL;
     MPAlgorithmVersion masterKeyAlgorithm = user->algorithm - 1;
-    if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, user->algorithm, user->fullName, user->masterPassword )) {
+    if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, user->algorithm, user->fullName, user->masterPassword, masterKeyProvider )) {
         *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
         return false;
     }
@@ -185,7 +729,7 @@ static bool mpw_marshall_write_flat(
         const char *content = NULL, *loginContent = NULL;
         if (!user->redacted) {
             // Clear Text
-            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, user->fullName, user->masterPassword )) {
+            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, user->fullName, user->masterPassword, masterKeyProvider )) {
                 *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
                 return false;
             }
@@ -216,7 +760,7 @@ static bool mpw_marshall_write_flat(
 }
 
 static bool mpw_marshall_write_json(
-        char **out, const MPMarshalledUser *user, MPMarshallError *error) {
+        char **out, const MPMarshalledUser *user, MPMasterKeyProvider masterKeyProvider, MPMarshallError *error) {
 
     *error = (MPMarshallError){ MPMarshallErrorInternal, "Unexpected internal error." };
     if (!user->fullName || !strlen( user->fullName )) {
@@ -229,7 +773,7 @@ static bool mpw_marshall_write_json(
     }
     MPMasterKey masterKey = NULL;
     MPAlgorithmVersion masterKeyAlgorithm = user->algorithm - 1;
-    if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, user->algorithm, user->fullName, user->masterPassword )) {
+    if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, user->algorithm, user->fullName, user->masterPassword, masterKeyProvider )) {
         *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
         return false;
     }
@@ -270,7 +814,7 @@ static bool mpw_marshall_write_json(
         const char *content = NULL, *loginContent = NULL;
         if (!user->redacted) {
             // Clear Text
-            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, user->fullName, user->masterPassword )) {
+            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, user->fullName, user->masterPassword, masterKeyProvider )) {
                 *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
                 return false;
             }
@@ -346,14 +890,22 @@ static bool mpw_marshall_write_json(
 bool mpw_marshall_write(
         char **out, const MPMarshallFormat outFormat, const MPMarshalledUser *user, MPMarshallError *error) {
 
+    return mpw_marshall_write_provided( out, outFormat, user, NULL, error );
+}
+
+bool mpw_marshall_write_provided(
+        char **out, const MPMarshallFormat outFormat, const MPMarshalledUser *user,
+        MPMasterKeyProvider masterKeyProvider, MPMarshallError *error) {
+
+    mpw_metric_scope( MPMetricMarshallWrite );
     switch (outFormat) {
         case MPMarshallFormatNone:
             *error = (MPMarshallError){ .type = MPMarshallSuccess };
             return false;
         case MPMarshallFormatFlat:
-            return mpw_marshall_write_flat( out, user, error );
+            return mpw_marshall_write_flat( out, user, masterKeyProvider, error );
         case MPMarshallFormatJSON:
-            return mpw_marshall_write_json( out, user, error );
+            return mpw_marshall_write_json( out, user, masterKeyProvider, error );
         default:
             *error = (MPMarshallError){ MPMarshallErrorFormat, mpw_str( "Unsupported output format: %u", outFormat ) };
             return false;
@@ -408,7 +960,7 @@ static void mpw_marshall_read_flat_info(
 }
 
 static MPMarshalledUser *mpw_marshall_read_flat(
-        const char *in, const char *masterPassword, MPMarshallError *error) {
+        const char *in, const char *masterPassword, MPMasterKeyProvider masterKeyProvider, const bool metadata, MPMarshallError *error) {
 
     *error = (MPMarshallError){ MPMarshallErrorInternal, "Unexpected internal error." };
     if (!in || !strlen( in )) {
@@ -496,20 +1048,20 @@ static MPMarshalledUser *mpw_marshall_read_flat(
             continue;
 
         if (!user) {
-            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, algorithm, fullName, masterPassword )) {
+            if (!metadata && !mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, algorithm, fullName, masterPassword, masterKeyProvider )) {
                 *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
                 return NULL;
             }
-            if (keyID && !mpw_id_buf_equals( keyID, mpw_id_buf( masterKey, MPMasterKeySize ) )) {
+            if (!metadata && keyID && !mpw_id_buf_equals( keyID, mpw_id_buf( masterKey, MPMasterKeySize ) )) {
                 *error = (MPMarshallError){ MPMarshallErrorMasterPassword, "Master password doesn't match key ID." };
                 return NULL;
             }
-            if (!(user = mpw_marshall_user( fullName, masterPassword, algorithm ))) {
+            if (!(user = mpw_marshall_user( fullName, metadata? "": masterPassword, algorithm ))) {
                 *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't allocate a new user." };
                 return NULL;
             }
 
-            user->redacted = importRedacted;
+            user->redacted = importRedacted || metadata;
             user->avatar = avatar;
             user->defaultType = defaultType;
         }
@@ -587,9 +1139,12 @@ static MPMarshalledUser *mpw_marshall_read_flat(
 
             site->uses = (unsigned int)atoi( str_uses );
             site->lastUsed = siteLastUsed;
-            if (!user->redacted) {
+            if (metadata && !importRedacted) {
+                // Clear Text, left out without a master key to encrypt it with
+            }
+            else if (!user->redacted) {
                 // Clear Text
-                if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, fullName, masterPassword )) {
+                if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, fullName, masterPassword, masterKeyProvider )) {
                     *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
                     return NULL;
                 }
@@ -604,9 +1159,9 @@ static MPMarshalledUser *mpw_marshall_read_flat(
             else {
                 // Redacted
                 if (siteContent && strlen( siteContent ))
-                    site->content = strdup( siteContent );
+                    site->content = mpw_marshall_strdup( user, siteContent );
                 if (siteLoginName && strlen( siteLoginName ))
-                    site->loginContent = strdup( siteLoginName );
+                    site->loginContent = mpw_marshall_strdup( user, siteLoginName );
             }
         }
         else {
@@ -632,7 +1187,9 @@ static void mpw_marshall_read_json_info(
 
     // Parse JSON.
     enum json_tokener_error json_error = json_tokener_success;
+    MPMetricTimer parseTimer = mpw_metric_begin( MPMetricJSONParse );
     json_object *json_file = json_tokener_parse_verbose( in, &json_error );
+    mpw_metric_end( &parseTimer );
     if (!json_file || json_error != json_tokener_success)
         return;
 
@@ -645,14 +1202,16 @@ static void mpw_marshall_read_json_info(
 
     // Section: "user"
     info->algorithm = (MPAlgorithmVersion)mpw_get_json_int( json_file, "user.algorithm", MPAlgorithmVersionCurrent );
-    info->fullName = strdup( mpw_get_json_string( json_file, "user.full_name", NULL ) );
-    info->keyID = strdup( mpw_get_json_string( json_file, "user.key_id", NULL ) );
+    const char *fullName = mpw_get_json_string( json_file, "user.full_name", NULL );
+    const char *keyID = mpw_get_json_string( json_file, "user.key_id", NULL );
+    info->fullName = fullName? strdup( fullName ): NULL;
+    info->keyID = keyID? strdup( keyID ): NULL;
 
     json_object_put( json_file );
 }
 
 static MPMarshalledUser *mpw_marshall_read_json(
-        const char *in, const char *masterPassword, MPMarshallError *error) {
+        const char *in, const char *masterPassword, MPMasterKeyProvider masterKeyProvider, const bool metadata, MPMarshallError *error) {
 
     *error = (MPMarshallError){ MPMarshallErrorInternal, "Unexpected internal error." };
     if (!in || !strlen( in )) {
@@ -663,7 +1222,9 @@ static MPMarshalledUser *mpw_marshall_read_json(
 
     // Parse JSON.
     enum json_tokener_error json_error = json_tokener_success;
+    MPMetricTimer parseTimer = mpw_metric_begin( MPMetricJSONParse );
     json_object *json_file = json_tokener_parse_verbose( in, &json_error );
+    mpw_metric_end( &parseTimer );
     if (!json_file || json_error != json_tokener_success) {
         *error = (MPMarshallError){ MPMarshallErrorStructure, mpw_str( "JSON error: %s", json_tokener_error_desc( json_error ) ) };
         return NULL;
@@ -707,19 +1268,19 @@ static MPMarshalledUser *mpw_marshall_read_json(
         *error = (MPMarshallError){ MPMarshallErrorMissing, "Missing value for full name." };
         return NULL;
     }
-    if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, algorithm, fullName, masterPassword )) {
+    if (!metadata && !mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, algorithm, fullName, masterPassword, masterKeyProvider )) {
         *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
         return NULL;
     }
-    if (keyID && !mpw_id_buf_equals( keyID, mpw_id_buf( masterKey, MPMasterKeySize ) )) {
+    if (!metadata && keyID && !mpw_id_buf_equals( keyID, mpw_id_buf( masterKey, MPMasterKeySize ) )) {
         *error = (MPMarshallError){ MPMarshallErrorMasterPassword, "Master password doesn't match key ID." };
         return NULL;
     }
-    if (!(user = mpw_marshall_user( fullName, masterPassword, algorithm ))) {
+    if (!(user = mpw_marshall_user( fullName, metadata? "": masterPassword, algorithm ))) {
         *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't allocate a new user." };
         return NULL;
     }
-    user->redacted = fileRedacted;
+    user->redacted = fileRedacted || metadata;
     user->avatar = avatar;
     user->defaultType = defaultType;
     user->lastUsed = lastUsed;
@@ -767,12 +1328,15 @@ static MPMarshalledUser *mpw_marshall_read_json(
         }
 
         site->loginType = siteLoginType;
-        site->url = siteURL? strdup( siteURL ): NULL;
+        site->url = mpw_marshall_strdup( user, siteURL );
         site->uses = siteUses;
         site->lastUsed = siteLastUsed;
-        if (!user->redacted) {
+        if (metadata && !fileRedacted) {
+            // Clear Text, left out without a master key to encrypt it with
+        }
+        else if (!user->redacted) {
             // Clear Text
-            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, fullName, masterPassword )) {
+            if (!mpw_update_masterKey( &masterKey, &masterKeyAlgorithm, site->algorithm, fullName, masterPassword, masterKeyProvider )) {
                 *error = (MPMarshallError){ MPMarshallErrorInternal, "Couldn't derive master key." };
                 return NULL;
             }
@@ -787,30 +1351,34 @@ static MPMarshalledUser *mpw_marshall_read_json(
         else {
             // Redacted
             if (siteContent && strlen( siteContent ))
-                site->content = strdup( siteContent );
+                site->content = mpw_marshall_strdup( user, siteContent );
             if (siteLoginName && strlen( siteLoginName ))
-                site->loginContent = strdup( siteLoginName );
+                site->loginContent = mpw_marshall_strdup( user, siteLoginName );
         }
 
         json_object_iter json_site_question;
         json_object *json_site_questions = mpw_get_json_section( json_site.val, "questions" );
-        json_object_object_foreachC( json_site_questions, json_site_question ) {
-            MPMarshalledQuestion *question = mpw_marshal_question( site, json_site_question.key );
-            const char *answerContent = mpw_get_json_string( json_site_question.val, "answer", NULL );
-            question->type = (MPResultType)mpw_get_json_int( json_site_question.val, "type", MPResultTypeTemplatePhrase );
-
-            if (!user->redacted) {
-                // Clear Text
-                if (answerContent && strlen( answerContent ))
-                    question->content = mpw_siteState( masterKey, site->name, MPCounterValueInitial,
-                            MPKeyPurposeRecovery, question->keyword, question->type, answerContent, site->algorithm );
-            }
-            else {
-                // Redacted
-                if (answerContent && strlen( answerContent ))
-                    question->content = strdup( answerContent );
+        if (json_site_questions)
+            json_object_object_foreachC( json_site_questions, json_site_question ) {
+                MPMarshalledQuestion *question = mpw_marshal_question( site, json_site_question.key );
+                const char *answerContent = mpw_get_json_string( json_site_question.val, "answer", NULL );
+                question->type = (MPResultType)mpw_get_json_int( json_site_question.val, "type", MPResultTypeTemplatePhrase );
+
+                if (metadata && !fileRedacted) {
+                    // Clear Text, left out without a master key to encrypt it with
+                }
+                else if (!user->redacted) {
+                    // Clear Text
+                    if (answerContent && strlen( answerContent ))
+                        question->content = mpw_siteState( masterKey, site->name, MPCounterValueInitial,
+                                MPKeyPurposeRecovery, question->keyword, question->type, answerContent, site->algorithm );
+                }
+                else {
+                    // Redacted
+                    if (answerContent && strlen( answerContent ))
+                        question->content = mpw_marshall_strdup( user, answerContent );
+                }
             }
-        }
     }
     json_object_put( json_file );
 
@@ -841,18 +1409,48 @@ MPMarshallInfo *mpw_marshall_read_info(
 MPMarshalledUser *mpw_marshall_read(
         const char *in, const MPMarshallFormat inFormat, const char *masterPassword, MPMarshallError *error) {
 
+    return mpw_marshall_read_provided( in, inFormat, masterPassword, NULL, error );
+}
+
+static MPMarshalledUser *mpw_marshall_read_user(
+        const char *in, const MPMarshallFormat inFormat, const char *masterPassword,
+        MPMasterKeyProvider masterKeyProvider, const bool metadata, MPMarshallError *error) {
+
+    mpw_metric_scope( MPMetricMarshallRead );
+    MPMarshalledUser *user = NULL;
     switch (inFormat) {
         case MPMarshallFormatNone:
             *error = (MPMarshallError){ .type = MPMarshallSuccess };
             return false;
         case MPMarshallFormatFlat:
-            return mpw_marshall_read_flat( in, masterPassword, error );
+            user = mpw_marshall_read_flat( in, masterPassword, masterKeyProvider, metadata, error );
+            break;
         case MPMarshallFormatJSON:
-            return mpw_marshall_read_json( in, masterPassword, error );
+            user = mpw_marshall_read_json( in, masterPassword, masterKeyProvider, metadata, error );
+            break;
         default:
             *error = (MPMarshallError){ MPMarshallErrorFormat, mpw_str( "Unsupported input format: %u", inFormat ) };
             return NULL;
     }
+
+    // Lay out the columnar view of the sites while they're fresh in the cache.
+    if (user && !mpw_marshall_columns( user ))
+        wrn( "Could not lay out the columns of the user's sites: %s\n", strerror( errno ) );
+
+    return user;
+}
+
+MPMarshalledUser *mpw_marshall_read_provided(
+        const char *in, const MPMarshallFormat inFormat, const char *masterPassword,
+        MPMasterKeyProvider masterKeyProvider, MPMarshallError *error) {
+
+    return mpw_marshall_read_user( in, inFormat, masterPassword, masterKeyProvider, false, error );
+}
+
+MPMarshalledUser *mpw_marshall_read_metadata(
+        const char *in, const MPMarshallFormat inFormat, MPMarshallError *error) {
+
+    return mpw_marshall_read_user( in, inFormat, NULL, NULL, true, error );
 }
 
 const MPMarshallFormat mpw_formatWithName(
@@ -81,6 +81,51 @@ typedef struct MPMarshalledSite {
     MPMarshalledQuestion *questions;
 } MPMarshalledSite;
 
+/** A columnar view of a user's sites, for scans over many sites: row s of each column describes the user's sites[s].
+ * The view is a snapshot of the sites, see mpw_marshall_columns. */
+typedef struct MPMarshalledColumns {
+    size_t count;
+    /** The FNV-1a hash of each site's name. */
+    uint32_t *nameHashes;
+    /** The first 8 bytes of each site's name, padded with NULs, to compare name prefixes a word at a time. */
+    uint64_t *namePrefixes;
+    /** The offset of each site's name in names. */
+    uint32_t *nameOffsets;
+    /** The NUL-terminated names of all sites, back to back. */
+    const char *names;
+    MPResultType *types;
+    MPCounterValue *counters;
+    MPAlgorithmVersion *algorithms;
+    unsigned int *uses;
+    time_t *lastUsed;
+
+    /** The size of the one allocation that holds the view and all of its columns. */
+    size_t bufferSize;
+} MPMarshalledColumns;
+
+/** An index of the trigrams in the names and URLs of a user's sites, to find sites by approximate name.
+ * Trigrams are taken from the ASCII-lowercased strings, padded so that their first and last bytes weigh in. */
+typedef struct MPMarshalledSearch {
+    size_t count;
+    /** The amount of distinct trigrams of each site. */
+    uint32_t *siteTrigrams;
+    /** The distinct trigrams of all sites, ascending. */
+    size_t trigramsCount;
+    uint32_t *trigrams;
+    /** The sites that have trigrams[t] are postings[postingOffsets[t]] up to postings[postingOffsets[t + 1]], ascending. */
+    uint32_t *postingOffsets;
+    uint32_t *postings;
+
+    /** The size of the one allocation that holds the index. */
+    size_t bufferSize;
+} MPMarshalledSearch;
+
+typedef struct MPMarshalledMatch {
+    size_t site;
+    /** How much the site resembles the query, from 0 to 1: the Dice coefficient of their trigrams. */
+    float score;
+} MPMarshalledMatch;
+
 typedef struct MPMarshalledUser {
     const char *fullName;
     const char *masterPassword;
@@ -93,8 +138,30 @@ typedef struct MPMarshalledUser {
 
     size_t sites_count;
     MPMarshalledSite *sites;
+
+    /** The locked memory that the user's strings are allocated from, or NULL if none could be mapped.
+     * Replace the user's strings with mpw_marshal_string, since strings from the arena can't be freed on their own. */
+    struct MPArena *arena;
+    /** The columnar view of the sites, built by the readers or on demand, see mpw_marshall_columns. */
+    MPMarshalledColumns *columns;
+    /** The trigram index of the sites, built on demand, see mpw_marshall_search. */
+    MPMarshalledSearch *search;
 } MPMarshalledUser;
 
+/** All of a site's results, see mpw_site_render.  The strings share one buffer, free them with mpw_site_render_free. */
+typedef struct MPRenderedSite {
+    /** The site's password, the result of its type and content. */
+    const char *password;
+    /** The site's login name, the result of its login type and login content. */
+    const char *login;
+    /** The answers to the site's security questions, answers[q] for questions[q]. */
+    size_t answers_count;
+    const char **answers;
+
+    void *buffer;
+    size_t bufferSize;
+} MPRenderedSite;
+
 typedef struct MPMarshallInfo {
     MPMarshallFormat format;
     MPAlgorithmVersion algorithm;
@@ -109,12 +176,27 @@ typedef struct MPMarshallInfo {
 /** Write the user and all associated data out to the given output buffer using the given marshalling format. */
 bool mpw_marshall_write(
         char **out, const MPMarshallFormat outFormat, const MPMarshalledUser *user, MPMarshallError *error);
+/** Write the user out like mpw_marshall_write, obtaining master keys from the given provider.
+ * @param masterKeyProvider Supplies the user's master keys, or NULL to derive them from the user's master password. */
+bool mpw_marshall_write_provided(
+        char **out, const MPMarshallFormat outFormat, const MPMarshalledUser *user,
+        MPMasterKeyProvider masterKeyProvider, MPMarshallError *error);
 /** Try to read metadata on the sites in the input buffer. */
 MPMarshallInfo *mpw_marshall_read_info(
         const char *in);
 /** Unmarshall sites in the given input buffer by parsing it using the given marshalling format. */
 MPMarshalledUser *mpw_marshall_read(
         const char *in, const MPMarshallFormat inFormat, const char *masterPassword, MPMarshallError *error);
+/** Unmarshall sites like mpw_marshall_read, obtaining master keys from the given provider.
+ * @param masterKeyProvider Supplies the user's master keys, or NULL to derive them from the master password. */
+MPMarshalledUser *mpw_marshall_read_provided(
+        const char *in, const MPMarshallFormat inFormat, const char *masterPassword,
+        MPMasterKeyProvider masterKeyProvider, MPMarshallError *error);
+/** Unmarshall the user's sites for listing them, without deriving a master key or checking the key ID.
+ * The user has an empty master password so it can't be written out, and is redacted:
+ * states of a redacted input are kept, the contents of a clear text input are left out. */
+MPMarshalledUser *mpw_marshall_read_metadata(
+        const char *in, const MPMarshallFormat inFormat, MPMarshallError *error);
 
 //// Utilities.
 
@@ -128,6 +210,66 @@ MPMarshalledSite *mpw_marshall_site(
 /** Create a new question attached to the given site object, ready for marshalling. */
 MPMarshalledQuestion *mpw_marshal_question(
         MPMarshalledSite *site, const char *keyword);
+/** Generate all of a site's results at once: its password, login name and the answers to its security questions.
+ * Their site keys are derived in one batch.  A result that cannot be generated, eg. a missing state, is NULL.
+ * @return false if an error occurred, out is then left empty. */
+bool mpw_site_render(
+        MPMasterKey masterKey, const MPMarshalledSite *site, MPRenderedSite *out);
+/** Free the results of a rendered site and empty it. */
+void mpw_site_render_free(
+        MPRenderedSite *rendered);
+/** Lay out a columnar view of the user's sites.
+ * @return A new view that is freed with mpw_marshall_columns_free, or NULL if an error occurred. */
+MPMarshalledColumns *mpw_marshall_columns_new(
+        const MPMarshalledUser *user);
+/** Get the user's columnar view of its sites, laying it out if the readers haven't.
+ * The view is dropped when a site is added with mpw_marshall_site.
+ * Later changes to a site's fields are not reflected in the view: free user->columns to lay it out again.
+ * @return The user's view, or NULL if an error occurred. */
+const MPMarshalledColumns *mpw_marshall_columns(
+        MPMarshalledUser *user);
+/** Find a site by its name, comparing the hashes of the names before the names themselves.
+ * @param site Receives the index of the site in the user's sites.
+ * @return false if no site has the given name. */
+bool mpw_marshall_columns_find(
+        const MPMarshalledColumns *columns, const char *siteName, size_t *site);
+/** Find the sites whose name starts with the given prefix, in the order of the user's sites.
+ * @param sites An array with room for columns->count indexes that receives the index of each matching site, or NULL.
+ * @return The amount of matching sites. */
+size_t mpw_marshall_columns_prefix(
+        const MPMarshalledColumns *columns, const char *prefix, size_t *sites);
+/** Order the sites by the time they were last used, most recent first.  Sites used at the same time keep their order.
+ * @param sites An array of columns->count indexes that receives the index of each site in order.
+ * @return false if an error occurred. */
+bool mpw_marshall_columns_recent(
+        const MPMarshalledColumns *columns, size_t *sites);
+/** Free a columnar view and set the reference to NULL. */
+bool mpw_marshall_columns_free(
+        MPMarshalledColumns **columns);
+/** Index the trigrams of the names and URLs of the user's sites.
+ * @return A new index that is freed with mpw_marshall_search_free, or NULL if an error occurred. */
+MPMarshalledSearch *mpw_marshall_search_new(
+        const MPMarshalledUser *user);
+/** Get the user's trigram index of its sites, building it on first use.
+ * The index is dropped when a site is added with mpw_marshall_site.
+ * Later changes to a site's name or URL are not reflected in it: free user->search to build it again.
+ * @return The user's index, or NULL if an error occurred. */
+const MPMarshalledSearch *mpw_marshall_search(
+        MPMarshalledUser *user);
+/** Find the sites whose name or URL most resemble the query, ie. share the most trigrams with it.
+ * @param matches An array with room for matchesCount matches that receives the best ones, best first.
+ *                Sites that resemble the query equally are in the order of the user's sites.
+ * @return The amount of matches, sites that share no trigram with the query don't match. */
+size_t mpw_marshall_search_query(
+        const MPMarshalledSearch *search, const char *query, MPMarshalledMatch *matches, const size_t matchesCount);
+/** Free a trigram index and set the reference to NULL. */
+bool mpw_marshall_search_free(
+        MPMarshalledSearch **search);
+/** Replace a string of the user's data, eg. a site's content, with a copy of value that is freed with the user.
+ * The string that is replaced is wiped.
+ * @return false if value could not be copied, the string is then NULL. */
+bool mpw_marshal_string(
+        MPMarshalledUser *user, const char **string, const char *value);
 /** Free the given user object and all associated data. */
 bool mpw_marshal_info_free(
         MPMarshallInfo **info);
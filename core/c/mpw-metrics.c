@@ -0,0 +1,115 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include "mpw-util.h"
+
+#include "mpw-metrics.h"
+
+static MPMetricValue mpw_metrics[MPMetricLast + 1];
+
+MPMetricTimer mpw_metric_begin(const MPMetric metric) {
+
+    return mpw_metric_begin_count( metric, 1 );
+}
+
+MPMetricTimer mpw_metric_begin_count(const MPMetric metric, const uint64_t count) {
+
+    return (MPMetricTimer){ .metric = metric, .start = mpw_now(), .count = count };
+}
+
+void mpw_metric_end(const MPMetricTimer *timer) {
+
+    if (!timer || timer->metric > MPMetricLast)
+        return;
+
+    uint64_t end = mpw_now();
+    __atomic_add_fetch( &mpw_metrics[timer->metric].count, timer->count, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &mpw_metrics[timer->metric].nanos, end > timer->start? end - timer->start: 0, __ATOMIC_RELAXED );
+}
+
+MPMetricsSnapshot mpw_metrics_snapshot(void) {
+
+    MPMetricsSnapshot snapshot;
+    for (MPMetric metric = MPMetricFirst; metric <= MPMetricLast; ++metric) {
+        snapshot.values[metric].count = __atomic_load_n( &mpw_metrics[metric].count, __ATOMIC_RELAXED );
+        snapshot.values[metric].nanos = __atomic_load_n( &mpw_metrics[metric].nanos, __ATOMIC_RELAXED );
+    }
+
+    return snapshot;
+}
+
+void mpw_metrics_reset(void) {
+
+    for (MPMetric metric = MPMetricFirst; metric <= MPMetricLast; ++metric) {
+        __atomic_store_n( &mpw_metrics[metric].count, 0, __ATOMIC_RELAXED );
+        __atomic_store_n( &mpw_metrics[metric].nanos, 0, __ATOMIC_RELAXED );
+    }
+}
+
+const char *mpw_nameForMetric(const MPMetric metric) {
+
+    switch (metric) {
+        case MPMetricScrypt:
+            return "scrypt";
+        case MPMetricBlake2b:
+            return "blake2b";
+        case MPMetricHMAC:
+            return "hmac-sha-256";
+        case MPMetricAESEncrypt:
+            return "aes-encrypt";
+        case MPMetricAESDecrypt:
+            return "aes-decrypt";
+        case MPMetricBase64Encode:
+            return "base64-encode";
+        case MPMetricBase64Decode:
+            return "base64-decode";
+        case MPMetricJSONParse:
+            return "json-parse";
+        case MPMetricMarshallRead:
+            return "marshall-read";
+        case MPMetricMarshallWrite:
+            return "marshall-write";
+        case MPMetricFileRead:
+            return "file-read";
+        case MPMetricFileWrite:
+            return "file-write";
+        default: {
+            dbg( "Unknown metric: %d\n", metric );
+            return NULL;
+        }
+    }
+}
+
+const char *mpw_metrics_json(const MPMetricsSnapshot *snapshot) {
+
+    if (!snapshot)
+        return NULL;
+
+    char *json = NULL;
+    bool success = mpw_string_push( &json, "{" );
+    for (MPMetric metric = MPMetricFirst; success && metric <= MPMetricLast; ++metric)
+        success = mpw_string_pushf( &json, "%s\n  \"%s\": { \"count\": %llu, \"us\": %.3f }",
+                metric == MPMetricFirst? "": ",", mpw_nameForMetric( metric ),
+                (unsigned long long)snapshot->values[metric].count, (double)snapshot->values[metric].nanos / 1000 );
+    if (!success || !mpw_string_push( &json, "\n}\n" )) {
+        mpw_free_string( &json );
+        return NULL;
+    }
+
+    return json;
+}
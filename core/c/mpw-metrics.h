@@ -0,0 +1,101 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#ifndef _MPW_METRICS_H
+#define _MPW_METRICS_H
+
+#include "mpw-types.h"
+
+//// Metrics.
+
+typedef mpw_enum( unsigned int, MPMetric ) {
+    /** Key stretching: mpw_kdf_scrypt. */
+            MPMetricScrypt,
+    /** Key derivation: mpw_kdf_blake2b and each mpw_kdf_blake2b_batch. */
+            MPMetricBlake2b,
+    /** Message authentication: mpw_hash_hmac_sha256 and each message of mpw_hash_hmac_sha256_batch. */
+            MPMetricHMAC,
+    /** Encryption: mpw_aes_encrypt. */
+            MPMetricAESEncrypt,
+    /** Decryption: mpw_aes_decrypt. */
+            MPMetricAESDecrypt,
+    /** Encoding: mpw_base64_encode. */
+            MPMetricBase64Encode,
+    /** Decoding: mpw_base64_decode. */
+            MPMetricBase64Decode,
+    /** Parsing the JSON document of a user's sites. */
+            MPMetricJSONParse,
+    /** Unmarshalling a user's sites: mpw_marshall_read. */
+            MPMetricMarshallRead,
+    /** Marshalling a user's sites: mpw_marshall_write. */
+            MPMetricMarshallWrite,
+    /** Reading a user's sites from storage, timed by the application. */
+            MPMetricFileRead,
+    /** Writing a user's sites to storage, timed by the application. */
+            MPMetricFileWrite,
+
+    MPMetricFirst = MPMetricScrypt,
+    MPMetricLast = MPMetricFileWrite,
+};
+
+typedef struct {
+    /** The amount of times the operation completed. */
+    uint64_t count;
+    /** The total time spent in the operation, in nanoseconds of the monotonic clock. */
+    uint64_t nanos;
+} MPMetricValue;
+
+typedef struct {
+    MPMetricValue values[MPMetricLast + 1];
+} MPMetricsSnapshot;
+
+/** A running measurement of an operation, see mpw_metric_scope. */
+typedef struct {
+    MPMetric metric;
+    uint64_t start;
+    /** The amount of occurrences the measurement covers. */
+    uint64_t count;
+} MPMetricTimer;
+
+/** Measure the remainder of the enclosing scope as one occurrence of the given metric. */
+#define mpw_metric_scope(metric) \
+        mpw_metric_scope_count( metric, 1 )
+/** Measure the remainder of the enclosing scope as count occurrences of the given metric, such as the items of a batch. */
+#define mpw_metric_scope_count(metric, count) \
+        MPMetricTimer _mpw_metric_timer __attribute__((cleanup( mpw_metric_end ), unused)) = mpw_metric_begin_count( metric, count )
+
+/** Start measuring an occurrence of the given metric.
+ * @return A timer to pass to mpw_metric_end when the operation completes. */
+MPMetricTimer mpw_metric_begin(const MPMetric metric);
+/** Start measuring count occurrences of the given metric that complete together.
+ * @return A timer to pass to mpw_metric_end when the operations complete. */
+MPMetricTimer mpw_metric_begin_count(const MPMetric metric, const uint64_t count);
+/** Record the time since the timer began as the timer's occurrences of its metric. */
+void mpw_metric_end(const MPMetricTimer *timer);
+
+/** @return A consistent-enough copy of the metrics recorded by all threads since the last reset. */
+MPMetricsSnapshot mpw_metrics_snapshot(void);
+/** Discard all recorded metrics. */
+void mpw_metrics_reset(void);
+
+/** @return The name of the given metric, or NULL if it is not known. */
+const char *mpw_nameForMetric(const MPMetric metric);
+/** @return A newly allocated JSON object of each metric's name to its count and total time in microseconds. */
+const char *mpw_metrics_json(const MPMetricsSnapshot *snapshot);
+
+#endif // _MPW_METRICS_H
@@ -41,6 +41,17 @@ typedef const uint8_t *MPMasterKey;
 typedef const uint8_t *MPSiteKey;
 typedef const char *MPKeyID;
 
+/** Control over a running master key derivation, see mpw_masterKey_control. */
+typedef struct {
+    /** Abandon the derivation once this flag is set, from any thread.  NULL if it can't be cancelled. */
+    const bool *cancelled;
+    /** Abandon the derivation once it runs past this time of the monotonic clock, in nanoseconds.  0 for no deadline. */
+    uint64_t deadline;
+    /** Called on the deriving thread as the work progresses, with the fraction of it done from 0 to 1.  May be NULL. */
+    void (*progress)(double done, void *context);
+    void *context;
+} MPKDFControl;
+
 typedef mpw_enum( uint8_t, MPKeyPurpose ) {
     /** Generate a key for authentication. */
             MPKeyPurposeAuthentication,
@@ -19,21 +19,23 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #if MPW_COLOR
-#include <unistd.h>
 #include <curses.h>
 #include <term.h>
 #endif
 
-#if MPW_CPERCIVA
-#include <scrypt/crypto_scrypt.h>
-#include <scrypt/sha256.h>
-#elif MPW_SODIUM
-#include "sodium.h"
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MPW_UTIL_X86 1
+#include <immintrin.h>
 #endif
 
 #include "mpw-util.h"
+#include "mpw-crypto.h"
+#include "mpw-metrics.h"
 
 #ifdef inf_level
 int mpw_verbosity = inf_level;
@@ -165,29 +167,441 @@ bool __mpw_free_strings(const char **strings, ...) {
     return success;
 }
 
+/** A run of pages of an arena between two guard pages.  The chunk's header lives at the start of its own pages. */
+typedef struct MPArenaChunk {
+    struct MPArenaChunk *next;
+    uint8_t *mapping;
+    size_t mappingSize;
+    size_t size, used;
+    bool locked;
+} MPArenaChunk;
+
+struct MPArena {
+    /** The chunk that is allocated from, followed by the ones that filled up before it. */
+    MPArenaChunk *chunks;
+    size_t chunkSize;
+};
+
+#define MP_arena_alignment 16
+
+/** Zero a buffer with a store the compiler can't elide as dead. */
+static void mpw_arena_wipe(void *buffer, const size_t bufferSize) {
+
+#if defined(__GLIBC__) || defined(__OpenBSD__) || defined(__FreeBSD__)
+    explicit_bzero( buffer, bufferSize );
+#else
+    static void *(*const volatile wipe)(void *, int, size_t) = memset;
+    wipe( buffer, 0, bufferSize );
+#endif
+}
+
+static MPArenaChunk *mpw_arena_chunk(const size_t size) {
+
+    const size_t pageSize = (size_t)sysconf( _SC_PAGESIZE );
+    const size_t headerSize = (sizeof( MPArenaChunk ) + MP_arena_alignment - 1) & ~(size_t)(MP_arena_alignment - 1);
+    if (size > SIZE_MAX - headerSize - 3 * pageSize) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    const size_t chunkSize = (headerSize + size + pageSize - 1) / pageSize * pageSize;
+
+    // A fresh anonymous mapping is zero'ed.  The pages around the chunk trap overruns.
+    uint8_t *mapping = mmap( NULL, chunkSize + 2 * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+    if (mapping == MAP_FAILED)
+        return NULL;
+    if (mprotect( mapping, pageSize, PROT_NONE ) != 0 ||
+        mprotect( mapping + pageSize + chunkSize, pageSize, PROT_NONE ) != 0) {
+        munmap( mapping, chunkSize + 2 * pageSize );
+        return NULL;
+    }
+
+    MPArenaChunk *chunk = (MPArenaChunk *)(mapping + pageSize);
+    *chunk = (MPArenaChunk){
+            .mapping = mapping, .mappingSize = chunkSize + 2 * pageSize, .size = chunkSize, .used = headerSize,
+    };
+    // Locking is best-effort, it is subject to the process' RLIMIT_MEMLOCK.
+    if (!(chunk->locked = mlock( chunk, chunk->size ) == 0))
+        dbg( "Could not lock arena memory: %s\n", strerror( errno ) );
+#ifdef MADV_DONTDUMP
+    madvise( chunk, chunk->size, MADV_DONTDUMP );
+#endif
+
+    return chunk;
+}
+
+MPArena *mpw_arena_new(const size_t capacity) {
+
+    MPArena *arena = malloc( sizeof( MPArena ) );
+    if (!arena)
+        return NULL;
+
+    *arena = (MPArena){ .chunkSize = capacity };
+    if (!(arena->chunks = mpw_arena_chunk( capacity ))) {
+        free( arena );
+        return NULL;
+    }
+    arena->chunkSize = arena->chunks->size;
+
+    return arena;
+}
+
+void *mpw_arena_alloc(MPArena *arena, size_t size) {
+
+    if (!arena)
+        return NULL;
+
+    // Each allocation takes at least a byte, so that it is owned by the arena.
+    size = max( size, (size_t)1 );
+
+    MPArenaChunk *chunk = arena->chunks;
+    size_t offset = (chunk->used + MP_arena_alignment - 1) & ~(size_t)(MP_arena_alignment - 1);
+    if (size > chunk->size || offset > chunk->size - size) {
+        // Chunks double in size, so that an arena holds many allocations in few chunks.
+        MPArenaChunk *next = mpw_arena_chunk( max( arena->chunkSize * 2, size ) );
+        if (!next)
+            return NULL;
+
+        next->next = chunk;
+        arena->chunks = chunk = next;
+        arena->chunkSize = chunk->size;
+        offset = chunk->used;
+    }
+
+    chunk->used = offset + size;
+    return (uint8_t *)chunk + offset;
+}
+
+const char *mpw_arena_strdup(MPArena *arena, const char *string) {
+
+    if (!string)
+        return NULL;
+
+    size_t size = strlen( string ) + 1;
+    char *copy = mpw_arena_alloc( arena, size );
+    if (copy)
+        memcpy( copy, string, size );
+
+    return copy;
+}
+
+bool mpw_arena_owns(const MPArena *arena, const void *buffer) {
+
+    if (!arena || !buffer)
+        return false;
+
+    for (const MPArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+        if ((const uint8_t *)buffer >= (const uint8_t *)chunk && (const uint8_t *)buffer < (const uint8_t *)chunk + chunk->used)
+            return true;
+
+    return false;
+}
+
+bool mpw_arena_free(MPArena **arena) {
+
+    if (!arena || !*arena)
+        return false;
+
+    bool success = true;
+    for (MPArenaChunk *chunk = (*arena)->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+
+        uint8_t *mapping = chunk->mapping;
+        size_t mappingSize = chunk->mappingSize, chunkSize = chunk->size;
+        bool locked = chunk->locked;
+        mpw_arena_wipe( chunk, chunk->used );
+        if (locked)
+            munlock( chunk, chunkSize );
+        success &= munmap( mapping, mappingSize ) == 0;
+    }
+    free( *arena );
+    *arena = NULL;
+
+    return success;
+}
+
+/** The BlockMix rounds of scrypt's ROMix between checks of a derivation's control, about a millisecond's worth. */
+#define MP_scrypt_chunk 1024
+
+/** Report the progress of the derivation and check whether it should go on.
+ * @return false, with errno set, if the derivation was cancelled or ran past its deadline. */
+static bool mpw_kdf_proceed(const MPKDFControl *control, const double done) {
+
+    if (control->cancelled && __atomic_load_n( control->cancelled, __ATOMIC_RELAXED )) {
+        errno = ECANCELED;
+        return false;
+    }
+    if (control->deadline && mpw_now() >= control->deadline) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    if (control->progress)
+        control->progress( done, control->context );
+
+    return true;
+}
+
+/** The Salsa20/8 core, applied to the block in place. */
+static void mpw_scrypt_salsa20_8(uint32_t block[16]) {
+
+#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+    uint32_t x[16];
+    memcpy( x, block, sizeof( x ) );
+    for (int round = 0; round < 8; round += 2) {
+        // Columns.
+        x[4] ^= R( x[0] + x[12], 7 );   x[8] ^= R( x[4] + x[0], 9 );
+        x[12] ^= R( x[8] + x[4], 13 );  x[0] ^= R( x[12] + x[8], 18 );
+        x[9] ^= R( x[5] + x[1], 7 );    x[13] ^= R( x[9] + x[5], 9 );
+        x[1] ^= R( x[13] + x[9], 13 );  x[5] ^= R( x[1] + x[13], 18 );
+        x[14] ^= R( x[10] + x[6], 7 );  x[2] ^= R( x[14] + x[10], 9 );
+        x[6] ^= R( x[2] + x[14], 13 );  x[10] ^= R( x[6] + x[2], 18 );
+        x[3] ^= R( x[15] + x[11], 7 );  x[7] ^= R( x[3] + x[15], 9 );
+        x[11] ^= R( x[7] + x[3], 13 );  x[15] ^= R( x[11] + x[7], 18 );
+        // Rows.
+        x[1] ^= R( x[0] + x[3], 7 );    x[2] ^= R( x[1] + x[0], 9 );
+        x[3] ^= R( x[2] + x[1], 13 );   x[0] ^= R( x[3] + x[2], 18 );
+        x[6] ^= R( x[5] + x[4], 7 );    x[7] ^= R( x[6] + x[5], 9 );
+        x[4] ^= R( x[7] + x[6], 13 );   x[5] ^= R( x[4] + x[7], 18 );
+        x[11] ^= R( x[10] + x[9], 7 );  x[8] ^= R( x[11] + x[10], 9 );
+        x[9] ^= R( x[8] + x[11], 13 );  x[10] ^= R( x[9] + x[8], 18 );
+        x[12] ^= R( x[15] + x[14], 7 ); x[13] ^= R( x[12] + x[15], 9 );
+        x[14] ^= R( x[13] + x[12], 13 ); x[15] ^= R( x[14] + x[13], 18 );
+    }
+#undef R
+    for (int w = 0; w < 16; ++w)
+        block[w] += x[w];
+}
+
+/** scrypt's BlockMix of the 2r 64-byte blocks of in into out, after XOR'ing in with the blocks of xor if given. */
+static inline __attribute__((always_inline))
+void mpw_scrypt_blockmix(uint32_t *restrict out, const uint32_t *in, const uint32_t *xor, const uint32_t r) {
+
+    uint32_t x[16];
+    for (int w = 0; w < 16; ++w)
+        x[w] = in[(2 * r - 1) * 16 + w] ^ (xor? xor[(2 * r - 1) * 16 + w]: 0);
+    for (uint32_t b = 0; b < 2 * r; ++b) {
+        for (int w = 0; w < 16; ++w)
+            x[w] ^= in[b * 16 + w] ^ (xor? xor[b * 16 + w]: 0);
+        mpw_scrypt_salsa20_8( x );
+        memcpy( &out[(b / 2 + (b & 1) * r) * 16], x, sizeof( x ) );
+    }
+}
+
+/** Load the little-endian words of a ROMix lane, each 64-byte block's words in the order given by the stride of shuffle:
+ * word w of a block goes to position w, or to the position whose w * shuffle % 16 it is. */
+static void mpw_scrypt_decode(uint32_t *x, const uint8_t *lane, const size_t words, const unsigned int shuffle) {
+
+    for (size_t w = 0; w < words; ++w) {
+        const uint8_t *word = lane + 4 * (w / 16 * 16 + w % 16 * shuffle % 16);
+        x[w] = (uint32_t)word[0] | (uint32_t)word[1] << 8 | (uint32_t)word[2] << 16 | (uint32_t)word[3] << 24;
+    }
+}
+
+static void mpw_scrypt_encode(uint8_t *lane, const uint32_t *x, const size_t words, const unsigned int shuffle) {
+
+    for (size_t w = 0; w < words; ++w) {
+        uint8_t *word = lane + 4 * (w / 16 * 16 + w % 16 * shuffle % 16);
+        for (int o = 0; o < 4; ++o)
+            word[o] = (uint8_t)(x[w] >> (8 * o));
+    }
+}
+
+/** scrypt's ROMix of one lane of B in place, in chunks of BlockMix rounds between which the control is consulted.
+ * @param x Room for two lanes of words.
+ * @param v Room for N lanes of words.
+ * @param done, part The fraction of the derivation done before this lane and the fraction this lane takes of it. */
+typedef bool (*MPScryptROMix)(uint8_t *lane, uint32_t *x, uint32_t *v, const uint64_t N, const uint32_t r,
+        const MPKDFControl *control, const double done, const double part);
+
+static bool mpw_scrypt_romix(uint8_t *lane, uint32_t *x, uint32_t *v, const uint64_t N, const uint32_t r,
+        const MPKDFControl *control, const double done, const double part) {
+
+    const size_t words = 32 * (size_t)r;
+    uint32_t *y = x + words;
+    mpw_scrypt_decode( x, lane, words, 1 );
+    for (uint64_t i = 0; i < 2 * N; ++i) {
+        if (i % MP_scrypt_chunk == 0 && !mpw_kdf_proceed( control, done + part * (double)i / (double)(2 * N) ))
+            return false;
+
+        if (i < N) {
+            memcpy( v + i * words, x, words * sizeof( *x ) );
+            mpw_scrypt_blockmix( y, x, NULL, r );
+        }
+        else
+            mpw_scrypt_blockmix( y, x, v + (x[words - 16] & (N - 1)) * words, r );
+        uint32_t *mixed = y;
+        y = x;
+        x = mixed;
+    }
+    mpw_scrypt_encode( lane, x, words, 1 );
+
+    return true;
+}
+
+#if MPW_UTIL_X86
+
+/** The Salsa20/8 core on a block whose words are held by the vectors in the order 0 5 10 15, 4 9 14 3, 8 13 2 7, 12 1 6 11:
+ * each step of a round then works on whole vectors. */
+__attribute__((target( "sse2" )))
+static inline void mpw_scrypt_salsa20_8_sse2(__m128i x[4]) {
+
+#define R(v, a, b) _mm_xor_si128( v, _mm_xor_si128( _mm_slli_epi32( a, b ), _mm_srli_epi32( a, 32 - (b) ) ) )
+    __m128i x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+    for (int round = 0; round < 8; round += 2) {
+        // Columns.
+        x1 = R( x1, _mm_add_epi32( x0, x3 ), 7 );
+        x2 = R( x2, _mm_add_epi32( x1, x0 ), 9 );
+        x3 = R( x3, _mm_add_epi32( x2, x1 ), 13 );
+        x0 = R( x0, _mm_add_epi32( x3, x2 ), 18 );
+        x1 = _mm_shuffle_epi32( x1, 0x93 );
+        x2 = _mm_shuffle_epi32( x2, 0x4E );
+        x3 = _mm_shuffle_epi32( x3, 0x39 );
+        // Rows.
+        x3 = R( x3, _mm_add_epi32( x0, x1 ), 7 );
+        x2 = R( x2, _mm_add_epi32( x3, x0 ), 9 );
+        x1 = R( x1, _mm_add_epi32( x2, x3 ), 13 );
+        x0 = R( x0, _mm_add_epi32( x1, x2 ), 18 );
+        x1 = _mm_shuffle_epi32( x1, 0x39 );
+        x2 = _mm_shuffle_epi32( x2, 0x4E );
+        x3 = _mm_shuffle_epi32( x3, 0x93 );
+    }
+#undef R
+    x[0] = _mm_add_epi32( x[0], x0 );
+    x[1] = _mm_add_epi32( x[1], x1 );
+    x[2] = _mm_add_epi32( x[2], x2 );
+    x[3] = _mm_add_epi32( x[3], x3 );
+}
+
+__attribute__((target( "sse2" )))
+static inline void mpw_scrypt_blockmix_sse2(__m128i *restrict out, const __m128i *in, const __m128i *xor, const uint32_t r) {
+
+    __m128i x[4];
+    for (int v = 0; v < 4; ++v)
+        x[v] = xor? _mm_xor_si128( in[(2 * r - 1) * 4 + v], xor[(2 * r - 1) * 4 + v] ): in[(2 * r - 1) * 4 + v];
+    for (uint32_t b = 0; b < 2 * r; ++b) {
+        for (int v = 0; v < 4; ++v)
+            x[v] = _mm_xor_si128( x[v], xor? _mm_xor_si128( in[b * 4 + v], xor[b * 4 + v] ): in[b * 4 + v] );
+        mpw_scrypt_salsa20_8_sse2( x );
+        memcpy( &out[(b / 2 + (b & 1) * r) * 4], x, sizeof( x ) );
+    }
+}
+
+/** mpw_scrypt_romix on vectors of the blocks' words in the order of mpw_scrypt_salsa20_8_sse2, a stride of 5. */
+__attribute__((target( "sse2" )))
+static bool mpw_scrypt_romix_sse2(uint8_t *lane, uint32_t *x, uint32_t *v, const uint64_t N, const uint32_t r,
+        const MPKDFControl *control, const double done, const double part) {
+
+    const size_t words = 32 * (size_t)r;
+    __m128i *vx = (__m128i *)x, *vy = vx + words / 4, *vv = (__m128i *)v;
+    mpw_scrypt_decode( x, lane, words, 5 );
+    for (uint64_t i = 0; i < 2 * N; ++i) {
+        if (i % MP_scrypt_chunk == 0 && !mpw_kdf_proceed( control, done + part * (double)i / (double)(2 * N) ))
+            return false;
+
+        if (i < N) {
+            memcpy( vv + i * words / 4, vx, words * sizeof( *x ) );
+            mpw_scrypt_blockmix_sse2( vy, vx, NULL, r );
+        }
+        else
+            mpw_scrypt_blockmix_sse2( vy, vx, vv + ((uint32_t)_mm_cvtsi128_si32( vx[words / 4 - 4] ) & (N - 1)) * words / 4, r );
+        __m128i *mixed = vy;
+        vy = vx;
+        vx = mixed;
+    }
+    mpw_scrypt_encode( lane, (uint32_t *)vx, words, 5 );
+
+    return true;
+}
+
+#endif
+
+/** scrypt, checking the control and reporting progress between chunks of ROMix.
+ * The password-based key derivations around ROMix are a single iteration of PBKDF2-HMAC-SHA256 each. */
+static bool mpw_kdf_scrypt_chunked(uint8_t *key, const size_t keySize, const uint8_t *secret, const size_t secretSize,
+        const uint8_t *salt, const size_t saltSize, const uint64_t N, const uint32_t r, const uint32_t p,
+        const MPKDFControl *control) {
+
+    const MPCryptoBackend *crypto = mpw_crypto();
+    if (!crypto->hmac_sha256) {
+        errno = ENOTSUP;
+        return false;
+    }
+    if (N < 2 || N & (N - 1) || N > UINT32_MAX || !r || !p || (uint64_t)r * p >= 1 << 30 ||
+        N > SIZE_MAX / 128 / r) {
+        errno = EINVAL;
+        return false;
+    }
+
+    MPScryptROMix romix = mpw_scrypt_romix;
+#if MPW_UTIL_X86
+    if (__builtin_cpu_supports( "sse2" ))
+        romix = mpw_scrypt_romix_sse2;
+#endif
+
+    // The lanes are aligned for vectors of their words.
+    const size_t blockSize = 128 * (size_t)r, bSize = blockSize * p;
+    uint8_t *b = malloc( bSize ), *message = malloc( max( saltSize, bSize ) + 4 );
+    uint32_t *x = NULL, *v = NULL;
+    bool success = b && message &&
+                   posix_memalign( (void **)&x, 64, 2 * blockSize ) == 0 && posix_memalign( (void **)&v, 64, blockSize * N ) == 0;
+
+    // B = PBKDF2( secret, salt, 1, p * 128r ), each of its p lanes ROMix'ed, then key = PBKDF2( secret, B, 1, keySize ).
+    for (int pass = 0; success && pass < 2; ++pass) {
+        const uint8_t *input = pass? b: salt;
+        const size_t inputSize = pass? bSize: saltSize, outputSize = pass? keySize: bSize;
+        uint8_t *output = pass? key: b, mac[MPCryptoSHA256Size];
+        memcpy( message, input, inputSize );
+        for (size_t offset = 0, i = 1; success && offset < outputSize; offset += sizeof( mac ), ++i) {
+            mpw_uint32( (uint32_t)i, message + inputSize );
+            success = crypto->hmac_sha256( mac, secret, secretSize, message, inputSize + 4 );
+            memcpy( output + offset, mac, min( sizeof( mac ), outputSize - offset ) );
+        }
+        bzero( mac, sizeof( mac ) );
+
+        for (uint32_t lane = 0; success && !pass && lane < p; ++lane)
+            success = romix( b + lane * blockSize, x, v, N, r, control, (double)lane / p, 1. / p );
+    }
+    if (success && control->progress)
+        control->progress( 1, control->context );
+
+    mpw_free( &b, bSize );
+    mpw_free( &message, max( saltSize, bSize ) + 4 );
+    mpw_free( &x, 2 * blockSize );
+    mpw_free( &v, blockSize * N );
+
+    return success;
+}
+
 uint8_t const *mpw_kdf_scrypt(const size_t keySize, const char *secret, const uint8_t *salt, const size_t saltSize,
         uint64_t N, uint32_t r, uint32_t p) {
 
+    return mpw_kdf_scrypt_control( keySize, secret, salt, saltSize, N, r, p, NULL );
+}
+
+uint8_t const *mpw_kdf_scrypt_control(const size_t keySize, const char *secret, const uint8_t *salt, const size_t saltSize,
+        uint64_t N, uint32_t r, uint32_t p, const MPKDFControl *control) {
+
     if (!secret || !salt)
         return NULL;
 
+    mpw_metric_scope( MPMetricScrypt );
+
+    const MPCryptoBackend *crypto = mpw_crypto();
+    if (!control && !crypto->scrypt) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
     uint8_t *key = malloc( keySize );
     if (!key)
         return NULL;
 
-#if MPW_CPERCIVA
-    if (crypto_scrypt( (const uint8_t *)secret, strlen( secret ), salt, saltSize, N, r, p, key, keySize ) < 0) {
+    if (!(control? mpw_kdf_scrypt_chunked( key, keySize, (const uint8_t *)secret, strlen( secret ), salt, saltSize, N, r, p, control ):
+          crypto->scrypt( key, keySize, (const uint8_t *)secret, strlen( secret ), salt, saltSize, N, r, p ))) {
+        int error = errno;
         mpw_free( &key, keySize );
+        errno = error;
         return NULL;
     }
-#elif MPW_SODIUM
-    if (crypto_pwhash_scryptsalsa208sha256_ll( (const uint8_t *)secret, strlen( secret ), salt, saltSize, N, r, p, key, keySize ) != 0) {
-        mpw_free( &key, keySize );
-        return NULL;
-    }
-#else
-#error No crypto support for mpw_scrypt.
-#endif
 
     return key;
 }
@@ -204,35 +618,49 @@ uint8_t const *mpw_kdf_blake2b(const size_t subkeySize, const uint8_t *key, cons
     if (!subkey)
         return NULL;
 
-#if MPW_SODIUM
-    if (keySize < crypto_generichash_blake2b_KEYBYTES_MIN || keySize > crypto_generichash_blake2b_KEYBYTES_MAX ||
-        subkeySize < crypto_generichash_blake2b_KEYBYTES_MIN || subkeySize > crypto_generichash_blake2b_KEYBYTES_MAX ||
-        contextSize < crypto_generichash_blake2b_BYTES_MIN || contextSize > crypto_generichash_blake2b_BYTES_MAX ||
-        (personal && strlen( personal ) > crypto_generichash_blake2b_PERSONALBYTES)) {
-        errno = EINVAL;
-        free( subkey );
+    if (!mpw_kdf_blake2b_batch( subkey, subkeySize, key, keySize, 1, context, contextSize, id, personal )) {
+        mpw_free( &subkey, subkeySize );
         return NULL;
     }
 
-    uint8_t saltBuf[crypto_generichash_blake2b_SALTBYTES];
+    return subkey;
+}
+
+bool mpw_kdf_blake2b_batch(uint8_t *subkeys, const size_t subkeySize, const uint8_t *keys, const size_t keySize, const size_t count,
+        const uint8_t *context, const size_t contextSize, const uint64_t id, const char *personal) {
+
+    if (!subkeys || !keys || !keySize || !subkeySize || (personal && strlen( personal ) > MPCryptoBlake2bPersonalSize)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    mpw_metric_scope( MPMetricBlake2b );
+
+    const MPCryptoBackend *crypto = mpw_crypto();
+    if (!crypto->blake2b) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    // The parameter block is the same for all keys, only prepare it once.
+    uint8_t saltBuf[MPCryptoBlake2bSaltSize];
     bzero( saltBuf, sizeof saltBuf );
     if (id)
         mpw_uint64( id, saltBuf );
 
-    uint8_t personalBuf[crypto_generichash_blake2b_PERSONALBYTES];
-    bzero( personalBuf, sizeof saltBuf );
+    uint8_t personalBuf[MPCryptoBlake2bPersonalSize];
+    bzero( personalBuf, sizeof personalBuf );
     if (personal && strlen( personal ))
         memcpy( personalBuf, personal, strlen( personal ) );
 
-    if (crypto_generichash_blake2b_salt_personal( subkey, subkeySize, context, contextSize, key, keySize, saltBuf, personalBuf ) != 0) {
-        mpw_free( &subkey, subkeySize );
-        return NULL;
-    }
-#else
-#error No crypto support for mpw_kdf_blake2b.
-#endif
+    for (size_t k = 0; k < count; ++k)
+        if (!crypto->blake2b( subkeys + k * subkeySize, subkeySize, keys + k * keySize, keySize,
+                context, contextSize, saltBuf, personalBuf )) {
+            bzero( subkeys, count * subkeySize );
+            return false;
+        }
 
-    return subkey;
+    return true;
 }
 
 uint8_t const *mpw_hash_hmac_sha256(const uint8_t *key, const size_t keySize, const uint8_t *message, const size_t messageSize) {
@@ -240,77 +668,121 @@ uint8_t const *mpw_hash_hmac_sha256(const uint8_t *key, const size_t keySize, co
     if (!key || !keySize || !message || !messageSize)
         return NULL;
 
-#if MPW_CPERCIVA
-    uint8_t *const mac = malloc( 32 );
-    if (!mac)
+    mpw_metric_scope( MPMetricHMAC );
+
+    const MPCryptoBackend *crypto = mpw_crypto();
+    if (!crypto->hmac_sha256) {
+        errno = ENOTSUP;
         return NULL;
+    }
 
-    HMAC_SHA256_Buf( key, keySize, message, messageSize, mac );
-#elif MPW_SODIUM
-    uint8_t *const mac = malloc( crypto_auth_hmacsha256_BYTES );
+    uint8_t *const mac = malloc( MPCryptoSHA256Size );
     if (!mac)
         return NULL;
 
-    crypto_auth_hmacsha256_state state;
-    if (crypto_auth_hmacsha256_init( &state, key, keySize ) != 0 ||
-        crypto_auth_hmacsha256_update( &state, message, messageSize ) != 0 ||
-        crypto_auth_hmacsha256_final( &state, mac ) != 0) {
-        mpw_free( &mac, crypto_auth_hmacsha256_BYTES );
+    if (!crypto->hmac_sha256( mac, key, keySize, message, messageSize )) {
+        mpw_free( &mac, MPCryptoSHA256Size );
         return NULL;
     }
-#else
-#error No crypto support for mpw_hmac_sha256.
-#endif
 
     return mac;
 }
 
-static uint8_t const *mpw_aes(bool encrypt, const uint8_t *key, const size_t keySize, const uint8_t *buf, const size_t bufSize) {
+bool mpw_hash_hmac_sha256_batch(
+        uint8_t macs[][MPCryptoSHA256Size], const uint8_t *key, const size_t keySize, const uint8_t *prefix, const size_t prefixSize,
+        const uint8_t *const messages[], const size_t messageSizes[], const size_t count) {
 
-#if MPW_SODIUM
-    if (!key || keySize < crypto_stream_KEYBYTES)
-        return NULL;
+    if (!macs || !key || !keySize || (!prefix && prefixSize) || !messages || !messageSizes)
+        return false;
+    for (size_t m = 0; m < count; ++m)
+        if (!messages[m] || !(prefixSize + messageSizes[m]))
+            return false;
 
-    uint8_t nonce[crypto_stream_NONCEBYTES];
-    bzero( (void *)nonce, sizeof( nonce ) );
+    mpw_metric_scope_count( MPMetricHMAC, count );
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-    if (encrypt) {
-        uint8_t *const cipherBuf = malloc( bufSize );
-        if (crypto_stream_aes128ctr_xor( cipherBuf, buf, bufSize, nonce, key ) != 0) {
-            mpw_free( &cipherBuf, bufSize );
-            return NULL;
-        }
-        return cipherBuf;
+    const MPCryptoBackend *crypto = mpw_crypto();
+    if (crypto->hmac_sha256_batch)
+        return crypto->hmac_sha256_batch( macs, key, keySize, prefix, prefixSize, messages, messageSizes, count );
+    if (!crypto->hmac_sha256) {
+        errno = ENOTSUP;
+        return false;
     }
-    else {
-        uint8_t *const plainBuf = malloc( bufSize );
-        if (crypto_stream_aes128ctr( plainBuf, bufSize, nonce, key ) != 0) {
-            mpw_free( &plainBuf, bufSize );
-            return NULL;
+
+    bool success = true;
+    for (size_t m = 0; success && m < count; ++m) {
+        if (!prefixSize) {
+            success = crypto->hmac_sha256( macs[m], key, keySize, messages[m], messageSizes[m] );
+            continue;
         }
-        for (size_t c = 0; c < bufSize; ++c)
-            plainBuf[c] = buf[c] ^ plainBuf[c];
-        return plainBuf;
+
+        size_t joinedSize = prefixSize + messageSizes[m];
+        uint8_t *joined = malloc( joinedSize );
+        success = joined != NULL;
+        if (success) {
+            memcpy( joined, prefix, prefixSize );
+            memcpy( joined + prefixSize, messages[m], messageSizes[m] );
+            success = crypto->hmac_sha256( macs[m], key, keySize, joined, joinedSize );
+        }
+        mpw_free( &joined, joinedSize );
     }
-#pragma clang diagnostic pop
-#pragma GCC diagnostic pop
-#else
-#error No crypto support for mpw_aes.
-#endif
+
+    return success;
+}
+
+static bool mpw_aes(const uint8_t *key, const size_t keySize, uint8_t *out, const uint8_t *in, const size_t bufSize) {
+
+    if (!key || keySize < MPCryptoAESKeySize || !out || !in)
+        return false;
+
+    const MPCryptoBackend *crypto = mpw_crypto();
+    if (!crypto->aes128_ctr) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    // CTR mode: encryption and decryption both XOR the buffer with the key stream, which can be done in place.
+    uint8_t nonce[MPCryptoAESBlockSize];
+    bzero( (void *)nonce, sizeof( nonce ) );
+
+    return crypto->aes128_ctr( out, in, bufSize, key, nonce );
 }
 
 uint8_t const *mpw_aes_encrypt(const uint8_t *key, const size_t keySize, const uint8_t *plainBuf, const size_t bufSize) {
 
-    return mpw_aes( true, key, keySize, plainBuf, bufSize );
+    mpw_metric_scope( MPMetricAESEncrypt );
+
+    uint8_t *const cipherBuf = malloc( bufSize );
+    if (!mpw_aes( key, keySize, cipherBuf, plainBuf, bufSize )) {
+        mpw_free( &cipherBuf, bufSize );
+        return NULL;
+    }
+
+    return cipherBuf;
 }
 
 uint8_t const *mpw_aes_decrypt(const uint8_t *key, const size_t keySize, const uint8_t *cipherBuf, const size_t bufSize) {
 
-    return mpw_aes( false, key, keySize, cipherBuf, bufSize );
+    mpw_metric_scope( MPMetricAESDecrypt );
+
+    uint8_t *const plainBuf = malloc( bufSize );
+    if (!mpw_aes( key, keySize, plainBuf, cipherBuf, bufSize )) {
+        mpw_free( &plainBuf, bufSize );
+        return NULL;
+    }
+
+    return plainBuf;
+}
+
+bool mpw_aes_encrypt_inplace(const uint8_t *key, const size_t keySize, uint8_t *buf, const size_t bufSize) {
+
+    mpw_metric_scope( MPMetricAESEncrypt );
+    return mpw_aes( key, keySize, buf, buf, bufSize );
+}
+
+bool mpw_aes_decrypt_inplace(const uint8_t *key, const size_t keySize, uint8_t *buf, const size_t bufSize) {
+
+    mpw_metric_scope( MPMetricAESDecrypt );
+    return mpw_aes( key, keySize, buf, buf, bufSize );
 }
 
 #if UNUSED
@@ -347,15 +819,10 @@ MPKeyID mpw_id_buf(const void *buf, size_t length) {
     if (!buf)
         return "<unset>";
 
-#if MPW_CPERCIVA
-    uint8_t hash[32];
-    SHA256_Buf( buf, length, hash );
-#elif MPW_SODIUM
-    uint8_t hash[crypto_hash_sha256_BYTES];
-    crypto_hash_sha256( hash, buf, length );
-#else
-#error No crypto support for mpw_id_buf.
-#endif
+    const MPCryptoBackend *crypto = mpw_crypto();
+    uint8_t hash[MPCryptoSHA256Size];
+    if (!crypto->sha256 || !crypto->sha256( hash, buf, length ))
+        return "<unknown>";
 
     return mpw_hex( hash, sizeof( hash ) / sizeof( uint8_t ) );
 }
@@ -386,9 +853,9 @@ const char *mpw_str(const char *format, ...) {
 const char *mpw_vstr(const char *format, va_list args) {
 
     // TODO: We should find a way to get rid of this shared storage medium.
-    // TODO: Not thread-safe
-    static char *str_str;
-    static size_t str_str_max;
+    // Thread-local, so that callers on other threads (eg. background key derivation) don't clobber it.
+    static __thread char *str_str;
+    static __thread size_t str_str_max;
     if (!str_str && !(str_str = calloc( str_str_max = 1, sizeof( char ) )))
         return NULL;
 
@@ -413,9 +880,9 @@ const char *mpw_vstr(const char *format, va_list args) {
 const char *mpw_hex(const void *buf, size_t length) {
 
     // TODO: We should find a way to get rid of this shared storage medium.
-    // TODO: Not thread-safe
-    static char **mpw_hex_buf;
-    static unsigned int mpw_hex_buf_i;
+    // Thread-local, see mpw_vstr.
+    static __thread char **mpw_hex_buf;
+    static __thread unsigned int mpw_hex_buf_i;
 
     if (!mpw_hex_buf)
         mpw_hex_buf = calloc( 10, sizeof( char * ) );
@@ -552,12 +1019,108 @@ static int mpw_utf8_sizeof(unsigned char utf8Byte) {
     return 0;
 }
 
+#if MPW_UTIL_X86
+
+/* Reading a whole block past the end of the string is safe as long as the block doesn't cross into the next page,
+ * but the address sanitizer can't tell. */
+
+/** @return The amount of ASCII characters the string starts with, counted 16 bytes at a time. */
+__attribute__((target( "sse2" ), no_sanitize_address))
+static size_t mpw_utf8_asciilen_sse2(const char *utf8String) {
+
+    size_t asciilen = 0;
+    for (; ((uintptr_t)(utf8String + asciilen) & 4095) <= 4096 - 16; asciilen += 16) {
+        __m128i bytes = _mm_loadu_si128( (const __m128i *)(utf8String + asciilen) );
+
+        // The run ends at a NUL or a byte with its high bit set.
+        unsigned int ends = (unsigned int)_mm_movemask_epi8( _mm_or_si128( bytes, _mm_cmpeq_epi8( bytes, _mm_setzero_si128() ) ) );
+        if (ends)
+            return asciilen + (size_t)__builtin_ctz( ends );
+    }
+
+    return asciilen;
+}
+
+/** @return The amount of ASCII characters the string starts with, counted 32 bytes at a time. */
+__attribute__((target( "avx2" ), no_sanitize_address))
+static size_t mpw_utf8_asciilen_avx2(const char *utf8String) {
+
+    size_t asciilen = 0;
+    for (; ((uintptr_t)(utf8String + asciilen) & 4095) <= 4096 - 32; asciilen += 32) {
+        __m256i bytes = _mm256_loadu_si256( (const __m256i *)(utf8String + asciilen) );
+
+        unsigned int ends = (unsigned int)_mm256_movemask_epi8(
+                _mm256_or_si256( bytes, _mm256_cmpeq_epi8( bytes, _mm256_setzero_si256() ) ) );
+        if (ends)
+            return asciilen + (size_t)__builtin_ctz( ends );
+    }
+
+    return asciilen;
+}
+
+#endif
+
+/** @return The amount of ASCII characters the string starts with, where the vector units can count them quickly. */
+static size_t mpw_utf8_asciilen(const char *utf8String) {
+
+#if MPW_UTIL_X86
+    if (__builtin_cpu_supports( "avx2" ))
+        return mpw_utf8_asciilen_avx2( utf8String );
+    if (__builtin_cpu_supports( "sse2" ))
+        return mpw_utf8_asciilen_sse2( utf8String );
+#endif
+
+    return 0;
+}
+
 const size_t mpw_utf8_strlen(const char *utf8String) {
 
+    // Runs of ASCII are counted a block at a time, the characters between them and at page boundaries one at a time.
     size_t charlen = 0;
-    char *remainingString = (char *)utf8String;
-    for (int charByteSize; (charByteSize = mpw_utf8_sizeof( (unsigned char)*remainingString )); remainingString += charByteSize)
+    const char *remainingString = utf8String;
+    for (int charByteSize;; remainingString += charByteSize) {
+        if (!(*remainingString & 0x80)) {
+            size_t asciilen = mpw_utf8_asciilen( remainingString );
+            charlen += asciilen;
+            remainingString += asciilen;
+        }
+
+        if (!(charByteSize = mpw_utf8_sizeof( (unsigned char)*remainingString )))
+            break;
         ++charlen;
 
+        // A character cut short by the end of the string is its last.
+        for (int b = 1; b < charByteSize; ++b)
+            if (!remainingString[b])
+                return charlen;
+    }
+
     return charlen;
 }
+
+const size_t mpw_utf8_strnlen(const char *utf8String, const size_t utf8Size) {
+
+    // Counts like mpw_utf8_strlen, with the end of the string at utf8Size or its NUL, whichever is first.
+    size_t charlen = 0;
+    for (size_t offset = 0, charByteSize; offset < utf8Size; offset += charByteSize) {
+        if (!(charByteSize = (size_t)mpw_utf8_sizeof( (unsigned char)utf8String[offset] )))
+            break;
+        ++charlen;
+
+        // A character cut short by the end of the string is its last.
+        for (size_t b = 1; b < charByteSize; ++b)
+            if (offset + b >= utf8Size || !utf8String[offset + b])
+                return charlen;
+    }
+
+    return charlen;
+}
+
+uint64_t mpw_now() {
+
+    struct timespec now;
+    if (clock_gettime( CLOCK_MONOTONIC, &now ) != 0)
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
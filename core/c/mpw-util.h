@@ -26,47 +26,54 @@
 
 //// Logging.
 
+#ifndef MPW_LOG_LEVEL
+/** The most verbose level of logging compiled in, from -2 (ftl) to 3 (trc).
+ * Logging calls above it are compiled out, along with the evaluation of their arguments.
+ * The CLI's build script (mpw_log_level) and CMake (LOG_LEVEL) build with 2 unless told otherwise, dropping trc. */
+#define MPW_LOG_LEVEL 3
+#endif
+
 #ifndef trc
 extern int mpw_verbosity;
 #define trc_level 3
 /** Logging internal state. */
 #define trc(...) ({ \
-    if (mpw_verbosity >= 3) \
+    if (MPW_LOG_LEVEL >= 3 && mpw_verbosity >= 3) \
         fprintf( stderr, __VA_ARGS__ ); })
 #endif
 #ifndef dbg
 #define dbg_level 2
 /** Logging state and events interesting when investigating issues. */
 #define dbg(...) ({ \
-    if (mpw_verbosity >= 2) \
+    if (MPW_LOG_LEVEL >= 2 && mpw_verbosity >= 2) \
         fprintf( stderr, __VA_ARGS__ ); })
 #endif
 #ifndef inf
 #define inf_level 1
 /** User messages. */
 #define inf(...) ({ \
-    if (mpw_verbosity >= 1) \
+    if (MPW_LOG_LEVEL >= 1 && mpw_verbosity >= 1) \
         fprintf( stderr, __VA_ARGS__ ); })
 #endif
 #ifndef wrn
 #define wrn_level 0
 /** Recoverable issues and user suggestions. */
 #define wrn(...) ({ \
-    if (mpw_verbosity >= 0) \
+    if (MPW_LOG_LEVEL >= 0 && mpw_verbosity >= 0) \
         fprintf( stderr, __VA_ARGS__ ); })
 #endif
 #ifndef err
 #define err_level -1
 /** Unrecoverable issues. */
 #define err(...) ({ \
-    if (mpw_verbosity >= -1) \
+    if (MPW_LOG_LEVEL >= -1 && mpw_verbosity >= -1) \
         fprintf( stderr, __VA_ARGS__ ); })
 #endif
 #ifndef ftl
 #define ftl_level -2
 /** Issues that lead to abortion. */
 #define ftl(...) ({ \
-    if (mpw_verbosity >= -2) \
+    if (MPW_LOG_LEVEL >= -2 && mpw_verbosity >= -2) \
         fprintf( stderr, __VA_ARGS__ ); })
 #endif
 
@@ -151,6 +158,27 @@ bool __mpw_free_string(
 bool __mpw_free_strings(
         const char **strings, ...);
 
+/** A region of memory that many allocations are taken from, to be wiped and released all at once.
+ * Its pages are locked out of swap where the system allows it and fenced off by inaccessible guard pages. */
+typedef struct MPArena MPArena;
+/** Create an arena with room for about capacity bytes, it grows as needed.
+ * @return A new arena or NULL if its memory could not be mapped. */
+MPArena *mpw_arena_new(
+        const size_t capacity);
+/** Allocate zero'ed memory that lives until the arena is freed, aligned for any type.
+ * @return NULL if the arena could not grow. */
+void *mpw_arena_alloc(
+        MPArena *arena, const size_t size);
+/** @return A copy of the string that lives until the arena is freed, or NULL if string is NULL or the arena could not grow. */
+const char *mpw_arena_strdup(
+        MPArena *arena, const char *string);
+/** @return true if the buffer was allocated from the arena. */
+bool mpw_arena_owns(
+        const MPArena *arena, const void *buffer);
+/** Wipe and release all memory of the arena at once, then set the reference to NULL. */
+bool mpw_arena_free(
+        MPArena **arena);
+
 //// Cryptographic functions.
 
 /** Derive a key from the given secret and salt using the scrypt KDF.
@@ -158,15 +186,35 @@ bool __mpw_free_strings(
 uint8_t const *mpw_kdf_scrypt(
         const size_t keySize, const char *secret, const uint8_t *salt, const size_t saltSize,
         uint64_t N, uint32_t r, uint32_t p);
+/** Derive a key like mpw_kdf_scrypt, under the given control: cancelled, held to a deadline or reporting progress.
+  * With a control, scrypt runs in chunks of its mixing between which the control is checked, rather than on the backend.
+  * @param control NULL to derive like mpw_kdf_scrypt.
+  * @return A new keySize allocated buffer containing the key, or NULL with errno set to ECANCELED or ETIMEDOUT
+  *         if the derivation was abandoned. */
+uint8_t const *mpw_kdf_scrypt_control(
+        const size_t keySize, const char *secret, const uint8_t *salt, const size_t saltSize,
+        uint64_t N, uint32_t r, uint32_t p, const MPKDFControl *control);
 /** Derive a subkey from the given key using the blake2b KDF.
   * @return A new keySize allocated buffer containing the key. */
 uint8_t const *mpw_kdf_blake2b(
         const size_t subkeySize, const uint8_t *key, const size_t keySize,
         const uint8_t *context, const size_t contextSize, const uint64_t id, const char *personal);
+/** Derive a subkey from each of many keys using the blake2b KDF, with the same context, id and personalization.
+  * @param subkeys A table of count subkeys, the subkey of keys + k * keySize is written to subkeys + k * subkeySize.
+  * @return false if an error occurred. */
+bool mpw_kdf_blake2b_batch(
+        uint8_t *subkeys, const size_t subkeySize, const uint8_t *keys, const size_t keySize, const size_t count,
+        const uint8_t *context, const size_t contextSize, const uint64_t id, const char *personal);
 /** Calculate the MAC for the given message with the given key using SHA256-HMAC.
   * @return A new 32-byte allocated buffer containing the MAC. */
 uint8_t const *mpw_hash_hmac_sha256(
         const uint8_t *key, const size_t keySize, const uint8_t *salt, const size_t saltSize);
+/** Calculate the MACs for many messages with the same key using SHA256-HMAC, sharing the work for the key between them.
+  * @param prefix Bytes that all messages start with, or NULL.  Its work is shared between the messages as well.
+  * @return false if an error occurred, the MAC of prefix || messages[m] is written to macs[m] otherwise. */
+bool mpw_hash_hmac_sha256_batch(
+        uint8_t macs[][256 / 8], const uint8_t *key, const size_t keySize, const uint8_t *prefix, const size_t prefixSize,
+        const uint8_t *const messages[], const size_t messageSizes[], const size_t count);
 /** Encrypt a plainBuf with the given key using AES-128-CBC.
   * @return A new bufSize allocated buffer containing the cipherBuf. */
 uint8_t const *mpw_aes_encrypt(
@@ -175,6 +223,14 @@ uint8_t const *mpw_aes_encrypt(
   * @return A new bufSize allocated buffer containing the plainBuf. */
 uint8_t const *mpw_aes_decrypt(
         const uint8_t *key, const size_t keySize, const uint8_t *cipherBuf, const size_t bufSize);
+/** Encrypt the buffer in place with the given key using AES-128-CTR.
+  * @return false if an error occurred. */
+bool mpw_aes_encrypt_inplace(
+        const uint8_t *key, const size_t keySize, uint8_t *buf, const size_t bufSize);
+/** Decrypt the buffer in place with the given key using AES-128-CTR.
+  * @return false if an error occurred. */
+bool mpw_aes_decrypt_inplace(
+        const uint8_t *key, const size_t keySize, uint8_t *buf, const size_t bufSize);
 /** Calculate an OTP using RFC-4226.
   * @return A newly allocated string containing exactly `digits` decimal OTP digits. */
 #if UNUSED
@@ -206,5 +262,12 @@ const char *mpw_identicon(const char *fullName, const char *masterPassword);
 
 /** @return The amount of display characters in the given UTF-8 string. */
 const size_t mpw_utf8_strlen(const char *utf8String);
+/** @return The amount of display characters in the first utf8Size bytes of the given UTF-8 string, which needn't be NUL-terminated. */
+const size_t mpw_utf8_strnlen(const char *utf8String, const size_t utf8Size);
+
+//// Time utilities.
+
+/** @return The time of the monotonic clock in nanoseconds, the clock of an MPKDFControl's deadline, or 0 if it can't be read. */
+uint64_t mpw_now();
 
 #endif // _MPW_UTIL_H
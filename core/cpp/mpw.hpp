@@ -0,0 +1,338 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+
+// A header-only C++17 interface to the Master Password algorithm of core/c.
+// Keys are owned by move-only handles that wipe them, strings are taken as views and results are written into buffers
+// of the caller.  Algorithm<V> resolves the algorithm version at compile-time for loops over sites of a known version.
+#ifndef _MPW_HPP
+#define _MPW_HPP
+
+extern "C" {
+#include "mpw-algorithm.h"
+#include "mpw-util.h"
+}
+
+#include <cstring>
+#include <string_view>
+#include <utility>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+namespace mpw {
+
+#if __cplusplus >= 202002L
+using std::span;
+#else
+/** A view of size contiguous objects, the part of C++20's std::span that mpw needs. */
+template<typename T>
+class span {
+public:
+    constexpr span() noexcept : data_( nullptr ), size_( 0 ) {}
+    constexpr span(T *data, std::size_t size) noexcept : data_( data ), size_( size ) {}
+    template<std::size_t N>
+    constexpr span(T (&array)[N]) noexcept : data_( array ), size_( N ) {}
+    template<typename C, typename = decltype( std::declval<C &>().data() ), typename = decltype( std::declval<C &>().size() )>
+    constexpr span(C &container) noexcept : data_( container.data() ), size_( container.size() ) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return !size_; }
+    constexpr T &operator[](std::size_t index) const noexcept { return data_[index]; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+
+private:
+    T *data_;
+    std::size_t size_;
+};
+#endif
+
+namespace detail {
+
+/** Zero a buffer with stores the compiler can't elide. */
+inline void wipe(void *buffer, std::size_t bufferSize) noexcept {
+
+    volatile uint8_t *bytes = static_cast<volatile uint8_t *>( buffer );
+    while (bufferSize--)
+        *bytes++ = 0;
+}
+
+/** A NUL-terminated copy of a string view for the C interface, wiped when it goes out of scope. */
+class CString {
+public:
+    explicit CString(std::string_view string) :
+            size_( string.size() ), heap_( string.size() < sizeof( stack_ )? nullptr: new char[string.size() + 1] ) {
+        if (size_)
+            std::memcpy( data(), string.data(), size_ );
+        data()[size_] = '\0';
+    }
+    CString(const CString &) = delete;
+    CString &operator=(const CString &) = delete;
+    ~CString() {
+        wipe( data(), size_ );
+        delete[] heap_;
+    }
+
+    const char *c_str() const noexcept { return heap_? heap_: stack_; }
+
+private:
+    char *data() noexcept { return heap_? heap_: stack_; }
+
+    std::size_t size_;
+    char *heap_;
+    char stack_[128];
+};
+
+} // namespace detail
+
+template<MPAlgorithmVersion V>
+struct Algorithm;
+
+/** A user's master key, wiped and freed when it goes out of scope.  Master keys can be moved but not copied. */
+class MasterKey {
+public:
+    MasterKey() noexcept = default;
+    /** Take ownership of a master key of the C interface, eg. from mpw_masterKey. */
+    explicit MasterKey(MPMasterKey masterKey) noexcept : key_( masterKey ) {}
+    MasterKey(MasterKey &&other) noexcept : key_( std::exchange( other.key_, nullptr ) ) {}
+    MasterKey &operator=(MasterKey &&other) noexcept {
+        if (this != &other) {
+            reset();
+            key_ = std::exchange( other.key_, nullptr );
+        }
+        return *this;
+    }
+    MasterKey(const MasterKey &) = delete;
+    MasterKey &operator=(const MasterKey &) = delete;
+    ~MasterKey() { reset(); }
+
+    /** Derive the master key for a user based on their name and master password, see mpw_masterKey.
+     * @return An empty master key if an error occurred. */
+    static MasterKey derive(std::string_view fullName, std::string_view masterPassword, MPAlgorithmVersion algorithmVersion) {
+
+        detail::CString fullNameString( fullName ), masterPasswordString( masterPassword );
+        return MasterKey( mpw_masterKey( fullNameString.c_str(), masterPasswordString.c_str(), algorithmVersion ) );
+    }
+
+    /** @return The MPMasterKeySize bytes of the key for the C interface, or NULL if the master key is empty. */
+    MPMasterKey get() const noexcept { return key_; }
+    explicit operator bool() const noexcept { return key_ != nullptr; }
+    void reset() noexcept {
+        if (key_)
+            __mpw_free( reinterpret_cast<const void **>( &key_ ), MPMasterKeySize );
+    }
+
+private:
+    MPMasterKey key_ = nullptr;
+};
+
+/** A site key, held in place and wiped when it goes out of scope.  Site keys can be moved but not copied. */
+class SiteKey {
+public:
+    SiteKey() noexcept = default;
+    SiteKey(SiteKey &&other) noexcept { *this = std::move( other ); }
+    SiteKey &operator=(SiteKey &&other) noexcept {
+        if (this != &other) {
+            std::memcpy( key_, other.key_, sizeof( key_ ) );
+            valid_ = other.valid_;
+            other.reset();
+        }
+        return *this;
+    }
+    SiteKey(const SiteKey &) = delete;
+    SiteKey &operator=(const SiteKey &) = delete;
+    ~SiteKey() { reset(); }
+
+    /** @return The MPSiteKeySize bytes of the key for the C interface, or NULL if the site key is empty. */
+    MPSiteKey get() const noexcept { return valid_? key_: nullptr; }
+    explicit operator bool() const noexcept { return valid_; }
+    void reset() noexcept {
+        detail::wipe( key_, sizeof( key_ ) );
+        valid_ = false;
+    }
+
+private:
+    template<MPAlgorithmVersion V>
+    friend struct Algorithm;
+
+    uint8_t key_[MPSiteKeySize] = {};
+    bool valid_ = false;
+};
+
+/** The algorithm of one version.  Its functions do what the C interface does for algorithmVersion V,
+ * without dispatching on the version or copying strings: site salts are laid out on the stack by the C interface of V
+ * and template passwords are encoded in place. */
+template<MPAlgorithmVersion V>
+struct Algorithm {
+    static_assert( V <= MPAlgorithmVersionLast, "Unsupported algorithm version." );
+
+    static constexpr MPAlgorithmVersion version = V;
+
+    /** Write the site salt of version V into a buffer of the caller, see mpw_siteSalt_v0_buf.
+     * @return The size of the salt, it is written only if it fits, or 0 if an error occurred. */
+    static std::size_t siteSalt(
+            std::string_view siteName, MPCounterValue siteCounter, MPKeyPurpose keyPurpose, std::string_view keyContext,
+            span<uint8_t> salt) {
+
+        const char *context = keyContext.empty()? nullptr: keyContext.data();
+        if constexpr (V == MPAlgorithmVersion0)
+            return mpw_siteSalt_v0_buf( siteName.data(), siteName.size(), siteCounter, keyPurpose, context, keyContext.size(),
+                    salt.data(), salt.size() );
+        else if constexpr (V == MPAlgorithmVersion1)
+            return mpw_siteSalt_v1_buf( siteName.data(), siteName.size(), siteCounter, keyPurpose, context, keyContext.size(),
+                    salt.data(), salt.size() );
+        else if constexpr (V == MPAlgorithmVersion2)
+            return mpw_siteSalt_v2_buf( siteName.data(), siteName.size(), siteCounter, keyPurpose, context, keyContext.size(),
+                    salt.data(), salt.size() );
+        else
+            return mpw_siteSalt_v3_buf( siteName.data(), siteName.size(), siteCounter, keyPurpose, context, keyContext.size(),
+                    salt.data(), salt.size() );
+    }
+
+    /** Derive the site key for a user's site from the given master key and site parameters, see mpw_siteKey.
+     * @return false if an error occurred, in which case siteKey is empty. */
+    static bool siteKey(
+            const MasterKey &masterKey, std::string_view siteName, MPCounterValue siteCounter,
+            MPKeyPurpose keyPurpose, std::string_view keyContext, SiteKey &siteKey) {
+
+        siteKey.reset();
+        if (!masterKey || siteName.empty())
+            return false;
+
+        // The site salt is laid out on the stack unless it's unusually long, the site key is its HMAC under the master key.
+        uint8_t saltStack[256];
+        std::size_t saltSize = siteSalt( siteName, siteCounter, keyPurpose, keyContext, saltStack );
+        const std::size_t saltBufSize = saltSize > sizeof( saltStack )? saltSize: sizeof( saltStack );
+        uint8_t *salt = saltBufSize > sizeof( saltStack )? new uint8_t[saltBufSize]: saltStack;
+        if (salt != saltStack && siteSalt( siteName, siteCounter, keyPurpose, keyContext, span<uint8_t>( salt, saltBufSize ) ) != saltSize)
+            saltSize = 0;
+
+        const uint8_t *mac = saltSize? mpw_hash_hmac_sha256( masterKey.get(), MPMasterKeySize, salt, saltSize ): nullptr;
+        if ((siteKey.valid_ = mac != nullptr))
+            std::memcpy( siteKey.key_, mac, sizeof( siteKey.key_ ) );
+        __mpw_free( reinterpret_cast<const void **>( &mac ), MPSiteKeySize );
+        detail::wipe( salt, salt == saltStack? saltSize: saltBufSize );
+        if (salt != saltStack)
+            delete[] salt;
+
+        return siteKey.valid_;
+    }
+
+    /** Generate a site result token from a site key into a buffer of the caller, see mpw_siteResult_forKey.
+     * @param resultParam A parameter for the resultType.  For stateful result types, the output of mpw_siteState.
+     * @return The length of the NUL-terminated token written into result,
+     *         or 0 if an error occurred or the token doesn't fit. */
+    static std::size_t siteResult(
+            const MasterKey &masterKey, const SiteKey &siteKey, MPResultType resultType, std::string_view resultParam,
+            span<char> result) {
+
+        if (!siteKey || result.empty())
+            return 0;
+
+        // Encode template passwords from the site key in place, as mpw_sitePasswordFromTemplate_v1.
+        // V0 did this with platform-dependent char math, it is left to the C interface.
+        if constexpr (V >= MPAlgorithmVersion1)
+            if (resultType & MPResultTypeClassTemplate) {
+                const char *resultTemplate = mpw_templateForType( resultType, siteKey.key_[0] );
+                const std::size_t resultSize = resultTemplate? std::strlen( resultTemplate ): 0;
+                if (!resultSize || resultSize >= MPSiteKeySize || resultSize >= result.size())
+                    return 0;
+
+                for (std::size_t c = 0; c < resultSize; ++c)
+                    result[c] = mpw_characterFromClass( resultTemplate[c], siteKey.key_[c + 1] );
+                result[resultSize] = '\0';
+                return resultSize;
+            }
+
+        // Stateful and derived results allocate in the C interface anyway.
+        detail::CString resultParamString( resultParam );
+        const char *siteResult = mpw_siteResult_forKey( masterKey.get(), siteKey.get(), resultType,
+                resultParam.empty()? nullptr: resultParamString.c_str(), V );
+        std::size_t resultSize = siteResult? std::strlen( siteResult ): 0;
+        if (resultSize < result.size())
+            std::memcpy( result.data(), siteResult, resultSize + 1 );
+        else
+            resultSize = 0;
+        __mpw_free_string( &siteResult );
+
+        return resultSize;
+    }
+
+    /** Generate a site result token from the given parameters into a buffer of the caller, see mpw_siteResult.
+     * @return The length of the NUL-terminated token written into result,
+     *         or 0 if an error occurred or the token doesn't fit. */
+    static std::size_t siteResult(
+            const MasterKey &masterKey, std::string_view siteName, MPCounterValue siteCounter,
+            MPKeyPurpose keyPurpose, std::string_view keyContext,
+            MPResultType resultType, std::string_view resultParam, span<char> result) {
+
+        SiteKey key;
+        if (!siteKey( masterKey, siteName, siteCounter, keyPurpose, keyContext, key ))
+            return 0;
+
+        return siteResult( masterKey, key, resultType, resultParam, result );
+    }
+};
+
+/** Call function with the Algorithm of algorithmVersion, for when the version is only known at run-time.
+ * Loops over many sites should dispatch once, outside of the loop.
+ * @return The result of function, or unsupported if the version is not supported. */
+template<typename R, typename F>
+R withAlgorithm(MPAlgorithmVersion algorithmVersion, R unsupported, F &&function) {
+
+    switch (algorithmVersion) {
+        case MPAlgorithmVersion0:
+            return function( Algorithm<MPAlgorithmVersion0>() );
+        case MPAlgorithmVersion1:
+            return function( Algorithm<MPAlgorithmVersion1>() );
+        case MPAlgorithmVersion2:
+            return function( Algorithm<MPAlgorithmVersion2>() );
+        case MPAlgorithmVersion3:
+            return function( Algorithm<MPAlgorithmVersion3>() );
+        default:
+            return unsupported;
+    }
+}
+
+/** Derive a site key with the algorithm of a version known at run-time, see Algorithm::siteKey. */
+inline bool siteKey(
+        const MasterKey &masterKey, std::string_view siteName, MPCounterValue siteCounter,
+        MPKeyPurpose keyPurpose, std::string_view keyContext, MPAlgorithmVersion algorithmVersion, SiteKey &siteKey) {
+
+    return withAlgorithm( algorithmVersion, false, [&](auto algorithm) {
+        return decltype( algorithm )::siteKey( masterKey, siteName, siteCounter, keyPurpose, keyContext, siteKey );
+    } );
+}
+
+/** Generate a site result token with the algorithm of a version known at run-time, see Algorithm::siteResult. */
+inline std::size_t siteResult(
+        const MasterKey &masterKey, std::string_view siteName, MPCounterValue siteCounter,
+        MPKeyPurpose keyPurpose, std::string_view keyContext,
+        MPResultType resultType, std::string_view resultParam, MPAlgorithmVersion algorithmVersion, span<char> result) {
+
+    return withAlgorithm( algorithmVersion, std::size_t( 0 ), [&](auto algorithm) {
+        return decltype( algorithm )::siteResult( masterKey, siteName, siteCounter, keyPurpose, keyContext,
+                resultType, resultParam, result );
+    } );
+}
+
+} // namespace mpw
+
+#endif // _MPW_HPP
@@ -32,6 +32,7 @@
  */
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <errno.h>
 #include <pwd.h>
@@ -43,6 +44,35 @@
 #include "blf.h"
 #include "blowfish.h"
 
+/* Portability: the BSD extensions this implementation relies on. */
+#ifndef _PASSWORD_LEN
+#define _PASSWORD_LEN 128
+#endif
+
+#if defined(__linux__)
+static int
+timingsafe_bcmp(const void *b1, const void *b2, size_t n) {
+
+    const unsigned char *p1 = b1, *p2 = b2;
+    int ret = 0;
+
+    for (; n > 0; n--)
+        ret |= *p1++ ^ *p2++;
+    return (ret != 0);
+}
+#endif
+
+#if defined(__GLIBC__) && !(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 36))
+static void
+arc4random_buf(void *buf, size_t nbytes) {
+
+    FILE *urandom = fopen( "/dev/urandom", "r" );
+    if (!urandom || fread( buf, 1, nbytes, urandom ) != nbytes)
+        abort();
+    fclose( urandom );
+}
+#endif
+
 /* This implementation is adaptable to current computing power.
  * You can have up to 2^31 rounds which should be enough for some
  * time to come.
@@ -46,6 +46,10 @@
 
 #include "blf.h"
 
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
 #undef inline
 #ifdef __GNUC__
 #define inline __inline
@@ -0,0 +1,217 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mpw-util.h"
+
+#include "mpw-agent-util.h"
+
+const char *mpw_agent_path(void) {
+
+    const char *socketPath = getenv( MP_ENV_agentSocket );
+    if (socketPath && strlen( socketPath ))
+        return strdup( socketPath );
+
+    const char *runtimeDir = getenv( "XDG_RUNTIME_DIR" );
+    if (runtimeDir && strlen( runtimeDir ))
+        return strdup( mpw_str( "%s/mpw-agent.sock", runtimeDir ) );
+
+    return NULL;
+}
+
+const char *mpw_agent_path_new(void) {
+
+    const char *tmpDir = getenv( "TMPDIR" );
+    if (!tmpDir || !strlen( tmpDir ))
+        tmpDir = "/tmp";
+
+    // mkdtemp creates the directory with mode 0700.
+    char *socketDir = strdup( mpw_str( "%s/mpw-agent.XXXXXX", tmpDir ) );
+    if (!socketDir || !mkdtemp( socketDir )) {
+        mpw_free_string( &socketDir );
+        return NULL;
+    }
+
+    const char *socketPath = strdup( mpw_str( "%s/agent.%d.sock", socketDir, (int)getpid() ) );
+    mpw_free_string( &socketDir );
+    return socketPath;
+}
+
+bool mpw_agent_trusted(int socketFD) {
+
+#if defined(SO_PEERCRED)
+    struct ucred credentials;
+    socklen_t credentialsSize = sizeof( credentials );
+    if (getsockopt( socketFD, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsSize ) == ERR)
+        return false;
+    return credentials.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid( socketFD, &uid, &gid ) == ERR)
+        return false;
+    return uid == geteuid();
+#endif
+}
+
+FILE *mpw_agent_connect(const char *socketPath) {
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (!socketPath) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (strlen( socketPath ) >= sizeof( address.sun_path )) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy( address.sun_path, socketPath );
+
+    int agentFD = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if (agentFD == ERR)
+        return NULL;
+    if (connect( agentFD, (struct sockaddr *)&address, sizeof( address ) ) == ERR) {
+        int connectErrno = errno;
+        close( agentFD );
+        errno = connectErrno;
+        return NULL;
+    }
+    if (!mpw_agent_trusted( agentFD )) {
+        close( agentFD );
+        errno = EPERM;
+        return NULL;
+    }
+
+    FILE *agent = fdopen( agentFD, "r" );
+    if (!agent)
+        close( agentFD );
+
+    return agent;
+}
+
+static char *mpw_agent_vline(const char *field, va_list fields) {
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    bool firstField = true;
+    for (const char *f = field; f; f = va_arg( fields, const char * ), firstField = false) {
+        if (!firstField)
+            mpw_push_buf( (uint8_t **)&line, &lineSize, "\t", 1 );
+
+        for (const char *c = f; *c; ++c)
+            switch (*c) {
+                case '\t':
+                    mpw_push_buf( (uint8_t **)&line, &lineSize, "\\t", 2 );
+                    break;
+                case '\n':
+                    mpw_push_buf( (uint8_t **)&line, &lineSize, "\\n", 2 );
+                    break;
+                case '\\':
+                    mpw_push_buf( (uint8_t **)&line, &lineSize, "\\\\", 2 );
+                    break;
+                default:
+                    mpw_push_buf( (uint8_t **)&line, &lineSize, c, 1 );
+            }
+    }
+    mpw_push_buf( (uint8_t **)&line, &lineSize, "\n", 2 );
+
+    return line;
+}
+
+char *mpw_agent_line(const char *field, ...) {
+
+    va_list fields;
+    va_start( fields, field );
+    char *line = mpw_agent_vline( field, fields );
+    va_end( fields );
+
+    return line;
+}
+
+char *mpw_agent_read(FILE *stream, const char **fields, const size_t fieldsMax, size_t *fieldsCount, size_t *lineSize) {
+
+    char *line = NULL;
+    *lineSize = 0;
+    ssize_t lineLength = getline( &line, lineSize, stream );
+    if (lineLength <= 0 || line[lineLength - 1] != '\n') {
+        mpw_free( &line, *lineSize );
+        *lineSize = 0;
+        return NULL;
+    }
+    line[lineLength - 1] = '\0';
+
+    // Split the line into fields and unescape them in place.
+    *fieldsCount = 0;
+    char *to = line;
+    if (fieldsMax)
+        fields[(*fieldsCount)++] = to;
+    for (const char *from = line; *from; ++from) {
+        if (*from == '\t') {
+            *to++ = '\0';
+            if (*fieldsCount < fieldsMax)
+                fields[(*fieldsCount)++] = to;
+        }
+        else if (*from == '\\' && *(from + 1)) {
+            switch (*++from) {
+                case 't':
+                    *to++ = '\t';
+                    break;
+                case 'n':
+                    *to++ = '\n';
+                    break;
+                default:
+                    *to++ = *from;
+            }
+        }
+        else
+            *to++ = *from;
+    }
+    *to = '\0';
+
+    return line;
+}
+
+char *mpw_agent_call(FILE *agent, const char **fields, const size_t fieldsMax, size_t *fieldsCount, size_t *lineSize,
+        const char *field, ...) {
+
+    va_list requestFields;
+    va_start( requestFields, field );
+    char *request = mpw_agent_vline( field, requestFields );
+    va_end( requestFields );
+    if (!request)
+        return NULL;
+
+    size_t requestLength = strlen( request );
+    bool sent = write( fileno( agent ), request, requestLength ) == (ssize_t)requestLength;
+    mpw_free( &request, requestLength );
+    if (!sent)
+        return NULL;
+
+    return mpw_agent_read( agent, fields, fieldsMax, fieldsCount, lineSize );
+}
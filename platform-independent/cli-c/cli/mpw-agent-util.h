@@ -0,0 +1,71 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#ifndef _MPW_AGENT_UTIL_H
+#define _MPW_AGENT_UTIL_H
+
+#include <stdio.h>
+
+#define MP_ENV_agentSocket  "MP_AGENT_SOCK"
+
+/// The agent protocol.
+///
+/// Clients send requests and the agent answers each with a reply, one line each.
+/// A line holds tab-separated fields; tabs, newlines and backslashes within a field are escaped with a backslash.
+///
+///   info                                                              -> ok  full-name  algorithm  identicon
+///   result|state  algorithm  site-name  counter  purpose  context  type  param -> ok  value
+///   lock                                                              -> ok
+///
+/// Failed requests are answered with: err  description
+
+/** Resolve the path of the agent's socket: MP_AGENT_SOCK in env or a per-user path in the runtime directory.
+ * @return A newly allocated string, or NULL if neither is set: the agent's socket is in a private directory then,
+ *         which only MP_AGENT_SOCK can point to (see mpw_agent_path_new). */
+const char *mpw_agent_path(void);
+
+/** Create a new directory that only our user can access for the agent's socket, as ssh-agent does.
+ * Unlike a well-known path in a shared directory, other users can't claim it before the agent does.
+ * @return A newly allocated string holding the path of the socket within the directory, or NULL if it couldn't be created. */
+const char *mpw_agent_path_new(void);
+
+/** @return true if the process on the other end of the connected socket runs as our own user. */
+bool mpw_agent_trusted(int socketFD);
+
+/** Connect to the agent listening on the socket at the given path.
+ * An agent that doesn't run as our own user is refused, it could be another user's that's after our secrets.
+ * @return A stream for reading the agent's replies, or NULL if the connection failed or was refused (EPERM). */
+FILE *mpw_agent_connect(const char *socketPath);
+
+/** Encode the given fields as a protocol line.  Terminate the va_list with NULL.
+ * @return A newly allocated string, including the line's newline. */
+char *mpw_agent_line(const char *field, ...);
+
+/** Read a protocol line from the stream and split it into its fields.
+ * @param fields An array of fieldsMax references that will point into the returned line.
+ * @param fieldsCount The amount of fields found, at most fieldsMax.
+ * @param lineSize The size of the returned line's buffer.  The fields are NUL-separated, so wipe it with mpw_free, not mpw_free_string.
+ * @return A newly allocated string holding the fields' contents, or NULL if no line could be read. */
+char *mpw_agent_read(FILE *stream, const char **fields, const size_t fieldsMax, size_t *fieldsCount, size_t *lineSize);
+
+/** Send a request to the agent and read its reply.  Terminate the va_list with NULL.
+ * @return A newly allocated string holding the reply's fields (see mpw_agent_read), or NULL if the exchange failed. */
+char *mpw_agent_call(FILE *agent, const char **fields, const size_t fieldsMax, size_t *fieldsCount, size_t *lineSize,
+        const char *field, ...);
+
+#endif // _MPW_AGENT_UTIL_H
@@ -0,0 +1,553 @@
+//==============================================================================
+// This file is part of Master Password.
+// Copyright (c) 2011-2017, Maarten Billemont.
+//
+// Master Password is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Master Password is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You can find a copy of the GNU General Public License in the
+// LICENSE file.  Alternatively, see <http://www.gnu.org/licenses/>.
+//==============================================================================
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mpw-algorithm.h"
+#include "mpw-util.h"
+#include "mpw-agent-util.h"
+
+#ifndef MP_VERSION
+#define MP_VERSION ?
+#endif
+#define MP_ENV_fullName     "MP_FULLNAME"
+#define MP_ENV_algorithm    "MP_ALGORITHM"
+
+#define MP_AGENT_timeout    900 /* seconds */
+#define MP_AGENT_fields     8
+
+typedef struct {
+    const char *fullName;
+    const char *identicon;
+    MPAlgorithmVersion algorithm;
+    MPMasterKey masterKey;
+} MPAgentKey;
+
+static volatile sig_atomic_t mpw_agent_running = 1;
+
+static void usage() {
+
+    inf( ""
+            "  Master Password v%s - agent\n"
+            "--------------------------------------------------------------------------------\n"
+            "      https://masterpasswordapp.com\n\n", stringify_def( MP_VERSION ) );
+    inf( ""
+            "USAGE\n"
+            "  mpw-agent [-u full-name] [-m fd] [-a version] [-s socket] [-t timeout]\n"
+            "            [-d] [-v|-q] [-h]\n"
+            "  mpw-agent [-s socket] -k\n\n" );
+    inf( ""
+            "  Unlocks a user's master key once and serves site results to mpw -A\n"
+            "  over a local socket, without deriving the master key again.\n"
+            "  Evaluate the output in your shell to point mpw at the agent:\n"
+            "      eval \"$(mpw-agent -u 'Full Name')\"\n\n" );
+    inf( ""
+            "  -u full-name Specify the full name of the user.\n"
+            "               Defaults to %s in env or prompts.\n\n", MP_ENV_fullName );
+    dbg( ""
+            "  -M master-pw Specify the master password of the user.\n"
+            "               Passing secrets as arguments is unsafe, for use in testing only.\n" );
+    inf( ""
+            "  -m fd        Read the master password of the user from a file descriptor.\n\n" );
+    inf( ""
+            "  -a version   The algorithm version of the master key to hold, %d - %d.\n"
+            "               Defaults to %s in env or %d.\n\n",
+            MPAlgorithmVersionFirst, MPAlgorithmVersionLast, MP_ENV_algorithm, MPAlgorithmVersionCurrent );
+    inf( ""
+            "  -s socket    The path of the agent's socket.\n"
+            "               Defaults to %s in env, mpw-agent.sock in XDG_RUNTIME_DIR\n"
+            "               or a new private directory in TMPDIR.\n\n", MP_ENV_agentSocket );
+    inf( ""
+            "  -t timeout   Lock the agent after this many seconds without requests.\n"
+            "               Defaults to %d, 0 never locks.\n\n", MP_AGENT_timeout );
+    inf( ""
+            "  -d           Stay in the foreground instead of detaching.\n"
+            "  -k           Lock a running agent: wipe its master key and stop it.\n\n" );
+    inf( ""
+            "  -v           Increase output verbosity (can be repeated).\n"
+            "               Output above MPW_LOG_LEVEL is compiled out: this build has level %d,\n"
+            "               -vv traces need level 3 (mpw_log_level=3 ./build, or cmake -DLOG_LEVEL=3).\n"
+            "  -q           Decrease output verbosity (can be repeated).\n\n", MPW_LOG_LEVEL );
+    exit( 0 );
+}
+
+static const char *mpw_getenv(const char *variableName) {
+
+    char *envBuf = getenv( variableName );
+    return envBuf? strdup( envBuf ): NULL;
+}
+
+static const char *mpw_getline(const char *prompt) {
+
+    fprintf( stderr, "%s ", prompt );
+
+    char *buf = NULL;
+    size_t bufSize = 0;
+    ssize_t lineSize = getline( &buf, &bufSize, stdin );
+    if (lineSize <= 1) {
+        free( buf );
+        return NULL;
+    }
+
+    // Remove the newline.
+    buf[lineSize - 1] = '\0';
+    return buf;
+}
+
+static const char *mpw_getpass(const char *prompt) {
+
+    char *passBuf = getpass( prompt );
+    if (!passBuf)
+        return NULL;
+
+    char *buf = strdup( passBuf );
+    bzero( passBuf, strlen( passBuf ) );
+    return buf;
+}
+
+static char *mpw_read_file(FILE *file) {
+
+    char *buf = NULL;
+    size_t blockSize = 4096, bufSize = 0, bufOffset = 0, readSize = 0;
+    while ((mpw_realloc( &buf, &bufSize, blockSize )) &&
+           (bufOffset += (readSize = fread( buf + bufOffset, 1, blockSize, file ))) &&
+           (readSize == blockSize));
+
+    // Terminate the contents, or drop them if the buffer couldn't grow to hold the terminator.
+    if (buf && bufOffset < bufSize)
+        buf[bufOffset] = '\0';
+    else
+        mpw_free( &buf, bufSize );
+
+    return buf;
+}
+
+static void mpw_agent_stop(int __unused signal) {
+
+    mpw_agent_running = 0;
+}
+
+static time_t mpw_agent_now() {
+
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec;
+}
+
+/** Remove the agent's socket, and the private directory it was created in if it has one. */
+static void mpw_agent_unlink(const char *socketPath, const bool privateDir) {
+
+    unlink( socketPath );
+
+    const char *socketName = strrchr( socketPath, '/' );
+    if (privateDir && socketName) {
+        char *socketDir = strndup( socketPath, (size_t)(socketName - socketPath) );
+        if (socketDir)
+            rmdir( socketDir );
+        free( socketDir );
+    }
+}
+
+static int mpw_agent_listen(const char *socketPath) {
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen( socketPath ) >= sizeof( address.sun_path )) {
+        errno = ENAMETOOLONG;
+        return ERR;
+    }
+    strcpy( address.sun_path, socketPath );
+
+    // Refuse to take over the socket of a running agent, but clean up after a dead one.
+    FILE *runningAgent = mpw_agent_connect( socketPath );
+    if (runningAgent) {
+        fclose( runningAgent );
+        errno = EADDRINUSE;
+        return ERR;
+    }
+    if (errno == EPERM)
+        return ERR;
+    unlink( socketPath );
+
+    int listenFD = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if (listenFD == ERR)
+        return ERR;
+
+    mode_t mask = umask( 0177 );
+    int bound = bind( listenFD, (struct sockaddr *)&address, sizeof( address ) );
+    umask( mask );
+    if (bound == ERR || listen( listenFD, 16 ) == ERR) {
+        int listenErrno = errno;
+        close( listenFD );
+        errno = listenErrno;
+        return ERR;
+    }
+    fcntl( listenFD, F_SETFD, FD_CLOEXEC );
+
+    return listenFD;
+}
+
+static char *mpw_agent_reply(MPAgentKey *key, const char **fields, const size_t fieldsCount) {
+
+    if (!fieldsCount)
+        return mpw_agent_line( "err", "Empty request.", NULL );
+
+    if (strcmp( fields[0], "info" ) == 0) {
+        char algorithm[4];
+        snprintf( algorithm, sizeof( algorithm ), "%u", key->algorithm );
+        return mpw_agent_line( "ok", key->fullName, algorithm, key->identicon?: "", NULL );
+    }
+
+    if (strcmp( fields[0], "lock" ) == 0) {
+        mpw_agent_running = 0;
+        return mpw_agent_line( "ok", NULL );
+    }
+
+    bool result = strcmp( fields[0], "result" ) == 0, state = strcmp( fields[0], "state" ) == 0;
+    if (!result && !state)
+        return mpw_agent_line( "err", "Unknown request.", NULL );
+    if (fieldsCount != MP_AGENT_fields)
+        return mpw_agent_line( "err", "Malformed request.", NULL );
+
+    char *end = NULL;
+    unsigned long algorithm = strtoul( fields[1], &end, 10 );
+    if (!strlen( fields[1] ) || *end)
+        return mpw_agent_line( "err", "Invalid algorithm version.", NULL );
+    if (algorithm != key->algorithm)
+        return mpw_agent_line( "err", "The agent doesn't hold a master key for this algorithm version.", NULL );
+    const char *siteName = fields[2];
+    if (!strlen( siteName ))
+        return mpw_agent_line( "err", "Missing site name.", NULL );
+    unsigned long long siteCounter = strtoull( fields[3], &end, 10 );
+    if (!strlen( fields[3] ) || *end || siteCounter > MPCounterValueLast)
+        return mpw_agent_line( "err", "Invalid site counter.", NULL );
+    unsigned long keyPurpose = strtoul( fields[4], &end, 10 );
+    if (!strlen( fields[4] ) || *end || !mpw_nameForPurpose( (MPKeyPurpose)keyPurpose ))
+        return mpw_agent_line( "err", "Invalid purpose.", NULL );
+    const char *keyContext = strlen( fields[5] )? fields[5]: NULL;
+    unsigned long resultType = strtoul( fields[6], &end, 10 );
+    if (!strlen( fields[6] ) || *end || !mpw_nameForType( (MPResultType)resultType ))
+        return mpw_agent_line( "err", "Invalid type.", NULL );
+    const char *resultParam = strlen( fields[7] )? fields[7]: NULL;
+
+    const char *value = (result? mpw_siteResult: mpw_siteState)(
+            key->masterKey, siteName, (MPCounterValue)siteCounter, (MPKeyPurpose)keyPurpose, keyContext,
+            (MPResultType)resultType, resultParam, key->algorithm );
+    if (!value)
+        return mpw_agent_line( "err", result? "Couldn't generate site result.": "Couldn't encrypt site result.", NULL );
+
+    char *reply = mpw_agent_line( "ok", value, NULL );
+    mpw_free_string( &value );
+    return reply;
+}
+
+static void mpw_agent_serve(MPAgentKey *key, int clientFD) {
+
+    // Don't let a stalled client hold up the agent.
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt( clientFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    setsockopt( clientFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+
+    FILE *client = fdopen( clientFD, "r" );
+    if (!client) {
+        close( clientFD );
+        return;
+    }
+
+    const char *fields[MP_AGENT_fields + 1];
+    size_t fieldsCount = 0, requestSize = 0;
+    for (char *request; mpw_agent_running &&
+                        (request = mpw_agent_read( client, fields, MP_AGENT_fields + 1, &fieldsCount, &requestSize ));) {
+        trc( "request: %s\n", fields[0] );
+        char *reply = mpw_agent_reply( key, fields, fieldsCount );
+        mpw_free( &request, requestSize );
+
+        size_t replyLength = strlen( reply );
+        bool sent = write( clientFD, reply, replyLength ) == (ssize_t)replyLength;
+        mpw_free( &reply, replyLength );
+        if (!sent)
+            break;
+    }
+
+    fclose( client );
+}
+
+int main(const int argc, char *const argv[]) {
+
+    // CLI defaults.
+    bool foreground = false, lock = false;
+
+    // Read the environment.
+    const char *fullNameArg = NULL, *masterPasswordFDArg = NULL, *masterPasswordArg = NULL, *algorithmVersionArg = NULL;
+    const char *socketPathArg = NULL, *timeoutArg = NULL;
+    fullNameArg = mpw_getenv( MP_ENV_fullName );
+    algorithmVersionArg = mpw_getenv( MP_ENV_algorithm );
+
+    // Read the command-line options.
+    for (int opt; (opt = getopt( argc, argv, "u:m:M:a:s:t:dkvqh" )) != EOF;)
+        switch (opt) {
+            case 'u':
+                fullNameArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'm':
+                masterPasswordFDArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'M':
+                // Passing your master password via the command-line is insecure.  Testing purposes only.
+                masterPasswordArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'a':
+                algorithmVersionArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 's':
+                socketPathArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 't':
+                timeoutArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'd':
+                foreground = true;
+                break;
+            case 'k':
+                lock = true;
+                break;
+            case 'v':
+                ++mpw_verbosity;
+                break;
+            case 'q':
+                --mpw_verbosity;
+                break;
+            case 'h':
+                usage();
+                break;
+            case '?':
+                ftl( "Unknown option: -%c\n", optopt );
+                return EX_USAGE;
+            default:
+                ftl( "Unexpected option: %c\n", opt );
+                return EX_USAGE;
+        }
+
+    // Determine the socket.
+    const char *socketPath = socketPathArg? strdup( socketPathArg ): mpw_agent_path();
+    if (lock) {
+        FILE *agent = mpw_agent_connect( socketPath );
+        if (!agent) {
+            ftl( "Couldn't connect to agent:\n  %s: %s\n", socketPath?: MP_ENV_agentSocket, strerror( errno ) );
+            mpw_free_string( &socketPath );
+            return EX_UNAVAILABLE;
+        }
+
+        const char *fields[2];
+        size_t fieldsCount = 0, replySize = 0;
+        char *reply = mpw_agent_call( agent, fields, 2, &fieldsCount, &replySize, "lock", NULL );
+        bool locked = reply && strcmp( fields[0], "ok" ) == 0;
+        if (!locked)
+            ftl( "Couldn't lock agent:\n  %s: %s\n", socketPath, reply && fieldsCount > 1? fields[1]: "No reply." );
+        mpw_free( &reply, replySize );
+        fclose( agent );
+
+        if (locked && !foreground) {
+            fprintf( stdout, "unset %s;\n", MP_ENV_agentSocket );
+            fprintf( stdout, "echo Agent locked;\n" );
+        }
+        return locked? 0: EX_UNAVAILABLE;
+    }
+    int timeout = MP_AGENT_timeout;
+    if (timeoutArg) {
+        char *end = NULL;
+        long timeoutInt = strtol( timeoutArg, &end, 10 );
+        if (*end || timeoutInt < 0 || timeoutInt > INT32_MAX / 1000) {
+            ftl( "Invalid timeout: %s\n", timeoutArg );
+            return EX_USAGE;
+        }
+        timeout = (int)timeoutInt;
+    }
+    MPAlgorithmVersion algorithmVersion = MPAlgorithmVersionCurrent;
+    if (algorithmVersionArg) {
+        int algorithmVersionInt = atoi( algorithmVersionArg );
+        if (algorithmVersionInt < MPAlgorithmVersionFirst || algorithmVersionInt > MPAlgorithmVersionLast) {
+            ftl( "Invalid algorithm version: %s\n", algorithmVersionArg );
+            return EX_USAGE;
+        }
+        algorithmVersion = (MPAlgorithmVersion)algorithmVersionInt;
+    }
+
+    // Determine fullName & masterPassword.
+    const char *fullName = NULL, *masterPassword = NULL;
+    if (fullNameArg)
+        fullName = strdup( fullNameArg );
+    while (!fullName || !strlen( fullName ))
+        fullName = mpw_getline( "Your full name:" );
+    if (masterPasswordFDArg) {
+        FILE *masterPasswordFile = fdopen( atoi( masterPasswordFDArg ), "r" );
+        if (!masterPasswordFile)
+            wrn( "Error opening master password FD %s: %s\n", masterPasswordFDArg, strerror( errno ) );
+        else {
+            masterPassword = mpw_read_file( masterPasswordFile );
+            if (ferror( masterPasswordFile ))
+                wrn( "Error reading master password from %s: %d\n", masterPasswordFDArg, ferror( masterPasswordFile ) );
+        }
+    }
+    if ((!masterPassword || !strlen( masterPassword )) && masterPasswordArg)
+        masterPassword = strdup( masterPasswordArg );
+    while (!masterPassword || !strlen( masterPassword ))
+        masterPassword = mpw_getpass( "Your master password: " );
+    mpw_free_strings( &fullNameArg, &masterPasswordFDArg, &masterPasswordArg, NULL );
+    mpw_free_strings( &algorithmVersionArg, &socketPathArg, &timeoutArg, NULL );
+
+    // Without a socket path to share, listen in a new private directory and share its path through the environment.
+    bool privateDir = !socketPath;
+    if (privateDir && !(socketPath = mpw_agent_path_new())) {
+        ftl( "Couldn't create agent socket directory: %s\n", strerror( errno ) );
+        mpw_free_strings( &fullName, &masterPassword, NULL );
+        return EX_CANTCREAT;
+    }
+
+    // Claim the socket before the expensive work, so a running agent is detected early.
+    int listenFD = mpw_agent_listen( socketPath );
+    if (listenFD == ERR) {
+        ftl( "Couldn't listen on agent socket:\n  %s: %s\n", socketPath, strerror( errno ) );
+        if (privateDir)
+            mpw_agent_unlink( socketPath, privateDir );
+        mpw_free_strings( &fullName, &masterPassword, &socketPath, NULL );
+        return EX_CANTCREAT;
+    }
+
+    // Unlock the master key.
+    MPAgentKey key = {
+            .fullName = fullName,
+            .identicon = mpw_identicon( fullName, masterPassword ),
+            .algorithm = algorithmVersion,
+            .masterKey = mpw_masterKey( fullName, masterPassword, algorithmVersion ),
+    };
+    mpw_free_string( &masterPassword );
+    if (!key.masterKey) {
+        ftl( "Couldn't derive master key.\n" );
+        close( listenFD );
+        mpw_agent_unlink( socketPath, privateDir );
+        mpw_free_strings( &key.fullName, &key.identicon, &socketPath, NULL );
+        return EX_SOFTWARE;
+    }
+    inf( "%s's master key unlocked:\n[ %s ]\n", key.fullName, key.identicon );
+
+    // Detach from the terminal.
+    if (foreground && privateDir)
+        inf( "%s=%s; export %s;\n", MP_ENV_agentSocket, socketPath, MP_ENV_agentSocket );
+    if (!foreground) {
+        fflush( stdout );
+        pid_t agentPID = fork();
+        if (agentPID == ERR) {
+            ftl( "Couldn't start agent: %s\n", strerror( errno ) );
+            close( listenFD );
+            mpw_agent_unlink( socketPath, privateDir );
+            mpw_free( &key.masterKey, MPMasterKeySize );
+            mpw_free_strings( &key.fullName, &key.identicon, &socketPath, NULL );
+            return EX_OSERR;
+        }
+        if (agentPID) {
+            fprintf( stdout, "%s=%s; export %s;\n", MP_ENV_agentSocket, socketPath, MP_ENV_agentSocket );
+            fprintf( stdout, "echo Agent pid %d;\n", agentPID );
+            close( listenFD );
+            mpw_free( &key.masterKey, MPMasterKeySize );
+            mpw_free_strings( &key.fullName, &key.identicon, &socketPath, NULL );
+            return 0;
+        }
+
+        setsid();
+        int nullFD = open( "/dev/null", O_RDWR );
+        if (nullFD != ERR) {
+            dup2( nullFD, STDIN_FILENO );
+            dup2( nullFD, STDOUT_FILENO );
+            dup2( nullFD, STDERR_FILENO );
+            if (nullFD > STDERR_FILENO)
+                close( nullFD );
+        }
+    }
+
+    // Keep the master key out of swap and core dumps; memory locks aren't inherited across fork, so do this last.
+    struct rlimit noCore = { 0, 0 };
+    setrlimit( RLIMIT_CORE, &noCore );
+    if (mlock( key.masterKey, MPMasterKeySize ) == ERR)
+        wrn( "Couldn't lock master key in memory: %s\n", strerror( errno ) );
+
+    struct sigaction stopAction = { .sa_handler = mpw_agent_stop };
+    sigemptyset( &stopAction.sa_mask );
+    sigaction( SIGINT, &stopAction, NULL );
+    sigaction( SIGTERM, &stopAction, NULL );
+    sigaction( SIGHUP, &stopAction, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    // Serve requests until locked or idle.
+    time_t lastActivity = mpw_agent_now();
+    while (mpw_agent_running) {
+        int idle = (int)(mpw_agent_now() - lastActivity);
+        if (timeout && idle >= timeout) {
+            dbg( "Idle for %d seconds, locking.\n", idle );
+            break;
+        }
+
+        struct pollfd listenPoll = { .fd = listenFD, .events = POLLIN };
+        int ready = poll( &listenPoll, 1, timeout? (timeout - idle) * 1000: -1 );
+        if (ready == ERR) {
+            if (errno != EINTR)
+                err( "Couldn't wait for clients: %s\n", strerror( errno ) );
+            continue;
+        }
+        if (!ready)
+            continue;
+
+        int clientFD = accept( listenFD, NULL, NULL );
+        if (clientFD == ERR)
+            continue;
+        if (!mpw_agent_trusted( clientFD )) {
+            wrn( "Refused a client of another user.\n" );
+            close( clientFD );
+            continue;
+        }
+
+        mpw_agent_serve( &key, clientFD );
+        lastActivity = mpw_agent_now();
+    }
+
+    // Lock.
+    close( listenFD );
+    mpw_agent_unlink( socketPath, privateDir );
+    munlock( key.masterKey, MPMasterKeySize );
+    mpw_free( &key.masterKey, MPMasterKeySize );
+    mpw_free_strings( &key.fullName, &key.identicon, &socketPath, NULL );
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+//
+//  mpw-bench-cpp.cpp
+//  MasterPassword
+//
+//  Measures the C++ interface of mpw.hpp against the C entry points it wraps.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "mpw.hpp"
+
+#ifndef MP_VERSION
+#define MP_VERSION ?
+#endif
+
+static const char *fullName = "Robert Lee Mitchell";
+static const char *masterPassword = "banana colored duckling";
+static const MPKeyPurpose keyPurpose = MPKeyPurposeAuthentication;
+
+static const MPResultType resultTypes[] = {
+        MPResultTypeTemplateMaximum, MPResultTypeTemplateLong, MPResultTypeTemplateMedium, MPResultTypeTemplateShort,
+        MPResultTypeTemplateBasic, MPResultTypeTemplatePIN, MPResultTypeTemplateName, MPResultTypeTemplatePhrase,
+        MPResultTypeDeriveKey,
+};
+
+/** @return The site names that are measured, ASCII and multi-byte ones. */
+static std::vector<std::string> mpw_bench_siteNames(size_t count) {
+
+    std::vector<std::string> siteNames;
+    for (size_t s = 0; s < count; ++s)
+        siteNames.push_back( (s % 4 == 3? "ⓜⓟⓦ-": "site-") + std::to_string( s ) + ".example.com" );
+    return siteNames;
+}
+
+/** @return The amount of results for which the C++ interface differs from mpw_siteResult. */
+static size_t mpw_bench_verify(const mpw::MasterKey masterKeys[], const std::vector<std::string> &siteNames) {
+
+    size_t failed = 0;
+    for (MPAlgorithmVersion v = MPAlgorithmVersionFirst; v <= MPAlgorithmVersionLast; ++v)
+        for (size_t s = 0; s < siteNames.size(); ++s) {
+            const char *siteName = siteNames[s].c_str();
+            const MPCounterValue siteCounter = (MPCounterValue)(s % 5 + 1);
+            const char *keyContext = s % 3? NULL: "context";
+            const MPResultType resultType = resultTypes[s % (sizeof( resultTypes ) / sizeof( *resultTypes ))];
+            const char *resultParam = resultType == MPResultTypeDeriveKey? "256": NULL;
+
+            const char *expected = mpw_siteResult( masterKeys[v].get(), siteName, siteCounter, keyPurpose, keyContext,
+                    resultType, resultParam, v );
+            char result[128];
+            size_t resultSize = mpw::siteResult( masterKeys[v], siteNames[s], siteCounter, keyPurpose, keyContext? keyContext: "",
+                    resultType, resultParam? resultParam: "", v, result );
+            if (!expected || !resultSize || strcmp( expected, result ) != 0) {
+                fprintf( stderr, "mismatch: v%u %s: %s != %s\n", v, siteName, expected, resultSize? result: NULL );
+                ++failed;
+            }
+            mpw_free_string( &expected );
+        }
+
+    return failed;
+}
+
+/** Time operations over the site names.
+ * @return The mean time of an operation in nanoseconds. */
+template<typename F>
+static double mpw_bench_measure(const char *name, size_t iterations, const std::vector<std::string> &siteNames, F &&operation) {
+
+    size_t done = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        done += operation( siteNames[i % siteNames.size()] );
+    const auto end = std::chrono::steady_clock::now();
+    if (done != iterations)
+        fprintf( stderr, "%s: %zu of %zu operations failed.\n", name, iterations - done, iterations );
+
+    double mean = std::chrono::duration<double, std::nano>( end - start ).count() / iterations;
+    fprintf( stdout, "%-20s %10zu %12.1f\n", name, iterations, mean );
+    return mean;
+}
+
+[[noreturn]] static void usage() {
+
+    fprintf( stdout, "Usage: mpw-bench-cpp [-n iterations] [-h]\n\n" );
+    fprintf( stdout, "    Compare the C++ interface of mpw.hpp to the C entry points, after checking that they agree.\n\n" );
+    fprintf( stdout, "    -n iterations  The amount of site results to generate for each case (default 100000).\n" );
+    exit( EX_OK );
+}
+
+int main(int argc, char *const argv[]) {
+
+    size_t iterations = 100000;
+    for (int opt; (opt = getopt( argc, argv, "n:h" )) != EOF;)
+        switch (opt) {
+            case 'n':
+                iterations = strtoul( optarg, NULL, 10 );
+                break;
+            case 'h':
+                usage();
+            default:
+                return EX_USAGE;
+        }
+    if (!iterations)
+        return EX_USAGE;
+
+    fprintf( stdout, "<<< Benchmarking mpw.hpp against the C interface (%s) >>>\n", stringify_def( MP_VERSION ) );
+    mpw::MasterKey masterKeys[MPAlgorithmVersionLast + 1];
+    for (MPAlgorithmVersion v = MPAlgorithmVersionFirst; v <= MPAlgorithmVersionLast; ++v)
+        if (!(masterKeys[v] = mpw::MasterKey::derive( fullName, masterPassword, v ))) {
+            fprintf( stderr, "Could not derive master key for algorithm version %u.\n", v );
+            return EX_SOFTWARE;
+        }
+
+    const std::vector<std::string> siteNames = mpw_bench_siteNames( 1024 );
+    size_t failed = mpw_bench_verify( masterKeys, siteNames );
+    fprintf( stdout, "Verified %zu of %zu site results.\n",
+            siteNames.size() * (MPAlgorithmVersionLast + 1) - failed, siteNames.size() * (MPAlgorithmVersionLast + 1) );
+    if (failed)
+        return EX_SOFTWARE;
+
+    const MPAlgorithmVersion algorithmVersion = MPAlgorithmVersionCurrent;
+    const mpw::MasterKey &masterKey = masterKeys[algorithmVersion];
+    fprintf( stdout, "\n%-20s %10s %12s\n", "case", "iterations", "ns/op" );
+
+    double cResult = mpw_bench_measure( "mpw_siteResult", iterations, siteNames, [&](const std::string &siteName) {
+        const char *result = mpw_siteResult( masterKey.get(), siteName.c_str(), MPCounterValueDefault, keyPurpose, NULL,
+                MPResultTypeDefault, NULL, algorithmVersion );
+        return mpw_free_string( &result );
+    } );
+    double cForKey = mpw_bench_measure( "mpw_siteKey+forKey", iterations, siteNames, [&](const std::string &siteName) {
+        MPSiteKey siteKey = mpw_siteKey( masterKey.get(), siteName.c_str(), MPCounterValueDefault, keyPurpose, NULL,
+                algorithmVersion );
+        const char *result = mpw_siteResult_forKey( masterKey.get(), siteKey, MPResultTypeDefault, NULL, algorithmVersion );
+        mpw_free( &siteKey, MPSiteKeySize );
+        return mpw_free_string( &result );
+    } );
+    double cppRuntime = mpw_bench_measure( "mpw::siteResult", iterations, siteNames, [&](const std::string &siteName) {
+        char result[64];
+        return mpw::siteResult( masterKey, siteName, MPCounterValueDefault, keyPurpose, {},
+                MPResultTypeDefault, {}, algorithmVersion, result ) != 0;
+    } );
+    double cppStatic = mpw_bench_measure( "Algorithm<V3>", iterations, siteNames, [&](const std::string &siteName) {
+        char result[64];
+        return mpw::Algorithm<MPAlgorithmVersion3>::siteResult( masterKey, siteName, MPCounterValueDefault, keyPurpose, {},
+                MPResultTypeDefault, {}, result ) != 0;
+    } );
+
+    fprintf( stdout, "\n== SUMMARY ==\nOn this machine,\n" );
+    fprintf( stdout, " - Algorithm<V3> takes %.3g times as long as mpw_siteResult.\n", cppStatic / cResult );
+    fprintf( stdout, " - Algorithm<V3> takes %.3g times as long as mpw_siteKey with mpw_siteResult_forKey.\n", cppStatic / cForKey );
+    fprintf( stdout, " - mpw::siteResult takes %.3g times as long as Algorithm<V3>.\n", cppRuntime / cppStatic );
+
+    return EX_OK;
+}
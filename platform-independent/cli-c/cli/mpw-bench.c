@@ -8,125 +8,1178 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #include "bcrypt.h"
 
 #include "mpw-algorithm.h"
 #include "mpw-util.h"
+#include "mpw-crypto.h"
+#include "mpw-marshall.h"
+#include "mpw-derive.h"
+#include "base64.h"
 
-#define MP_N                32768
-#define MP_r                8
-#define MP_p                2
+#ifndef MP_VERSION
+#define MP_VERSION ?
+#endif
 
-static void mpw_getTime(struct timeval *time) {
+#define MP_BENCH_sizes      "1000,10000,100000"
+#define MP_BENCH_threads    "1"
+#define MP_BENCH_warmup     0.5 /* seconds */
+#define MP_BENCH_duration   2.0 /* seconds */
+#define MP_BENCH_iterations 3
+#define MP_BENCH_maxValues  16
 
-    if (gettimeofday( time, NULL ) != 0)
+extern char **environ;
+
+static const char *fullName = "Robert Lee Mitchell";
+static const char *masterPassword = "banana colored duckling";
+static const char *siteName = "masterpasswordapp.com";
+static const MPCounterValue siteCounter = MPCounterValueDefault;
+static const MPKeyPurpose keyPurpose = MPKeyPurposeAuthentication;
+static const char *keyContext = NULL;
+static const MPAlgorithmVersion algorithmVersion = MPAlgorithmVersionCurrent;
+
+/** Shared, read-only state prepared for a case before it is measured. */
+typedef struct MPBenchContext {
+    /** The amount of sites in the user, for cases that measure sites files. */
+    size_t sites;
+    MPMasterKey masterKey;
+    MPMarshalledUser *user;
+    char *flatSites;
+    char *jsonSites;
+    const char *mpwPath;
+    /** The crypto backend the case is measured with. */
+    const char *backend;
+} MPBenchContext;
+
+typedef struct MPBenchCase {
+    const char *name;
+    const char *description;
+    /** Measured once for every sites file size. */
+    bool sized;
+    /** Can be measured on multiple threads at once. */
+    bool concurrent;
+    bool (*run)(const MPBenchContext *context);
+    /** Run over and over on background threads while the case is measured, to keep the derivation scheduler saturated. */
+    bool (*load)(const MPBenchContext *context);
+} MPBenchCase;
+
+typedef struct MPBenchSamples {
+    uint64_t *ns;
+    size_t count, size;
+} MPBenchSamples;
+
+typedef struct MPBenchLoad {
+    const MPBenchCase *benchCase;
+    const MPBenchContext *context;
+    bool stopped;
+    pthread_t thread;
+} MPBenchLoad;
+
+typedef struct MPBenchThread {
+    const MPBenchCase *benchCase;
+    const MPBenchContext *context;
+    uint64_t deadline;
+    size_t minIterations;
+    MPBenchSamples samples;
+    bool failed;
+    pthread_t thread;
+} MPBenchThread;
+
+static uint64_t mpw_bench_now() {
+
+    struct timespec now;
+    if (clock_gettime( CLOCK_MONOTONIC, &now ) != 0)
         ftl( "Could not get time: %s\n", strerror( errno ) );
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
 }
 
-static const double mpw_showSpeed(struct timeval startTime, const unsigned int iterations, const char *operation) {
+//// Master keys.
 
-    struct timeval endTime;
-    mpw_getTime( &endTime );
+/** The sites file cases measure marshalling, not scrypt: they're served the master key derived during preparation. */
+static MPMasterKey mpw_bench_preparedKey;
 
-    const time_t dsec = (endTime.tv_sec - startTime.tv_sec);
-    const suseconds_t dusec = (endTime.tv_usec - startTime.tv_usec);
-    const double elapsed = dsec + dusec / 1000000.;
-    const double speed = iterations / elapsed;
+static MPMasterKey mpw_bench_masterKeyProvider(
+        const char __unused *fullName, const char __unused *masterPassword, const MPAlgorithmVersion __unused algorithmVersion) {
 
-    fprintf( stderr, " done.  " );
-    fprintf( stdout, "%d %s iterations in %lus %uµs -> %.2f/s\n", iterations, operation, dsec, dusec, speed );
+    uint8_t *masterKey = malloc( MPMasterKeySize );
+    if (masterKey)
+        memcpy( masterKey, mpw_bench_preparedKey, MPMasterKeySize );
 
-    return speed;
+    return masterKey;
 }
 
-int main(int argc, char *const argv[]) {
+//// Cases.
 
-    const char *fullName = "Robert Lee Mitchel";
-    const char *masterPassword = "banana colored duckling";
-    const char *siteName = "masterpasswordapp.com";
-    const MPCounterValue siteCounter = MPCounterValueDefault;
-    const MPResultType resultType = MPResultTypeDefault;
-    const MPKeyPurpose keyPurpose = MPKeyPurposeAuthentication;
-    const char *keyContext = NULL;
-    struct timeval startTime;
-    unsigned int iterations;
-    float percent;
-    MPMasterKey masterKey;
+static bool mpw_bench_hmac(const MPBenchContext *context) {
 
-    // Start HMAC-SHA-256
     // Similar to phase-two of mpw
-    uint8_t *sitePasswordInfo = malloc( 128 );
-    iterations = 4200000; /* tuned to ~10s on dev machine */
-    masterKey = mpw_masterKey( fullName, masterPassword, MPAlgorithmVersionCurrent );
-    if (!masterKey) {
-        ftl( "Could not allocate master key: %s\n", strerror( errno ) );
-        abort();
+    uint8_t sitePasswordInfo[128] = { 0 };
+    const uint8_t *mac = mpw_hash_hmac_sha256( context->masterKey, MPMasterKeySize, sitePasswordInfo, sizeof( sitePasswordInfo ) );
+    return mpw_free( &mac, MPSiteKeySize );
+}
+
+static bool mpw_bench_bcrypt(const MPBenchContext __unused *context) {
+
+    // Similar to phase-one of mpw
+    return bcrypt( masterPassword, bcrypt_gensalt( 9 ) ) != NULL;
+}
+
+static bool mpw_bench_scrypt(const MPBenchContext __unused *context) {
+
+    // Phase one of mpw
+    MPMasterKey masterKey = mpw_masterKey( fullName, masterPassword, algorithmVersion );
+    return mpw_free( &masterKey, MPMasterKeySize );
+}
+
+/** Derive a master key that no other derivation shares, with the given priority. */
+static bool mpw_bench_deriveFresh(const char *who, const MPDerivePriority priority) {
+
+    static size_t derivations;
+    char freshName[64];
+    snprintf( freshName, sizeof( freshName ), "%s %zu", who, __atomic_fetch_add( &derivations, 1, __ATOMIC_RELAXED ) );
+
+    MPMasterKey masterKey = mpw_derive_masterKey( freshName, masterPassword, algorithmVersion, priority, NULL );
+    return mpw_free( &masterKey, MPMasterKeySize );
+}
+
+static bool mpw_bench_unlock(const MPBenchContext __unused *context) {
+
+    // A user unlocking their key.
+    return mpw_bench_deriveFresh( "Unlocking User", MPDerivePriorityInteractive );
+}
+
+static bool mpw_bench_unlockBulk(const MPBenchContext __unused *context) {
+
+    // A user unlocking their key as if it were background work.
+    return mpw_bench_deriveFresh( "Unlocking User", MPDerivePriorityBulk );
+}
+
+static bool mpw_bench_bulkLoad(const MPBenchContext __unused *context) {
+
+    // Background work, such as verifying the keys of many users.
+    return mpw_bench_deriveFresh( "Bulk User", MPDerivePriorityBulk );
+}
+
+static bool mpw_bench_scryptControl(const MPBenchContext __unused *context) {
+
+    // Phase one of mpw, cancellable.
+    bool cancelled = false;
+    MPMasterKey masterKey = mpw_masterKey_control( fullName, masterPassword, algorithmVersion,
+            &(MPKDFControl){ .cancelled = &cancelled } );
+    return mpw_free( &masterKey, MPMasterKeySize );
+}
+
+static bool mpw_bench_siteKey(const MPBenchContext *context) {
+
+    // The HMAC of phase two of mpw
+    MPSiteKey siteKey = mpw_siteKey( context->masterKey, siteName, siteCounter, keyPurpose, keyContext, algorithmVersion );
+    return mpw_free( &siteKey, MPSiteKeySize );
+}
+
+static bool mpw_bench_siteKeysEach(const MPBenchContext *context) {
+
+    // The site keys of all the user's sites, one at a time
+    bool success = true;
+    for (size_t s = 0; success && s < context->user->sites_count; ++s) {
+        const MPMarshalledSite *site = &context->user->sites[s];
+        MPSiteKey siteKey = mpw_siteKey( context->masterKey, site->name, site->counter, keyPurpose, keyContext, site->algorithm );
+        success = mpw_free( &siteKey, MPSiteKeySize );
     }
-    mpw_getTime( &startTime );
-    for (int i = 1; i <= iterations; ++i) {
-        free( (void *)mpw_hash_hmac_sha256( masterKey, MPMasterKeySize, sitePasswordInfo, 128 ) );
 
-        if (modff( 100.f * i / iterations, &percent ) == 0)
-            fprintf( stderr, "\rhmac-sha-256: iteration %d / %d (%.0f%%)..", i, iterations, percent );
+    return success;
+}
+
+static bool mpw_bench_siteKeysBatch(const MPBenchContext *context) {
+
+    // The site keys of all the user's sites, at once
+    size_t count = context->user->sites_count;
+    MPSiteKeyParams *siteParams = calloc( count, sizeof( *siteParams ) );
+    uint8_t (*siteKeys)[MPSiteKeySize] = calloc( count, sizeof( *siteKeys ) );
+    bool success = siteParams && siteKeys;
+    for (size_t s = 0; success && s < count; ++s) {
+        const MPMarshalledSite *site = &context->user->sites[s];
+        siteParams[s] = (MPSiteKeyParams){
+                .siteName = site->name, .siteCounter = site->counter, .keyPurpose = keyPurpose, .keyContext = keyContext,
+                .algorithmVersion = site->algorithm,
+        };
     }
-    const double hmacSha256Speed = mpw_showSpeed( startTime, iterations, "hmac-sha-256" );
-    free( (void *)masterKey );
+    success = success && mpw_siteKeys_batch( context->masterKey, siteParams, count, siteKeys );
+    mpw_free( &siteParams, count * sizeof( *siteParams ) );
+    mpw_free( &siteKeys, count * sizeof( *siteKeys ) );
 
-    // Start BCrypt
-    // Similar to phase-one of mpw
-    uint8_t bcrypt_rounds = 9;
-    iterations = 170; /* tuned to ~10s on dev machine */
-    mpw_getTime( &startTime );
-    for (int i = 1; i <= iterations; ++i) {
-        bcrypt( masterPassword, bcrypt_gensalt( bcrypt_rounds ) );
+    return success;
+}
 
-        if (modff( 100.f * i / iterations, &percent ) == 0)
-            fprintf( stderr, "\rbcrypt (rounds 10^%d): iteration %d / %d (%.0f%%)..", bcrypt_rounds, i, iterations, percent );
+static bool mpw_bench_deriveEach(const MPBenchContext *context) {
+
+    // A derived key for each of the user's sites, one at a time
+    bool success = true;
+    for (size_t s = 0; success && s < context->user->sites_count; ++s) {
+        const MPMarshalledSite *site = &context->user->sites[s];
+        const char *result = mpw_siteResult( context->masterKey, site->name, site->counter, keyPurpose, keyContext,
+                MPResultTypeDeriveKey, "256", site->algorithm );
+        success = mpw_free_string( &result );
     }
-    const double bcrypt9Speed = mpw_showSpeed( startTime, iterations, "bcrypt" );
 
-    // Start SCrypt
-    // Phase one of mpw
-    iterations = 50; /* tuned to ~10s on dev machine */
-    mpw_getTime( &startTime );
-    for (int i = 1; i <= iterations; ++i) {
-        free( (void *)mpw_masterKey( fullName, masterPassword, MPAlgorithmVersionCurrent ) );
+    return success;
+}
+
+static bool mpw_bench_derive(const MPBenchContext *context) {
+
+    // A derived key for each of the user's sites, at once
+    size_t count = context->user->sites_count, rowSize = mpw_siteResults_deriveSize( 256 );
+    MPSiteKeyParams *siteParams = calloc( count, sizeof( *siteParams ) );
+    char *results = calloc( count, rowSize );
+    bool success = siteParams && results;
+    for (size_t s = 0; success && s < count; ++s) {
+        const MPMarshalledSite *site = &context->user->sites[s];
+        siteParams[s] = (MPSiteKeyParams){
+                .siteName = site->name, .siteCounter = site->counter, .keyPurpose = keyPurpose, .keyContext = keyContext,
+                .algorithmVersion = site->algorithm,
+        };
+    }
+    success = success && mpw_siteResults_derive( context->masterKey, siteParams, count, 256, results );
+    mpw_free( &siteParams, count * sizeof( *siteParams ) );
+    mpw_free( &results, count * rowSize );
+
+    return success;
+}
+
+static bool mpw_bench_countersEach(const MPBenchContext *context) {
+
+    // The passwords of as many counters of a site as there are sites, one at a time
+    bool success = true;
+    for (size_t c = 0; success && c < context->sites; ++c) {
+        const char *result = mpw_siteResult( context->masterKey, siteName, (MPCounterValue)(MPCounterValueInitial + c),
+                keyPurpose, keyContext, MPResultTypeDefault, NULL, algorithmVersion );
+        success = mpw_free_string( &result );
+    }
+
+    return success;
+}
+
+static bool mpw_bench_counters(const MPBenchContext *context) {
+
+    // The passwords of as many counters of a site as there are sites, swept at once
+    const char **results = calloc( context->sites, sizeof( *results ) );
+    bool success = results && mpw_siteResults_counterRange( context->masterKey, siteName,
+            MPCounterValueInitial, (MPCounterValue)(MPCounterValueInitial + context->sites - 1),
+            keyPurpose, keyContext, MPResultTypeDefault, NULL, algorithmVersion, results );
+    for (size_t c = 0; success && c < context->sites; ++c)
+        mpw_free_string( &results[c] );
+    mpw_free( &results, context->sites * sizeof( *results ) );
+
+    return success;
+}
+
+static bool mpw_bench_statesEach(const MPBenchContext *context) {
+
+    // The stored login names of all the user's sites, one allocation each
+    bool success = true;
+    for (size_t s = 0; success && s < context->user->sites_count; ++s) {
+        const MPMarshalledSite *site = &context->user->sites[s];
+        const char *loginName = mpw_siteResult( context->masterKey, site->name, MPCounterValueInitial,
+                MPKeyPurposeIdentification, NULL, site->loginType, site->loginContent, site->algorithm );
+        success = mpw_free_string( &loginName );
+    }
+
+    return success;
+}
+
+static bool mpw_bench_states(const MPBenchContext *context) {
+
+    // The stored login names of all the user's sites, decrypted into one buffer
+    size_t bufSize = 0;
+    for (size_t s = 0; s < context->user->sites_count; ++s)
+        bufSize += mpw_siteResult_decryptSize( context->user->sites[s].loginContent );
 
-        if (modff( 100.f * i / iterations, &percent ) == 0)
-            fprintf( stderr, "\rscrypt_mpw: iteration %d / %d (%.0f%%)..", i, iterations, percent );
+    char *buf = malloc( bufSize ), *loginName = buf;
+    bool success = buf != NULL;
+    for (size_t s = 0; success && s < context->user->sites_count; ++s) {
+        const MPMarshalledSite *site = &context->user->sites[s];
+        size_t loginNameSize = mpw_siteResult_decryptSize( site->loginContent );
+        success = mpw_siteResult_decrypt( context->masterKey, site->loginContent, loginName, loginNameSize, site->algorithm ) != NULL;
+        loginName += loginNameSize;
     }
-    const double scryptSpeed = mpw_showSpeed( startTime, iterations, "scrypt_mpw" );
+    mpw_free( &buf, bufSize );
+
+    return success;
+}
+
+static bool mpw_bench_findEach(const MPBenchContext *context) {
+
+    // Look up the last site by name, through the user's sites
+    char siteName[64];
+    snprintf( siteName, sizeof( siteName ), "site-%zu.example.com", context->sites - 1 );
+    for (size_t s = 0; s < context->user->sites_count; ++s)
+        if (strcmp( context->user->sites[s].name, siteName ) == 0)
+            return true;
+
+    return false;
+}
+
+static bool mpw_bench_find(const MPBenchContext *context) {
+
+    // Look up the last site by name, through the columns of the user's sites
+    char siteName[64];
+    snprintf( siteName, sizeof( siteName ), "site-%zu.example.com", context->sites - 1 );
+    size_t site;
+    return mpw_marshall_columns_find( context->user->columns, siteName, &site ) && site == context->sites - 1;
+}
+
+static bool mpw_bench_prefixEach(const MPBenchContext *context) {
+
+    // Count the sites whose name starts with a prefix, through the user's sites
+    size_t matches = 0;
+    for (size_t s = 0; s < context->user->sites_count; ++s)
+        if (strncmp( context->user->sites[s].name, "site-4", 6 ) == 0)
+            ++matches;
+
+    return matches > 0;
+}
+
+static bool mpw_bench_prefix(const MPBenchContext *context) {
+
+    // Count the sites whose name starts with a prefix, through the columns of the user's sites
+    return mpw_marshall_columns_prefix( context->user->columns, "site-4", NULL ) > 0;
+}
+
+static int mpw_bench_compareRecent(const void *a, const void *b) {
+
+    const MPMarshalledSite *siteA = *(const MPMarshalledSite **)a, *siteB = *(const MPMarshalledSite **)b;
+    if (siteA->lastUsed != siteB->lastUsed)
+        return siteA->lastUsed > siteB->lastUsed? -1: 1;
+
+    return siteA < siteB? -1: siteA > siteB;
+}
+
+static bool mpw_bench_recentEach(const MPBenchContext *context) {
+
+    // Order the user's sites by the time they were last used, sorting pointers to the sites
+    const MPMarshalledSite **sites = malloc( context->user->sites_count * sizeof( *sites ) );
+    if (!sites)
+        return false;
+
+    for (size_t s = 0; s < context->user->sites_count; ++s)
+        sites[s] = &context->user->sites[s];
+    qsort( sites, context->user->sites_count, sizeof( *sites ), mpw_bench_compareRecent );
+    free( sites );
+
+    return true;
+}
+
+static bool mpw_bench_recent(const MPBenchContext *context) {
+
+    // Order the user's sites by the time they were last used, through the columns of the user's sites
+    size_t *sites = malloc( context->user->sites_count * sizeof( *sites ) );
+    bool success = sites && mpw_marshall_columns_recent( context->user->columns, sites );
+    free( sites );
+
+    return success;
+}
+
+static bool mpw_bench_columns(const MPBenchContext *context) {
+
+    // Lay out the columns of the user's sites
+    MPMarshalledColumns *columns = mpw_marshall_columns_new( context->user );
+    return columns && mpw_marshall_columns_free( &columns );
+}
+
+static bool mpw_bench_searchIndex(const MPBenchContext *context) {
+
+    // Index the trigrams of the user's sites
+    MPMarshalledSearch *search = mpw_marshall_search_new( context->user );
+    return search && mpw_marshall_search_free( &search );
+}
+
+static bool mpw_bench_search(const MPBenchContext *context) {
+
+    // Find the sites that most resemble a mistyped site name, through the trigram index
+    const size_t site = min( context->sites / 2 + 1, context->sites - 1 );
+    char query[64];
+    snprintf( query, sizeof( query ), "SITE-%zu.exmaple.com", site );
+    MPMarshalledMatch matches[5];
+    return mpw_marshall_search_query( context->user->search, query, matches, 5 ) == min( context->sites, (size_t)5 ) &&
+           matches[0].site == site;
+}
+
+static bool mpw_bench_base64Size(const size_t plainSize) {
+
+    // Encode and decode a buffer of plainSize bytes
+    uint8_t *plainBuf = malloc( plainSize ), *decodedBuf = malloc( plainSize );
+    char *b64Text = malloc( mpw_base64_encode_max( plainSize ) + 1 );
+    bool success = plainBuf && decodedBuf && b64Text;
+    for (size_t b = 0; success && b < plainSize; ++b)
+        plainBuf[b] = (uint8_t)(b * 131);
+    success = success && mpw_base64_encode( b64Text, plainBuf, plainSize ) >= 0
+              && mpw_base64_decode( decodedBuf, b64Text ) == (int)plainSize
+              && memcmp( plainBuf, decodedBuf, plainSize ) == 0;
+    mpw_free( &plainBuf, plainSize );
+    mpw_free( &decodedBuf, plainSize );
+    mpw_free_string( &b64Text );
+
+    return success;
+}
+
+static bool mpw_bench_base64(const MPBenchContext __unused *context) {
+
+    // The size of a stored personal password
+    return mpw_bench_base64Size( 48 );
+}
+
+static bool mpw_bench_base64Bulk(const MPBenchContext __unused *context) {
+
+    return mpw_bench_base64Size( 64 * 1024 );
+}
+
+/** A site with a generated login name and three security questions. */
+static MPMarshalledQuestion mpw_bench_questions[] = {
+        { .keyword = "mother", .type = MPResultTypeTemplatePhrase },
+        { .keyword = "street", .type = MPResultTypeTemplatePhrase },
+        { .keyword = "pet", .type = MPResultTypeTemplatePhrase },
+};
+static const MPMarshalledSite mpw_bench_cardSite = {
+        .name = "masterpasswordapp.com", .type = MPResultTypeDefault, .counter = MPCounterValueDefault,
+        .algorithm = MPAlgorithmVersionCurrent, .loginType = MPResultTypeTemplateName,
+        .questions_count = sizeof( mpw_bench_questions ) / sizeof( *mpw_bench_questions ), .questions = mpw_bench_questions,
+};
+
+static bool mpw_bench_siteCardEach(const MPBenchContext *context) {
+
+    // All results of a site, one at a time
+    const MPMarshalledSite *site = &mpw_bench_cardSite;
+    const char *password = mpw_siteResult( context->masterKey, site->name, site->counter, MPKeyPurposeAuthentication, NULL,
+            site->type, site->content, site->algorithm );
+    const char *login = mpw_siteResult( context->masterKey, site->name, MPCounterValueInitial, MPKeyPurposeIdentification, NULL,
+            site->loginType, site->loginContent, site->algorithm );
+    bool success = mpw_free_strings( &password, &login, NULL );
+    for (size_t q = 0; q < site->questions_count; ++q) {
+        const char *answer = mpw_siteResult( context->masterKey, site->name, MPCounterValueInitial, MPKeyPurposeRecovery,
+                site->questions[q].keyword, site->questions[q].type, site->questions[q].content, site->algorithm );
+        success &= mpw_free_string( &answer );
+    }
+
+    return success;
+}
+
+static bool mpw_bench_siteCard(const MPBenchContext *context) {
+
+    // All results of a site, rendered at once
+    MPRenderedSite rendered;
+    bool success = mpw_site_render( context->masterKey, &mpw_bench_cardSite, &rendered ) &&
+                   rendered.password && rendered.login && rendered.answers_count == mpw_bench_cardSite.questions_count;
+    mpw_site_render_free( &rendered );
+
+    return success;
+}
+
+static bool mpw_bench_template(const MPBenchContext *context) {
+
+    // Phase two of mpw: the site key and its template encoding
+    const char *result = mpw_siteResult( context->masterKey, siteName, siteCounter, keyPurpose, keyContext,
+            MPResultTypeTemplateLong, NULL, algorithmVersion );
+    return mpw_free_string( &result );
+}
+
+static bool mpw_bench_aesState(const MPBenchContext *context) {
+
+    const char *state = mpw_siteState( context->masterKey, siteName, siteCounter, keyPurpose, keyContext,
+            MPResultTypeStatefulPersonal, "correct horse battery staple", algorithmVersion );
+    const char *result = mpw_siteResult( context->masterKey, siteName, siteCounter, keyPurpose, keyContext,
+            MPResultTypeStatefulPersonal, state, algorithmVersion );
+    bool success = result && strcmp( result, "correct horse battery staple" ) == 0;
+    mpw_free_strings( &state, &result, NULL );
+
+    return success;
+}
+
+static bool mpw_bench_mpw(const MPBenchContext __unused *context) {
 
-    // Start MPW
     // Both phases of mpw
-    iterations = 50; /* tuned to ~10s on dev machine */
-    mpw_getTime( &startTime );
-    for (int i = 1; i <= iterations; ++i) {
-        masterKey = mpw_masterKey( fullName, masterPassword, MPAlgorithmVersionCurrent );
-        if (!masterKey) {
-            ftl( "Could not allocate master key: %s\n", strerror( errno ) );
+    MPMasterKey masterKey = mpw_masterKey( fullName, masterPassword, algorithmVersion );
+    if (!masterKey)
+        return false;
+
+    const char *result = mpw_siteResult( masterKey, siteName, siteCounter, keyPurpose, keyContext,
+            MPResultTypeDefault, NULL, algorithmVersion );
+    mpw_free( &masterKey, MPMasterKeySize );
+    return mpw_free_string( &result );
+}
+
+static bool mpw_bench_write(const MPBenchContext *context, const MPMarshallFormat format) {
+
+    char *out = NULL;
+    MPMarshallError error = { .type = MPMarshallSuccess };
+    bool success = mpw_marshall_write_provided( &out, format, context->user, mpw_bench_masterKeyProvider, &error ) &&
+                   error.type == MPMarshallSuccess;
+    mpw_free_string( &out );
+
+    return success;
+}
+
+static bool mpw_bench_read(const MPBenchContext *context, const MPMarshallFormat format, const char *in) {
+
+    MPMarshallError error = { .type = MPMarshallSuccess };
+    MPMarshalledUser *user = mpw_marshall_read_provided( in, format, masterPassword, mpw_bench_masterKeyProvider, &error );
+    bool success = user && user->sites_count == context->sites && error.type == MPMarshallSuccess;
+    mpw_marshal_free( &user );
+
+    return success;
+}
+
+static bool mpw_bench_readMetadata(const MPBenchContext *context, const MPMarshallFormat format, const char *in) {
+
+    MPMarshallError error = { .type = MPMarshallSuccess };
+    MPMarshalledUser *user = mpw_marshall_read_metadata( in, format, &error );
+    bool success = user && user->sites_count == context->sites && error.type == MPMarshallSuccess;
+    mpw_marshal_free( &user );
+
+    return success;
+}
+
+static bool mpw_bench_flatWrite(const MPBenchContext *context) {
+
+    return mpw_bench_write( context, MPMarshallFormatFlat );
+}
+
+static bool mpw_bench_flatRead(const MPBenchContext *context) {
+
+    return mpw_bench_read( context, MPMarshallFormatFlat, context->flatSites );
+}
+
+static bool mpw_bench_flatMetadata(const MPBenchContext *context) {
+
+    return mpw_bench_readMetadata( context, MPMarshallFormatFlat, context->flatSites );
+}
+
+static bool mpw_bench_jsonWrite(const MPBenchContext *context) {
+
+    return mpw_bench_write( context, MPMarshallFormatJSON );
+}
+
+static bool mpw_bench_jsonRead(const MPBenchContext *context) {
+
+    return mpw_bench_read( context, MPMarshallFormatJSON, context->jsonSites );
+}
+
+static bool mpw_bench_jsonMetadata(const MPBenchContext *context) {
+
+    return mpw_bench_readMetadata( context, MPMarshallFormatJSON, context->jsonSites );
+}
+
+static bool mpw_bench_cli(const MPBenchContext *context) {
+
+    // A full mpw invocation, without a sites file.
+    char *const argv[] = {
+            (char *)context->mpwPath, "-q", "-Fnone", "--crypto-backend", (char *)context->backend,
+            "-u", (char *)fullName, "-M", (char *)masterPassword, (char *)siteName, NULL
+    };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_addopen( &actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0 );
+    posix_spawn_file_actions_addopen( &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0 );
+    posix_spawn_file_actions_addopen( &actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0 );
+
+    pid_t pid;
+    int status = 0;
+    bool success = posix_spawn( &pid, context->mpwPath, &actions, NULL, argv, environ ) == 0 &&
+                   waitpid( pid, &status, 0 ) == pid && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+    posix_spawn_file_actions_destroy( &actions );
+
+    return success;
+}
+
+static const MPBenchCase mpw_bench_cases[] = {
+        { .name = "hmac-sha-256", .description = "HMAC-SHA-256 of a 128-byte buffer",
+          .sized = false, .concurrent = true, .run = mpw_bench_hmac },
+        { .name = "bcrypt", .description = "bcrypt (rounds 10^9)",
+          .sized = false, .concurrent = false, .run = mpw_bench_bcrypt },
+        { .name = "scrypt", .description = "master key derivation (phase one)",
+          .sized = false, .concurrent = true, .run = mpw_bench_scrypt },
+        { .name = "scrypt-control", .description = "master key derivation, cancellable",
+          .sized = false, .concurrent = true, .run = mpw_bench_scryptControl },
+        { .name = "site-key", .description = "site key derivation",
+          .sized = false, .concurrent = true, .run = mpw_bench_siteKey },
+        { .name = "site-keys-each", .description = "site keys of all sites, one at a time",
+          .sized = true, .concurrent = true, .run = mpw_bench_siteKeysEach },
+        { .name = "site-keys", .description = "site keys of all sites, batched",
+          .sized = true, .concurrent = true, .run = mpw_bench_siteKeysBatch },
+        { .name = "template", .description = "site key and template password (phase two)",
+          .sized = false, .concurrent = true, .run = mpw_bench_template },
+        { .name = "derive-each", .description = "derived keys of all sites, one at a time",
+          .sized = true, .concurrent = true, .run = mpw_bench_deriveEach },
+        { .name = "derive", .description = "derived keys of all sites, into a table",
+          .sized = true, .concurrent = true, .run = mpw_bench_derive },
+        { .name = "counters-each", .description = "passwords of a site's counters, one at a time",
+          .sized = true, .concurrent = true, .run = mpw_bench_countersEach },
+        { .name = "counters", .description = "passwords of a site's counters, swept at once",
+          .sized = true, .concurrent = true, .run = mpw_bench_counters },
+        { .name = "site-card-each", .description = "all results of a site, one at a time",
+          .sized = false, .concurrent = true, .run = mpw_bench_siteCardEach },
+        { .name = "site-card", .description = "all results of a site, rendered at once",
+          .sized = false, .concurrent = true, .run = mpw_bench_siteCard },
+        { .name = "states-each", .description = "decrypt the stored login names of all sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_statesEach },
+        { .name = "states", .description = "decrypt the stored login names into a buffer",
+          .sized = true, .concurrent = true, .run = mpw_bench_states },
+        { .name = "columns", .description = "lay out the columns of the user's sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_columns },
+        { .name = "find-each", .description = "find a site by name in the user's sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_findEach },
+        { .name = "find", .description = "find a site by name in the sites' columns",
+          .sized = true, .concurrent = true, .run = mpw_bench_find },
+        { .name = "prefix-each", .description = "find sites by name prefix in the user's sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_prefixEach },
+        { .name = "prefix", .description = "find sites by name prefix in the sites' columns",
+          .sized = true, .concurrent = true, .run = mpw_bench_prefix },
+        { .name = "recent-each", .description = "sort the user's sites by last use",
+          .sized = true, .concurrent = true, .run = mpw_bench_recentEach },
+        { .name = "recent", .description = "sort the sites' columns by last use",
+          .sized = true, .concurrent = true, .run = mpw_bench_recent },
+        { .name = "search-index", .description = "index the trigrams of the user's sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_searchIndex },
+        { .name = "search", .description = "find sites by a mistyped name in the index",
+          .sized = true, .concurrent = true, .run = mpw_bench_search },
+        { .name = "base64", .description = "base64 encoding and decoding of a stored state",
+          .sized = false, .concurrent = true, .run = mpw_bench_base64 },
+        { .name = "base64-bulk", .description = "base64 encoding and decoding of 64 KiB",
+          .sized = false, .concurrent = true, .run = mpw_bench_base64Bulk },
+        { .name = "aes-state", .description = "personal password encryption and decryption",
+          .sized = false, .concurrent = true, .run = mpw_bench_aesState },
+        { .name = "mpw", .description = "master key and template password (both phases)",
+          .sized = false, .concurrent = true, .run = mpw_bench_mpw },
+        { .name = "unlock", .description = "interactive master key derivation, scheduled",
+          .sized = false, .concurrent = true, .run = mpw_bench_unlock },
+        { .name = "unlock-load", .description = "interactive master key derivation, under bulk load",
+          .sized = false, .concurrent = true, .run = mpw_bench_unlock, .load = mpw_bench_bulkLoad },
+        { .name = "unlock-bulk", .description = "bulk master key derivation, under bulk load",
+          .sized = false, .concurrent = true, .run = mpw_bench_unlockBulk, .load = mpw_bench_bulkLoad },
+        { .name = "flat-write", .description = "write a flat sites file",
+          .sized = true, .concurrent = true, .run = mpw_bench_flatWrite },
+        { .name = "flat-read", .description = "read a flat sites file",
+          .sized = true, .concurrent = true, .run = mpw_bench_flatRead },
+        { .name = "flat-metadata", .description = "read a flat sites file for listing its sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_flatMetadata },
+        { .name = "json-write", .description = "write a JSON sites file",
+          .sized = true, .concurrent = true, .run = mpw_bench_jsonWrite },
+        { .name = "json-read", .description = "read a JSON sites file",
+          .sized = true, .concurrent = true, .run = mpw_bench_jsonRead },
+        { .name = "json-metadata", .description = "read a JSON sites file for listing its sites",
+          .sized = true, .concurrent = true, .run = mpw_bench_jsonMetadata },
+        { .name = "cli", .description = "mpw invocation, end-to-end",
+          .sized = false, .concurrent = true, .run = mpw_bench_cli },
+};
+
+//// Preparation.
+
+static bool mpw_bench_prepare(MPBenchContext *context, const size_t sites) {
+
+    context->sites = sites;
+    if (!sites)
+        return true;
+
+    // A redacted user with the given amount of sites, and its serializations.
+    if (!(context->user = mpw_marshall_user( fullName, masterPassword, algorithmVersion )))
+        return false;
+    context->user->redacted = true;
+    context->user->lastUsed = (time_t)1500000000 + (time_t)sites;
+    for (size_t s = 0; s < sites; ++s) {
+        MPMarshalledSite *site = mpw_marshall_site( context->user, mpw_str( "site-%zu.example.com", s ),
+                MPResultTypeDefault, (MPCounterValue)(s % 3 + 1), algorithmVersion );
+        if (!site)
+            return false;
+        site->uses = (unsigned int)s;
+        site->lastUsed = (time_t)1500000000 + (time_t)(s * 7919 % sites);
+        site->loginType = MPResultTypeStatefulPersonal;
+        if (!(site->loginContent = mpw_siteState( context->masterKey, site->name, MPCounterValueInitial,
+                MPKeyPurposeIdentification, NULL, site->loginType, mpw_str( "user-%zu", s ), site->algorithm )))
+            return false;
+    }
+
+    MPMarshallError error = { .type = MPMarshallSuccess };
+    if (!mpw_marshall_write_provided( &context->flatSites, MPMarshallFormatFlat, context->user, mpw_bench_masterKeyProvider, &error ) ||
+        !mpw_marshall_write_provided( &context->jsonSites, MPMarshallFormatJSON, context->user, mpw_bench_masterKeyProvider, &error )) {
+        err( "Couldn't prepare sites: %s\n", error.description );
+        return false;
+    }
+    if (!mpw_marshall_columns( context->user ) || !mpw_marshall_search( context->user ))
+        return false;
+
+    return true;
+}
+
+static void mpw_bench_unprepare(MPBenchContext *context) {
+
+    mpw_marshal_free( &context->user );
+    mpw_free_strings( &context->flatSites, &context->jsonSites, NULL );
+    context->sites = 0;
+}
+
+//// Measurement.
+
+static bool mpw_bench_sample(MPBenchSamples *samples, const uint64_t ns) {
+
+    if (samples->count == samples->size) {
+        size_t size = samples->size? samples->size * 2: 1024;
+        uint64_t *ns = realloc( samples->ns, size * sizeof( *samples->ns ) );
+        if (!ns)
+            return false;
+
+        samples->ns = ns;
+        samples->size = size;
+    }
+
+    samples->ns[samples->count++] = ns;
+    return true;
+}
+
+static void *mpw_bench_thread(void *thread_) {
+
+    MPBenchThread *thread = thread_;
+    for (uint64_t start, end;
+         thread->samples.count < thread->minIterations || mpw_bench_now() < thread->deadline;) {
+        start = mpw_bench_now();
+        if (!thread->benchCase->run( thread->context )) {
+            thread->failed = true;
             break;
         }
+        end = mpw_bench_now();
 
-        free( (void *)mpw_siteResult(
-                masterKey, siteName, siteCounter, keyPurpose, keyContext, resultType, NULL, MPAlgorithmVersionCurrent ) );
-        free( (void *)masterKey );
+        if (!mpw_bench_sample( &thread->samples, end - start ))
+            break;
+    }
+
+    return NULL;
+}
+
+static void *mpw_bench_load(void *load_) {
+
+    MPBenchLoad *load = load_;
+    while (!__atomic_load_n( &load->stopped, __ATOMIC_RELAXED ))
+        if (!load->benchCase->load( load->context ))
+            break;
+
+    return NULL;
+}
 
-        if (modff( 100.f * i / iterations, &percent ) == 0)
-            fprintf( stderr, "\rmpw: iteration %d / %d (%.0f%%)..", i, iterations, percent );
+/** Stop the loads and wait for their last runs to complete. */
+static void mpw_bench_unload(MPBenchLoad loads[], const size_t loadsCount) {
+
+    for (size_t l = 0; l < loadsCount; ++l)
+        __atomic_store_n( &loads[l].stopped, true, __ATOMIC_RELAXED );
+    for (size_t l = 0; l < loadsCount; ++l)
+        pthread_join( loads[l].thread, NULL );
+}
+
+static int mpw_bench_compare(const void *a, const void *b) {
+
+    const uint64_t *nsA = a, *nsB = b;
+    return *nsA < *nsB? -1: *nsA > *nsB? 1: 0;
+}
+
+typedef struct MPBenchResult {
+    size_t iterations;
+    double seconds, opsPerSecond;
+    double mean, p50, p99, max; /* µs */
+} MPBenchResult;
+
+static bool mpw_bench_measure(
+        const MPBenchCase *benchCase, const MPBenchContext *context, const unsigned int threads,
+        const double warmup, const double duration, const size_t minIterations, MPBenchResult *result) {
+
+    // Saturate the derivation scheduler: as many loads queued as there are running.
+    size_t loadsCount = benchCase->load? 2 * mpw_derive_load().concurrency: 0;
+    MPBenchLoad loads[max( loadsCount, (size_t)1 )];
+    for (size_t l = 0; l < loadsCount; ++l) {
+        loads[l] = (MPBenchLoad){ .benchCase = benchCase, .context = context };
+        if (pthread_create( &loads[l].thread, NULL, mpw_bench_load, &loads[l] ) != 0) {
+            ftl( "Couldn't start load thread: %s\n", strerror( errno ) );
+            abort();
+        }
+    }
+    while (loadsCount && mpw_derive_load().running < mpw_derive_load().concurrency)
+        nanosleep( &(struct timespec){ .tv_nsec = 1000000 }, NULL );
+
+    // Warm up caches, page faults and lazy initialization on a single thread.
+    MPBenchThread warmupThread = {
+            .benchCase = benchCase, .context = context, .minIterations = 1,
+            .deadline = mpw_bench_now() + (uint64_t)(warmup * 1000000000)
+    };
+    mpw_bench_thread( &warmupThread );
+    free( warmupThread.samples.ns );
+    if (warmupThread.failed) {
+        mpw_bench_unload( loads, loadsCount );
+        return false;
+    }
+
+    // Measure all threads against the same deadline.
+    MPBenchThread benchThreads[threads];
+    uint64_t start = mpw_bench_now();
+    for (unsigned int t = 0; t < threads; ++t) {
+        benchThreads[t] = (MPBenchThread){
+                .benchCase = benchCase, .context = context, .minIterations = minIterations,
+                .deadline = start + (uint64_t)(duration * 1000000000)
+        };
+        if (threads == 1)
+            mpw_bench_thread( &benchThreads[t] );
+        else if (pthread_create( &benchThreads[t].thread, NULL, mpw_bench_thread, &benchThreads[t] ) != 0) {
+            ftl( "Couldn't start benchmark thread: %s\n", strerror( errno ) );
+            abort();
+        }
+    }
+    bool failed = false;
+    MPBenchSamples samples = { NULL, 0, 0 };
+    for (unsigned int t = 0; t < threads; ++t) {
+        if (threads > 1)
+            pthread_join( benchThreads[t].thread, NULL );
+        failed |= benchThreads[t].failed;
+
+        for (size_t s = 0; s < benchThreads[t].samples.count; ++s)
+            mpw_bench_sample( &samples, benchThreads[t].samples.ns[s] );
+        free( benchThreads[t].samples.ns );
+    }
+    uint64_t end = mpw_bench_now();
+    mpw_bench_unload( loads, loadsCount );
+    if (failed || !samples.count) {
+        free( samples.ns );
+        return false;
     }
-    const double mpwSpeed = mpw_showSpeed( startTime, iterations, "mpw" );
 
     // Summarize.
-    fprintf( stdout, "\n== SUMMARY ==\nOn this machine,\n" );
-    fprintf( stdout, " - mpw is %f times slower than hmac-sha-256.\n", hmacSha256Speed / mpwSpeed );
-    fprintf( stdout, " - mpw is %f times slower than bcrypt (rounds 10^%d).\n", bcrypt9Speed / mpwSpeed, bcrypt_rounds );
-    fprintf( stdout, " - scrypt is %f times slower than bcrypt (rounds 10^%d).\n", bcrypt9Speed / scryptSpeed, bcrypt_rounds );
+    qsort( samples.ns, samples.count, sizeof( *samples.ns ), mpw_bench_compare );
+    double total = 0;
+    for (size_t s = 0; s < samples.count; ++s)
+        total += samples.ns[s];
+    *result = (MPBenchResult){
+            .iterations = samples.count,
+            .seconds = (end - start) / 1000000000.,
+            .opsPerSecond = samples.count / ((end - start) / 1000000000.),
+            .mean = total / samples.count / 1000.,
+            .p50 = samples.ns[(samples.count - 1) * 50 / 100] / 1000.,
+            .p99 = samples.ns[(samples.count - 1) * 99 / 100] / 1000.,
+            .max = samples.ns[samples.count - 1] / 1000.,
+    };
+    free( samples.ns );
+
+    return true;
+}
+
+//// Command-line.
+
+static void usage() {
+
+    inf( ""
+            "  Master Password v%s - benchmark\n"
+            "--------------------------------------------------------------------------------\n"
+            "      https://masterpasswordapp.com\n\n", stringify_def( MP_VERSION ) );
+    inf( ""
+            "USAGE\n"
+            "  mpw-bench [-c case[,case...]] [-s sites[,sites...]] [-T threads[,threads...]]\n"
+            "            [-b backend[,backend...]] [-w seconds] [-d seconds] [-n iterations]\n"
+            "            [-j] [-l] [-v|-q] [-h]\n\n" );
+    inf( ""
+            "  -c cases     The cases to measure, defaults to all of them (see -l).\n\n" );
+    inf( ""
+            "  -s sites     The sizes of the sites files to measure, defaults to %s.\n\n", MP_BENCH_sizes );
+    inf( ""
+            "  -T threads   Measure each case on this many threads at once, defaults to %s.\n"
+            "               Cases that aren't thread-safe are only measured on one thread.\n\n", MP_BENCH_threads );
+    inf( ""
+            "  -b backends  Measure each case with these crypto backends, or all usable ones.\n"
+            "               Defaults to the most preferred backend usable on this host.\n"
+            "               Built-in backends:" );
+    for (const MPCryptoBackend *const *backend = mpw_crypto_backends(); *backend; ++backend)
+        inf( " %s", (*backend)->name );
+    inf( "\n\n" );
+    inf( ""
+            "  -w seconds   Warm up each case for this long before measuring it, defaults to %.1f.\n"
+            "  -d seconds   Measure each case for this long, defaults to %.1f.\n"
+            "  -n count     Measure each case at least this many times, defaults to %d.\n\n",
+            MP_BENCH_warmup, MP_BENCH_duration, MP_BENCH_iterations );
+    inf( ""
+            "  -j           Output the results as JSON.\n"
+            "  -l           List the cases.\n\n" );
+    inf( ""
+            "  -v           Increase output verbosity (can be repeated).\n"
+            "               Output above MPW_LOG_LEVEL is compiled out: this build has level %d,\n"
+            "               -vv traces need level 3 (mpw_log_level=3 ./build, or cmake -DLOG_LEVEL=3).\n"
+            "  -q           Decrease output verbosity (can be repeated).\n\n", MPW_LOG_LEVEL );
+    exit( 0 );
+}
+
+static size_t mpw_bench_values(const char *arg, unsigned long values[], const size_t valuesMax) {
+
+    size_t count = 0;
+    char *args = strdup( arg ), *remaining = args;
+    for (char *value; count < valuesMax && (value = strsep( &remaining, "," ));) {
+        char *end = NULL;
+        unsigned long number = strtoul( value, &end, 10 );
+        if (!strlen( value ) || *end) {
+            count = 0;
+            break;
+        }
+        values[count++] = number;
+    }
+    free( args );
+
+    return count;
+}
+
+static size_t mpw_bench_backends(const char *arg, const char *backends[], const size_t backendsMax) {
+
+    size_t count = 0;
+    if (!arg) {
+        backends[count++] = mpw_crypto()->name;
+        return count;
+    }
+
+    if (strcmp( arg, "all" ) == 0) {
+        for (const MPCryptoBackend *const *backend = mpw_crypto_backends(); count < backendsMax && *backend; ++backend)
+            if (mpw_crypto_select( (*backend)->name ))
+                backends[count++] = (*backend)->name;
+        return count;
+    }
+
+    char *args = strdup( arg ), *remaining = args;
+    for (char *value; count < backendsMax && (value = strsep( &remaining, "," ));) {
+        const MPCryptoBackend *const *backend = mpw_crypto_backends();
+        while (*backend && strcmp( (*backend)->name, value ) != 0)
+            ++backend;
+        if (!*backend || !mpw_crypto_select( (*backend)->name )) {
+            count = 0;
+            break;
+        }
+        backends[count++] = (*backend)->name;
+    }
+    free( args );
+
+    return count;
+}
+
+static const MPBenchCase *mpw_bench_case(const char *name, const size_t nameLength) {
+
+    for (size_t c = 0; c < sizeof( mpw_bench_cases ) / sizeof( *mpw_bench_cases ); ++c)
+        if (strlen( mpw_bench_cases[c].name ) == nameLength && strncmp( mpw_bench_cases[c].name, name, nameLength ) == 0)
+            return &mpw_bench_cases[c];
+
+    return NULL;
+}
+
+static bool mpw_bench_selected(const char *casesArg, const MPBenchCase *benchCase) {
+
+    if (!casesArg)
+        return true;
+
+    for (const char *selected = casesArg; *selected; selected += strcspn( selected, "," ) + (selected[strcspn( selected, "," )]? 1: 0))
+        if (mpw_bench_case( selected, strcspn( selected, "," ) ) == benchCase)
+            return true;
+
+    return false;
+}
+
+int main(int argc, char *const argv[]) {
+
+    const char *casesArg = NULL, *sitesArg = MP_BENCH_sizes, *threadsArg = MP_BENCH_threads, *backendsArg = NULL;
+    double warmup = MP_BENCH_warmup, duration = MP_BENCH_duration;
+    size_t minIterations = MP_BENCH_iterations;
+    bool json = false;
+
+    for (int opt; (opt = getopt( argc, argv, "c:s:T:b:w:d:n:jlvqh" )) != EOF;)
+        switch (opt) {
+            case 'c':
+                casesArg = optarg;
+                break;
+            case 's':
+                sitesArg = optarg;
+                break;
+            case 'T':
+                threadsArg = optarg;
+                break;
+            case 'b':
+                backendsArg = optarg;
+                break;
+            case 'w':
+                warmup = atof( optarg );
+                break;
+            case 'd':
+                duration = atof( optarg );
+                break;
+            case 'n':
+                minIterations = (size_t)atol( optarg );
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'l':
+                for (size_t c = 0; c < sizeof( mpw_bench_cases ) / sizeof( *mpw_bench_cases ); ++c)
+                    fprintf( stdout, "%-14s %s%s\n", mpw_bench_cases[c].name, mpw_bench_cases[c].description,
+                            mpw_bench_cases[c].sized? " (per sites file size)": "" );
+                return 0;
+            case 'v':
+                ++mpw_verbosity;
+                break;
+            case 'q':
+                --mpw_verbosity;
+                break;
+            case 'h':
+                usage();
+                break;
+            default:
+                ftl( "Unknown option: -%c\n", optopt );
+                return EX_USAGE;
+        }
+    for (const char *selected = casesArg; selected && *selected; selected += strcspn( selected, "," ) + (selected[strcspn( selected, "," )]? 1: 0))
+        if (!mpw_bench_case( selected, strcspn( selected, "," ) )) {
+            ftl( "Unknown case: %.*s\n", (int)strcspn( selected, "," ), selected );
+            return EX_USAGE;
+        }
+    unsigned long sizes[MP_BENCH_maxValues], threads[MP_BENCH_maxValues];
+    size_t sizesCount = mpw_bench_values( sitesArg, sizes, MP_BENCH_maxValues );
+    size_t threadsCount = mpw_bench_values( threadsArg, threads, MP_BENCH_maxValues );
+    if (!sizesCount) {
+        ftl( "Invalid sites file sizes: %s\n", sitesArg );
+        return EX_USAGE;
+    }
+    for (size_t t = 0; t < threadsCount; ++t)
+        if (!threads[t] || threads[t] > 1024)
+            threadsCount = 0;
+    if (!threadsCount) {
+        ftl( "Invalid thread counts: %s\n", threadsArg );
+        return EX_USAGE;
+    }
+    const char *backends[MP_BENCH_maxValues];
+    size_t backendsCount = mpw_bench_backends( backendsArg, backends, MP_BENCH_maxValues );
+    if (!backendsCount || !mpw_crypto_select( backends[0] )) {
+        ftl( "Invalid or unavailable crypto backends: %s\n", backendsArg );
+        return EX_USAGE;
+    }
+
+    // The master key for the cases that build on one.
+    MPBenchContext context = { .sites = 0 };
+    if (!(mpw_bench_preparedKey = context.masterKey = mpw_masterKey( fullName, masterPassword, algorithmVersion ))) {
+        ftl( "Could not allocate master key: %s\n", strerror( errno ) );
+        return EX_SOFTWARE;
+    }
+
+    // The mpw binary is expected next to us.
+    const char *slash = strrchr( argv[0], '/' );
+    context.mpwPath = slash? strdup( mpw_str( "%.*s/mpw", (int)(slash - argv[0]), argv[0] ) ): strdup( "./mpw" );
+
+    if (json)
+        fprintf( stdout, "{\n  \"version\": \"%s\",\n  \"warmup\": %.3f,\n  \"duration\": %.3f,\n  \"results\": [",
+                stringify_def( MP_VERSION ), warmup, duration );
+    else
+        fprintf( stdout, "%-14s %-9s %7s %7s %10s %12s %12s %12s %12s %12s\n",
+                "case", "backend", "sites", "threads", "iterations", "ops/s", "mean µs", "p50 µs", "p99 µs", "max µs" );
+
+    // Measure.
+    bool first = true, failed = false, progress = isatty( STDERR_FILENO ) && mpw_verbosity >= inf_level;
+    double scryptMean = 0, templateMean = 0, mpwMean = 0, hmacMean = 0, bcryptMean = 0;
+    for (size_t c = 0; c < sizeof( mpw_bench_cases ) / sizeof( *mpw_bench_cases ); ++c) {
+        const MPBenchCase *benchCase = &mpw_bench_cases[c];
+        if (!mpw_bench_selected( casesArg, benchCase ))
+            continue;
+        if (strcmp( benchCase->name, "cli" ) == 0 && access( context.mpwPath, X_OK ) != 0) {
+            wrn( "Skipping %s: no mpw at %s\n", benchCase->name, context.mpwPath );
+            continue;
+        }
+
+        for (size_t s = 0; s < (benchCase->sized? sizesCount: 1); ++s) {
+            if (benchCase->sized && !mpw_bench_prepare( &context, sizes[s] )) {
+                ftl( "Could not prepare %s for %lu sites.\n", benchCase->name, sizes[s] );
+                return EX_SOFTWARE;
+            }
+
+            for (size_t b = 0; b < backendsCount; ++b) {
+                // Backends are only switched between measurements, once all of a measurement's threads are joined.
+                if (!mpw_crypto_select( context.backend = backends[b] )) {
+                    err( "Crypto backend %s became unavailable.\n", backends[b] );
+                    failed = true;
+                    continue;
+                }
+
+                for (size_t t = 0; t < threadsCount; ++t) {
+                    if (threads[t] > 1 && !benchCase->concurrent)
+                        continue;
+
+                    if (progress)
+                        fprintf( stderr, "\r%s (%s): %lu sites, %lu threads..",
+                                benchCase->name, context.backend, benchCase->sized? sizes[s]: 0, threads[t] );
+                    MPBenchResult result;
+                    bool measured = mpw_bench_measure( benchCase, &context, (unsigned int)threads[t], warmup, duration, minIterations, &result );
+                    if (progress)
+                        fprintf( stderr, "\r%60s\r", "" );
+                    if (!measured) {
+                        err( "%s failed.\n", benchCase->name );
+                        failed = true;
+                        continue;
+                    }
+
+                    if (json)
+                        fprintf( stdout, "%s\n    { \"case\": \"%s\", \"backend\": \"%s\", "
+                                         "\"sites\": %zu, \"threads\": %lu, \"iterations\": %zu, "
+                                         "\"seconds\": %.6f, \"ops_per_sec\": %.3f, "
+                                         "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f }",
+                                first? "": ",", benchCase->name, context.backend, context.sites, threads[t], result.iterations,
+                                result.seconds, result.opsPerSecond, result.mean, result.p50, result.p99, result.max );
+                    else
+                        fprintf( stdout, "%-14s %-9s %7zu %7lu %10zu %12.2f %12.2f %12.2f %12.2f %12.2f\n",
+                                benchCase->name, context.backend, context.sites, threads[t], result.iterations,
+                                result.opsPerSecond, result.mean, result.p50, result.p99, result.max );
+                    fflush( stdout );
+                    first = false;
+
+                    if (b == 0 && threads[t] == 1) {
+                        if (strcmp( benchCase->name, "scrypt" ) == 0)
+                            scryptMean = result.mean;
+                        else if (strcmp( benchCase->name, "template" ) == 0)
+                            templateMean = result.mean;
+                        else if (strcmp( benchCase->name, "mpw" ) == 0)
+                            mpwMean = result.mean;
+                        else if (strcmp( benchCase->name, "hmac-sha-256" ) == 0)
+                            hmacMean = result.mean;
+                        else if (strcmp( benchCase->name, "bcrypt" ) == 0)
+                            bcryptMean = result.mean;
+                    }
+                }
+
+            }
+            mpw_crypto_select( backends[0] );
+
+            if (benchCase->sized)
+                mpw_bench_unprepare( &context );
+        }
+    }
+
+    // Summarize.
+    if (json)
+        fprintf( stdout, "\n  ]\n}\n" );
+    else if (mpwMean) {
+        fprintf( stdout, "\n== SUMMARY ==\nOn this machine,\n" );
+        if (scryptMean && templateMean)
+            fprintf( stdout, " - mpw spends %.4g%% in phase one (scrypt) and %.4g%% in phase two (site result).\n",
+                    100 * scryptMean / (scryptMean + templateMean), 100 * templateMean / (scryptMean + templateMean) );
+        if (hmacMean)
+            fprintf( stdout, " - mpw is %f times slower than hmac-sha-256.\n", mpwMean / hmacMean );
+        if (bcryptMean)
+            fprintf( stdout, " - mpw is %f times slower than bcrypt (rounds 10^9).\n", mpwMean / bcryptMean );
+        if (bcryptMean && scryptMean)
+            fprintf( stdout, " - scrypt is %f times slower than bcrypt (rounds 10^9).\n", scryptMean / bcryptMean );
+    }
+
+    mpw_free( &context.masterKey, MPMasterKeySize );
+    mpw_free_string( &context.mpwPath );
 
-    return 0;
+    return failed? EX_SOFTWARE: 0;
 }
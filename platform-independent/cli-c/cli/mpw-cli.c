@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <ctype.h>
 #include <pwd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +21,10 @@
 #include "mpw-algorithm.h"
 #include "mpw-util.h"
 #include "mpw-marshall.h"
+#include "mpw-marshall-util.h"
+#include "mpw-crypto.h"
+#include "mpw-metrics.h"
+#include "mpw-agent-util.h"
 
 #ifndef MP_VERSION
 #define MP_VERSION ?
@@ -23,6 +32,11 @@
 #define MP_ENV_fullName     "MP_FULLNAME"
 #define MP_ENV_algorithm    "MP_ALGORITHM"
 #define MP_ENV_format       "MP_FORMAT"
+/** The sorted site names next to a user's sites file, that completion searches instead of reading the sites. */
+#define MP_indexExtension   "mpsites.index"
+/** The most sites to suggest for a site name that is not found, and how much they should resemble it. */
+#define MP_suggestCount     3
+#define MP_suggestScore     0.5f
 
 static void usage() {
 
@@ -34,7 +48,11 @@ static void usage() {
             "USAGE\n"
             "  mpw [-u|-U full-name] [-m fd] [-t pw-type] [-P value] [-c counter]\n"
             "      [-a version] [-p purpose] [-C context] [-f|-F format] [-R 0|1]\n"
-            "      [-v|-q] [-h] site-name\n\n" );
+            "      [-v|-q] [-h] site-name\n"
+            "  mpw -B [-u|-U full-name] [-m fd] [options] < requests\n"
+            "  mpw -A [-u full-name] [-t pw-type] [-P value] [-c counter] [options] site-name\n"
+            "  mpw -L [-u full-name] [-f|-F format]\n"
+            "  mpw --complete prefix [-u full-name]\n\n" );
     inf( ""
             "  -u full-name Specify the full name of the user.\n"
             "               -u checks the master password against the config,\n"
@@ -96,15 +114,48 @@ static void usage() {
     inf( ""
             "  -R redacted  Whether to save the mpsites in redacted format or not.\n"
             "               Defaults to 1, redacted.\n\n" );
+    inf( ""
+            "  -B, --batch  Read site requests from standard input, one per line.\n"
+            "               Each master key is derived once and reused for all requests.\n"
+            "               A request is either tab-separated fields or a JSON object:\n"
+            "                   site-name [<tab> pw-type [<tab> counter [<tab> purpose [<tab> context]]]]\n"
+            "                   { \"site\": ..., \"type\": ..., \"counter\": ..., \"purpose\": ..., \"context\": ... }\n"
+            "               Missing fields default to -t, -c, -p and -C.\n"
+            "               Each result is written on its own line, failures as an empty line.\n\n" );
+    inf( ""
+            "  -A, --agent  Ask a running mpw-agent for the result instead of deriving the master key.\n"
+            "               The agent's socket is %s in env or mpw-agent.sock in XDG_RUNTIME_DIR.\n"
+            "               The mpsites file is not used: pass the site's parameters as options.\n\n", MP_ENV_agentSocket );
+    inf( ""
+            "  -L, --list   List the user's sites, most recently used first, one per line:\n"
+            "                   site-name <tab> pw-type <tab> counter <tab> version <tab> uses <tab> last-used\n"
+            "               Only the mpsites file is read: no master password is asked for.\n\n" );
+    inf( ""
+            "  --complete prefix\n"
+            "               List the user's site names that start with prefix, ignoring case, for shell completion.\n"
+            "               They are searched in an index that is kept next to the mpsites file.\n"
+            "               Never prompts: the full name must come from -u or %s in env.\n\n", MP_ENV_fullName );
+    inf( ""
+            "  --stats      On exit, write the time spent in each costly operation to standard error, as JSON.\n\n" );
+    inf( ""
+            "  --crypto-backend name\n"
+            "               The implementation of the cryptographic functions to use.\n"
+            "               Defaults to the first of these that works on this host:" );
+    for (const MPCryptoBackend *const *backend = mpw_crypto_backends(); *backend; ++backend)
+        inf( " %s", (*backend)->name );
+    inf( "\n\n" );
     inf( ""
             "  -v           Increase output verbosity (can be repeated).\n"
-            "  -q           Decrease output verbosity (can be repeated).\n\n" );
+            "               Output above MPW_LOG_LEVEL is compiled out: this build has level %d,\n"
+            "               -vv traces need level 3 (mpw_log_level=3 ./build, or cmake -DLOG_LEVEL=3).\n"
+            "  -q           Decrease output verbosity (can be repeated).\n\n", MPW_LOG_LEVEL );
     inf( ""
             "ENVIRONMENT\n\n"
             "  %-12s The full name of the user (see -u).\n"
             "  %-12s The default algorithm version (see -a).\n"
-            "  %-12s The default mpsites format (see -f).\n\n",
-            MP_ENV_fullName, MP_ENV_algorithm, MP_ENV_format );
+            "  %-12s The default mpsites format (see -f).\n"
+            "  %-12s The socket of a running mpw-agent (see -A).\n\n",
+            MP_ENV_fullName, MP_ENV_algorithm, MP_ENV_format, MP_ENV_agentSocket );
     exit( 0 );
 }
 
@@ -224,232 +275,130 @@ static char *mpw_read_file(FILE *file) {
            (bufOffset += (readSize = fread( buf + bufOffset, 1, blockSize, file ))) &&
            (readSize == blockSize));
 
+    // Terminate the contents, or drop them if the buffer couldn't grow to hold the terminator.
+    if (buf && bufOffset < bufSize)
+        buf[bufOffset] = '\0';
+    else
+        mpw_free( &buf, bufSize );
+
     return buf;
 }
 
-int main(const int argc, char *const argv[]) {
+/** The master keys of this run's user, derived once per algorithm version.
+ * The key of the expected algorithm is derived on a background thread while the sites file is read and parsed. */
+static struct {
+    const char *fullName, *masterPassword;
+    MPMasterKey keys[MPAlgorithmVersionLast + 1];
+    MPAlgorithmVersion pendingAlgorithm;
+    pthread_t pendingThread;
+    bool pending;
+} mpw_cli_keys;
 
-    // CLI defaults.
-    bool allowPasswordUpdate = false, sitesFormatFixed = false;
+static void *mpw_cli_masterKey_derive(void __unused *unused) {
 
-    // Read the environment.
-    const char *fullNameArg = NULL, *masterPasswordFDArg = NULL, *masterPasswordArg = NULL, *siteNameArg = NULL;
-    const char *resultTypeArg = NULL, *resultParamArg = NULL, *siteCounterArg = NULL, *algorithmVersionArg = NULL;
-    const char *keyPurposeArg = NULL, *keyContextArg = NULL, *sitesFormatArg = NULL, *sitesRedactedArg = NULL;
-    fullNameArg = mpw_getenv( MP_ENV_fullName );
-    algorithmVersionArg = mpw_getenv( MP_ENV_algorithm );
-    sitesFormatArg = mpw_getenv( MP_ENV_format );
+    mpw_cli_keys.keys[mpw_cli_keys.pendingAlgorithm] = mpw_masterKey(
+            mpw_cli_keys.fullName, mpw_cli_keys.masterPassword, mpw_cli_keys.pendingAlgorithm );
 
-    // Read the command-line options.
-    for (int opt; (opt = getopt( argc, argv, "u:U:m:M:t:P:c:a:p:C:f:F:R:vqh" )) != EOF;)
-        switch (opt) {
-            case 'u':
-                fullNameArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                allowPasswordUpdate = false;
-                break;
-            case 'U':
-                fullNameArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                allowPasswordUpdate = true;
-                break;
-            case 'm':
-                masterPasswordFDArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'M':
-                // Passing your master password via the command-line is insecure.  Testing purposes only.
-                masterPasswordArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 't':
-                resultTypeArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'P':
-                resultParamArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'c':
-                siteCounterArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'a':
-                algorithmVersionArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'p':
-                keyPurposeArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'C':
-                keyContextArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'f':
-                sitesFormatArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                sitesFormatFixed = false;
-                break;
-            case 'F':
-                sitesFormatArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                sitesFormatFixed = true;
-                break;
-            case 'R':
-                sitesRedactedArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
-                break;
-            case 'v':
-                ++mpw_verbosity;
-                break;
-            case 'q':
-                --mpw_verbosity;
-                break;
-            case 'h':
-                usage();
-                break;
-            case '?':
-                switch (optopt) {
-                    case 'u':
-                        ftl( "Missing full name to option: -%c\n", optopt );
-                        return EX_USAGE;
-                    case 't':
-                        ftl( "Missing type name to option: -%c\n", optopt );
-                        return EX_USAGE;
-                    case 'c':
-                        ftl( "Missing counter value to option: -%c\n", optopt );
-                        return EX_USAGE;
-                    default:
-                        ftl( "Unknown option: -%c\n", optopt );
-                        return EX_USAGE;
-                }
-            default:
-                ftl( "Unexpected option: %c\n", opt );
-                return EX_USAGE;
-        }
-    if (optind < argc && argv[optind])
-        siteNameArg = strdup( argv[optind] );
+    return NULL;
+}
 
-    // Determine fullName, siteName & masterPassword.
-    const char *fullName = NULL, *masterPassword = NULL, *siteName = NULL;
-    if ((!fullName || !strlen( fullName )) && fullNameArg)
-        fullName = strdup( fullNameArg );
-    while (!fullName || !strlen( fullName ))
-        fullName = mpw_getline( "Your full name:" );
-    if ((!masterPassword || !strlen( masterPassword )) && masterPasswordFDArg) {
-        FILE *masterPasswordFile = fdopen( atoi( masterPasswordFDArg ), "r" );
-        if (!masterPasswordFile)
-            wrn( "Error opening master password FD %s: %s\n", masterPasswordFDArg, strerror( errno ) );
-        else {
-            masterPassword = mpw_read_file( masterPasswordFile );
-            if (ferror( masterPasswordFile ))
-                wrn( "Error reading master password from %s: %d\n", masterPasswordFDArg, ferror( masterPasswordFile ) );
-        }
-    }
-    if ((!masterPassword || !strlen( masterPassword )) && masterPasswordArg)
-        masterPassword = strdup( masterPasswordArg );
-    while (!masterPassword || !strlen( masterPassword ))
-        masterPassword = mpw_getpass( "Your master password: " );
-    if ((!siteName || !strlen( siteName )) && siteNameArg)
-        siteName = strdup( siteNameArg );
-    while (!siteName || !strlen( siteName ))
-        siteName = mpw_getline( "Site name:" );
-    MPMarshallFormat sitesFormat = MPMarshallFormatDefault;
-    if (sitesFormatArg) {
-        sitesFormat = mpw_formatWithName( sitesFormatArg );
-        if (ERR == (int)sitesFormat) {
-            ftl( "Invalid sites format: %s\n", sitesFormatArg );
-            mpw_free_strings( &fullName, &masterPassword, &siteName, NULL );
-            return EX_USAGE;
-        }
-    }
-    MPKeyPurpose keyPurpose = MPKeyPurposeAuthentication;
-    if (keyPurposeArg) {
-        keyPurpose = mpw_purposeWithName( keyPurposeArg );
-        if (ERR == (int)keyPurpose) {
-            ftl( "Invalid purpose: %s\n", keyPurposeArg );
-            return EX_USAGE;
-        }
-    }
-    const char *keyContext = NULL;
-    if (keyContextArg)
-        keyContext = strdup( keyContextArg );
+static void mpw_cli_masterKey_prepare(const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion) {
 
-    // Find the user's sites file.
-    FILE *sitesFile = NULL;
-    const char *sitesPath = mpw_path( fullName, mpw_marshall_format_extension( sitesFormat ) );
-    if (!sitesPath || !(sitesFile = fopen( sitesPath, "r" ))) {
-        dbg( "Couldn't open configuration file:\n  %s: %s\n", sitesPath, strerror( errno ) );
+    mpw_cli_keys.fullName = strdup( fullName );
+    mpw_cli_keys.masterPassword = strdup( masterPassword );
+    mpw_cli_keys.pendingAlgorithm = algorithmVersion;
+    mpw_cli_keys.pending = mpw_cli_keys.fullName && mpw_cli_keys.masterPassword &&
+                           pthread_create( &mpw_cli_keys.pendingThread, NULL, mpw_cli_masterKey_derive, NULL ) == 0;
+    if (!mpw_cli_keys.pending)
+        dbg( "Couldn't derive master key in the background, will derive it when needed.\n" );
+}
 
-        // Try to fall back to the flat format.
-        if (!sitesFormatFixed) {
-            mpw_free_string( &sitesPath );
-            sitesPath = mpw_path( fullName, mpw_marshall_format_extension( MPMarshallFormatFlat ) );
-            if (sitesPath && (sitesFile = fopen( sitesPath, "r" )))
-                sitesFormat = MPMarshallFormatFlat;
-            else
-                dbg( "Couldn't open configuration file:\n  %s: %s\n", sitesPath, strerror( errno ) );
-        }
+static MPMasterKey mpw_cli_masterKey(const char *fullName, const char *masterPassword, const MPAlgorithmVersion algorithmVersion) {
+
+    // Keys for any other user, eg. while confirming an old master password, aren't cached.
+    if (algorithmVersion > MPAlgorithmVersionLast ||
+        !mpw_cli_keys.fullName || !fullName || strcmp( fullName, mpw_cli_keys.fullName ) != 0 ||
+        !mpw_cli_keys.masterPassword || !masterPassword || strcmp( masterPassword, mpw_cli_keys.masterPassword ) != 0)
+        return mpw_masterKey( fullName, masterPassword, algorithmVersion );
+
+    // Join the background derivation when its key is needed.
+    if (mpw_cli_keys.pending && mpw_cli_keys.pendingAlgorithm == algorithmVersion) {
+        pthread_join( mpw_cli_keys.pendingThread, NULL );
+        mpw_cli_keys.pending = false;
     }
+    if (!mpw_cli_keys.keys[algorithmVersion])
+        mpw_cli_keys.keys[algorithmVersion] = mpw_masterKey( fullName, masterPassword, algorithmVersion );
+    if (!mpw_cli_keys.keys[algorithmVersion])
+        return NULL;
 
-    // Load the user object from file.
-    MPMarshalledUser *user = NULL;
-    MPMarshalledSite *site = NULL;
-    MPMarshalledQuestion *question = NULL;
-    if (!sitesFile)
-        mpw_free_string( &sitesPath );
+    // Callers own the key they're given.
+    uint8_t *masterKey = malloc( MPMasterKeySize );
+    if (masterKey)
+        memcpy( masterKey, mpw_cli_keys.keys[algorithmVersion], MPMasterKeySize );
 
-    else {
-        // Read file.
-        char *sitesInputData = mpw_read_file( sitesFile );
-        if (ferror( sitesFile ))
-            wrn( "Error while reading configuration file:\n  %s: %d\n", sitesPath, ferror( sitesFile ) );
-        fclose( sitesFile );
+    return masterKey;
+}
 
-        // Parse file.
-        MPMarshallInfo *sitesInputInfo = mpw_marshall_read_info( sitesInputData );
-        MPMarshallFormat sitesInputFormat = sitesFormatArg? sitesFormat: sitesInputInfo->format;
-        MPMarshallError marshallError = { .type = MPMarshallSuccess };
-        mpw_marshal_info_free( &sitesInputInfo );
-        user = mpw_marshall_read( sitesInputData, sitesInputFormat, masterPassword, &marshallError );
-        if (marshallError.type == MPMarshallErrorMasterPassword) {
-            // Incorrect master password.
-            if (!allowPasswordUpdate) {
-                ftl( "Incorrect master password according to configuration:\n  %s: %s\n", sitesPath, marshallError.description );
-                mpw_marshal_free( &user );
-                mpw_free_strings( &sitesInputData, &sitesPath, &fullName, &masterPassword, &siteName, NULL );
-                return EX_DATAERR;
-            }
+static void mpw_cli_masterKey_free() {
 
-            // Update user's master password.
-            while (marshallError.type == MPMarshallErrorMasterPassword) {
-                inf( "Given master password does not match configuration.\n" );
-                inf( "To update the configuration with this new master password, first confirm the old master password.\n" );
+    if (mpw_cli_keys.pending) {
+        pthread_join( mpw_cli_keys.pendingThread, NULL );
+        mpw_cli_keys.pending = false;
+    }
+    for (MPAlgorithmVersion algorithmVersion = MPAlgorithmVersionFirst; algorithmVersion <= MPAlgorithmVersionLast; ++algorithmVersion)
+        mpw_free( &mpw_cli_keys.keys[algorithmVersion], MPMasterKeySize );
+    mpw_free_strings( &mpw_cli_keys.fullName, &mpw_cli_keys.masterPassword, NULL );
+}
 
-                const char *importMasterPassword = NULL;
-                while (!importMasterPassword || !strlen( importMasterPassword ))
-                    importMasterPassword = mpw_getpass( "Old master password: " );
+/** Point out the sites of the user whose name or URL resembles the given site name. */
+static void mpw_cli_suggest(MPMarshalledUser *user, const char *siteName) {
+
+    MPMarshalledMatch matches[MP_suggestCount];
+    size_t matched = mpw_marshall_search_query( mpw_marshall_search( user ), siteName, matches, MP_suggestCount );
+    char *suggestions = NULL;
+    for (size_t m = 0; m < matched && matches[m].score >= MP_suggestScore; ++m)
+        mpw_string_pushf( &suggestions, "%s%s", suggestions? ", ": "", user->sites[matches[m].site].name );
+    if (suggestions)
+        inf( "New site: %s, similar to: %s\n", siteName, suggestions );
+    mpw_free_string( &suggestions );
+}
 
-                mpw_marshal_free( &user );
-                user = mpw_marshall_read( sitesInputData, sitesInputFormat, importMasterPassword, &marshallError );
-                mpw_free_string( &importMasterPassword );
-            }
-            if (user) {
-                mpw_free_string( &user->masterPassword );
-                user->masterPassword = strdup( masterPassword );
-            }
-        }
-        mpw_free_string( &sitesInputData );
+static bool mpw_cli_operate(
+        MPMarshalledUser *user, const char *identicon, const char *siteName,
+        const char *resultTypeArg, const char *resultParamArg, const char *siteCounterArg, const char *algorithmVersionArg,
+        const char *keyPurposeArg, const char *keyContextArg, int *exitCode) {
 
-        if (!user || marshallError.type != MPMarshallSuccess) {
-            err( "Couldn't parse configuration file:\n  %s: %s\n", sitesPath, marshallError.description );
-            mpw_marshal_free( &user );
-            mpw_free_string( &sitesPath );
+    MPKeyPurpose keyPurpose = MPKeyPurposeAuthentication;
+    if (keyPurposeArg) {
+        keyPurpose = mpw_purposeWithName( keyPurposeArg );
+        if (keyPurpose == (MPKeyPurpose)ERR) {
+            ftl( "Invalid purpose: %s\n", keyPurposeArg );
+            *exitCode = EX_USAGE;
+            return false;
         }
     }
-    if (!user)
-        user = mpw_marshall_user( fullName, masterPassword, MPAlgorithmVersionCurrent );
-    mpw_free_strings( &fullName, &masterPassword, NULL );
+    const char *keyContext = NULL;
+    if (keyContextArg)
+        keyContext = strdup( keyContextArg );
 
     // Load the site object.
-    for (size_t s = 0; s < user->sites_count; ++s) {
-        site = &user->sites[s];
-        if (strcmp( siteName, site->name ) == 0)
-            // Found.
-            break;
-        site = NULL;
+    MPMarshalledSite *site = NULL;
+    MPMarshalledQuestion *question = NULL;
+    const MPMarshalledColumns *columns = mpw_marshall_columns( user );
+    if (!columns) {
+        ftl( "Couldn't look up site: %s\n", strerror( errno ) );
+        *exitCode = EX_SOFTWARE;
+        return false;
     }
-    if (!site)
+    size_t siteIndex;
+    if (mpw_marshall_columns_find( columns, siteName, &siteIndex ))
+        site = &user->sites[siteIndex];
+    else {
+        // A new site, unless its name is mistyped: point out the sites it resembles, outside of batch mode.
+        if (identicon)
+            mpw_cli_suggest( user, siteName );
         site = mpw_marshall_site( user, siteName, MPResultTypeDefault, MPCounterValueDefault, user->algorithm );
-    mpw_free_string( &siteName );
+    }
 
     // Load the question object.
     switch (keyPurpose) {
@@ -460,7 +409,7 @@ int main(const int argc, char *const argv[]) {
             for (size_t q = 0; q < site->questions_count; ++q) {
                 question = &site->questions[q];
                 if ((!keyContext && !strlen( question->keyword )) ||
-                    (keyContext && strcmp( keyContext, question->keyword ) != 0))
+                    (keyContext && strcmp( keyContext, question->keyword ) == 0))
                     // Found.
                     break;
                 question = NULL;
@@ -505,9 +454,9 @@ int main(const int argc, char *const argv[]) {
         resultType = mpw_typeWithName( resultTypeArg );
         if (ERR == (int)resultType) {
             ftl( "Invalid type: %s\n", resultTypeArg );
-            mpw_marshal_free( &user );
-            mpw_free_strings( &sitesPath, &resultState, &keyContext, NULL );
-            return EX_USAGE;
+            mpw_free_strings( &resultState, &keyContext, NULL );
+            *exitCode = EX_USAGE;
+            return false;
         }
 
         if (!(resultType & MPSiteFeatureAlternative)) {
@@ -528,9 +477,9 @@ int main(const int argc, char *const argv[]) {
         long long int siteCounterInt = atoll( siteCounterArg );
         if (siteCounterInt < MPCounterValueFirst || siteCounterInt > MPCounterValueLast) {
             ftl( "Invalid site counter: %s\n", siteCounterArg );
-            mpw_marshal_free( &user );
-            mpw_free_strings( &sitesPath, &resultState, &keyContext, NULL );
-            return EX_USAGE;
+            mpw_free_strings( &resultState, &keyContext, NULL );
+            *exitCode = EX_USAGE;
+            return false;
         }
 
         switch (keyPurpose) {
@@ -550,30 +499,14 @@ int main(const int argc, char *const argv[]) {
         int algorithmVersionInt = atoi( algorithmVersionArg );
         if (algorithmVersionInt < MPAlgorithmVersionFirst || algorithmVersionInt > MPAlgorithmVersionLast) {
             ftl( "Invalid algorithm version: %s\n", algorithmVersionArg );
-            mpw_marshal_free( &user );
-            mpw_free_strings( &sitesPath, &resultState, &keyContext, &resultParam, NULL );
-            return EX_USAGE;
+            mpw_free_strings( &resultState, &keyContext, &resultParam, NULL );
+            *exitCode = EX_USAGE;
+            return false;
         }
         site->algorithm = (MPAlgorithmVersion)algorithmVersionInt;
     }
-    if (sitesRedactedArg)
-        user->redacted = strcmp( sitesRedactedArg, "1" ) == 0;
-    else if (!user->redacted)
-        wrn( "Sites configuration is not redacted.  Use -R 1 to change this.\n" );
-    mpw_free_strings( &fullNameArg, &masterPasswordArg, &siteNameArg, NULL );
-    mpw_free_strings( &resultTypeArg, &resultParamArg, &siteCounterArg, &algorithmVersionArg, NULL );
-    mpw_free_strings( &keyPurposeArg, &keyContextArg, &sitesFormatArg, &sitesRedactedArg, NULL );
 
     // Operation summary.
-    const char *identicon = mpw_identicon( user->fullName, user->masterPassword );
-    if (!identicon)
-        wrn( "Couldn't determine identicon.\n" );
-    dbg( "-----------------\n" );
-    dbg( "fullName         : %s\n", user->fullName );
-    trc( "masterPassword   : %s\n", user->masterPassword );
-    dbg( "identicon        : %s\n", identicon );
-    dbg( "sitesFormat      : %s%s\n", mpw_nameForFormat( sitesFormat ), sitesFormatFixed? " (fixed)": "" );
-    dbg( "sitesPath        : %s\n", sitesPath );
     dbg( "siteName         : %s\n", site->name );
     dbg( "siteCounter      : %u\n", siteCounter );
     dbg( "resultType       : %s (%u)\n", mpw_nameForType( resultType ), resultType );
@@ -582,17 +515,16 @@ int main(const int argc, char *const argv[]) {
     dbg( "keyContext       : %s\n", keyContext );
     dbg( "algorithmVersion : %u\n", site->algorithm );
     dbg( "-----------------\n\n" );
-    inf( "%s's %s for %s:\n[ %s ]: ", user->fullName, purposeResult, site->name, identicon );
-    mpw_free_strings( &identicon, &sitesPath, NULL );
+    if (identicon)
+        inf( "%s's %s for %s:\n[ %s ]: ", user->fullName, purposeResult, site->name, identicon );
 
     // Determine master key.
-    MPMasterKey masterKey = mpw_masterKey(
-            user->fullName, user->masterPassword, site->algorithm );
+    MPMasterKey masterKey = mpw_cli_masterKey( user->fullName, user->masterPassword, site->algorithm );
     if (!masterKey) {
         ftl( "Couldn't derive master key.\n" );
-        mpw_marshal_free( &user );
         mpw_free_strings( &resultState, &keyContext, &resultParam, NULL );
-        return EX_SOFTWARE;
+        *exitCode = EX_SOFTWARE;
+        return false;
     }
 
     // Update state.
@@ -602,27 +534,24 @@ int main(const int argc, char *const argv[]) {
                 keyPurpose, keyContext, resultType, resultParam, site->algorithm ))) {
             ftl( "Couldn't encrypt site result.\n" );
             mpw_free( &masterKey, MPMasterKeySize );
-            mpw_marshal_free( &user );
             mpw_free_strings( &resultState, &keyContext, &resultParam, NULL );
-            return EX_SOFTWARE;
+            *exitCode = EX_SOFTWARE;
+            return false;
         }
         inf( "(state) %s => ", resultState );
 
         switch (keyPurpose) {
             case MPKeyPurposeAuthentication: {
-                mpw_free_string( &site->content );
-                site->content = strdup( resultState );
+                mpw_marshal_string( user, &site->content, resultState );
                 break;
             }
             case MPKeyPurposeIdentification: {
-                mpw_free_string( &site->loginContent );
-                site->loginContent = strdup( resultState );
+                mpw_marshal_string( user, &site->loginContent, resultState );
                 break;
             }
 
             case MPKeyPurposeRecovery: {
-                mpw_free_string( &question->content );
-                question->content = strdup( resultState );
+                mpw_marshal_string( user, &question->content, resultState );
                 break;
             }
         }
@@ -643,8 +572,8 @@ int main(const int argc, char *const argv[]) {
     mpw_free_strings( &keyContext, &resultParam, NULL );
     if (!result) {
         ftl( "Couldn't generate site result.\n" );
-        mpw_marshal_free( &user );
-        return EX_SOFTWARE;
+        *exitCode = EX_SOFTWARE;
+        return false;
     }
     fprintf( stdout, "%s\n", result );
     if (site->url)
@@ -655,31 +584,813 @@ int main(const int argc, char *const argv[]) {
     site->lastUsed = user->lastUsed = time( NULL );
     site->uses++;
 
-    // Update the mpsites file.
-    if (sitesFormat != MPMarshallFormatNone) {
-        if (!sitesFormatFixed)
-            sitesFormat = MPMarshallFormatDefault;
-        sitesPath = mpw_path( user->fullName, mpw_marshall_format_extension( sitesFormat ) );
+    return true;
+}
 
-        dbg( "Updating: %s (%s)\n", sitesPath, mpw_nameForFormat( sitesFormat ) );
-        if (!sitesPath || !mpw_mkdirs( sitesPath ) || !(sitesFile = fopen( sitesPath, "w" )))
-            wrn( "Couldn't create updated configuration file:\n  %s: %s\n", sitesPath, strerror( errno ) );
+static int mpw_cli_batch(
+        MPMarshalledUser *user,
+        const char *resultTypeArg, const char *siteCounterArg, const char *algorithmVersionArg,
+        const char *keyPurposeArg, const char *keyContextArg) {
+
+    // Each line of input is one request: either a JSON object or tab-separated fields.
+    // The command-line arguments provide the defaults for fields a request leaves unspecified.
+    int exitCode = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    for (ssize_t lineLength; (lineLength = getline( &line, &lineSize, stdin )) != ERR;) {
+        while (lineLength && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+            line[--lineLength] = '\0';
+        if (!lineLength || *line == '#')
+            continue;
 
+        const char *siteName = NULL, *resultType = NULL, *siteCounter = NULL, *keyPurpose = NULL, *keyContext = NULL;
+        json_object *json_request = NULL;
+        if (*line == '{') {
+            // JSON: { "site": "name", "type": "long", "counter": 1, "purpose": "auth", "context": "" }
+            enum json_tokener_error json_error = json_tokener_success;
+            if (!(json_request = json_tokener_parse_verbose( line, &json_error )) || json_error != json_tokener_success) {
+                err( "Invalid batch request: %s: %s\n", json_tokener_error_desc( json_error ), line );
+                fprintf( stdout, "\n" );
+                exitCode = EX_DATAERR;
+                continue;
+            }
+            siteName = mpw_get_json_string( json_request, "site", NULL );
+            resultType = mpw_get_json_string( json_request, "type", NULL );
+            siteCounter = mpw_get_json_string( json_request, "counter", NULL );
+            keyPurpose = mpw_get_json_string( json_request, "purpose", NULL );
+            keyContext = mpw_get_json_string( json_request, "context", NULL );
+        }
         else {
-            char *buf = NULL;
-            MPMarshallError marshallError = { .type = MPMarshallSuccess };
-            if (!mpw_marshall_write( &buf, sitesFormat, user, &marshallError ) || marshallError.type != MPMarshallSuccess)
-                wrn( "Couldn't encode updated configuration file:\n  %s: %s\n", sitesPath, marshallError.description );
-
-            else if (fwrite( buf, sizeof( char ), strlen( buf ), sitesFile ) != strlen( buf ))
-                wrn( "Error while writing updated configuration file:\n  %s: %d\n", sitesPath, ferror( sitesFile ) );
+            // Flat: site-name [<tab> type [<tab> counter [<tab> purpose [<tab> context]]]]
+            const char **fields[] = { &siteName, &resultType, &siteCounter, &keyPurpose, &keyContext };
+            char *remainingLine = line;
+            for (size_t f = 0; remainingLine && f < sizeof( fields ) / sizeof( *fields ); ++f)
+                *fields[f] = strsep( &remainingLine, "\t" );
+        }
 
-            mpw_free_string( &buf );
-            fclose( sitesFile );
+        if (!siteName || !strlen( siteName )) {
+            err( "Missing site name in batch request.\n" );
+            fprintf( stdout, "\n" );
+            exitCode = EX_DATAERR;
         }
-        mpw_free_string( &sitesPath );
+        else if (!mpw_cli_operate( user, NULL, siteName,
+                resultType && strlen( resultType )? resultType: resultTypeArg, NULL,
+                siteCounter && strlen( siteCounter )? siteCounter: siteCounterArg, algorithmVersionArg,
+                keyPurpose && strlen( keyPurpose )? keyPurpose: keyPurposeArg,
+                keyContext && strlen( keyContext )? keyContext: keyContextArg, &exitCode ))
+            // Keep the output aligned with the requests.
+            fprintf( stdout, "\n" );
+        fflush( stdout );
+
+        if (json_request)
+            json_object_put( json_request );
+    }
+    if (ferror( stdin )) {
+        err( "Error while reading batch requests: %s\n", strerror( errno ) );
+        exitCode = EX_IOERR;
+    }
+    mpw_free( &line, lineSize );
+
+    return exitCode;
+}
+
+static int mpw_cli_agent(
+        const char *fullNameArg, const char *siteNameArg,
+        const char *resultTypeArg, const char *resultParamArg, const char *siteCounterArg, const char *algorithmVersionArg,
+        const char *keyPurposeArg, const char *keyContextArg) {
+
+    // Connect to the agent and find out whose master key it holds.
+    const char *socketPath = mpw_agent_path();
+    FILE *agent = mpw_agent_connect( socketPath );
+    if (!agent) {
+        ftl( "Couldn't connect to agent:\n  %s: %s\n", socketPath?: MP_ENV_agentSocket, strerror( errno ) );
+        mpw_free_string( &socketPath );
+        return EX_UNAVAILABLE;
+    }
+    mpw_free_string( &socketPath );
+
+    const char *info[4];
+    size_t infoCount = 0, infoSize = 0;
+    char *infoReply = mpw_agent_call( agent, info, 4, &infoCount, &infoSize, "info", NULL );
+    if (!infoReply || infoCount != 4 || strcmp( info[0], "ok" ) != 0) {
+        ftl( "Couldn't identify agent: %s\n", infoReply && infoCount > 1? info[1]: "No reply." );
+        mpw_free( &infoReply, infoSize );
+        fclose( agent );
+        return EX_UNAVAILABLE;
+    }
+    if (fullNameArg && strcmp( fullNameArg, info[1] ) != 0) {
+        ftl( "The agent holds the master key of %s, not %s.\n", info[1], fullNameArg );
+        mpw_free( &infoReply, infoSize );
+        fclose( agent );
+        return EX_USAGE;
     }
-    mpw_marshal_free( &user );
+
+    // Determine the operation parameters; there is no mpsites file, only the command-line arguments and defaults.
+    MPKeyPurpose keyPurpose = MPKeyPurposeAuthentication;
+    if (keyPurposeArg) {
+        keyPurpose = mpw_purposeWithName( keyPurposeArg );
+        if (keyPurpose == (MPKeyPurpose)ERR) {
+            ftl( "Invalid purpose: %s\n", keyPurposeArg );
+            mpw_free( &infoReply, infoSize );
+            fclose( agent );
+            return EX_USAGE;
+        }
+    }
+    const char *purposeResult = NULL;
+    MPResultType resultType = MPResultTypeDefault;
+    MPCounterValue siteCounter = MPCounterValueInitial;
+    switch (keyPurpose) {
+        case MPKeyPurposeAuthentication:
+            purposeResult = "password";
+            resultType = MPResultTypeDefault;
+            siteCounter = MPCounterValueDefault;
+            break;
+        case MPKeyPurposeIdentification:
+            purposeResult = "login";
+            resultType = MPResultTypeTemplateName;
+            break;
+        case MPKeyPurposeRecovery:
+            purposeResult = "answer";
+            resultType = MPResultTypeTemplatePhrase;
+            break;
+    }
+    if (resultTypeArg) {
+        resultType = mpw_typeWithName( resultTypeArg );
+        if (ERR == (int)resultType) {
+            ftl( "Invalid type: %s\n", resultTypeArg );
+            mpw_free( &infoReply, infoSize );
+            fclose( agent );
+            return EX_USAGE;
+        }
+    }
+    if (siteCounterArg) {
+        long long int siteCounterInt = atoll( siteCounterArg );
+        if (siteCounterInt < MPCounterValueFirst || siteCounterInt > MPCounterValueLast) {
+            ftl( "Invalid site counter: %s\n", siteCounterArg );
+            mpw_free( &infoReply, infoSize );
+            fclose( agent );
+            return EX_USAGE;
+        }
+        siteCounter = (MPCounterValue)siteCounterInt;
+    }
+    MPAlgorithmVersion algorithmVersion = (MPAlgorithmVersion)atoi( info[2] );
+    if (algorithmVersionArg) {
+        int algorithmVersionInt = atoi( algorithmVersionArg );
+        if (algorithmVersionInt < MPAlgorithmVersionFirst || algorithmVersionInt > MPAlgorithmVersionLast) {
+            ftl( "Invalid algorithm version: %s\n", algorithmVersionArg );
+            mpw_free( &infoReply, infoSize );
+            fclose( agent );
+            return EX_USAGE;
+        }
+        algorithmVersion = (MPAlgorithmVersion)algorithmVersionInt;
+    }
+    const char *siteName = siteNameArg? strdup( siteNameArg ): NULL;
+    while (!siteName || !strlen( siteName ))
+        siteName = mpw_getline( "Site name:" );
+    const char *resultParam = resultParamArg? strdup( resultParamArg ): NULL;
+    inf( "%s's %s for %s:\n[ %s ]: ", info[1], purposeResult, siteName, info[3] );
+    mpw_free( &infoReply, infoSize );
+
+    char algorithm[4], counter[11], purpose[11], type[11];
+    snprintf( algorithm, sizeof( algorithm ), "%u", algorithmVersion );
+    snprintf( counter, sizeof( counter ), "%u", siteCounter );
+    snprintf( purpose, sizeof( purpose ), "%u", keyPurpose );
+    snprintf( type, sizeof( type ), "%u", resultType );
+
+    // Encrypt the state, then derive the result from it.
+    const char *reply[2];
+    size_t replyCount = 0, replySize = 0;
+    if (resultParam && resultType & MPResultTypeClassStateful) {
+        char *stateReply = mpw_agent_call( agent, reply, 2, &replyCount, &replySize, "state",
+                algorithm, siteName, counter, purpose, keyContextArg?: "", type, resultParam, NULL );
+        mpw_free_string( &resultParam );
+        if (!stateReply || replyCount != 2 || strcmp( reply[0], "ok" ) != 0) {
+            ftl( "Couldn't encrypt site result: %s\n", stateReply && replyCount > 1? reply[1]: "No reply." );
+            mpw_free( &stateReply, replySize );
+            mpw_free_string( &siteName );
+            fclose( agent );
+            return EX_SOFTWARE;
+        }
+        inf( "(state) %s => ", reply[1] );
+        resultParam = strdup( reply[1] );
+        mpw_free( &stateReply, replySize );
+    }
+
+    char *resultReply = mpw_agent_call( agent, reply, 2, &replyCount, &replySize, "result",
+            algorithm, siteName, counter, purpose, keyContextArg?: "", type, resultParam?: "", NULL );
+    mpw_free_strings( &resultParam, &siteName, NULL );
+    fclose( agent );
+    if (!resultReply || replyCount != 2 || strcmp( reply[0], "ok" ) != 0) {
+        ftl( "Couldn't generate site result: %s\n", resultReply && replyCount > 1? reply[1]: "No reply." );
+        mpw_free( &resultReply, replySize );
+        return EX_SOFTWARE;
+    }
+    fprintf( stdout, "%s\n", reply[1] );
+    mpw_free( &resultReply, replySize );
 
     return 0;
 }
+
+/** Read the user's sites file, falling back to the flat format unless the format is fixed.
+ * @param sitesFormat The format to look for, receives the format of the file that was found.
+ * @param sitesPath Receives the path of the file that was found.
+ * @return The contents of the sites file, or NULL if there is none. */
+static char *mpw_cli_read_sites(
+        const char *fullName, MPMarshallFormat *sitesFormat, const bool sitesFormatFixed, const char **sitesPath) {
+
+    // Find the user's sites file.
+    FILE *sitesFile = NULL;
+    *sitesPath = mpw_path( fullName, mpw_marshall_format_extension( *sitesFormat ) );
+    if (!*sitesPath || !(sitesFile = fopen( *sitesPath, "r" ))) {
+        dbg( "Couldn't open configuration file:\n  %s: %s\n", *sitesPath, strerror( errno ) );
+
+        // Try to fall back to the flat format.
+        if (!sitesFormatFixed) {
+            mpw_free_string( sitesPath );
+            *sitesPath = mpw_path( fullName, mpw_marshall_format_extension( MPMarshallFormatFlat ) );
+            if (*sitesPath && (sitesFile = fopen( *sitesPath, "r" )))
+                *sitesFormat = MPMarshallFormatFlat;
+            else
+                dbg( "Couldn't open configuration file:\n  %s: %s\n", *sitesPath, strerror( errno ) );
+        }
+    }
+    if (!sitesFile) {
+        mpw_free_string( sitesPath );
+        return NULL;
+    }
+
+    // Read file.
+    MPMetricTimer readTimer = mpw_metric_begin( MPMetricFileRead );
+    char *sitesInputData = mpw_read_file( sitesFile );
+    mpw_metric_end( &readTimer );
+    if (ferror( sitesFile ))
+        wrn( "Error while reading configuration file:\n  %s: %d\n", *sitesPath, ferror( sitesFile ) );
+    fclose( sitesFile );
+
+    return sitesInputData;
+}
+
+/** Read the user's sites for listing them, without a master password.
+ * @param exitCode Receives the reason the sites could not be read.
+ * @return The user, or NULL if there is no sites file or it could not be parsed. */
+static MPMarshalledUser *mpw_cli_read_metadata(
+        const char *fullName, const char *sitesFormatArg, const bool sitesFormatFixed, int *exitCode) {
+
+    MPMarshallFormat sitesFormat = MPMarshallFormatDefault;
+    if (sitesFormatArg && ERR == (int)(sitesFormat = mpw_formatWithName( sitesFormatArg ))) {
+        ftl( "Invalid sites format: %s\n", sitesFormatArg );
+        *exitCode = EX_USAGE;
+        return NULL;
+    }
+
+    const char *sitesPath = NULL;
+    char *sitesInputData = mpw_cli_read_sites( fullName, &sitesFormat, sitesFormatFixed, &sitesPath );
+    if (!sitesInputData) {
+        ftl( "No sites configuration for this user.\n" );
+        *exitCode = EX_NOINPUT;
+        return NULL;
+    }
+    MPMarshallInfo *sitesInputInfo = mpw_marshall_read_info( sitesInputData );
+    MPMarshallFormat sitesInputFormat = sitesFormatArg? sitesFormat: sitesInputInfo->format;
+    mpw_marshal_info_free( &sitesInputInfo );
+    MPMarshallError marshallError = { .type = MPMarshallSuccess };
+    MPMarshalledUser *user = mpw_marshall_read_metadata( sitesInputData, sitesInputFormat, &marshallError );
+    mpw_free_string( &sitesInputData );
+    if (!user || marshallError.type != MPMarshallSuccess) {
+        ftl( "Couldn't parse configuration file:\n  %s: %s\n", sitesPath, marshallError.description );
+        mpw_marshal_free( &user );
+        *exitCode = EX_DATAERR;
+    }
+    mpw_free_string( &sitesPath );
+
+    return user;
+}
+
+static int mpw_cli_list(
+        const char *fullNameArg, const char *sitesFormatArg, const bool sitesFormatFixed) {
+
+    // Only the structure of the sites file is read: there is no master password to ask for or master key to derive.
+    const char *fullName = fullNameArg && strlen( fullNameArg )? strdup( fullNameArg ): NULL;
+    while (!fullName || !strlen( fullName ))
+        fullName = mpw_getline( "Your full name:" );
+    int exitCode = EX_OK;
+    MPMarshalledUser *user = mpw_cli_read_metadata( fullName, sitesFormatArg, sitesFormatFixed, &exitCode );
+    mpw_free_string( &fullName );
+    if (!user)
+        return exitCode;
+
+    // One site per line, most recently used first: name, type, counter, algorithm, uses, last used.
+    const MPMarshalledColumns *columns = mpw_marshall_columns( user );
+    size_t *sites = columns? malloc( columns->count * sizeof( size_t ) ): NULL;
+    if (!columns || (columns->count && !sites) || !mpw_marshall_columns_recent( columns, sites )) {
+        ftl( "Couldn't order the user's sites: %s\n", strerror( errno ) );
+        free( sites );
+        mpw_marshal_free( &user );
+        return EX_SOFTWARE;
+    }
+    for (size_t s = 0; s < columns->count; ++s) {
+        const size_t site = sites[s];
+        char dateString[21] = "";
+        strftime( dateString, sizeof( dateString ), "%FT%TZ", gmtime( &columns->lastUsed[site] ) );
+        fprintf( stdout, "%s\t%s\t%u\t%u\t%u\t%s\n", columns->names + columns->nameOffsets[site],
+                mpw_nameForType( columns->types[site] ), columns->counters[site], columns->algorithms[site],
+                columns->uses[site], dateString );
+    }
+    free( sites );
+    mpw_marshal_free( &user );
+
+    return EX_OK;
+}
+
+/** Compare two site names for the completion index, ignoring the case of ASCII letters like completion does.
+ * @return <0, 0 or >0 if a sorts before, with or after b.  A name sorts after the names it starts with. */
+static int mpw_cli_index_compare(const char *a, const size_t aSize, const char *b, const size_t bSize) {
+
+    for (size_t c = 0; c < aSize && c < bSize; ++c) {
+        int difference = tolower( (unsigned char)a[c] ) - tolower( (unsigned char)b[c] );
+        if (difference)
+            return difference;
+    }
+
+    return (aSize > bSize) - (aSize < bSize);
+}
+
+static int mpw_cli_index_sort(const void *a, const void *b) {
+
+    const char *aName = *(const char **)a, *bName = *(const char **)b;
+    return mpw_cli_index_compare( aName, strlen( aName ), bName, strlen( bName ) ) ?: strcmp( aName, bName );
+}
+
+/** Lay out the completion index of the user's sites: their names, sorted and one per line.
+ * @return A new buffer of indexSize bytes, or NULL if an error occurred. */
+static char *mpw_cli_index(
+        MPMarshalledUser *user, size_t *indexSize) {
+
+    const MPMarshalledColumns *columns = mpw_marshall_columns( user );
+    const char **names = columns? calloc( columns->count?: 1, sizeof( *names ) ): NULL;
+    if (!names)
+        return NULL;
+
+    // Names that would span lines can't be completed.
+    size_t n = 0;
+    *indexSize = 0;
+    for (size_t s = 0; s < columns->count; ++s) {
+        const char *name = columns->names + columns->nameOffsets[s];
+        if (!strchr( name, '\n' )) {
+            names[n++] = name;
+            *indexSize += strlen( name ) + 1;
+        }
+    }
+    qsort( names, n, sizeof( *names ), mpw_cli_index_sort );
+
+    char *index = malloc( *indexSize?: 1 ), *position = index;
+    for (size_t i = 0; index && i < n; ++i) {
+        size_t nameSize = strlen( names[i] );
+        memcpy( position, names[i], nameSize );
+        position += nameSize;
+        *position++ = '\n';
+    }
+    free( names );
+
+    return index;
+}
+
+/** Replace the completion index next to the user's sites file.
+ * @return false if the index could not be written. */
+static bool mpw_cli_index_write(
+        const char *fullName, const char *index, const size_t indexSize) {
+
+    // Write a new index and move it in place, so completion never reads half of one.
+    const char *indexPath = mpw_path( fullName, MP_indexExtension );
+    const char *indexTemp = indexPath? strdup( mpw_str( "%s.new", indexPath ) ): NULL;
+    FILE *indexFile = indexTemp && mpw_mkdirs( indexTemp )? fopen( indexTemp, "w" ): NULL;
+    bool success = indexFile && fwrite( index, 1, indexSize, indexFile ) == indexSize;
+    if (indexFile)
+        success &= fclose( indexFile ) == 0;
+    success = success && rename( indexTemp, indexPath ) == 0;
+    if (!success)
+        wrn( "Couldn't write completion index:\n  %s: %s\n", indexPath, strerror( errno ) );
+    if (!success && indexFile)
+        unlink( indexTemp );
+    mpw_free_strings( &indexPath, &indexTemp, NULL );
+
+    return success;
+}
+
+/** Write the names in the completion index that start with the given prefix, ignoring the case of ASCII letters.
+ * The lines of the index are binary searched for the first match, the matches follow it.
+ * @return The amount of names written. */
+static size_t mpw_cli_index_complete(
+        const char *index, const size_t indexSize, const char *prefix) {
+
+    const size_t prefixSize = strlen( prefix );
+    const char *end = index + indexSize, *low = index, *high = end;
+    while (low < high) {
+        const char *line = low + (high - low) / 2;
+        while (line > low && line[-1] != '\n')
+            --line;
+        const char *lineEnd = memchr( line, '\n', (size_t)(end - line) ) ?: end;
+
+        // Names that start with the prefix don't sort before it.
+        if (mpw_cli_index_compare( line, (size_t)(lineEnd - line), prefix, prefixSize ) < 0)
+            low = min( lineEnd + 1, end );
+        else
+            high = line;
+    }
+
+    size_t matches = 0;
+    for (const char *line = low, *lineEnd; line < end; line = lineEnd + 1, ++matches) {
+        lineEnd = memchr( line, '\n', (size_t)(end - line) ) ?: end;
+        if ((size_t)(lineEnd - line) < prefixSize || mpw_cli_index_compare( line, prefixSize, prefix, prefixSize ) != 0)
+            break;
+        fwrite( line, 1, (size_t)(lineEnd - line), stdout );
+        fputc( '\n', stdout );
+    }
+
+    return matches;
+}
+
+/** @return true if the file of the status a was modified no earlier than that of b, at the file system's timestamp resolution. */
+static bool mpw_cli_modified_since(const struct stat *a, const struct stat *b) {
+
+#if defined(__APPLE__)
+    const struct timespec aTime = a->st_mtimespec, bTime = b->st_mtimespec;
+#else
+    const struct timespec aTime = a->st_mtim, bTime = b->st_mtim;
+#endif
+    return aTime.tv_sec > bTime.tv_sec || (aTime.tv_sec == bTime.tv_sec && aTime.tv_nsec >= bTime.tv_nsec);
+}
+
+static int mpw_cli_complete(
+        const char *fullNameArg, const char *prefix) {
+
+    // Completion can't prompt for the full name, let alone the master password.
+    if (!fullNameArg || !strlen( fullNameArg ))
+        return EX_USAGE;
+
+    // The index is rebuilt when a sites file has changed since it was written, eg. by another application.
+    const char *indexPath = mpw_path( fullNameArg, MP_indexExtension );
+    struct stat indexStat, sitesStat;
+    bool indexCurrent = indexPath && stat( indexPath, &indexStat ) == 0;
+    const MPMarshallFormat formats[] = { MPMarshallFormatFlat, MPMarshallFormatJSON };
+    for (size_t f = 0; indexCurrent && f < sizeof( formats ) / sizeof( *formats ); ++f) {
+        const char *sitesPath = mpw_path( fullNameArg, mpw_marshall_format_extension( formats[f] ) );
+        if (sitesPath && stat( sitesPath, &sitesStat ) == 0 && mpw_cli_modified_since( &sitesStat, &indexStat ))
+            indexCurrent = false;
+        mpw_free_string( &sitesPath );
+    }
+
+    int indexFD = indexCurrent? open( indexPath, O_RDONLY ): ERR;
+    mpw_free_string( &indexPath );
+    if (indexFD != ERR) {
+        const size_t indexSize = (size_t)indexStat.st_size;
+        const char *index = indexSize? mmap( NULL, indexSize, PROT_READ, MAP_PRIVATE, indexFD, 0 ): NULL;
+        close( indexFD );
+        if (index != MAP_FAILED) {
+            mpw_cli_index_complete( index, indexSize, prefix );
+            if (index)
+                munmap( (void *)index, indexSize );
+            return EX_OK;
+        }
+    }
+
+    // Without a current index, read the structure of the sites file and write a new one.
+    int exitCode = EX_OK;
+    MPMarshalledUser *user = mpw_cli_read_metadata( fullNameArg, NULL, false, &exitCode );
+    if (!user)
+        return exitCode;
+    size_t indexSize = 0;
+    char *index = mpw_cli_index( user, &indexSize );
+    mpw_marshal_free( &user );
+    if (!index) {
+        ftl( "Couldn't lay out completion index: %s\n", strerror( errno ) );
+        return EX_SOFTWARE;
+    }
+    mpw_cli_index_write( fullNameArg, index, indexSize );
+    mpw_cli_index_complete( index, indexSize, prefix );
+    free( index );
+
+    return EX_OK;
+}
+
+static void mpw_cli_stats() {
+
+    MPMetricsSnapshot snapshot = mpw_metrics_snapshot();
+    const char *json = mpw_metrics_json( &snapshot );
+    if (json)
+        fputs( json, stderr );
+    mpw_free_string( &json );
+}
+
+int main(const int argc, char *const argv[]) {
+
+    // CLI defaults.
+    bool allowPasswordUpdate = false, sitesFormatFixed = false, batch = false, agent = false, list = false;
+    int stats = false;
+
+    // Read the environment.
+    const char *fullNameArg = NULL, *masterPasswordFDArg = NULL, *masterPasswordArg = NULL, *siteNameArg = NULL;
+    const char *resultTypeArg = NULL, *resultParamArg = NULL, *siteCounterArg = NULL, *algorithmVersionArg = NULL;
+    const char *keyPurposeArg = NULL, *keyContextArg = NULL, *sitesFormatArg = NULL, *sitesRedactedArg = NULL;
+    const char *cryptoBackendArg = NULL, *completeArg = NULL;
+    fullNameArg = mpw_getenv( MP_ENV_fullName );
+    algorithmVersionArg = mpw_getenv( MP_ENV_algorithm );
+    sitesFormatArg = mpw_getenv( MP_ENV_format );
+
+    // Read the command-line options.
+    enum {
+        optionCryptoBackend = 0x100,
+        optionComplete,
+    };
+    const struct option longOptions[] = {
+            { "batch", no_argument, NULL, 'B' },
+            { "agent", no_argument, NULL, 'A' },
+            { "list",  no_argument, NULL, 'L' },
+            { "stats", no_argument, &stats, true },
+            { "crypto-backend", required_argument, NULL, optionCryptoBackend },
+            { "complete", required_argument, NULL, optionComplete },
+            { "help",  no_argument, NULL, 'h' },
+            { NULL, 0,              NULL, 0 },
+    };
+    for (int opt; (opt = getopt_long( argc, argv, "u:U:m:M:t:P:c:a:p:C:f:F:R:BALvqh", longOptions, NULL )) != EOF;)
+        switch (opt) {
+            case 'u':
+                fullNameArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                allowPasswordUpdate = false;
+                break;
+            case 'U':
+                fullNameArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                allowPasswordUpdate = true;
+                break;
+            case 'm':
+                masterPasswordFDArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'M':
+                // Passing your master password via the command-line is insecure.  Testing purposes only.
+                masterPasswordArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 't':
+                resultTypeArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'P':
+                resultParamArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'c':
+                siteCounterArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'a':
+                algorithmVersionArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'p':
+                keyPurposeArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'C':
+                keyContextArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'f':
+                sitesFormatArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                sitesFormatFixed = false;
+                break;
+            case 'F':
+                sitesFormatArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                sitesFormatFixed = true;
+                break;
+            case 'R':
+                sitesRedactedArg = optarg && strlen( optarg )? strdup( optarg ): NULL;
+                break;
+            case 'B':
+                batch = true;
+                break;
+            case 'A':
+                agent = true;
+                break;
+            case 'L':
+                list = true;
+                break;
+            case 'v':
+                ++mpw_verbosity;
+                break;
+            case 'q':
+                --mpw_verbosity;
+                break;
+            case 'h':
+                usage();
+                break;
+            case optionCryptoBackend:
+                cryptoBackendArg = optarg;
+                break;
+            case optionComplete:
+                completeArg = optarg;
+                break;
+            case 0:
+                break;
+            case '?':
+                switch (optopt) {
+                    case 'u':
+                        ftl( "Missing full name to option: -%c\n", optopt );
+                        return EX_USAGE;
+                    case 't':
+                        ftl( "Missing type name to option: -%c\n", optopt );
+                        return EX_USAGE;
+                    case 'c':
+                        ftl( "Missing counter value to option: -%c\n", optopt );
+                        return EX_USAGE;
+                    default:
+                        ftl( "Unknown option: -%c\n", optopt );
+                        return EX_USAGE;
+                }
+            default:
+                ftl( "Unexpected option: %c\n", opt );
+                return EX_USAGE;
+        }
+    if (optind < argc && argv[optind])
+        siteNameArg = strdup( argv[optind] );
+    if (stats)
+        atexit( mpw_cli_stats );
+    if (cryptoBackendArg && !mpw_crypto_select( cryptoBackendArg )) {
+        ftl( "Crypto backend is not available on this host: %s\n", cryptoBackendArg );
+        return EX_USAGE;
+    }
+    if (agent)
+        return mpw_cli_agent( fullNameArg, siteNameArg,
+                resultTypeArg, resultParamArg, siteCounterArg, algorithmVersionArg, keyPurposeArg, keyContextArg );
+    if (list)
+        return mpw_cli_list( fullNameArg, sitesFormatArg, sitesFormatFixed );
+    if (completeArg)
+        return mpw_cli_complete( fullNameArg, completeArg );
+
+    // Determine fullName, siteName & masterPassword.
+    const char *fullName = NULL, *masterPassword = NULL, *siteName = NULL;
+    if ((!fullName || !strlen( fullName )) && fullNameArg)
+        fullName = strdup( fullNameArg );
+    if (batch && (!fullName || !strlen( fullName ))) {
+        // Standard input carries the batch requests.
+        ftl( "Batch mode needs the full name from -u or %s.\n", MP_ENV_fullName );
+        return EX_USAGE;
+    }
+    while (!fullName || !strlen( fullName ))
+        fullName = mpw_getline( "Your full name:" );
+    if ((!masterPassword || !strlen( masterPassword )) && masterPasswordFDArg) {
+        FILE *masterPasswordFile = fdopen( atoi( masterPasswordFDArg ), "r" );
+        if (!masterPasswordFile)
+            wrn( "Error opening master password FD %s: %s\n", masterPasswordFDArg, strerror( errno ) );
+        else {
+            masterPassword = mpw_read_file( masterPasswordFile );
+            if (ferror( masterPasswordFile ))
+                wrn( "Error reading master password from %s: %d\n", masterPasswordFDArg, ferror( masterPasswordFile ) );
+        }
+    }
+    if ((!masterPassword || !strlen( masterPassword )) && masterPasswordArg)
+        masterPassword = strdup( masterPasswordArg );
+    while (!masterPassword || !strlen( masterPassword ))
+        masterPassword = mpw_getpass( "Your master password: " );
+
+    // Start deriving the master key of the expected algorithm, it will be needed once the sites file is read.
+    int expectedAlgorithm = algorithmVersionArg? atoi( algorithmVersionArg ): MPAlgorithmVersionCurrent;
+    if (expectedAlgorithm < MPAlgorithmVersionFirst || expectedAlgorithm > MPAlgorithmVersionLast)
+        expectedAlgorithm = MPAlgorithmVersionCurrent;
+    mpw_cli_masterKey_prepare( fullName, masterPassword, (MPAlgorithmVersion)expectedAlgorithm );
+
+    if ((!siteName || !strlen( siteName )) && siteNameArg)
+        siteName = strdup( siteNameArg );
+    while (!batch && (!siteName || !strlen( siteName )))
+        siteName = mpw_getline( "Site name:" );
+    MPMarshallFormat sitesFormat = MPMarshallFormatDefault;
+    if (sitesFormatArg) {
+        sitesFormat = mpw_formatWithName( sitesFormatArg );
+        if (ERR == (int)sitesFormat) {
+            ftl( "Invalid sites format: %s\n", sitesFormatArg );
+            mpw_cli_masterKey_free();
+            mpw_free_strings( &fullName, &masterPassword, &siteName, NULL );
+            return EX_USAGE;
+        }
+    }
+
+    // Load the user object from file.
+    MPMarshalledUser *user = NULL;
+    const char *sitesPath = NULL;
+    char *sitesInputData = mpw_cli_read_sites( fullName, &sitesFormat, sitesFormatFixed, &sitesPath );
+    if (sitesInputData) {
+        // Parse file.
+        MPMarshallInfo *sitesInputInfo = mpw_marshall_read_info( sitesInputData );
+        MPMarshallFormat sitesInputFormat = sitesFormatArg? sitesFormat: sitesInputInfo->format;
+        MPMarshallError marshallError = { .type = MPMarshallSuccess };
+        mpw_marshal_info_free( &sitesInputInfo );
+        user = mpw_marshall_read_provided( sitesInputData, sitesInputFormat, masterPassword, mpw_cli_masterKey, &marshallError );
+        if (marshallError.type == MPMarshallErrorMasterPassword) {
+            // Incorrect master password.
+            if (!allowPasswordUpdate) {
+                ftl( "Incorrect master password according to configuration:\n  %s: %s\n", sitesPath, marshallError.description );
+                mpw_marshal_free( &user );
+                mpw_cli_masterKey_free();
+                mpw_free_strings( &sitesInputData, &sitesPath, &fullName, &masterPassword, &siteName, NULL );
+                return EX_DATAERR;
+            }
+
+            // Update user's master password.
+            while (marshallError.type == MPMarshallErrorMasterPassword) {
+                inf( "Given master password does not match configuration.\n" );
+                inf( "To update the configuration with this new master password, first confirm the old master password.\n" );
+
+                const char *importMasterPassword = NULL;
+                while (!importMasterPassword || !strlen( importMasterPassword ))
+                    importMasterPassword = mpw_getpass( "Old master password: " );
+
+                mpw_marshal_free( &user );
+                user = mpw_marshall_read( sitesInputData, sitesInputFormat, importMasterPassword, &marshallError );
+                mpw_free_string( &importMasterPassword );
+            }
+            if (user) {
+                mpw_marshal_string( user, &user->masterPassword, masterPassword );
+            }
+        }
+        mpw_free_string( &sitesInputData );
+
+        if (!user || marshallError.type != MPMarshallSuccess) {
+            err( "Couldn't parse configuration file:\n  %s: %s\n", sitesPath, marshallError.description );
+            mpw_marshal_free( &user );
+            mpw_free_string( &sitesPath );
+        }
+    }
+    if (!user)
+        user = mpw_marshall_user( fullName, masterPassword, MPAlgorithmVersionCurrent );
+    mpw_free_strings( &fullName, &masterPassword, NULL );
+
+    if (sitesRedactedArg)
+        user->redacted = strcmp( sitesRedactedArg, "1" ) == 0;
+    else if (!user->redacted)
+        wrn( "Sites configuration is not redacted.  Use -R 1 to change this.\n" );
+
+    // Operation summary.
+    const char *identicon = mpw_identicon( user->fullName, user->masterPassword );
+    if (!identicon)
+        wrn( "Couldn't determine identicon.\n" );
+    dbg( "-----------------\n" );
+    dbg( "fullName         : %s\n", user->fullName );
+    trc( "masterPassword   : %s\n", user->masterPassword );
+    dbg( "identicon        : %s\n", identicon );
+    dbg( "sitesFormat      : %s%s\n", mpw_nameForFormat( sitesFormat ), sitesFormatFixed? " (fixed)": "" );
+    dbg( "sitesPath        : %s\n", sitesPath );
+    mpw_free_string( &sitesPath );
+
+    // Perform the operations.
+    int exitCode = 0;
+    if (batch)
+        exitCode = mpw_cli_batch( user,
+                resultTypeArg, siteCounterArg, algorithmVersionArg, keyPurposeArg, keyContextArg );
+    else
+        mpw_cli_operate( user, identicon?: "", siteName,
+                resultTypeArg, resultParamArg, siteCounterArg, algorithmVersionArg, keyPurposeArg, keyContextArg, &exitCode );
+    mpw_free_strings( &identicon, &siteName, NULL );
+    mpw_free_strings( &fullNameArg, &masterPasswordArg, &siteNameArg, NULL );
+    mpw_free_strings( &resultTypeArg, &resultParamArg, &siteCounterArg, &algorithmVersionArg, NULL );
+    mpw_free_strings( &keyPurposeArg, &keyContextArg, &sitesFormatArg, &sitesRedactedArg, NULL );
+    if (exitCode && !batch) {
+        mpw_cli_masterKey_free();
+        mpw_marshal_free( &user );
+        return exitCode;
+    }
+
+    // Update the mpsites file.
+    if (sitesFormat != MPMarshallFormatNone) {
+        if (!sitesFormatFixed)
+            sitesFormat = MPMarshallFormatDefault;
+        sitesPath = mpw_path( user->fullName, mpw_marshall_format_extension( sitesFormat ) );
+
+        dbg( "Updating: %s (%s)\n", sitesPath, mpw_nameForFormat( sitesFormat ) );
+        FILE *sitesFile = NULL;
+        if (!sitesPath || !mpw_mkdirs( sitesPath ) || !(sitesFile = fopen( sitesPath, "w" )))
+            wrn( "Couldn't create updated configuration file:\n  %s: %s\n", sitesPath, strerror( errno ) );
+
+        else {
+            char *buf = NULL;
+            MPMarshallError marshallError = { .type = MPMarshallSuccess };
+            if (!mpw_marshall_write_provided( &buf, sitesFormat, user, mpw_cli_masterKey, &marshallError ) || marshallError.type != MPMarshallSuccess)
+                wrn( "Couldn't encode updated configuration file:\n  %s: %s\n", sitesPath, marshallError.description );
+
+            else {
+                MPMetricTimer writeTimer = mpw_metric_begin( MPMetricFileWrite );
+                if (fwrite( buf, sizeof( char ), strlen( buf ), sitesFile ) != strlen( buf ))
+                    wrn( "Error while writing updated configuration file:\n  %s: %d\n", sitesPath, ferror( sitesFile ) );
+                mpw_metric_end( &writeTimer );
+            }
+
+            mpw_free_string( &buf );
+            fclose( sitesFile );
+
+            // Keep the completion index in step with the sites file.
+            size_t indexSize = 0;
+            char *index = mpw_cli_index( user, &indexSize );
+            if (!index)
+                wrn( "Couldn't lay out completion index: %s\n", strerror( errno ) );
+            else
+                mpw_cli_index_write( user->fullName, index, indexSize );
+            free( index );
+        }
+        mpw_free_string( &sitesPath );
+    }
+    mpw_cli_masterKey_free();
+    mpw_marshal_free( &user );
+
+    return exitCode;
+}
@@ -1,88 +1,1367 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 #define ftl(...) do { fprintf( stderr, __VA_ARGS__ ); exit(2); } while (0)
 
 #include "mpw-algorithm.h"
 #include "mpw-util.h"
+#include "mpw-crypto.h"
+#include "mpw-metrics.h"
+#include "mpw-derive.h"
+#include "mpw-marshall.h"
 
 #include "mpw-tests-util.h"
 
-int main(int argc, char *const argv[]) {
+/** A master key shared by all test cases with the same fullName, masterPassword and algorithm. */
+typedef struct MPTestMasterKey {
+    xmlChar *fullName;
+    xmlChar *masterPassword;
+    MPAlgorithmVersion algorithm;
 
-    int failedTests = 0;
+    MPMasterKey masterKey;
+    double seconds;
+} MPTestMasterKey;
 
-    xmlNodePtr tests = xmlDocGetRootElement( xmlParseFile( "mpw_tests.xml" ) );
-    if (!tests) {
-        ftl( "Couldn't find test case: mpw_tests.xml\n" );
-        abort();
+typedef struct MPTestCase {
+    xmlChar *id;
+    MPAlgorithmVersion algorithm;
+    xmlChar *siteName;
+    MPCounterValue siteCounter;
+    MPResultType resultType;
+    MPKeyPurpose keyPurpose;
+    xmlChar *keyContext;
+    xmlChar *result;
+    bool abstract;
+    size_t masterKey;
+
+    const char *sitePassword;
+    double seconds;
+} MPTestCase;
+
+typedef struct MPTestRun {
+    MPTestMasterKey *masterKeys;
+    size_t masterKeysCount;
+    MPTestCase *cases;
+    size_t casesCount;
+
+    size_t nextMasterKey;
+    size_t nextCase;
+} MPTestRun;
+
+static double mpw_tests_now() {
+
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+}
+
+static size_t mpw_tests_masterKey(MPTestRun *run, xmlChar *fullName, xmlChar *masterPassword, MPAlgorithmVersion algorithm) {
+
+    for (size_t k = 0; k < run->masterKeysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        if (masterKey->algorithm == algorithm &&
+            xmlStrcmp( masterKey->fullName, fullName ) == 0 && xmlStrcmp( masterKey->masterPassword, masterPassword ) == 0) {
+            xmlFree( fullName );
+            xmlFree( masterPassword );
+            return k;
+        }
     }
 
-    for (xmlNodePtr testCase = tests->children; testCase; testCase = testCase->next) {
-        if (testCase->type != XML_ELEMENT_NODE || xmlStrcmp( testCase->name, BAD_CAST "case" ) != 0)
+    if (!mpw_realloc( &run->masterKeys, NULL, sizeof( *run->masterKeys ) * (run->masterKeysCount + 1) ))
+        ftl( "Couldn't allocate master keys.\n" );
+    run->masterKeys[run->masterKeysCount] =
+            (MPTestMasterKey){ .fullName = fullName, .masterPassword = masterPassword, .algorithm = algorithm };
+
+    return run->masterKeysCount++;
+}
+
+static void *mpw_tests_deriveMasterKeys(void *run_) {
+
+    MPTestRun *run = run_;
+    for (size_t k; (k = __atomic_fetch_add( &run->nextMasterKey, 1, __ATOMIC_RELAXED )) < run->masterKeysCount;) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+
+        double start = mpw_tests_now();
+        masterKey->masterKey = mpw_masterKey(
+                (char *)masterKey->fullName, (char *)masterKey->masterPassword, masterKey->algorithm );
+        masterKey->seconds = mpw_tests_now() - start;
+    }
+
+    return NULL;
+}
+
+static void *mpw_tests_runCases(void *run_) {
+
+    MPTestRun *run = run_;
+    for (size_t c; (c = __atomic_fetch_add( &run->nextCase, 1, __ATOMIC_RELAXED )) < run->casesCount;) {
+        MPTestCase *testCase = &run->cases[c];
+        MPMasterKey masterKey = testCase->abstract? NULL: run->masterKeys[testCase->masterKey].masterKey;
+        if (!masterKey)
             continue;
 
-        // Read in the test case.
-        xmlChar *id = mpw_xmlTestCaseString( testCase, "id" );
-        MPAlgorithmVersion algorithm = (MPAlgorithmVersion)mpw_xmlTestCaseInteger( testCase, "algorithm" );
-        xmlChar *fullName = mpw_xmlTestCaseString( testCase, "fullName" );
-        xmlChar *masterPassword = mpw_xmlTestCaseString( testCase, "masterPassword" );
-        xmlChar *keyID = mpw_xmlTestCaseString( testCase, "keyID" );
-        xmlChar *siteName = mpw_xmlTestCaseString( testCase, "siteName" );
-        MPCounterValue siteCounter = (MPCounterValue)mpw_xmlTestCaseInteger( testCase, "siteCounter" );
-        xmlChar *resultTypeString = mpw_xmlTestCaseString( testCase, "resultType" );
-        xmlChar *keyPurposeString = mpw_xmlTestCaseString( testCase, "keyPurpose" );
-        xmlChar *keyContext = mpw_xmlTestCaseString( testCase, "keyContext" );
-        xmlChar *result = mpw_xmlTestCaseString( testCase, "result" );
-
-        MPResultType resultType = mpw_typeWithName( (char *)resultTypeString );
-        MPKeyPurpose keyPurpose = mpw_purposeWithName( (char *)keyPurposeString );
-
-        // Run the test case.
-        fprintf( stdout, "test case %s... ", id );
-        if (!xmlStrlen( result )) {
-            fprintf( stdout, "abstract.\n" );
+        double start = mpw_tests_now();
+        testCase->sitePassword = mpw_siteResult(
+                masterKey, (char *)testCase->siteName, testCase->siteCounter,
+                testCase->keyPurpose, (char *)testCase->keyContext, testCase->resultType, NULL, testCase->algorithm );
+        testCase->seconds = mpw_tests_now() - start;
+    }
+
+    return NULL;
+}
+
+/** Derive the site keys of each master key's cases in one batch and compare them with the site keys derived one at a time.
+ * @return The amount of cases whose batched site key is wrong. */
+static int mpw_tests_batchSiteKeys(MPTestRun *run) {
+
+    int failedCases = 0;
+    for (size_t k = 0; k < run->masterKeysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        if (!masterKey->masterKey)
             continue;
+
+        size_t count = 0;
+        MPSiteKeyParams *siteParams = NULL;
+        MPTestCase **testCases = NULL;
+        for (size_t c = 0; c < run->casesCount; ++c) {
+            MPTestCase *testCase = &run->cases[c];
+            if (testCase->abstract || testCase->masterKey != k)
+                continue;
+
+            if (!mpw_realloc( &siteParams, NULL, sizeof( *siteParams ) * (count + 1) ) ||
+                !mpw_realloc( &testCases, NULL, sizeof( *testCases ) * (count + 1) ))
+                ftl( "Couldn't allocate site key parameters.\n" );
+            testCases[count] = testCase;
+            siteParams[count++] = (MPSiteKeyParams){
+                    .siteName = (char *)testCase->siteName, .siteCounter = testCase->siteCounter,
+                    .keyPurpose = testCase->keyPurpose, .keyContext = (char *)testCase->keyContext,
+                    .algorithmVersion = testCase->algorithm,
+            };
         }
 
-        // 1. calculate the master key.
-        MPMasterKey masterKey = mpw_masterKey(
-                (char *)fullName, (char *)masterPassword, algorithm );
-        if (!masterKey) {
-            ftl( "Couldn't derive master key.\n" );
+        uint8_t (*siteKeys)[MPSiteKeySize] = calloc( count, sizeof( *siteKeys ) );
+        bool batched = siteKeys && mpw_siteKeys_batch( masterKey->masterKey, siteParams, count, siteKeys );
+        int failedKeys = 0;
+        for (size_t s = 0; s < count; ++s) {
+            MPSiteKey siteKey = mpw_siteKey( masterKey->masterKey, siteParams[s].siteName, siteParams[s].siteCounter,
+                    siteParams[s].keyPurpose, siteParams[s].keyContext, siteParams[s].algorithmVersion );
+            if (!batched || !siteKey || memcmp( siteKey, siteKeys[s], MPSiteKeySize ) != 0) {
+                fprintf( stdout, "test case %s... FAILED!  (batched site key differs)\n", testCases[s]->id );
+                ++failedKeys;
+            }
+            mpw_free( &siteKey, MPSiteKeySize );
+        }
+        fprintf( stdout, "site keys %s (v%d)... %zu of %zu batched %s\n", masterKey->fullName, masterKey->algorithm,
+                count - (size_t)failedKeys, count, failedKeys? "FAILED!": "match." );
+        failedCases += failedKeys;
+
+        mpw_free( &siteKeys, count * sizeof( *siteKeys ) );
+        mpw_free( &siteParams, count * sizeof( *siteParams ) );
+        mpw_free( &testCases, count * sizeof( *testCases ) );
+    }
+
+    return failedCases;
+}
+
+static int mpw_tests_batchDerive(MPTestRun *run) {
+
+    int failedCases = 0;
+    const uint16_t keySizes[] = { 128, 512 };
+    for (size_t k = 0; k < run->masterKeysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        if (!masterKey->masterKey)
             continue;
+
+        size_t count = 0;
+        MPSiteKeyParams *siteParams = NULL;
+        for (size_t c = 0; c < run->casesCount; ++c) {
+            MPTestCase *testCase = &run->cases[c];
+            if (testCase->abstract || testCase->masterKey != k)
+                continue;
+
+            if (!mpw_realloc( &siteParams, NULL, sizeof( *siteParams ) * (count + 1) ))
+                ftl( "Couldn't allocate site key parameters.\n" );
+            siteParams[count++] = (MPSiteKeyParams){
+                    .siteName = (char *)testCase->siteName, .siteCounter = testCase->siteCounter,
+                    .keyPurpose = testCase->keyPurpose, .keyContext = (char *)testCase->keyContext,
+                    .algorithmVersion = testCase->algorithm,
+            };
         }
 
-        // 2. calculate the site password.
-        const char *sitePassword = mpw_siteResult(
-                masterKey, (char *)siteName, siteCounter, keyPurpose, (char *)keyContext, resultType, NULL, algorithm );
-        mpw_free( &masterKey, MPMasterKeySize );
-        if (!sitePassword) {
-            ftl( "Couldn't derive site password.\n" );
+        int failedKeys = 0;
+        for (size_t z = 0; z < sizeof( keySizes ) / sizeof( *keySizes ); ++z) {
+            size_t rowSize = mpw_siteResults_deriveSize( keySizes[z] );
+            char *results = calloc( count, rowSize );
+            bool batched = results && mpw_siteResults_derive( masterKey->masterKey, siteParams, count, keySizes[z], results );
+            for (size_t s = 0; s < count; ++s) {
+                const char *result = mpw_siteResult( masterKey->masterKey, siteParams[s].siteName, siteParams[s].siteCounter,
+                        siteParams[s].keyPurpose, siteParams[s].keyContext,
+                        MPResultTypeDeriveKey, mpw_str( "%u", keySizes[z] ), siteParams[s].algorithmVersion );
+                if (!batched || !result || strcmp( result, results + s * rowSize ) != 0)
+                    ++failedKeys;
+                mpw_free_string( &result );
+            }
+            mpw_free( &results, count * rowSize );
+        }
+        fprintf( stdout, "derived keys %s (v%d)... %zu of %zu batched %s\n", masterKey->fullName, masterKey->algorithm,
+                2 * count - (size_t)failedKeys, 2 * count, failedKeys? "FAILED!": "match." );
+        failedCases += failedKeys;
+
+        mpw_free( &siteParams, count * sizeof( *siteParams ) );
+    }
+
+    return failedCases;
+}
+
+static int mpw_tests_counterRange(MPTestRun *run) {
+
+    int failedCases = 0;
+    size_t checked = 0;
+    const char *results[8];
+    for (size_t c = 0; c < run->casesCount; ++c) {
+        MPTestCase *testCase = &run->cases[c];
+        if (testCase->abstract || !(testCase->resultType & MPResultTypeClassTemplate))
+            continue;
+        MPMasterKey masterKey = run->masterKeys[testCase->masterKey].masterKey;
+        if (!masterKey)
             continue;
+
+        // Sweep up to the counter ceiling, and also a site name long enough for the salt's shared prefix to span whole blocks.
+        const size_t sweep = sizeof( results ) / sizeof( *results );
+        MPCounterValue firstCounter = min( testCase->siteCounter, (MPCounterValue)(MPCounterValueLast - (sweep - 1)) );
+        for (int long_ = 0; long_ <= 1; ++long_) {
+            const char *siteName = long_? mpw_str( "%1$s.%1$s.%1$s.%1$s.%1$s.%1$s", testCase->siteName ): (char *)testCase->siteName;
+            char *sweptName = strdup( siteName );
+            bool swept = mpw_siteResults_counterRange( masterKey, sweptName, firstCounter,
+                    (MPCounterValue)(firstCounter + sweep - 1), testCase->keyPurpose,
+                    (char *)testCase->keyContext, testCase->resultType, NULL, testCase->algorithm, results );
+            for (size_t r = 0; r < sweep; ++r) {
+                const char *result = mpw_siteResult( masterKey, sweptName, (MPCounterValue)(firstCounter + r),
+                        testCase->keyPurpose, (char *)testCase->keyContext, testCase->resultType, NULL, testCase->algorithm );
+                if (!swept || !result || strcmp( result, results[r] ) != 0) {
+                    fprintf( stdout, "test case %s... FAILED!  (counter %zu of sweep differs)\n", testCase->id, r );
+                    ++failedCases;
+                }
+                if (swept)
+                    mpw_free_string( &results[r] );
+                mpw_free_string( &result );
+                ++checked;
+            }
+            free( sweptName );
         }
+    }
+    fprintf( stdout, "counter sweeps... %zu of %zu %s\n", checked - (size_t)failedCases, checked,
+            failedCases? "FAILED!": "match." );
 
-        // Check the result.
-        if (xmlStrcmp( result, BAD_CAST sitePassword ) == 0)
-            fprintf( stdout, "pass.\n" );
+    return failedCases;
+}
 
-        else {
-            ++failedTests;
-            fprintf( stdout, "FAILED!  (got %s != expected %s)\n", sitePassword, result );
+/** Compare a rendered result with the expected one, either of which may be NULL.
+ * @return 1 if they differ. */
+static int mpw_tests_renderedResult(const char *id, const char *slot, const char *rendered, const char *expected) {
+
+    if (rendered == expected || (rendered && expected && strcmp( rendered, expected ) == 0))
+        return 0;
+
+    fprintf( stdout, "rendered site %s... FAILED!  (%s: got %s != expected %s)\n", id, slot, rendered?: "(null)", expected?: "(null)" );
+    return 1;
+}
+
+/** Render a site for each test case, with the case's result in the site's password, login name or answer,
+ * and a site of each kind of content for each master key: personal passwords, a derived key and a missing state.
+ * @return The amount of rendered results that differ from the test cases' results or from those generated one at a time. */
+static int mpw_tests_render(MPTestRun *run) {
+
+    int failedResults = 0;
+    size_t checked = 0;
+    for (size_t k = 0; k < run->masterKeysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        if (!masterKey->masterKey)
+            continue;
+
+        MPMarshalledUser *user = mpw_marshall_user( (char *)masterKey->fullName, (char *)masterKey->masterPassword, masterKey->algorithm );
+        MPTestCase **siteCases = calloc( run->casesCount, sizeof( *siteCases ) );
+        if (!user || !siteCases)
+            ftl( "Couldn't allocate user.\n" );
+
+        // Each case's site keeps the defaults in the slots the case doesn't cover.
+        for (size_t c = 0; c < run->casesCount; ++c) {
+            MPTestCase *testCase = &run->cases[c];
+            if (testCase->abstract || testCase->masterKey != k ||
+                (testCase->keyPurpose != MPKeyPurposeAuthentication && testCase->siteCounter != MPCounterValueInitial))
+                continue;
+
+            MPMarshalledSite *site = mpw_marshall_site( user, (char *)testCase->siteName,
+                    MPResultTypeDefault, MPCounterValueInitial, testCase->algorithm );
+            MPMarshalledQuestion *question = NULL;
+            if (!site || (testCase->keyPurpose == MPKeyPurposeRecovery &&
+                          !(question = mpw_marshal_question( site, (char *)testCase->keyContext ))))
+                ftl( "Couldn't allocate site.\n" );
+            siteCases[user->sites_count - 1] = testCase;
+            switch (testCase->keyPurpose) {
+                case MPKeyPurposeAuthentication:
+                    site->type = testCase->resultType;
+                    site->counter = testCase->siteCounter;
+                    break;
+                case MPKeyPurposeIdentification:
+                    site->loginType = testCase->resultType;
+                    break;
+                case MPKeyPurposeRecovery:
+                    question->type = testCase->resultType;
+                    break;
+            }
+        }
+
+        // A site of personal passwords, with a question that has no answer stored.
+        MPMarshalledSite *stateful = mpw_marshall_site( user, "stateful.example.com",
+                MPResultTypeStatefulPersonal, MPCounterValueInitial, masterKey->algorithm );
+        MPMarshalledQuestion *unanswered = stateful? mpw_marshal_question( stateful, "unanswered" ): NULL;
+        const char *passwordState = stateful? mpw_siteState( masterKey->masterKey, stateful->name, stateful->counter,
+                MPKeyPurposeAuthentication, NULL, stateful->type, "personal password", stateful->algorithm ): NULL;
+        const char *loginState = stateful? mpw_siteState( masterKey->masterKey, stateful->name, MPCounterValueInitial,
+                MPKeyPurposeIdentification, NULL, MPResultTypeStatefulPersonal, "personal login", stateful->algorithm ): NULL;
+        if (!unanswered || !passwordState || !loginState ||
+            !mpw_marshal_string( user, &stateful->content, passwordState ) ||
+            !mpw_marshal_string( user, &stateful->loginContent, loginState ))
+            ftl( "Couldn't allocate site.\n" );
+        mpw_free_strings( &passwordState, &loginState, NULL );
+        stateful->loginType = MPResultTypeStatefulPersonal;
+        unanswered->type = MPResultTypeStatefulPersonal;
+        size_t statefulSite = user->sites_count - 1;
+
+        // A site of a derived key, whose content is the key size.
+        MPMarshalledSite *derived = mpw_marshall_site( user, "derived.example.com",
+                MPResultTypeDeriveKey, MPCounterValueInitial, masterKey->algorithm );
+        if (!derived || !mpw_marshal_string( user, &derived->content, "128" ))
+            ftl( "Couldn't allocate site.\n" );
+        size_t derivedSite = user->sites_count - 1;
+
+        // Expect the test case's result in the slot it covers, and the results generated one at a time everywhere.
+        for (size_t s = 0; s < user->sites_count; ++s) {
+            MPMarshalledSite *site = &user->sites[s];
+            MPTestCase *testCase = s < run->casesCount? siteCases[s]: NULL;
+            const char *id = testCase? (char *)testCase->id: site->name;
+
+            // The unanswered question's missing state is expected, don't log it.
+            const int verbosity = mpw_verbosity;
+            if (s == statefulSite)
+                mpw_verbosity = err_level - 1;
+            MPRenderedSite rendered;
+            if (!mpw_site_render( masterKey->masterKey, site, &rendered )) {
+                mpw_verbosity = verbosity;
+                fprintf( stdout, "rendered site %s... FAILED!  (couldn't render)\n", id );
+                failedResults += 2 + site->questions_count;
+                checked += 2 + site->questions_count;
+                continue;
+            }
+
+            const char *password = mpw_siteResult( masterKey->masterKey, site->name, site->counter,
+                    MPKeyPurposeAuthentication, NULL, site->type, site->content, site->algorithm );
+            const char *login = mpw_siteResult( masterKey->masterKey, site->name, MPCounterValueInitial,
+                    MPKeyPurposeIdentification, NULL, site->loginType, site->loginContent, site->algorithm );
+            failedResults += mpw_tests_renderedResult( id, "password", rendered.password, password );
+            failedResults += mpw_tests_renderedResult( id, "login", rendered.login, login );
+            mpw_free_strings( &password, &login, NULL );
+            for (size_t q = 0; q < site->questions_count; ++q) {
+                MPMarshalledQuestion *question = &site->questions[q];
+                const char *answer = mpw_siteResult( masterKey->masterKey, site->name, MPCounterValueInitial,
+                        MPKeyPurposeRecovery, question->keyword, question->type, question->content, site->algorithm );
+                failedResults += mpw_tests_renderedResult( id, "answer", q < rendered.answers_count? rendered.answers[q]: NULL, answer );
+                mpw_free_string( &answer );
+            }
+            mpw_verbosity = verbosity;
+            checked += 2 + site->questions_count;
+
+            if (testCase) {
+                const char *slot = testCase->keyPurpose == MPKeyPurposeAuthentication? rendered.password:
+                                   testCase->keyPurpose == MPKeyPurposeIdentification? rendered.login:
+                                   rendered.answers_count? rendered.answers[0]: NULL;
+                failedResults += mpw_tests_renderedResult( id, "test case", slot, (char *)testCase->result );
+                ++checked;
+            }
+            else if (s == statefulSite) {
+                failedResults += mpw_tests_renderedResult( id, "personal password", rendered.password, "personal password" );
+                failedResults += mpw_tests_renderedResult( id, "personal login", rendered.login, "personal login" );
+                failedResults += mpw_tests_renderedResult( id, "missing answer", rendered.answers[0], NULL );
+                checked += 3;
+            }
+            else if (s == derivedSite) {
+                if (!rendered.password) {
+                    fprintf( stdout, "rendered site %s... FAILED!  (derived key: got (null))\n", id );
+                    ++failedResults;
+                }
+                ++checked;
+            }
+            mpw_site_render_free( &rendered );
         }
+        mpw_free( &siteCases, run->casesCount * sizeof( *siteCases ) );
+        mpw_marshal_free( &user );
+    }
+    fprintf( stdout, "rendered sites... %zu of %zu %s\n", checked - (size_t)failedResults, checked,
+            failedResults? "FAILED!": "match." );
+
+    return failedResults;
+}
+
+/** mpw_utf8_strlen as it was before it counted ASCII runs in blocks, the reference for its semantics. */
+static int mpw_tests_utf8_sizeof(unsigned char utf8Byte) {
+
+    if (!utf8Byte)
+        return 0;
+    if ((utf8Byte & 0x80) == 0)
+        return 1;
+    if ((utf8Byte & 0xC0) != 0xC0)
+        return 0;
+    if ((utf8Byte & 0xE0) == 0xC0)
+        return 2;
+    if ((utf8Byte & 0xF0) == 0xE0)
+        return 3;
+    if ((utf8Byte & 0xF8) == 0xF0)
+        return 4;
+
+    return 0;
+}
+
+static size_t mpw_tests_utf8_strlen(const char *utf8String) {
+
+    size_t charlen = 0;
+    char *remainingString = (char *)utf8String;
+    for (int charByteSize; (charByteSize = mpw_tests_utf8_sizeof( (unsigned char)*remainingString )); remainingString += charByteSize)
+        ++charlen;
+
+    return charlen;
+}
+
+static int mpw_tests_utf8(void) {
+
+    // Strings of ASCII, multi-byte characters and invalid sequences, ending before an unreadable page and anywhere else.
+    static const char *pieces[] = {
+            "a", "site", "masterpasswordapp.com", "\xC3\xA9", "\xE2\x9B\x84", "\xF0\x9F\x98\x80", "\x80", "\xFF",
+            "\xC3", "\xE2\x9B", "\xC3" "a", "\xF8\x80",
+    };
+    char *page = NULL;
+    if (posix_memalign( (void **)&page, 4096, 2 * 4096 ) != 0 || mprotect( page + 4096, 4096, PROT_NONE ) != 0)
+        ftl( "Couldn't allocate pages.\n" );
+
+    int failedStrings = 0;
+    uint32_t seed = 1;
+    const size_t strings = 20000;
+    for (size_t s = 0; s < strings; ++s) {
+        char string[512] = { 0 };
+        size_t stringSize = 0;
+        for (size_t p = (seed = seed * 1103515245 + 12345) >> 16 & 15; p; --p) {
+            const char *piece = pieces[((seed = seed * 1103515245 + 12345) >> 16) % (s % 3? 3: sizeof( pieces ) / sizeof( *pieces ))];
+            memcpy( string + stringSize, piece, strlen( piece ) );
+            stringSize += strlen( piece );
+        }
+
+        // Truncated sequences are followed by NULs so the reference doesn't read past the end of the string.
+        char *utf8String = s % 2? string: page + 4096 - (stringSize + 4);
+        if (utf8String != string) {
+            bzero( page, 4096 );
+            memcpy( utf8String, string, stringSize );
+        }
+        if (mpw_utf8_strlen( utf8String ) != mpw_tests_utf8_strlen( utf8String )) {
+            fprintf( stdout, "utf8 string %s... FAILED!  (length %zu != expected %zu)\n", mpw_hex( utf8String, stringSize ),
+                    mpw_utf8_strlen( utf8String ), mpw_tests_utf8_strlen( utf8String ) );
+            ++failedStrings;
+        }
+    }
+    fprintf( stdout, "utf8 lengths... %zu of %zu %s\n", strings - (size_t)failedStrings, strings,
+            failedStrings? "FAILED!": "match." );
+    mprotect( page + 4096, 4096, PROT_READ | PROT_WRITE );
+    free( page );
+
+    return failedStrings;
+}
+
+static int mpw_tests_arena(void) {
+
+    // Allocations of all sizes, some larger than a chunk, must stay intact, aligned and owned as the arena grows.
+    MPArena *arena = mpw_arena_new( 0 );
+    if (!arena)
+        ftl( "Couldn't create arena.\n" );
+
+    const size_t allocations = 5000;
+    uint8_t **buffers = calloc( allocations, sizeof( *buffers ) );
+    size_t *sizes = calloc( allocations, sizeof( *sizes ) );
+    int failedAllocations = 0;
+    uint32_t seed = 1;
+    for (size_t a = 0; a < allocations; ++a) {
+        sizes[a] = a % 1000 == 999? 3 * 4096 + a: ((seed = seed * 1103515245 + 12345) >> 16) % 200;
+        if (!(buffers[a] = mpw_arena_alloc( arena, sizes[a] )) || (uintptr_t)buffers[a] % 16 ||
+            !mpw_arena_owns( arena, buffers[a] )) {
+            ++failedAllocations;
+            continue;
+        }
+        for (size_t b = 0; b < sizes[a]; ++b)
+            if (buffers[a][b])
+                ++failedAllocations;
+        memset( buffers[a], (int)(a & 0xFF), sizes[a] );
+    }
+    for (size_t a = 0; a < allocations; ++a)
+        for (size_t b = 0; buffers[a] && b < sizes[a]; ++b)
+            if (buffers[a][b] != (uint8_t)(a & 0xFF)) {
+                ++failedAllocations;
+                break;
+            }
+
+    const char *copy = mpw_arena_strdup( arena, "masterpasswordapp.com" );
+    if (!copy || strcmp( copy, "masterpasswordapp.com" ) != 0 || mpw_arena_owns( arena, sizes ))
+        ++failedAllocations;
+    if (!mpw_arena_free( &arena ) || arena)
+        ++failedAllocations;
+    fprintf( stdout, "arena allocations... %zu of %zu %s\n", allocations - min( allocations, (size_t)failedAllocations ),
+            allocations, failedAllocations? "FAILED!": "match." );
+    free( buffers );
+    free( sizes );
+
+    return failedAllocations;
+}
+
+/** Lay out the columns of a user's sites and compare them and their lookups with the sites themselves.
+ * @return The amount of rows and lookups that differ. */
+static int mpw_tests_columns(void) {
+
+    // Names shorter, as long as and longer than a name prefix word, and multi-byte ones; last use times with ties.
+    static const char *stems[] = { "s", "site", "sitesite", "site-long-name", "\xE2\x93\x9C\xE2\x93\x9F\xE2\x93\xA6", "a" };
+    static const char *prefixes[] = { "", "s", "site", "sitesite", "sitesite.", "site-long-name.1", "\xE2\x93\x9C", "x", "sitesite.29" };
+    const size_t stemsCount = sizeof( stems ) / sizeof( *stems ), sitesCount = 300;
+    MPMarshalledUser *user = mpw_marshall_user( "Robert Lee Mitchell", "banana colored duckling", MPAlgorithmVersionCurrent );
+    if (!user)
+        ftl( "Couldn't allocate user.\n" );
+    uint32_t seed = 1;
+    for (size_t s = 0; s < sitesCount; ++s) {
+        MPMarshalledSite *site = mpw_marshall_site( user, s < stemsCount? stems[s]: mpw_str( "%s.%zu", stems[s % stemsCount], s ),
+                s % 2? MPResultTypeTemplateLong: MPResultTypeStatefulPersonal, (MPCounterValue)(s % 7 + 1),
+                (MPAlgorithmVersion)(s % (MPAlgorithmVersionLast + 1)) );
+        if (!site)
+            ftl( "Couldn't allocate site.\n" );
+        site->uses = (unsigned int)s * 3;
+        site->lastUsed = (time_t)((seed = seed * 1103515245 + 12345) >> 16) % 50 - 10;
+    }
+
+    int failedChecks = 0;
+    size_t checked = 0;
+    const MPMarshalledColumns *columns = mpw_marshall_columns( user );
+    if (!columns || columns != user->columns || columns->count != user->sites_count)
+        ftl( "Couldn't lay out columns.\n" );
+
+    // Each row holds its site's fields, and finds its site by name.
+    for (size_t s = 0; s < columns->count; ++s, ++checked) {
+        const MPMarshalledSite *site = &user->sites[s];
+        size_t found = columns->count;
+        if (strcmp( columns->names + columns->nameOffsets[s], site->name ) != 0 || columns->types[s] != site->type ||
+            columns->counters[s] != site->counter || columns->algorithms[s] != site->algorithm ||
+            columns->uses[s] != site->uses || columns->lastUsed[s] != site->lastUsed ||
+            !mpw_marshall_columns_find( columns, site->name, &found ) || found != s) {
+            fprintf( stdout, "columns... FAILED!  (row %zu differs from %s)\n", s, site->name );
+            ++failedChecks;
+        }
+    }
+    if (mpw_marshall_columns_find( columns, "site.unknown", NULL ) || mpw_marshall_columns_find( columns, "sitesit", NULL )) {
+        fprintf( stdout, "columns... FAILED!  (found an unknown site)\n" );
+        ++failedChecks;
+    }
+    ++checked;
+
+    // Each prefix matches the sites whose name starts with it, in order.
+    size_t *sites = calloc( columns->count, sizeof( *sites ) );
+    if (!sites)
+        ftl( "Couldn't allocate sites.\n" );
+    for (size_t p = 0; p < sizeof( prefixes ) / sizeof( *prefixes ); ++p, ++checked) {
+        size_t matches = mpw_marshall_columns_prefix( columns, prefixes[p], sites ), expected = 0;
+        bool ordered = true;
+        for (size_t s = 0; s < user->sites_count; ++s)
+            if (strncmp( user->sites[s].name, prefixes[p], strlen( prefixes[p] ) ) == 0) {
+                ordered &= expected < matches && sites[expected] == s;
+                ++expected;
+            }
+        if (!ordered || matches != expected) {
+            fprintf( stdout, "columns... FAILED!  (prefix %s matched %zu sites)\n", prefixes[p], matches );
+            ++failedChecks;
+        }
+    }
+
+    // The most recently used sites come first, sites used at the same time keep their order.
+    if (!mpw_marshall_columns_recent( columns, sites ))
+        ++failedChecks;
+    else
+        for (size_t s = 1; s < columns->count; ++s)
+            if (columns->lastUsed[sites[s - 1]] < columns->lastUsed[sites[s]] ||
+                (columns->lastUsed[sites[s - 1]] == columns->lastUsed[sites[s]] && sites[s - 1] > sites[s])) {
+                fprintf( stdout, "columns... FAILED!  (site %zu is out of order)\n", sites[s] );
+                ++failedChecks;
+                break;
+            }
+    ++checked;
+    mpw_free( &sites, user->sites_count * sizeof( *sites ) );
+
+    // Adding a site drops the view.
+    if (!mpw_marshall_site( user, "site.added", MPResultTypeDefault, MPCounterValueDefault, MPAlgorithmVersionCurrent ) ||
+        user->columns || !(columns = mpw_marshall_columns( user )) || columns->count != user->sites_count ||
+        !mpw_marshall_columns_find( columns, "site.added", NULL )) {
+        fprintf( stdout, "columns... FAILED!  (not laid out again after adding a site)\n" );
+        ++failedChecks;
+    }
+    ++checked;
+    mpw_marshal_free( &user );
+
+    fprintf( stdout, "columns... %zu of %zu %s\n", checked - (size_t)failedChecks, checked, failedChecks? "FAILED!": "match." );
+
+    return failedChecks;
+}
+
+/** Gather the distinct trigrams of a string that aren't among the given ones yet, the way the search index pads and folds them.
+ * @return The new amount of trigrams. */
+static size_t mpw_tests_trigrams(const char *string, uint32_t *trigrams, size_t trigramsCount) {
+
+    if (!string || !*string)
+        return trigramsCount;
+
+    uint32_t trigram = 0;
+    for (const char *c = string; c <= string + strlen( string ); ++c) {
+        trigram = ((trigram << 8) | (uint8_t)(*c >= 'A' && *c <= 'Z'? *c - 'A' + 'a': *c)) & 0xFFFFFF;
+        bool known = false;
+        for (size_t t = 0; t < trigramsCount && !known; ++t)
+            known = trigrams[t] == trigram;
+        if (!known)
+            trigrams[trigramsCount++] = trigram;
+    }
+
+    return trigramsCount;
+}
+
+static int mpw_tests_search(void) {
+
+    // Equal names in another case, a name with a URL, names shorter than a trigram, an empty and a multi-byte name.
+    static const char *sites[][2] = {
+            { "Example.com", NULL }, { "abc", NULL }, { "bank", "mybank.example.net" }, { "a", NULL }, { "", NULL },
+            { "\xE2\x93\x9C\xE2\x93\x9F\xE2\x93\xA6", NULL }, { "example.COM", NULL }, { "example.org", "https://example.org/login" },
+    };
+    static const char *queries[] = {
+            "example.com", "EXAMPLE", "abx", "axc", "ab", "a", "", "zzz", "mybank.example.net", "example.org/login",
+            "\xE2\x93\x9C\xE2\x93\x9F\xE2\x93\xA6", "\xE2\x93\x9C",
+    };
+    const size_t sitesCount = sizeof( sites ) / sizeof( *sites ), queriesCount = sizeof( queries ) / sizeof( *queries );
+    MPMarshalledUser *user = mpw_marshall_user( "Robert Lee Mitchell", "banana colored duckling", MPAlgorithmVersionCurrent );
+    if (!user)
+        ftl( "Couldn't allocate user.\n" );
+    for (size_t s = 0; s < sitesCount; ++s) {
+        MPMarshalledSite *site = mpw_marshall_site( user, sites[s][0], MPResultTypeDefault, MPCounterValueDefault, MPAlgorithmVersionCurrent );
+        if (!site || (sites[s][1] && !mpw_marshal_string( user, &site->url, sites[s][1] )))
+            ftl( "Couldn't allocate site.\n" );
+    }
+
+    int failedChecks = 0;
+    size_t checked = 0;
+    const MPMarshalledSearch *search = mpw_marshall_search( user );
+    if (!search || search != user->search || search->count != user->sites_count)
+        ftl( "Couldn't index sites.\n" );
+
+    // Each query matches the sites it shares trigrams with, by their Dice coefficient, equal ones in the order of the sites.
+    MPMarshalledMatch matches[sizeof( sites ) / sizeof( *sites )], expected[sizeof( sites ) / sizeof( *sites )];
+    for (size_t q = 0; q < queriesCount; ++q, ++checked) {
+        uint32_t queryTrigrams[64], siteTrigrams[64];
+        const size_t queryTrigramsCount = mpw_tests_trigrams( queries[q], queryTrigrams, 0 );
+        size_t expectedCount = 0;
+        for (size_t s = 0; s < sitesCount; ++s) {
+            const size_t siteTrigramsCount = mpw_tests_trigrams( sites[s][1], siteTrigrams, mpw_tests_trigrams( sites[s][0], siteTrigrams, 0 ) );
+            size_t shared = 0;
+            for (size_t qt = 0; qt < queryTrigramsCount; ++qt)
+                for (size_t st = 0; st < siteTrigramsCount; ++st)
+                    shared += queryTrigrams[qt] == siteTrigrams[st];
+            if (!shared)
+                continue;
+
+            const float score = 2.0f * shared / (float)(queryTrigramsCount + siteTrigramsCount);
+            size_t to = expectedCount++;
+            for (; to > 0 && expected[to - 1].score < score; --to)
+                expected[to] = expected[to - 1];
+            expected[to] = (MPMarshalledMatch){ .site = s, .score = score };
+        }
+
+        size_t matched = mpw_marshall_search_query( search, queries[q], matches, sitesCount );
+        bool same = matched == expectedCount;
+        for (size_t m = 0; same && m < matched; ++m)
+            same = matches[m].site == expected[m].site && matches[m].score == expected[m].score;
+        if (!same) {
+            fprintf( stdout, "search... FAILED!  (%s matched %zu sites, expected %zu)\n", queries[q], matched, expectedCount );
+            ++failedChecks;
+        }
+    }
+
+    // Fewer matches keep the best ones: of equal names the first site, an exact name or URL first.
+    const struct {
+        const char *query;
+        size_t site;
+        float score;
+    } best[] = {
+            { "example.com", 0, 1.0f }, { "a", 3, 1.0f }, { "\xE2\x93\x9C\xE2\x93\x9F\xE2\x93\xA6", 5, 1.0f },
+            { "mybank.example.net", 2, -1 }, { "abx", 1, 0.5f },
+    };
+    for (size_t b = 0; b < sizeof( best ) / sizeof( *best ); ++b, ++checked)
+        if (mpw_marshall_search_query( search, best[b].query, matches, 1 ) != 1 || matches[0].site != best[b].site ||
+            (best[b].score >= 0 && matches[0].score != best[b].score)) {
+            fprintf( stdout, "search... FAILED!  (%s didn't match %s best)\n", best[b].query, sites[best[b].site][0] );
+            ++failedChecks;
+        }
+
+    // A suggestion needs half of the trigrams in common: abx shares 2 of 4 with abc, axc shares only 1 with any site.
+    size_t matched = mpw_marshall_search_query( search, "axc", matches, sitesCount );
+    for (size_t m = 0; m < matched; ++m)
+        if (matches[m].score >= 0.5f) {
+            fprintf( stdout, "search... FAILED!  (axc resembles %s too much)\n", sites[matches[m].site][0] );
+            ++failedChecks;
+        }
+    ++checked;
+
+    // Adding a site drops the index.
+    if (!mpw_marshall_site( user, "abx", MPResultTypeDefault, MPCounterValueDefault, MPAlgorithmVersionCurrent ) ||
+        user->search || !(search = mpw_marshall_search( user )) || search->count != user->sites_count ||
+        mpw_marshall_search_query( search, "abx", matches, 1 ) != 1 || matches[0].site != sitesCount || matches[0].score != 1.0f) {
+        fprintf( stdout, "search... FAILED!  (not indexed again after adding a site)\n" );
+        ++failedChecks;
+    }
+    ++checked;
+    mpw_marshal_free( &user );
 
-        // Free test case.
-        mpw_free_string( &sitePassword );
-        xmlFree( id );
-        xmlFree( fullName );
-        xmlFree( masterPassword );
-        xmlFree( keyID );
-        xmlFree( siteName );
+    fprintf( stdout, "search... %zu of %zu %s\n", checked - (size_t)failedChecks, checked, failedChecks? "FAILED!": "match." );
+
+    return failedChecks;
+}
+
+/** Threads that derive master keys all at once, after the last of them is ready. */
+typedef struct MPTestDerive {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    size_t waiting, threadsCount;
+
+    MPTestMasterKey *masterKeys;
+    size_t keysCount;
+    MPMasterKey *results;
+    size_t nextThread;
+} MPTestDerive;
+
+static void *mpw_tests_deriveConcurrently(void *derive_) {
+
+    MPTestDerive *derive = derive_;
+    pthread_mutex_lock( &derive->lock );
+    size_t t = derive->nextThread++;
+    if (++derive->waiting == derive->threadsCount)
+        pthread_cond_broadcast( &derive->ready );
+    while (derive->waiting < derive->threadsCount)
+        pthread_cond_wait( &derive->ready, &derive->lock );
+    pthread_mutex_unlock( &derive->lock );
+
+    MPTestMasterKey *masterKey = &derive->masterKeys[t % derive->keysCount];
+    derive->results[t] = mpw_derive_masterKey(
+            (char *)masterKey->fullName, (char *)masterKey->masterPassword, masterKey->algorithm,
+            t / derive->keysCount % 2? MPDerivePriorityBulk: MPDerivePriorityInteractive, NULL );
+
+    return NULL;
+}
+
+/** Derive the same master keys on many threads at once, each distinct key must be stretched only once.
+ * @return The amount of threads that got a wrong master key, or 1 if any key was stretched more than once. */
+static int mpw_tests_derive(MPTestRun *run) {
+
+    const size_t keysCount = min( run->masterKeysCount, (size_t)2 ), threadsCount = keysCount * 8;
+    for (size_t k = 0; k < keysCount; ++k)
+        if (!run->masterKeys[k].masterKey)
+            return 0;
+
+    MPTestDerive derive = {
+            .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .threadsCount = threadsCount,
+            .masterKeys = run->masterKeys, .keysCount = keysCount, .results = calloc( threadsCount, sizeof( MPMasterKey ) ),
+    };
+    pthread_t threads[threadsCount];
+    uint64_t scrypts = mpw_metrics_snapshot().values[MPMetricScrypt].count;
+    for (size_t t = 0; t < threadsCount; ++t)
+        if (pthread_create( &threads[t], NULL, mpw_tests_deriveConcurrently, &derive ) != 0)
+            ftl( "Couldn't start derivation thread.\n" );
+    for (size_t t = 0; t < threadsCount; ++t)
+        pthread_join( threads[t], NULL );
+    scrypts = mpw_metrics_snapshot().values[MPMetricScrypt].count - scrypts;
+
+    int failedThreads = 0;
+    for (size_t t = 0; t < threadsCount; ++t) {
+        if (!derive.results[t] || memcmp( derive.results[t], run->masterKeys[t % keysCount].masterKey, MPMasterKeySize ) != 0)
+            ++failedThreads;
+        mpw_free( &derive.results[t], MPMasterKeySize );
+    }
+    fprintf( stdout, "coalesced derivations... %zu of %zu match, %llu of %zu keys stretched%s\n",
+            threadsCount - (size_t)failedThreads, threadsCount, (unsigned long long)scrypts, keysCount,
+            failedThreads || scrypts != keysCount? ".  FAILED!": "." );
+    free( derive.results );
+
+    return failedThreads + (scrypts != keysCount);
+}
+
+/** Derivations that note the order in which the scheduler lets them start. */
+typedef struct MPTestSchedule {
+    pthread_mutex_t lock;
+    pthread_cond_t opened;
+    /** Derivations hold their place until the schedule opens, so the others can be queued behind the running one. */
+    bool open;
+    size_t departures;
+} MPTestSchedule;
+
+typedef struct MPTestScheduled {
+    MPTestSchedule *schedule;
+    MPTestMasterKey *masterKey;
+    MPDerivePriority priority;
+
+    MPMasterKey result;
+    bool departed;
+    size_t departure;
+    pthread_t thread;
+} MPTestScheduled;
+
+/** The first progress report of a derivation is when it started. */
+static void mpw_tests_departScheduled(double __unused done, void *scheduled_) {
+
+    MPTestScheduled *scheduled = scheduled_;
+    if (scheduled->departed)
+        return;
+    scheduled->departed = true;
+
+    MPTestSchedule *schedule = scheduled->schedule;
+    pthread_mutex_lock( &schedule->lock );
+    scheduled->departure = schedule->departures++;
+    while (!schedule->open)
+        pthread_cond_wait( &schedule->opened, &schedule->lock );
+    pthread_mutex_unlock( &schedule->lock );
+}
+
+static void *mpw_tests_deriveScheduled(void *scheduled_) {
+
+    MPTestScheduled *scheduled = scheduled_;
+    scheduled->result = mpw_derive_masterKey( (char *)scheduled->masterKey->fullName,
+            (char *)scheduled->masterKey->masterPassword, scheduled->masterKey->algorithm, scheduled->priority,
+            &(MPKDFControl){ .progress = mpw_tests_departScheduled, .context = scheduled } );
+
+    return NULL;
+}
+
+/** Wait until the derivations have taken up the given places in the scheduler. */
+static void mpw_tests_awaitLoad(const size_t running, const size_t queuedBulk, const size_t queuedInteractive) {
+
+    for (MPDeriveLoad load; (load = mpw_derive_load()).running != running ||
+                            load.queued[MPDerivePriorityBulk] != queuedBulk ||
+                            load.queued[MPDerivePriorityInteractive] != queuedInteractive;)
+        nanosleep( &(struct timespec){ .tv_nsec = 1000000 }, NULL );
+}
+
+/** Queue bulk derivations behind a running one, one at a time, then an interactive derivation.
+ * The running derivation is held until all others are queued, so their order doesn't depend on how long they take.
+ * @return The amount of derivations with a wrong master key or that didn't start in the order of their priority. */
+static int mpw_tests_schedule(MPTestRun *run) {
+
+    MPTestScheduled scheduled[4];
+    const size_t scheduledCount = sizeof( scheduled ) / sizeof( *scheduled );
+    if (run->masterKeysCount < scheduledCount)
+        return 0;
+
+    MPTestSchedule schedule = { .lock = PTHREAD_MUTEX_INITIALIZER, .opened = PTHREAD_COND_INITIALIZER };
+    mpw_derive_limit( MPDeriveMemory );
+    for (size_t s = 0; s < scheduledCount; ++s) {
+        bool interactive = s == scheduledCount - 1;
+        scheduled[s] = (MPTestScheduled){
+                .schedule = &schedule, .masterKey = &run->masterKeys[s],
+                .priority = interactive? MPDerivePriorityInteractive: MPDerivePriorityBulk,
+        };
+        if (pthread_create( &scheduled[s].thread, NULL, mpw_tests_deriveScheduled, &scheduled[s] ) != 0)
+            ftl( "Couldn't start derivation thread.\n" );
+        mpw_tests_awaitLoad( 1, interactive? s - 1: s, interactive );
+    }
+    pthread_mutex_lock( &schedule.lock );
+    schedule.open = true;
+    pthread_cond_broadcast( &schedule.opened );
+    pthread_mutex_unlock( &schedule.lock );
+
+    // The interactive derivation starts right after the one that was running when it was queued.
+    int failedDerivations = 0;
+    for (size_t s = 0; s < scheduledCount; ++s) {
+        pthread_join( scheduled[s].thread, NULL );
+        size_t expected = s == 0? 0: s == scheduledCount - 1? 1: s + 1;
+        if (!scheduled[s].result || !scheduled[s].masterKey->masterKey || scheduled[s].departure != expected ||
+            memcmp( scheduled[s].result, scheduled[s].masterKey->masterKey, MPMasterKeySize ) != 0)
+            ++failedDerivations;
+        mpw_free( &scheduled[s].result, MPMasterKeySize );
+    }
+    mpw_derive_limit( 0 );
+    pthread_cond_destroy( &schedule.opened );
+    pthread_mutex_destroy( &schedule.lock );
+    fprintf( stdout, "scheduled derivations... %zu of %zu %s\n", scheduledCount - (size_t)failedDerivations, scheduledCount,
+            failedDerivations? "FAILED!": "in order." );
+
+    return failedDerivations;
+}
+
+/** The outcome of an asynchronous derivation. */
+typedef struct MPTestAsync {
+    pthread_mutex_t *lock;
+    pthread_cond_t *called;
+    size_t *remaining;
+
+    MPMasterKey masterKey;
+    pthread_t thread;
+} MPTestAsync;
+
+static void mpw_tests_deriveAsync(MPMasterKey masterKey, void *async_) {
+
+    MPTestAsync *async = async_;
+    pthread_mutex_lock( async->lock );
+    async->masterKey = masterKey;
+    async->thread = pthread_self();
+    --*async->remaining;
+    pthread_cond_broadcast( async->called );
+    pthread_mutex_unlock( async->lock );
+}
+
+/** Derive master keys asynchronously, called back on the pool and completed into a queue that is polled.
+ * @return The amount of derivations with a wrong master key or that were called back on the wrong thread. */
+static int mpw_tests_async(MPTestRun *run) {
+
+    MPTestAsync asyncs[2][3];
+    const size_t keysCount = min( run->masterKeysCount, sizeof( *asyncs ) / sizeof( **asyncs ) );
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t called = PTHREAD_COND_INITIALIZER;
+    size_t remaining = 0;
+    int failedDerivations = 0;
+
+    // Called back on the pool.
+    for (size_t k = 0; k < keysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        asyncs[0][k] = (MPTestAsync){ .lock = &lock, .called = &called, .remaining = &remaining, .thread = pthread_self() };
+        pthread_mutex_lock( &lock );
+        ++remaining;
+        pthread_mutex_unlock( &lock );
+        if (!mpw_masterKey_async( (char *)masterKey->fullName, (char *)masterKey->masterPassword, masterKey->algorithm,
+                NULL, mpw_tests_deriveAsync, &asyncs[0][k] ))
+            ftl( "Couldn't start asynchronous derivation.\n" );
+    }
+    pthread_mutex_lock( &lock );
+    while (remaining)
+        pthread_cond_wait( &called, &lock );
+    pthread_mutex_unlock( &lock );
+
+    // Completed into a queue, called back while running the queue once its descriptor is readable.
+    MPDeriveQueue *queue = mpw_derive_queue_new();
+    if (!queue)
+        ftl( "Couldn't create derivation queue.\n" );
+    for (size_t k = 0; k < keysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        asyncs[1][k] = (MPTestAsync){ .lock = &lock, .called = &called, .remaining = &remaining };
+        ++remaining;
+        if (!mpw_masterKey_queued( queue, (char *)masterKey->fullName, (char *)masterKey->masterPassword, masterKey->algorithm,
+                NULL, mpw_tests_deriveAsync, &asyncs[1][k] ))
+            ftl( "Couldn't start queued derivation.\n" );
+    }
+    for (struct pollfd pollFD = { .fd = mpw_derive_queue_fd( queue ), .events = POLLIN }; remaining;)
+        if (poll( &pollFD, 1, 60000 ) <= 0 || !mpw_derive_queue_run( queue ))
+            break;
+    mpw_derive_queue_free( &queue );
+
+    for (size_t a = 0; a < 2; ++a)
+        for (size_t k = 0; k < keysCount; ++k) {
+            if (!asyncs[a][k].masterKey || !run->masterKeys[k].masterKey ||
+                memcmp( asyncs[a][k].masterKey, run->masterKeys[k].masterKey, MPMasterKeySize ) != 0 ||
+                (a == 0) == !!pthread_equal( asyncs[a][k].thread, pthread_self() ))
+                ++failedDerivations;
+            mpw_free( &asyncs[a][k].masterKey, MPMasterKeySize );
+        }
+    fprintf( stdout, "asynchronous derivations... %zu of %zu %s\n", 2 * keysCount - (size_t)failedDerivations, 2 * keysCount,
+            failedDerivations? "FAILED!": "match." );
+
+    return failedDerivations;
+}
+
+/** The progress a controlled derivation reported, and when to cancel it. */
+typedef struct MPTestControl {
+    bool cancelled;
+    double cancelAt;
+    size_t reports;
+    double done;
+    bool backwards;
+} MPTestControl;
+
+static void mpw_tests_progress(double done, void *control_) {
+
+    MPTestControl *control = control_;
+    control->backwards |= done < control->done;
+    control->done = done;
+    ++control->reports;
+    if (control->cancelAt && done >= control->cancelAt)
+        __atomic_store_n( &control->cancelled, true, __ATOMIC_RELAXED );
+}
+
+/** Derive master keys under control: to completion with progress, cancelled part-way, directly and through the
+ * scheduler, and past a deadline.
+ * @return The amount of derivations with a wrong key, progress or outcome. */
+static int mpw_tests_control(MPTestRun *run) {
+
+    int failedDerivations = 0;
+    const size_t keysCount = min( run->masterKeysCount, (size_t)2 );
+    for (size_t k = 0; k < keysCount; ++k) {
+        MPTestMasterKey *masterKey = &run->masterKeys[k];
+        MPTestControl progress = { .done = 0 };
+        MPMasterKey controlled = mpw_masterKey_control( (char *)masterKey->fullName, (char *)masterKey->masterPassword,
+                masterKey->algorithm, &(MPKDFControl){ .progress = mpw_tests_progress, .context = &progress } );
+        if (!controlled || !masterKey->masterKey || memcmp( controlled, masterKey->masterKey, MPMasterKeySize ) != 0 ||
+            progress.backwards || progress.reports < 3 || progress.done != 1)
+            ++failedDerivations;
+        mpw_free( &controlled, MPMasterKeySize );
+    }
+
+    // Cancelled from the progress callback, as another thread would.
+    MPTestMasterKey *masterKey = &run->masterKeys[0];
+    MPTestControl cancel = { .cancelAt = 0.25 };
+    MPMasterKey cancelled = mpw_masterKey_control( (char *)masterKey->fullName, (char *)masterKey->masterPassword,
+            masterKey->algorithm, &(MPKDFControl){
+                    .cancelled = &cancel.cancelled, .progress = mpw_tests_progress, .context = &cancel } );
+    if (cancelled || errno != ECANCELED || cancel.done > 0.3)
+        ++failedDerivations;
+    mpw_free( &cancelled, MPMasterKeySize );
+
+    // Cancelled while the scheduler derives it.
+    MPTestControl cancelScheduled = { .cancelAt = 0.25 };
+    MPMasterKey cancelledScheduled = mpw_derive_masterKey( (char *)masterKey->fullName, (char *)masterKey->masterPassword,
+            masterKey->algorithm, MPDerivePriorityInteractive, &(MPKDFControl){
+                    .cancelled = &cancelScheduled.cancelled, .progress = mpw_tests_progress, .context = &cancelScheduled } );
+    if (cancelledScheduled || errno != ECANCELED || cancelScheduled.done > 0.3)
+        ++failedDerivations;
+    mpw_free( &cancelledScheduled, MPMasterKeySize );
+
+    // Past a deadline that's too close to make.
+    MPMasterKey late = mpw_masterKey_control( (char *)masterKey->fullName, (char *)masterKey->masterPassword,
+            masterKey->algorithm, &(MPKDFControl){ .deadline = mpw_now() + 1000000 } );
+    if (late || errno != ETIMEDOUT)
+        ++failedDerivations;
+    mpw_free( &late, MPMasterKeySize );
+
+    fprintf( stdout, "controlled derivations... %zu of %zu %s\n", keysCount + 3 - (size_t)failedDerivations, keysCount + 3,
+            failedDerivations? "FAILED!": "match." );
+
+    return failedDerivations;
+}
+
+static void mpw_tests_deriveDropped(MPMasterKey masterKey, void *called_) {
+
+    __atomic_add_fetch( (size_t *)called_, 1, __ATOMIC_RELAXED );
+    mpw_free( &masterKey, MPMasterKeySize );
+}
+
+/** Free a queue with more derivations pending than the pool runs at once.
+ * @return 1 if the derivations that hadn't started still ran, a callback was called or the control was used after the free. */
+static int mpw_tests_queueFree(MPTestRun *run) {
+
+    if (!run->masterKeysCount)
+        return 0;
+
+    MPDeriveQueue *queue = mpw_derive_queue_new();
+    if (!queue)
+        ftl( "Couldn't create derivation queue.\n" );
+
+    // The control goes away right after the free, any later use of it is caught by the sanitizers.
+    MPTestControl *progress = calloc( 1, sizeof( *progress ) );
+    MPKDFControl *control = calloc( 1, sizeof( *control ) );
+    *control = (MPKDFControl){ .progress = mpw_tests_progress, .context = progress };
+    const size_t concurrency = mpw_derive_load().concurrency, queuedCount = concurrency + 4;
+    size_t called = 0;
+    uint64_t scrypts = mpw_metrics_snapshot().values[MPMetricScrypt].count;
+    for (size_t q = 0; q < queuedCount; ++q) {
+        const char *fullName = mpw_str( "%s %zu", (char *)run->masterKeys[0].fullName, q );
+        if (!mpw_masterKey_queued( queue, fullName, (char *)run->masterKeys[0].masterPassword, run->masterKeys[0].algorithm,
+                control, mpw_tests_deriveDropped, &called ))
+            ftl( "Couldn't start queued derivation.\n" );
+    }
+    mpw_derive_queue_free( &queue );
+    mpw_free( &control, sizeof( *control ) );
+    mpw_free( &progress, sizeof( *progress ) );
+    scrypts = mpw_metrics_snapshot().values[MPMetricScrypt].count - scrypts;
+
+    int failed = queue || called || scrypts > concurrency;
+    fprintf( stdout, "freed derivation queue... %llu of %zu pending derivations ran, %zu called back%s\n",
+            (unsigned long long)scrypts, queuedCount, called, failed? ".  FAILED!": "." );
+
+    return failed;
+}
+
+/** A scheduled derivation that is held at its first progress report. */
+typedef struct MPTestHeld {
+    MPTestMasterKey *masterKey;
+    /** Cancel the derivation once another call joins it, rather than hold it until it's released. */
+    bool cancelOnJoin;
+    bool cancelled, released, reported;
+
+    MPMasterKey result;
+    int error;
+    pthread_t thread;
+} MPTestHeld;
+
+static void mpw_tests_holdProgress(double __unused done, void *held_) {
+
+    MPTestHeld *held = held_;
+    if (held->reported)
+        return;
+    held->reported = true;
+
+    if (held->cancelOnJoin) {
+        while (!mpw_derive_load().joined)
+            nanosleep( &(struct timespec){ .tv_nsec = 1000000 }, NULL );
+        __atomic_store_n( &held->cancelled, true, __ATOMIC_RELAXED );
+    }
+    else
+        while (!__atomic_load_n( &held->released, __ATOMIC_RELAXED ))
+            nanosleep( &(struct timespec){ .tv_nsec = 1000000 }, NULL );
+}
+
+static void *mpw_tests_deriveHeld(void *held_) {
+
+    MPTestHeld *held = held_;
+    held->result = mpw_derive_masterKey( (char *)held->masterKey->fullName, (char *)held->masterKey->masterPassword,
+            held->masterKey->algorithm, MPDerivePriorityInteractive, &(MPKDFControl){
+                    .cancelled = &held->cancelled, .progress = mpw_tests_holdProgress, .context = held } );
+    held->error = errno;
+
+    return NULL;
+}
+
+/** Abandon scheduled derivations: the one that derives a key joined by another, one that waits for its turn and one
+ * that waits for a derivation it joined.  The calls that remain must not be affected.
+ * @return The amount of calls with a wrong key or outcome. */
+static int mpw_tests_abandon(MPTestRun *run) {
+
+    if (run->masterKeysCount < 2 || !run->masterKeys[0].masterKey || !run->masterKeys[1].masterKey)
+        return 0;
+
+    // Cancelled by the call that derives it, another call that joined it derives the key instead.
+    int failedDerivations = 0;
+    MPTestMasterKey *masterKey = &run->masterKeys[0];
+    MPTestHeld cancelled = { .masterKey = masterKey, .cancelOnJoin = true };
+    if (pthread_create( &cancelled.thread, NULL, mpw_tests_deriveHeld, &cancelled ) != 0)
+        ftl( "Couldn't start derivation thread.\n" );
+    mpw_tests_awaitLoad( 1, 0, 0 );
+    MPMasterKey joined = mpw_derive_masterKey( (char *)masterKey->fullName, (char *)masterKey->masterPassword,
+            masterKey->algorithm, MPDerivePriorityInteractive, NULL );
+    pthread_join( cancelled.thread, NULL );
+    if (cancelled.result || cancelled.error != ECANCELED)
+        ++failedDerivations;
+    if (!joined || memcmp( joined, masterKey->masterKey, MPMasterKeySize ) != 0)
+        ++failedDerivations;
+    mpw_free( &cancelled.result, MPMasterKeySize );
+    mpw_free( &joined, MPMasterKeySize );
+
+    // Past their deadlines while waiting: for their turn behind a running derivation, and for the derivation they joined.
+    mpw_derive_limit( MPDeriveMemory );
+    masterKey = &run->masterKeys[1];
+    MPTestHeld held = { .masterKey = masterKey };
+    if (pthread_create( &held.thread, NULL, mpw_tests_deriveHeld, &held ) != 0)
+        ftl( "Couldn't start derivation thread.\n" );
+    mpw_tests_awaitLoad( 1, 0, 0 );
+    MPMasterKey queued = mpw_derive_masterKey( (char *)run->masterKeys[0].fullName, (char *)run->masterKeys[0].masterPassword,
+            run->masterKeys[0].algorithm, MPDerivePriorityBulk, &(MPKDFControl){ .deadline = mpw_now() + 20000000 } );
+    int queuedError = errno;
+    MPMasterKey late = mpw_derive_masterKey( (char *)masterKey->fullName, (char *)masterKey->masterPassword,
+            masterKey->algorithm, MPDerivePriorityInteractive, &(MPKDFControl){ .deadline = mpw_now() + 20000000 } );
+    int lateError = errno;
+    MPDeriveLoad load = mpw_derive_load();
+    __atomic_store_n( &held.released, true, __ATOMIC_RELAXED );
+    pthread_join( held.thread, NULL );
+    mpw_derive_limit( 0 );
+    if (queued || queuedError != ETIMEDOUT || load.queued[MPDerivePriorityBulk])
+        ++failedDerivations;
+    if (late || lateError != ETIMEDOUT || load.joined)
+        ++failedDerivations;
+    if (!held.result || memcmp( held.result, masterKey->masterKey, MPMasterKeySize ) != 0)
+        ++failedDerivations;
+    mpw_free( &queued, MPMasterKeySize );
+    mpw_free( &late, MPMasterKeySize );
+    mpw_free( &held.result, MPMasterKeySize );
+
+    fprintf( stdout, "abandoned derivations... %d of 5 %s\n", 5 - failedDerivations,
+            failedDerivations? "FAILED!": "as expected." );
+
+    return failedDerivations;
+}
+
+/** Run the worker on the given amount of threads until it runs out of work.
+ * @return The amount of threads that ran the worker. */
+static long mpw_tests_parallel(void *(*worker)(void *), MPTestRun *run, const long threadsCount) {
+
+    pthread_t threads[threadsCount];
+    long threadsStarted = 0;
+    while (threadsStarted < threadsCount && pthread_create( &threads[threadsStarted], NULL, worker, run ) == 0)
+        ++threadsStarted;
+    if (!threadsStarted) {
+        worker( run );
+        return 1;
+    }
+
+    for (long t = 0; t < threadsStarted; ++t)
+        pthread_join( threads[t], NULL );
+
+    return threadsStarted;
+}
+
+static void usage() {
+
+    fprintf( stdout, "Usage: mpw-tests [-j threads] [-b backend] [-h] [file]\n\n"
+                     "  Verify the algorithm's test vectors, from mpw_tests.xml by default.\n"
+                     "  Master keys are derived once for all cases that share them.\n\n" );
+    fprintf( stdout, "  -j threads  The amount of threads to run the cases on.\n"
+                     "              Defaults to the amount of online processors.\n\n" );
+    fprintf( stdout, "  -b backend  The crypto backend to verify the cases with, one of:\n"
+                     "             " );
+    for (const MPCryptoBackend *const *backend = mpw_crypto_backends(); *backend; ++backend)
+        fprintf( stdout, " %s", (*backend)->name );
+    fprintf( stdout, "\n              Defaults to the most preferred backend usable on this host.\n\n" );
+    exit( 0 );
+}
+
+int main(int argc, char *const argv[]) {
+
+    long threadsCount = sysconf( _SC_NPROCESSORS_ONLN );
+    for (int opt; (opt = getopt( argc, argv, "j:b:h" )) != EOF;)
+        switch (opt) {
+            case 'j':
+                threadsCount = atol( optarg );
+                break;
+            case 'b':
+                if (!mpw_crypto_select( optarg ))
+                    ftl( "Crypto backend is not available on this host: %s\n", optarg );
+                break;
+            case 'h':
+                usage();
+                break;
+            default:
+                ftl( "Unknown option: %c\n", optopt );
+        }
+    if (threadsCount < 1)
+        threadsCount = 1;
+    const char *testsPath = optind < argc? argv[optind]: "mpw_tests.xml";
+
+    xmlDocPtr testsDoc = xmlParseFile( testsPath );
+    xmlNodePtr tests = testsDoc? xmlDocGetRootElement( testsDoc ): NULL;
+    if (!tests) {
+        ftl( "Couldn't find test case: %s\n", testsPath );
+        abort();
+    }
+
+    // Read in the test cases and the master keys they need.
+    MPTestRun run = { .masterKeys = NULL };
+    double start = mpw_tests_now();
+    for (xmlNodePtr testCaseNode = tests->children; testCaseNode; testCaseNode = testCaseNode->next) {
+        if (testCaseNode->type != XML_ELEMENT_NODE || xmlStrcmp( testCaseNode->name, BAD_CAST "case" ) != 0)
+            continue;
+
+        if (!mpw_realloc( &run.cases, NULL, sizeof( *run.cases ) * (run.casesCount + 1) ))
+            ftl( "Couldn't allocate test cases.\n" );
+        MPTestCase *testCase = &run.cases[run.casesCount++];
+
+        xmlChar *resultTypeString = mpw_xmlTestCaseString( testCaseNode, "resultType" );
+        xmlChar *keyPurposeString = mpw_xmlTestCaseString( testCaseNode, "keyPurpose" );
+        *testCase = (MPTestCase){
+                .id = mpw_xmlTestCaseString( testCaseNode, "id" ),
+                .algorithm = (MPAlgorithmVersion)mpw_xmlTestCaseInteger( testCaseNode, "algorithm" ),
+                .siteName = mpw_xmlTestCaseString( testCaseNode, "siteName" ),
+                .siteCounter = (MPCounterValue)mpw_xmlTestCaseInteger( testCaseNode, "siteCounter" ),
+                .resultType = mpw_typeWithName( (char *)resultTypeString ),
+                .keyPurpose = mpw_purposeWithName( (char *)keyPurposeString ),
+                .keyContext = mpw_xmlTestCaseString( testCaseNode, "keyContext" ),
+                .result = mpw_xmlTestCaseString( testCaseNode, "result" ),
+        };
+        testCase->abstract = !xmlStrlen( testCase->result );
         xmlFree( resultTypeString );
         xmlFree( keyPurposeString );
-        xmlFree( keyContext );
-        xmlFree( result );
+
+        // Abstract cases only hold defaults for the cases that extend them.
+        if (!testCase->abstract)
+            testCase->masterKey = mpw_tests_masterKey( &run,
+                    mpw_xmlTestCaseString( testCaseNode, "fullName" ), mpw_xmlTestCaseString( testCaseNode, "masterPassword" ),
+                    testCase->algorithm );
+    }
+
+    // 1. calculate the master keys, each only once.  2. calculate the site passwords.
+    long threadsUsed = mpw_tests_parallel( mpw_tests_deriveMasterKeys, &run, threadsCount );
+    mpw_tests_parallel( mpw_tests_runCases, &run, threadsCount );
+    double seconds = mpw_tests_now() - start;
+
+    // Check the results.
+    int failedTests = 0;
+    for (size_t k = 0; k < run.masterKeysCount; ++k) {
+        MPTestMasterKey *masterKey = &run.masterKeys[k];
+        fprintf( stdout, "master key %s (v%d)... [%7.2f ms] %s\n", masterKey->fullName, masterKey->algorithm,
+                masterKey->seconds * 1000, masterKey->masterKey? "derived.": "FAILED!  (couldn't derive master key)" );
+    }
+    for (size_t c = 0; c < run.casesCount; ++c) {
+        MPTestCase *testCase = &run.cases[c];
+        fprintf( stdout, "test case %s... ", testCase->id );
+        if (testCase->abstract)
+            fprintf( stdout, "abstract.\n" );
+
+        else if (!run.masterKeys[testCase->masterKey].masterKey) {
+            ++failedTests;
+            fprintf( stdout, "FAILED!  (couldn't derive master key)\n" );
+        }
+
+        else if (!testCase->sitePassword) {
+            ++failedTests;
+            fprintf( stdout, "FAILED!  (couldn't derive site password)\n" );
+        }
+
+        else if (xmlStrcmp( testCase->result, BAD_CAST testCase->sitePassword ) == 0)
+            fprintf( stdout, "[%7.3f ms] pass.\n", testCase->seconds * 1000 );
+
+        else {
+            ++failedTests;
+            fprintf( stdout, "FAILED!  (got %s != expected %s)\n", testCase->sitePassword, testCase->result );
+        }
+    }
+    failedTests += mpw_tests_batchSiteKeys( &run );
+    failedTests += mpw_tests_batchDerive( &run );
+    failedTests += mpw_tests_counterRange( &run );
+    failedTests += mpw_tests_render( &run );
+    failedTests += mpw_tests_utf8();
+    failedTests += mpw_tests_arena();
+    failedTests += mpw_tests_columns();
+    failedTests += mpw_tests_search();
+    failedTests += mpw_tests_derive( &run );
+    failedTests += mpw_tests_schedule( &run );
+    failedTests += mpw_tests_async( &run );
+    failedTests += mpw_tests_control( &run );
+    failedTests += mpw_tests_abandon( &run );
+    failedTests += mpw_tests_queueFree( &run );
+    fprintf( stdout, "%d of %zu test cases failed, %zu master keys derived on %ld threads in %.2fs using %s.\n",
+            failedTests, run.casesCount, run.masterKeysCount, threadsUsed, seconds, mpw_crypto()->name );
+
+    // Free test cases.
+    for (size_t c = 0; c < run.casesCount; ++c) {
+        MPTestCase *testCase = &run.cases[c];
+        mpw_free_string( &testCase->sitePassword );
+        xmlFree( testCase->id );
+        xmlFree( testCase->siteName );
+        xmlFree( testCase->keyContext );
+        xmlFree( testCase->result );
+    }
+    for (size_t k = 0; k < run.masterKeysCount; ++k) {
+        MPTestMasterKey *masterKey = &run.masterKeys[k];
+        mpw_free( &masterKey->masterKey, MPMasterKeySize );
+        xmlFree( masterKey->fullName );
+        xmlFree( masterKey->masterPassword );
     }
+    mpw_free( &run.cases, sizeof( *run.cases ) * run.casesCount );
+    mpw_free( &run.masterKeys, sizeof( *run.masterKeys ) * run.masterKeysCount );
+    xmlFreeDoc( testsDoc );
 
     return failedTests;
 }
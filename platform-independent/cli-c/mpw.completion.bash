@@ -29,14 +29,16 @@ _comp_mpw() {
         *)
             # previous word is not an option we can complete, complete site name (or option if leading -)
             if [[ $cword = -* ]]; then
-                COMPREPLY=( -u -t -c -V -v -C )
+                COMPREPLY=( -u -t -c -V -v -C -L --list --complete )
             else
                 local w fullName=$MP_FULLNAME
                 for (( w = 0; w < ${#COMP_WORDS[@]}; ++w )); do
                     [[ ${COMP_WORDS[w]} = -u ]] && fullName=$(xargs <<< "${COMP_WORDS[w + 1]}") && break
                 done
-                if [[ -e ~/.mpw.d/"$fullName.mpsites" ]]; then
-                    IFS=$'\n' read -d '' -ra COMPREPLY < <(awk -F$'\t' '!/^ *#/{sub(/^ */, "", $2); print $2}' ~/.mpw.d/"$fullName.mpsites")
+                local partial=$(xargs <<< "$cword") sites
+                if [[ $fullName ]] && sites=$(mpw -u "$fullName" --complete "$partial" 2>/dev/null); then
+                    # mpw searches the index it keeps next to the user's sites, no master password is needed.
+                    IFS=$'\n' read -d '' -ra COMPREPLY <<< "$sites"
                     printf -v _comp_title 'Sites for %s' "$fullName"
                 else
                     # Default list from the Alexa Top 500